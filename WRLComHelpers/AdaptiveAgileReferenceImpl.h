@@ -0,0 +1,196 @@
+#pragma once
+#include <new>                              // For std::nothrow
+#include <combaseapi.h>                     // For RoGetAgileReference and CoGetContextToken
+#include <wrl.h>                            // For Microsoft::WRL::ComPtr, RuntimeClass and FtmBase
+
+// Agile references that pick how to reach their object from how it is used, for
+// PSO_ADAPTIVE_AGILE_REFERENCES and OWSO_ADAPTIVE_SITE_REFERENCE.
+//
+// AGILEREFERENCE_DEFAULT marshals the object when the reference is created, which is wasted on the
+// many services (and sites) only ever used from their own apartment. AGILEREFERENCE_DELAYEDMARSHAL
+// moves that cost to the first Resolve from another apartment, and every Resolve still goes through
+// COM even in the object's own apartment. An AdaptiveAgileReference
+//
+//  - resolves an agile object (one implementing IAgileObject) with a plain QueryInterface, anywhere,
+//  - resolves any other object the same way in the context the reference was created in, and
+//  - upgrades to a delayed marshal reference, marshaling the object once, on the first Resolve from
+//    anywhere else.
+//
+// The underlying AGILEREFERENCE_DELAYEDMARSHAL reference is what keeps the object alive, the object is
+// only ever released through it. How many references took which route is counted process wide, see
+// GetAdaptiveAgileReferenceStatistics. Each reference also keeps its own route and resolve counts, see
+// GetAdaptiveAgileReferenceUsage, which the helpers hand out per proffered service
+// (ProfferService::GetServiceReferenceUsage) and per site (ObjectWithSite::GetSiteReferenceUsage).
+
+namespace Windows { namespace Internal { namespace WRL {
+
+struct AdaptiveAgileReferenceStatistics
+{
+    ULONGLONG cAgile;               // references to agile objects, always resolved directly
+    ULONGLONG cApartmentBound;      // references to other objects, resolved directly in their context
+    ULONGLONG cUpgraded;            // of those, the ones resolved from another context at least once
+};
+
+// How a single AdaptiveAgileReference was used. The resolve counts are gathered without
+// synchronization, treat them as approximate.
+struct AdaptiveAgileReferenceUsage
+{
+    bool fAgile;                    // the object is agile, every Resolve is direct
+    bool fUpgraded;                 // resolved from another context at least once
+    ULONGLONG cDirectResolves;      // resolved with a QueryInterface on the object
+    ULONGLONG cMarshaledResolves;   // resolved through the delayed marshal reference
+};
+
+// Implemented by AdaptiveAgileReference alone, to tell it from other agile references
+MIDL_INTERFACE("c53cfe1c-9c20-400b-a3d6-cf38b5681dad")
+IAdaptiveAgileReference : public IUnknown
+{
+public:
+    virtual void STDMETHODCALLTYPE GetUsage(_Out_ AdaptiveAgileReferenceUsage *pUsage) = 0;
+};
+
+namespace Details
+{
+
+template <typename Unused = void>
+class AdaptiveAgileReferenceCountersT
+{
+public:
+    static void OnCreate(_In_ bool fAgile)
+    {
+        InterlockedIncrement64(fAgile ? &s_cAgile : &s_cApartmentBound);
+    }
+
+    static void OnUpgrade()
+    {
+        InterlockedIncrement64(&s_cUpgraded);
+    }
+
+    static void Get(_Out_ AdaptiveAgileReferenceStatistics *pStatistics)
+    {
+        pStatistics->cAgile = static_cast<ULONGLONG>(InterlockedCompareExchange64(&s_cAgile, 0, 0));
+        pStatistics->cApartmentBound = static_cast<ULONGLONG>(InterlockedCompareExchange64(&s_cApartmentBound, 0, 0));
+        pStatistics->cUpgraded = static_cast<ULONGLONG>(InterlockedCompareExchange64(&s_cUpgraded, 0, 0));
+    }
+
+private:
+    static LONGLONG volatile s_cAgile;
+    static LONGLONG volatile s_cApartmentBound;
+    static LONGLONG volatile s_cUpgraded;
+};
+
+template <typename Unused>
+LONGLONG volatile AdaptiveAgileReferenceCountersT<Unused>::s_cAgile = 0;
+
+template <typename Unused>
+LONGLONG volatile AdaptiveAgileReferenceCountersT<Unused>::s_cApartmentBound = 0;
+
+template <typename Unused>
+LONGLONG volatile AdaptiveAgileReferenceCountersT<Unused>::s_cUpgraded = 0;
+
+typedef AdaptiveAgileReferenceCountersT<> AdaptiveAgileReferenceCounters;
+
+class AdaptiveAgileReference : public Microsoft::WRL::RuntimeClass<
+    Microsoft::WRL::RuntimeClassFlags<Microsoft::WRL::RuntimeClassType::ClassicCom>,
+    Microsoft::WRL::FtmBase,
+    IAgileReference,
+    IAdaptiveAgileReference>
+{
+public:
+    AdaptiveAgileReference() : _punk(nullptr), _ulHomeContext(0), _fAgile(false), _fUpgraded(0), _cDirectResolves(0), _cMarshaledResolves(0)
+    {
+    }
+
+    HRESULT RuntimeClassInitialize(_In_ REFIID riid, _In_ IUnknown *punk)
+    {
+        HRESULT hr = RoGetAgileReference(AgileReferenceOptions::AGILEREFERENCE_DELAYEDMARSHAL, riid, punk, &_spReference);
+        if (SUCCEEDED(hr))
+        {
+            // Not AddRef'd, _spReference keeps the object alive
+            Microsoft::WRL::ComPtr<IUnknown> spAgile;
+            _fAgile = SUCCEEDED(punk->QueryInterface(__uuidof(IAgileObject), reinterpret_cast<void **>(spAgile.GetAddressOf())));
+            _punk = punk;
+            CoGetContextToken(&_ulHomeContext);
+            AdaptiveAgileReferenceCounters::OnCreate(_fAgile);
+        }
+        return hr;
+    }
+
+    // IAgileReference
+    IFACEMETHODIMP Resolve(_In_ REFIID riid, _COM_Outptr_ void **ppv)
+    {
+        *ppv = nullptr;
+        ULONG_PTR ulContext = 0;
+        if (_fAgile || (SUCCEEDED(CoGetContextToken(&ulContext)) && (ulContext == _ulHomeContext)))
+        {
+            _Count(&_cDirectResolves);
+            return _punk->QueryInterface(riid, ppv);
+        }
+
+        if (InterlockedCompareExchange(&_fUpgraded, 1, 0) == 0)
+        {
+            AdaptiveAgileReferenceCounters::OnUpgrade();
+        }
+        _Count(&_cMarshaledResolves);
+        return _spReference->Resolve(riid, ppv);
+    }
+
+    // IAdaptiveAgileReference
+    IFACEMETHODIMP_(void) GetUsage(_Out_ AdaptiveAgileReferenceUsage *pUsage)
+    {
+        pUsage->fAgile = _fAgile;
+        pUsage->fUpgraded = (ReadAcquire(&_fUpgraded) != 0);
+        pUsage->cDirectResolves = ReadULongNoFence(&_cDirectResolves);
+        pUsage->cMarshaledResolves = ReadULongNoFence(&_cMarshaledResolves);
+    }
+
+private:
+    // Not interlocked, the readers of a reference shouldn't pay for a locked instruction each
+    static void _Count(_Inout_ ULONG volatile *pcCount)
+    {
+        WriteULongNoFence(pcCount, ReadULongNoFence(pcCount) + 1);
+    }
+
+    Microsoft::WRL::ComPtr<IAgileReference> _spReference;
+    IUnknown *_punk;
+    ULONG_PTR _ulHomeContext;
+    bool _fAgile;
+    LONG volatile _fUpgraded;
+    ULONG volatile _cDirectResolves;
+    ULONG volatile _cMarshaledResolves;
+};
+
+// RoGetAgileReference with agileReferenceOption, or an AdaptiveAgileReference when fAdaptive
+inline HRESULT GetAgileReference(_In_ bool fAdaptive, _In_ AgileReferenceOptions agileReferenceOption, _In_ REFIID riid, _In_ IUnknown *punk, _COM_Outptr_ IAgileReference **ppReference)
+{
+    *ppReference = nullptr;
+    if (!fAdaptive)
+    {
+        return RoGetAgileReference(agileReferenceOption, riid, punk, ppReference);
+    }
+    return (punk != nullptr) ? Microsoft::WRL::MakeAndInitialize<AdaptiveAgileReference>(ppReference, riid, punk) : E_INVALIDARG;
+}
+
+} // namespace Details
+
+inline void GetAdaptiveAgileReferenceStatistics(_Out_ AdaptiveAgileReferenceStatistics *pStatistics)
+{
+    Details::AdaptiveAgileReferenceCounters::Get(pStatistics);
+}
+
+// Fails with E_NOINTERFACE, and zeroes *pUsage, when pReference isn't an AdaptiveAgileReference
+inline HRESULT GetAdaptiveAgileReferenceUsage(_In_ IAgileReference *pReference, _Out_ AdaptiveAgileReferenceUsage *pUsage)
+{
+    ZeroMemory(pUsage, sizeof(*pUsage));
+    Microsoft::WRL::ComPtr<IAdaptiveAgileReference> spAdaptive;
+    HRESULT hr = pReference->QueryInterface(IID_PPV_ARGS(&spAdaptive));
+    if (SUCCEEDED(hr))
+    {
+        spAdaptive->GetUsage(pUsage);
+    }
+    return hr;
+}
+
+} // namespace WRL
+} // namespace Internal
+} // namespace Windows
@@ -0,0 +1,215 @@
+#pragma once
+#include <new>                              // For std::nothrow
+#include <combaseapi.h>                     // For CoInitializeEx
+#include <ctxtcall.h>                       // For IContextCallback
+#include <wrl.h>                            // For Microsoft::WRL::ComPtr and SLists
+#include "ModuleThreadpoolImpl.h"           // For the thread pool callbacks that empty the queue
+
+// Releases agile references somewhere other than where they were let go of, for PSO_DEFER_RELEASE and
+// OWSO_DEFER_RELEASE.
+//
+// The last release of an agile reference to an object in another apartment calls into that apartment,
+// and so does the last release of the proxies it handed out. RevokeService and SetSite make those
+// releases on the calling thread, a burst of them (say a window closing hundreds of sited objects)
+// keeps that thread waiting for every apartment involved. With the options set the references go to
+// a process wide queue instead, which a thread pool callback empties in batches.
+//
+// The queue also takes interfaces that have to be released in a given apartment, along with the
+// object context of that apartment (CoGetObjectContext), from code that lets go of them elsewhere.
+// DeferInContext is how OWSO_CACHE_RESOLVED_SITE gives back the interfaces another apartment resolved.
+//
+// A thread that would rather release the queue itself, at a point of its choosing, calls
+// DeferredReleaseQueue::Flush. At most c_cMaxPending references wait in the queue, past that the
+// caller releases its references right away as if the option was not set. Call Drain before
+// shutting COM down, when it returns every reference queued before the call has been released.
+//
+// The module needs no Drain before it unloads: while references are queued a callback is scheduled
+// (see ModuleThreadpoolImpl.h) and holds the module loaded, a FreeLibrary only unloads it once that
+// callback emptied the queue. The exception is a queue whose callback could not be submitted, which
+// waits for the next Defer or Flush, and whose references are leaked if the module unloads first.
+
+namespace Windows { namespace Internal { namespace WRL {
+
+namespace Details
+{
+
+template <typename Unused = void>
+class DeferredReleaseQueueT
+{
+public:
+    static const WORD c_cMaxPending = 4096;
+
+    // Takes over the reference *ppReference holds, which is null afterwards, and queues it for release.
+    // Pass ComPtr::GetAddressOf, ComPtr's operator& would release the reference first.
+    static void Defer(_Inout_ IAgileReference **ppReference)
+    {
+        IAgileReference *pReference = *ppReference;
+        *ppReference = nullptr;
+        if ((pReference != nullptr) && (QueryDepthSList(&s_pending) < c_cMaxPending))
+        {
+            PendingRelease *pPending = new (std::nothrow) PendingRelease();
+            if (pPending != nullptr)
+            {
+                pPending->punk = pReference;
+                InterlockedPushEntrySList(&s_pending, &pPending->entry);
+                _Schedule();
+                pReference = nullptr;
+            }
+        }
+
+        if (pReference != nullptr)
+        {
+            pReference->Release();
+        }
+    }
+
+    // Takes over the reference *ppunk holds, which is null afterwards, and queues it for release in
+    // the apartment of pContext. That one is called into right away if the queue is full.
+    static void DeferInContext(_In_ IContextCallback *pContext, _Inout_ IUnknown **ppunk)
+    {
+        IUnknown *punk = *ppunk;
+        *ppunk = nullptr;
+        if ((punk != nullptr) && (QueryDepthSList(&s_pending) < c_cMaxPending))
+        {
+            PendingRelease *pPending = new (std::nothrow) PendingRelease();
+            if (pPending != nullptr)
+            {
+                pPending->punk = punk;
+                pPending->pContext = pContext;
+                pContext->AddRef();
+                InterlockedPushEntrySList(&s_pending, &pPending->entry);
+                _Schedule();
+                punk = nullptr;
+            }
+        }
+
+        if (punk != nullptr)
+        {
+            _ReleaseInContext(pContext, punk);
+        }
+    }
+
+    // Releases whatever is queued on the calling thread, returns how many references that was
+    static UINT Flush()
+    {
+        UINT cReleased = 0;
+        PSLIST_ENTRY pEntry = InterlockedFlushSList(&s_pending);
+        while (pEntry != nullptr)
+        {
+            PendingRelease *pPending = reinterpret_cast<PendingRelease *>(pEntry);
+            pEntry = pEntry->Next;
+            if (pPending->pContext != nullptr)
+            {
+                _ReleaseInContext(pPending->pContext, pPending->punk);
+                pPending->pContext->Release();
+            }
+            else
+            {
+                pPending->punk->Release();
+            }
+            delete pPending;
+            cReleased++;
+        }
+        return cReleased;
+    }
+
+    // Flush, and wait for any batch the thread pool took before that to be released
+    static void Drain()
+    {
+        do
+        {
+            while (ReadAcquire(&s_lScheduled) != 0)
+            {
+                SwitchToThread();
+            }
+            Flush();
+        } while (ReadAcquire(&s_lScheduled) != 0);
+    }
+
+    static UINT Pending()
+    {
+        return QueryDepthSList(&s_pending);
+    }
+
+private:
+    struct PendingRelease
+    {
+        PendingRelease() : punk(nullptr), pContext(nullptr)
+        {
+        }
+
+        SLIST_ENTRY entry;           // first, so that an entry is its PendingRelease
+        IUnknown *punk;              // an agile reference, or an interface of pContext's apartment
+        IContextCallback *pContext;  // null for an agile reference
+    };
+
+    // ICallbackWithNoReentrancyToApplicationSTA, whose IID the SDK headers don't declare
+    static REFIID _CallbackIid()
+    {
+        static const IID c_iidCallback = { 0x0A299774, 0x3E4E, 0xFC42, { 0x1D, 0x9D, 0x72, 0xCE, 0xE1, 0x05, 0xCA, 0x57 } };
+        return c_iidCallback;
+    }
+
+    static HRESULT STDMETHODCALLTYPE _ReleaseCallback(_In_ ComCallData *pParam)
+    {
+        static_cast<IUnknown *>(pParam->pUserDefined)->Release();
+        return S_OK;
+    }
+
+    // An apartment that is gone can't be called into, and has no thread left that punk would have to
+    // be released on, so it is released right here then
+    static void _ReleaseInContext(_In_ IContextCallback *pContext, _In_ IUnknown *punk)
+    {
+        ComCallData data = {};
+        data.pUserDefined = punk;
+        if (FAILED(pContext->ContextCallback(_ReleaseCallback, &data, _CallbackIid(), 5, nullptr)))
+        {
+            punk->Release();
+        }
+    }
+
+    // One callback at a time, a batch queued while it runs is left to the callback it schedules. It
+    // reschedules before it returns, so the module stays loaded until the queue is empty.
+    static void _Schedule()
+    {
+        if ((InterlockedCompareExchange(&s_lScheduled, 1, 0) == 0) && !ModuleThreadpool::TrySubmitCallback(_Run, nullptr))
+        {
+            // Left for the next Defer, or Flush
+            InterlockedExchange(&s_lScheduled, 0);
+        }
+    }
+
+    static void CALLBACK _Run(_Inout_ PTP_CALLBACK_INSTANCE pInstance, _Inout_opt_ PVOID /*pvContext*/)
+    {
+        CallbackMayRunLong(pInstance);
+        HRESULT const hrInitialize = CoInitializeEx(nullptr, COINIT_MULTITHREADED);
+        Flush();
+        if (SUCCEEDED(hrInitialize))
+        {
+            CoUninitialize();
+        }
+
+        InterlockedExchange(&s_lScheduled, 0);
+        if (QueryDepthSList(&s_pending) != 0)
+        {
+            _Schedule();
+        }
+    }
+
+    static SLIST_HEADER s_pending;          // all zero is an empty list
+    static LONG volatile s_lScheduled;
+};
+
+template <typename Unused>
+SLIST_HEADER DeferredReleaseQueueT<Unused>::s_pending;
+
+template <typename Unused>
+LONG volatile DeferredReleaseQueueT<Unused>::s_lScheduled = 0;
+
+} // namespace Details
+
+typedef Details::DeferredReleaseQueueT<> DeferredReleaseQueue;
+
+} // namespace WRL
+} // namespace Internal
+} // namespace Windows
@@ -0,0 +1,200 @@
+#pragma once
+#include <wrl.h>                            // For Interlocked* and friends
+
+// Hazard pointers used by the lock free read paths of these helpers.
+//
+// A reader publishes the pointer it is about to dereference in a hazard slot. A writer that
+// unpublishes a pointer hands it to a HazardRetireList, which only gives it back for release
+// once no hazard slot holds it anymore.
+//
+// The slots are process wide and each lives on its own cache line. A reader picks its starting
+// slot by hashing its thread id, so readers on different threads normally never write to the
+// same cache line, which is the whole point compared to taking a shared lock.
+//
+// There are only c_cSlots of them for the whole process, so a reader holds one just long enough
+// to take a reference on what it reads, never across a call that may block or re-enter (such as
+// IAgileReference::Resolve). When every slot is taken the HazardPointer isn't valid and the
+// reader falls back to the writer's lock instead of waiting for a slot.
+
+namespace Windows { namespace Internal { namespace WRL {
+
+namespace Details
+{
+
+struct DECLSPEC_CACHEALIGN HazardSlot
+{
+    void * volatile pHazard;
+    LONG volatile fInUse;
+};
+
+// Templated only so that the slot array can live in a header without a separate definition
+// in some translation unit.
+template <typename Unused = void>
+class HazardPointerDomainT
+{
+public:
+    static const UINT c_cSlots = 128;
+
+    // nullptr when every slot is taken
+    static HazardSlot *AcquireSlot()
+    {
+        // Thread ids are multiples of four, drop those bits before spreading them.
+        UINT const idxStart = ((GetCurrentThreadId() >> 2) * 2654435761u) % c_cSlots;
+        for (UINT cProbes = 0; cProbes < c_cSlots; cProbes++)
+        {
+            HazardSlot *pSlot = &s_rgSlots[(idxStart + cProbes) % c_cSlots];
+            if ((pSlot->fInUse == 0) && (InterlockedCompareExchange(&pSlot->fInUse, 1, 0) == 0))
+            {
+                return pSlot;
+            }
+        }
+        return nullptr;
+    }
+
+    static void ReleaseSlot(_In_ HazardSlot *pSlot)
+    {
+        InterlockedExchangePointer(&pSlot->pHazard, nullptr);
+        InterlockedExchange(&pSlot->fInUse, 0);
+    }
+
+    static bool IsHazard(_In_ void const *p)
+    {
+        for (UINT idx = 0; idx < c_cSlots; idx++)
+        {
+            if (ReadPointerAcquire(&s_rgSlots[idx].pHazard) == p)
+            {
+                return true;
+            }
+        }
+        return false;
+    }
+
+private:
+    static HazardSlot s_rgSlots[c_cSlots];
+};
+
+template <typename Unused>
+HazardSlot HazardPointerDomainT<Unused>::s_rgSlots[HazardPointerDomainT<Unused>::c_cSlots];
+
+typedef HazardPointerDomainT<> HazardPointerDomain;
+
+// Scoped reader side of a hazard pointer. Keep these short lived, the slot is held until
+// the HazardPointer goes out of scope.
+class HazardPointer
+{
+public:
+    HazardPointer() : _pSlot(HazardPointerDomain::AcquireSlot())
+    {
+    }
+
+    ~HazardPointer()
+    {
+        if (_pSlot != nullptr)
+        {
+            HazardPointerDomain::ReleaseSlot(_pSlot);
+        }
+    }
+
+    // False when no slot was free, Protect and Reset must not be called then
+    bool IsValid() const
+    {
+        return _pSlot != nullptr;
+    }
+
+    // Returns the current value of *ppSource, guaranteed not to be reclaimed until this
+    // HazardPointer is reset or destroyed.
+    template <typename T>
+    T *Protect(_In_ T * const volatile *ppSource)
+    {
+        T *p;
+        do
+        {
+            p = static_cast<T *>(ReadPointerAcquire(reinterpret_cast<PVOID const volatile *>(ppSource)));
+            // Full barrier so the re-read below can't be satisfied before the hazard is visible
+            InterlockedExchangePointer(&_pSlot->pHazard, p);
+        } while (p != ReadPointerAcquire(reinterpret_cast<PVOID const volatile *>(ppSource)));
+        return p;
+    }
+
+    void Reset()
+    {
+        InterlockedExchangePointer(&_pSlot->pHazard, nullptr);
+    }
+
+private:
+    HazardSlot *_pSlot;
+
+    HazardPointer(const HazardPointer &);
+    HazardPointer & operator=(const HazardPointer &);
+};
+
+// Objects unpublished by a writer that may still be in use by readers. T needs a
+// "T *pNextRetired" member and a Release method.
+//
+// The list does no locking of its own, the owner serializes access (typically with the
+// writer lock). Releasing is left to the caller through ReleaseChain so that it can happen
+// after that lock has been dropped.
+template <typename T>
+class HazardRetireList
+{
+public:
+    HazardRetireList() : _pRetired(nullptr)
+    {
+    }
+
+    ~HazardRetireList()
+    {
+        // The owner is being destroyed so there can't be any readers left.
+        ReleaseChain(_pRetired);
+    }
+
+    void Retire(_In_ T *p)
+    {
+        p->pNextRetired = _pRetired;
+        _pRetired = p;
+    }
+
+    // Unlinks every retired object that no reader holds anymore and returns them as a chain
+    // for ReleaseChain.
+    T *DetachReclaimable()
+    {
+        T *pReclaimable = nullptr;
+        T **ppLink = &_pRetired;
+        while (*ppLink != nullptr)
+        {
+            T *p = *ppLink;
+            if (HazardPointerDomain::IsHazard(p))
+            {
+                ppLink = &p->pNextRetired;
+            }
+            else
+            {
+                *ppLink = p->pNextRetired;
+                p->pNextRetired = pReclaimable;
+                pReclaimable = p;
+            }
+        }
+        return pReclaimable;
+    }
+
+    static void ReleaseChain(_In_opt_ T *p)
+    {
+        while (p != nullptr)
+        {
+            T *pNext = p->pNextRetired;
+            p->Release();
+            p = pNext;
+        }
+    }
+
+private:
+    T *_pRetired;
+
+    HazardRetireList(const HazardRetireList &);
+    HazardRetireList & operator=(const HazardRetireList &);
+};
+
+} // namespace Details
+} // namespace WRL
+} // namespace Internal
+} // namespace Windows
@@ -0,0 +1,61 @@
+#pragma once
+#include <wrl.h>                            // For the thread pool and InitOnce
+
+// Submits thread pool callbacks on behalf of the module these helpers are built into, for
+// DeferredReleaseQueue and QueryServiceAsync.
+//
+// A callback submitted with no environment runs the module's code with nothing keeping the module
+// loaded, a FreeLibrary while it is queued or running unloads the code out from under it. The
+// callbacks go through a callback environment whose library is this module instead
+// (SetThreadpoolCallbackLibrary), so the thread pool holds a reference on the module from the submit
+// until the callback returned, and the module only unloads once the callbacks it submitted are done.
+
+namespace Windows { namespace Internal { namespace WRL {
+
+namespace Details
+{
+
+template <typename Unused = void>
+class ModuleThreadpoolT
+{
+public:
+    // TrySubmitThreadpoolCallback in the environment of the module
+    static BOOL TrySubmitCallback(_In_ PTP_SIMPLE_CALLBACK pfnCallback, _Inout_opt_ PVOID pvContext)
+    {
+        return InitOnceExecuteOnce(&s_initOnce, _InitializeEnvironment, nullptr, nullptr) &&
+               TrySubmitThreadpoolCallback(pfnCallback, pvContext, &s_environment);
+    }
+
+private:
+    static BOOL CALLBACK _InitializeEnvironment(_Inout_ PINIT_ONCE /*pInitOnce*/, _Inout_opt_ PVOID /*pvParameter*/, _Outptr_opt_result_maybenull_ PVOID * /*ppvContext*/)
+    {
+        // The module that has this function, without a reference of its own, the callbacks hold theirs
+        HMODULE hModule;
+        BOOL const fSucceeded = GetModuleHandleExW(GET_MODULE_HANDLE_EX_FLAG_FROM_ADDRESS | GET_MODULE_HANDLE_EX_FLAG_UNCHANGED_REFCOUNT,
+                                                   reinterpret_cast<LPCWSTR>(&_InitializeEnvironment), &hModule);
+        if (fSucceeded)
+        {
+            InitializeThreadpoolEnvironment(&s_environment);
+            SetThreadpoolCallbackLibrary(&s_environment, hModule);
+        }
+        return fSucceeded;
+    }
+
+    // Never destroyed, DestroyThreadpoolEnvironment does nothing for an environment without a pool
+    static TP_CALLBACK_ENVIRON s_environment;
+    static INIT_ONCE s_initOnce;
+};
+
+template <typename Unused>
+TP_CALLBACK_ENVIRON ModuleThreadpoolT<Unused>::s_environment;
+
+template <typename Unused>
+INIT_ONCE ModuleThreadpoolT<Unused>::s_initOnce = INIT_ONCE_STATIC_INIT;
+
+} // namespace Details
+
+typedef Details::ModuleThreadpoolT<> ModuleThreadpool;
+
+} // namespace WRL
+} // namespace Internal
+} // namespace Windows
@@ -2,6 +2,10 @@
 #include "CppUnitTest.h"
 #include "..\ObjectWithSiteImpl.h"
 #include "..\ProfferServiceImpl.h"
+#include "..\ServiceMapImpl.h"
+#include "..\ServiceInstrumentationImpl.h"
+#include "..\QueryServiceAsyncImpl.h"
+#include "..\ServiceRefImpl.h"
 
 // Comment this unit test
 
@@ -20,11 +24,12 @@ namespace ObjectWithSite
 	{
 	};
 
-	class CSimpleServiceProvider : public RuntimeClass <
+	template <typename TProfferService, typename TObjectWithSite = Windows::Internal::WRL::ObjectWithSite>
+	class CSimpleServiceProviderT : public RuntimeClass <
 		RuntimeClassFlags<RuntimeClassType::ClassicCom>,
 		Implements<RuntimeClassFlags<RuntimeClassType::ClassicCom>,
-		Windows::Internal::WRL::ObjectWithSite,
-		ProfferService >>
+		TObjectWithSite,
+		TProfferService >>
 	{
 	public:
 		HRESULT RuntimeClassInitialize(_In_ REFGUID guidService)
@@ -41,7 +46,7 @@ namespace ObjectWithSite
 			if (guidService == _guidService)
 			{
 				Assert::AreEqual(_dwExpectedThread, GetCurrentThreadId());
-				hr = CastToUnknown()->QueryInterface(riid, ppv);
+				hr = this->CastToUnknown()->QueryInterface(riid, ppv);
 			}
 			return hr;
 		}
@@ -51,12 +56,305 @@ namespace ObjectWithSite
 		DWORD _dwExpectedThread;
 	};
 
+	typedef CSimpleServiceProviderT<ProfferService> CSimpleServiceProvider;
+
+	class CMemoizingProfferService : public ProfferService
+	{
+	public:
+		CMemoizingProfferService() : ProfferService(AgileReferenceOptions::AGILEREFERENCE_DEFAULT, PSO_MEMOIZE_SITE_CHAIN)
+		{
+		}
+	};
+
+	typedef CSimpleServiceProviderT<CMemoizingProfferService> CMemoizingServiceProvider;
+
+	class CSummarizingProfferService : public ProfferService
+	{
+	public:
+		CSummarizingProfferService() : ProfferService(AgileReferenceOptions::AGILEREFERENCE_DEFAULT, PSO_SUMMARIZE_SITE_CHAIN)
+		{
+		}
+	};
+
+	typedef CSimpleServiceProviderT<CSummarizingProfferService> CSummarizingServiceProvider;
+
+	class CWalkingProfferService : public ProfferService
+	{
+	public:
+		CWalkingProfferService() : ProfferService(AgileReferenceOptions::AGILEREFERENCE_DEFAULT, PSO_WALK_SITE_CHAIN)
+		{
+		}
+	};
+
+	typedef CSimpleServiceProviderT<CWalkingProfferService> CWalkingServiceProvider;
+
+	class CDeferringProfferService : public ProfferService
+	{
+	public:
+		CDeferringProfferService() : ProfferService(AgileReferenceOptions::AGILEREFERENCE_DEFAULT, PSO_DEFER_RELEASE)
+		{
+		}
+	};
+
+	class CDeferringObjectWithSite : public Windows::Internal::WRL::ObjectWithSite
+	{
+	public:
+		CDeferringObjectWithSite() : ObjectWithSite(OWSO_DEFER_RELEASE)
+		{
+		}
+	};
+
+	typedef CSimpleServiceProviderT<CDeferringProfferService, CDeferringObjectWithSite> CDeferringServiceProvider;
+
+	class CAdaptiveObjectWithSite : public Windows::Internal::WRL::ObjectWithSite
+	{
+	public:
+		CAdaptiveObjectWithSite() : ObjectWithSite(OWSO_ADAPTIVE_SITE_REFERENCE)
+		{
+		}
+	};
+
+	typedef CSimpleServiceProviderT<ProfferService, CAdaptiveObjectWithSite> CAdaptiveSiteServiceProvider;
+
+	// Its own tag, so that what the other tests do doesn't show up in the counts
+	struct InstrumentationTestTag {};
+	typedef ServiceLookupInstrumentationT<InstrumentationTestTag> TestInstrumentation;
+
+	class CInstrumentedProfferService : public ProfferServiceT<TestInstrumentation>
+	{
+	public:
+		CInstrumentedProfferService() : ProfferServiceT(AgileReferenceOptions::AGILEREFERENCE_DEFAULT, PSO_MEMOIZE_SITE_CHAIN)
+		{
+		}
+	};
+
+	typedef CSimpleServiceProviderT<CInstrumentedProfferService, ObjectWithSiteT<TestInstrumentation>> CInstrumentedServiceProvider;
+
+	struct ServiceProviderInfo
+	{
+		ComPtr<IServiceProvider> spProvider;
+		GUID serviceGUID;
+	};
+
+	// Builds a chain of cLayers providers, each sited to the previous one and each exposing its own service.
+	// Returns the providers from the root down, the last one is the bottom of the chain.
+	template <typename TServiceProvider>
+	vector<ServiceProviderInfo> _BuildServiceProviderChain(unsigned int cLayers)
+	{
+		vector<ServiceProviderInfo> rgProviders;
+		ComPtr<IServiceProvider> spPreviousProvider;
+		for (unsigned int idxProvider = 0; idxProvider < cLayers; idxProvider++)
+		{
+			ServiceProviderInfo info;
+			Assert::IsTrue(SUCCEEDED(CoCreateGuid(&info.serviceGUID)));
+			Assert::IsTrue(SUCCEEDED(MakeAndInitialize<TServiceProvider>(&info.spProvider, info.serviceGUID)));
+			ComPtr<IObjectWithSite> spSite;
+			Assert::IsTrue(SUCCEEDED(info.spProvider.CopyTo(IID_PPV_ARGS(&spSite))));
+			Assert::IsTrue(SUCCEEDED(spSite->SetSite(spPreviousProvider.Get())));
+			spPreviousProvider = info.spProvider;
+			rgProviders.push_back(info);
+		}
+		return rgProviders;
+	}
+
+	void _TearDownServiceProviderChain(vector<ServiceProviderInfo> const &rgProviders)
+	{
+		for (auto info : rgProviders)
+		{
+			ComPtr<IObjectWithSite> spSite;
+			Assert::IsTrue(SUCCEEDED(info.spProvider.CopyTo(IID_PPV_ARGS(&spSite))));
+			Assert::IsTrue(SUCCEEDED(spSite->SetSite(nullptr)));
+		}
+	}
+
+	// A free threaded provider, so that benchmarks can query it from any thread without marshaling
+	class CAgileServiceProvider : public RuntimeClass <
+		RuntimeClassFlags<RuntimeClassType::ClassicCom>,
+		FtmBase,
+		IServiceProvider>
+	{
+	public:
+		IFACEMETHODIMP QueryService(_In_ REFGUID /*guidService*/, _In_ REFIID riid, _COM_Outptr_ void **ppv)
+		{
+			return CastToUnknown()->QueryInterface(riid, ppv);
+		}
+	};
+
+	// Counts the times it was resolved (or otherwise queried) by a caller holding a hazard slot, which
+	// a resolve that blocks or re-enters must never do
+	class CHazardCheckingServiceProvider : public CAgileServiceProvider
+	{
+	public:
+		CHazardCheckingServiceProvider() : _cUnderHazard(0)
+		{
+		}
+
+		IFACEMETHODIMP QueryInterface(_In_ REFIID riid, _COM_Outptr_ void **ppv) override
+		{
+			Windows::Internal::WRL::Details::HazardPointer rgHazards[Windows::Internal::WRL::Details::HazardPointerDomain::c_cSlots];
+			if (!rgHazards[Windows::Internal::WRL::Details::HazardPointerDomain::c_cSlots - 1].IsValid())
+			{
+				_cUnderHazard++;
+			}
+			return CAgileServiceProvider::QueryInterface(riid, ppv);
+		}
+
+		unsigned int UnderHazard() const
+		{
+			return _cUnderHazard;
+		}
+
+	private:
+		unsigned int _cUnderHazard;
+	};
+
+	// Not agile, so that reaching it from another apartment takes a proxy
+	class CApartmentServiceProvider : public RuntimeClass <
+		RuntimeClassFlags<RuntimeClassType::ClassicCom>,
+		IServiceProvider>
+	{
+	public:
+		IFACEMETHODIMP QueryService(_In_ REFGUID /*guidService*/, _In_ REFIID riid, _COM_Outptr_ void **ppv)
+		{
+			return CastToUnknown()->QueryInterface(riid, ppv);
+		}
+	};
+
+	template <typename TProfferService>
+	class CAgileBroker : public RuntimeClass <
+		RuntimeClassFlags<RuntimeClassType::ClassicCom>,
+		FtmBase,
+		TProfferService>
+	{
+	};
+
+	class CCachingAgileProfferService : public AgileProfferService
+	{
+	public:
+		CCachingAgileProfferService() : AgileProfferService(AgileReferenceOptions::AGILEREFERENCE_DEFAULT, PSO_CACHE_RESOLVED_PROVIDERS)
+		{
+		}
+	};
+
+	class CAdaptiveAgileProfferService : public AgileProfferService
+	{
+	public:
+		CAdaptiveAgileProfferService() : AgileProfferService(AgileReferenceOptions::AGILEREFERENCE_DEFAULT, PSO_ADAPTIVE_AGILE_REFERENCES)
+		{
+		}
+	};
+
+	// Counts the lookups that reach it
+	class CCountingServiceProvider : public RuntimeClass <
+		RuntimeClassFlags<RuntimeClassType::ClassicCom>,
+		FtmBase,
+		IServiceProvider>
+	{
+	public:
+		CCountingServiceProvider() : _cQueries(0)
+		{
+		}
+
+		IFACEMETHODIMP QueryService(_In_ REFGUID /*guidService*/, _In_ REFIID riid, _COM_Outptr_ void **ppv)
+		{
+			_cQueries++;
+			return CastToUnknown()->QueryInterface(riid, ppv);
+		}
+
+		unsigned int Queries() const
+		{
+			return _cQueries;
+		}
+
+	private:
+		unsigned int _cQueries;
+	};
+
+	class CLockFreeSitedObject : public RuntimeClass <
+		RuntimeClassFlags<RuntimeClassType::ClassicCom>,
+		FtmBase,
+		Implements<RuntimeClassFlags<RuntimeClassType::ClassicCom>,
+		LockFreeObjectWithSite,
+		AgileProfferService >>
+	{
+	};
+
+	class CCachingObjectWithSite : public Windows::Internal::WRL::ObjectWithSite
+	{
+	public:
+		CCachingObjectWithSite() : ObjectWithSite(OWSO_CACHE_RESOLVED_SITE)
+		{
+		}
+	};
+
+	class CCachingSitedObject : public RuntimeClass <
+		RuntimeClassFlags<RuntimeClassType::ClassicCom>,
+		FtmBase,
+		Implements<RuntimeClassFlags<RuntimeClassType::ClassicCom>,
+		CCachingObjectWithSite,
+		AgileProfferService >>
+	{
+	};
+
+	// Distinct service ids with linkage, usable as ServiceEntry arguments
+	template <unsigned int idService>
+	struct TestServiceId
+	{
+		static const GUID guid;
+	};
+
+	template <unsigned int idService>
+	const GUID TestServiceId<idService>::guid = { 0x6d1b42c0, 0x5f3e, 0x4b8a, { 0x9c, 0x27, 0x3e, 0x81, static_cast<unsigned char>(idService >> 24), static_cast<unsigned char>(idService >> 16), static_cast<unsigned char>(idService >> 8), static_cast<unsigned char>(idService) } };
+
+	class CServiceMapProvider : public RuntimeClass <
+		RuntimeClassFlags<RuntimeClassType::ClassicCom>,
+		ServiceMap<CServiceMapProvider, ProfferService,
+			ServiceEntry<TestServiceId<1>::guid>,
+			ServiceEntry<TestServiceId<2>::guid>,
+			ServiceEntry<TestServiceId<3>::guid>>>
+	{
+	};
+
+	// Answers TestServiceId<4> from QueryService itself, past the registry and v_QueryService
+	class CQueryServiceOverride : public CSimpleServiceProvider
+	{
+	public:
+		IFACEMETHODIMP QueryService(_In_ REFGUID guidService, _In_ REFIID riid, _COM_Outptr_ void **ppv)
+		{
+			if (guidService == TestServiceId<4>::guid)
+			{
+				return CastToUnknown()->QueryInterface(riid, ppv);
+			}
+			return CSimpleServiceProvider::QueryService(guidService, riid, ppv);
+		}
+	};
+
 	TEST_CLASS(TestObjectWithSite)
 	{
 	public:
 		
 		TEST_METHOD(TestCrossApartmentQueryService);
 		TEST_METHOD(TestMultiLayerQueryService);
+		TEST_METHOD(TestResolvedProviderCacheRevoke);
+		TEST_METHOD(TestMemoizedSiteChain);
+		TEST_METHOD(TestRevokeStaleCookie);
+		TEST_METHOD(TestProfferServicesBatch);
+		TEST_METHOD(TestServiceMap);
+		TEST_METHOD(TestServiceLookupInstrumentation);
+		TEST_METHOD(TestInstrumentationThreadChurn);
+		TEST_METHOD(TestLockFreeObjectWithSite);
+		TEST_METHOD(TestHazardSlotsExhausted);
+		TEST_METHOD(TestResolvedSiteCache);
+		TEST_METHOD(TestInlineServiceEntries);
+		TEST_METHOD(TestQueryServiceAsync);
+		TEST_METHOD(TestQueryServicesBatch);
+		TEST_METHOD(TestSummarizedSiteChain);
+		TEST_METHOD(TestLazyService);
+		TEST_METHOD(TestDeferredRelease);
+		TEST_METHOD(TestAdaptiveAgileReference);
+		TEST_METHOD(TestSiteChainWalker);
+		TEST_METHOD(TestServiceRef);
+		TEST_METHOD(TestServiceTemplate);
 	};
 	
 	struct ObjectWithSiteTestData
@@ -133,4 +431,1161 @@ namespace ObjectWithSite
 		}
 	}
 
-}
\ No newline at end of file
+
+	ULONG _RefCount(_In_ IUnknown *punk)
+	{
+		punk->AddRef();
+		return punk->Release();
+	}
+
+	void TestObjectWithSite::TestResolvedProviderCacheRevoke()
+	{
+		GUID guidService;
+		Assert::IsTrue(SUCCEEDED(CoCreateGuid(&guidService)));
+		ComPtr<IServiceProvider> spFirstProvider, spSecondProvider;
+		Assert::IsTrue(SUCCEEDED(MakeAndInitialize<CAgileServiceProvider>(&spFirstProvider)));
+		Assert::IsTrue(SUCCEEDED(MakeAndInitialize<CAgileServiceProvider>(&spSecondProvider)));
+		ComPtr<CAgileBroker<CCachingAgileProfferService>> spBroker;
+		Assert::IsTrue(SUCCEEDED(MakeAndInitialize<CAgileBroker<CCachingAgileProfferService>>(&spBroker)));
+
+		DWORD dwCookie;
+		Assert::IsTrue(SUCCEEDED(spBroker->ProfferService(guidService, spFirstProvider.Get(), &dwCookie)));
+		for (int idxQuery = 0; idxQuery < 2; idxQuery++)
+		{
+			ComPtr<IServiceProvider> spService;
+			Assert::IsTrue(SUCCEEDED(spBroker->QueryService(guidService, IID_PPV_ARGS(&spService))));
+			Assert::IsTrue(spService.Get() == spFirstProvider.Get());
+		}
+
+		ULONGLONG cHits, cMisses;
+		spBroker->GetResolvedProviderCacheStatistics(&cHits, &cMisses);
+		Assert::AreEqual(1ULL, cHits);
+		Assert::AreEqual(1ULL, cMisses);
+
+		// Once revoked the cached provider is released, and must not come back, neither on its own
+		// nor in place of a provider proffered later for the same service.
+		Assert::IsTrue(SUCCEEDED(spBroker->RevokeService(dwCookie)));
+		Assert::AreEqual(1UL, _RefCount(spFirstProvider.Get()));
+		ComPtr<IServiceProvider> spRevoked;
+		Assert::AreEqual(E_NOTIMPL, spBroker->QueryService(guidService, IID_PPV_ARGS(&spRevoked)));
+
+		Assert::IsTrue(SUCCEEDED(spBroker->ProfferService(guidService, spSecondProvider.Get(), &dwCookie)));
+		ComPtr<IServiceProvider> spService;
+		Assert::IsTrue(SUCCEEDED(spBroker->QueryService(guidService, IID_PPV_ARGS(&spService))));
+		Assert::IsTrue(spService.Get() == spSecondProvider.Get());
+		spService.Reset();
+		Assert::IsTrue(SUCCEEDED(spBroker->RevokeService(dwCookie)));
+		Assert::AreEqual(1UL, _RefCount(spSecondProvider.Get()));
+	}
+
+	void TestObjectWithSite::TestMemoizedSiteChain()
+	{
+		auto rgProviders = _BuildServiceProviderChain<CMemoizingServiceProvider>(10);
+		auto spBottom = rgProviders.back().spProvider;
+
+		// Twice, the second time around every lookup is answered from the remembered routes
+		for (int idxPass = 0; idxPass < 2; idxPass++)
+		{
+			for (auto info : rgProviders)
+			{
+				ComPtr<IServiceProvider> spProvider;
+				Assert::IsTrue(SUCCEEDED(spBottom->QueryService(info.serviceGUID, IID_PPV_ARGS(&spProvider))));
+				Assert::IsTrue(spProvider.Get() == info.spProvider.Get());
+			}
+
+			GUID guidUnknown;
+			Assert::IsTrue(SUCCEEDED(CoCreateGuid(&guidUnknown)));
+			ComPtr<IServiceProvider> spProvider;
+			Assert::AreEqual(E_NOTIMPL, spBottom->QueryService(guidUnknown, IID_PPV_ARGS(&spProvider)));
+		}
+
+		// Cut the chain in the middle, the services above the cut must no longer be found
+		ComPtr<IObjectWithSite> spMiddle;
+		Assert::IsTrue(SUCCEEDED(rgProviders[5].spProvider.CopyTo(IID_PPV_ARGS(&spMiddle))));
+		Assert::IsTrue(SUCCEEDED(spMiddle->SetSite(nullptr)));
+		for (unsigned int idxProvider = 0; idxProvider < rgProviders.size(); idxProvider++)
+		{
+			ComPtr<IServiceProvider> spProvider;
+			HRESULT hr = spBottom->QueryService(rgProviders[idxProvider].serviceGUID, IID_PPV_ARGS(&spProvider));
+			Assert::AreEqual(idxProvider >= 5, SUCCEEDED(hr));
+		}
+
+		_TearDownServiceProviderChain(rgProviders);
+	}
+
+	void TestObjectWithSite::TestRevokeStaleCookie()
+	{
+		ComPtr<IServiceProvider> spProvider;
+		Assert::IsTrue(SUCCEEDED(MakeAndInitialize<CAgileServiceProvider>(&spProvider)));
+		ComPtr<IProfferService> spBroker;
+		Assert::IsTrue(SUCCEEDED(MakeAndInitialize<CAgileBroker<AgileProfferService>>(&spBroker)));
+
+		GUID guidFirst, guidSecond;
+		Assert::IsTrue(SUCCEEDED(CoCreateGuid(&guidFirst)));
+		Assert::IsTrue(SUCCEEDED(CoCreateGuid(&guidSecond)));
+		DWORD dwFirstCookie, dwSecondCookie;
+		Assert::IsTrue(SUCCEEDED(spBroker->ProfferService(guidFirst, spProvider.Get(), &dwFirstCookie)));
+		Assert::IsTrue(SUCCEEDED(spBroker->RevokeService(dwFirstCookie)));
+		Assert::AreEqual(E_INVALIDARG, spBroker->RevokeService(dwFirstCookie));
+
+		// The second service reuses the slot of the first one, the first cookie must still not revoke it
+		Assert::IsTrue(SUCCEEDED(spBroker->ProfferService(guidSecond, spProvider.Get(), &dwSecondCookie)));
+		Assert::AreNotEqual(dwFirstCookie, dwSecondCookie);
+
+		// Revoking nothing doesn't make anybody look their services up again either
+		ComPtr<Windows::Internal::WRL::Details::ISiteChainNode> spNode;
+		Assert::IsTrue(SUCCEEDED(spBroker.As(&spNode)));
+		Windows::Internal::WRL::Details::SiteChainNodeGeneration *pGeneration;
+		Assert::IsTrue(SUCCEEDED(spNode->GetNodeGeneration(&pGeneration)));
+		LONG const lGeneration = pGeneration->Current();
+		Assert::AreEqual(E_INVALIDARG, spBroker->RevokeService(dwFirstCookie));
+		Assert::AreEqual(E_INVALIDARG, spBroker->RevokeService(0));
+		Assert::AreEqual(lGeneration, pGeneration->Current());
+		pGeneration->Release();
+
+		ComPtr<IServiceProvider> spBrokerProvider, spService;
+		Assert::IsTrue(SUCCEEDED(spBroker.As(&spBrokerProvider)));
+		Assert::IsTrue(SUCCEEDED(spBrokerProvider->QueryService(guidSecond, IID_PPV_ARGS(&spService))));
+		Assert::IsTrue(SUCCEEDED(spBroker->RevokeService(dwSecondCookie)));
+	}
+
+	void TestObjectWithSite::TestProfferServicesBatch()
+	{
+		ComPtr<IServiceProvider> spProvider;
+		Assert::IsTrue(SUCCEEDED(MakeAndInitialize<CAgileServiceProvider>(&spProvider)));
+		ComPtr<CAgileBroker<AgileProfferService>> spBroker;
+		Assert::IsTrue(SUCCEEDED(MakeAndInitialize<CAgileBroker<AgileProfferService>>(&spBroker)));
+
+		GUID rgServices[8];
+		DWORD rgCookies[ARRAYSIZE(rgServices)];
+		for (auto &guidService : rgServices)
+		{
+			Assert::IsTrue(SUCCEEDED(CoCreateGuid(&guidService)));
+		}
+
+		// A batch that lists a service twice must not proffer anything
+		GUID const guidLast = rgServices[ARRAYSIZE(rgServices) - 1];
+		rgServices[ARRAYSIZE(rgServices) - 1] = rgServices[0];
+		Assert::AreEqual(HRESULT_FROM_WIN32(ERROR_ALREADY_REGISTERED), spBroker->ProfferServices(rgServices, ARRAYSIZE(rgServices), spProvider.Get(), rgCookies));
+		for (auto dwCookie : rgCookies)
+		{
+			Assert::AreEqual(0UL, dwCookie);
+		}
+		ComPtr<IServiceProvider> spService;
+		Assert::AreEqual(E_NOTIMPL, spBroker->QueryService(rgServices[0], IID_PPV_ARGS(&spService)));
+
+		rgServices[ARRAYSIZE(rgServices) - 1] = guidLast;
+		Assert::IsTrue(SUCCEEDED(spBroker->ProfferServices(rgServices, ARRAYSIZE(rgServices), spProvider.Get(), rgCookies)));
+		for (auto guidService : rgServices)
+		{
+			spService.Reset();
+			Assert::IsTrue(SUCCEEDED(spBroker->QueryService(guidService, IID_PPV_ARGS(&spService))));
+		}
+
+		Assert::IsTrue(SUCCEEDED(spBroker->RevokeServices(rgCookies, ARRAYSIZE(rgCookies))));
+		Assert::AreEqual(E_INVALIDARG, spBroker->RevokeServices(rgCookies, ARRAYSIZE(rgCookies)));
+		for (auto guidService : rgServices)
+		{
+			spService.Reset();
+			Assert::AreEqual(E_NOTIMPL, spBroker->QueryService(guidService, IID_PPV_ARGS(&spService)));
+		}
+	}
+
+	void TestObjectWithSite::TestServiceMap()
+	{
+		ComPtr<IServiceProvider> spProvider;
+		Assert::IsTrue(SUCCEEDED(MakeAndInitialize<CServiceMapProvider>(&spProvider)));
+		for (auto pguidService : { &TestServiceId<1>::guid, &TestServiceId<2>::guid, &TestServiceId<3>::guid })
+		{
+			ComPtr<IServiceProvider> spService;
+			Assert::IsTrue(SUCCEEDED(spProvider->QueryService(*pguidService, IID_PPV_ARGS(&spService))));
+			Assert::IsTrue(spService.Get() == spProvider.Get());
+		}
+
+		ComPtr<IServiceProvider> spService;
+		Assert::AreEqual(E_NOTIMPL, spProvider->QueryService(TestServiceId<4>::guid, IID_PPV_ARGS(&spService)));
+	}
+
+	ServiceLookupSnapshot::ServiceCounts const *_FindServiceCounts(ServiceLookupSnapshot const &snapshot, REFGUID guidService)
+	{
+		for (UINT idx = 0; idx < snapshot.cServices; idx++)
+		{
+			if (snapshot.rgServices[idx].guidService == guidService)
+			{
+				return &snapshot.rgServices[idx];
+			}
+		}
+		return nullptr;
+	}
+
+	void TestObjectWithSite::TestServiceLookupInstrumentation()
+	{
+		auto rgProviders = _BuildServiceProviderChain<CInstrumentedServiceProvider>(3);
+		auto spBottom = rgProviders.back().spProvider;
+		GUID const guidRoot = rgProviders.front().serviceGUID;
+		GUID const guidBottom = rgProviders.back().serviceGUID;
+
+		GUID guidProffered, guidUnknown;
+		Assert::IsTrue(SUCCEEDED(CoCreateGuid(&guidProffered)));
+		Assert::IsTrue(SUCCEEDED(CoCreateGuid(&guidUnknown)));
+		ComPtr<IServiceProvider> spAgileProvider;
+		Assert::IsTrue(SUCCEEDED(MakeAndInitialize<CAgileServiceProvider>(&spAgileProvider)));
+		ComPtr<IProfferService> spProfferService;
+		Assert::IsTrue(SUCCEEDED(spBottom.As(&spProfferService)));
+		DWORD dwCookie;
+		Assert::IsTrue(SUCCEEDED(spProfferService->ProfferService(guidProffered, spAgileProvider.Get(), &dwCookie)));
+
+		// The root's service twice, walked and then remembered, whatever happens to objects off the chain
+		// in between; then one of each other path
+		ComPtr<IProfferService> spUnrelated;
+		Assert::IsTrue(SUCCEEDED(MakeAndInitialize<CAgileBroker<AgileProfferService>>(&spUnrelated)));
+		ComPtr<IObjectWithSite> spUnrelatedObject;
+		Assert::IsTrue(SUCCEEDED(MakeAndInitialize<CSimpleServiceProvider>(&spUnrelatedObject, guidUnknown)));
+		for (int idxQuery = 0; idxQuery < 2; idxQuery++)
+		{
+			ComPtr<IServiceProvider> spService;
+			Assert::IsTrue(SUCCEEDED(spBottom->QueryService(guidRoot, IID_PPV_ARGS(&spService))));
+
+			DWORD dwUnrelatedCookie;
+			Assert::IsTrue(SUCCEEDED(spUnrelated->ProfferService(guidRoot, spAgileProvider.Get(), &dwUnrelatedCookie)));
+			Assert::IsTrue(SUCCEEDED(spUnrelated->RevokeService(dwUnrelatedCookie)));
+			Assert::IsTrue(SUCCEEDED(spUnrelatedObject->SetSite(spUnrelated.Get())));
+			Assert::IsTrue(SUCCEEDED(spUnrelatedObject->SetSite(nullptr)));
+		}
+		ComPtr<IServiceProvider> spService;
+		Assert::IsTrue(SUCCEEDED(spBottom->QueryService(guidBottom, IID_PPV_ARGS(&spService))));
+		spService.Reset();
+		Assert::IsTrue(SUCCEEDED(spBottom->QueryService(guidProffered, IID_PPV_ARGS(&spService))));
+		spService.Reset();
+		Assert::AreEqual(E_NOTIMPL, spBottom->QueryService(guidUnknown, IID_PPV_ARGS(&spService)));
+
+		ServiceLookupSnapshot snapshot;
+		TestInstrumentation::Snapshot(&snapshot);
+		Assert::AreEqual(1U, snapshot.cThreads);
+		Assert::AreEqual(0ULL, snapshot.cDroppedEvents);
+		Assert::AreEqual(0ULL, snapshot.cUntrackedQueries);
+
+		auto pRoot = _FindServiceCounts(snapshot, guidRoot);
+		Assert::IsNotNull(pRoot);
+		Assert::AreEqual(1ULL, pRoot->rgcQueries[SRP_SITE_CHAIN]);
+		Assert::AreEqual(1ULL, pRoot->rgcQueries[SRP_MEMOIZED_ROUTE]);
+		Assert::AreEqual(3ULL, pRoot->cHops);
+		auto pBottom = _FindServiceCounts(snapshot, guidBottom);
+		Assert::IsNotNull(pBottom);
+		Assert::AreEqual(1ULL, pBottom->rgcQueries[SRP_VIRTUAL]);
+		auto pProffered = _FindServiceCounts(snapshot, guidProffered);
+		Assert::IsNotNull(pProffered);
+		Assert::AreEqual(1ULL, pProffered->rgcQueries[SRP_REGISTRY]);
+		auto pUnknown = _FindServiceCounts(snapshot, guidUnknown);
+		Assert::IsNotNull(pUnknown);
+		Assert::AreEqual(1ULL, pUnknown->rgcQueries[SRP_NOT_FOUND]);
+		Assert::AreEqual(2ULL, pUnknown->cHops);
+
+		Assert::AreEqual(2ULL, snapshot.rgcQueriesByHops[0]);
+		Assert::AreEqual(1ULL, snapshot.rgcQueriesByHops[1]);
+		Assert::AreEqual(2ULL, snapshot.rgcQueriesByHops[2]);
+
+		ULONGLONG rgcResolves[ARK_COUNT] = {};
+		for (UINT kind = 0; kind < ARK_COUNT; kind++)
+		{
+			for (UINT idxBucket = 0; idxBucket < ServiceLookupSnapshot::c_cLatencyBuckets; idxBucket++)
+			{
+				rgcResolves[kind] += snapshot.rgcResolves[kind][idxBucket];
+			}
+		}
+		Assert::AreEqual(1ULL, rgcResolves[ARK_SERVICE_PROVIDER]);
+		Assert::AreEqual(1ULL, rgcResolves[ARK_ROUTE_OWNER]);
+		Assert::IsTrue(rgcResolves[ARK_SITE] > 0);
+
+		Assert::IsTrue(SUCCEEDED(spProfferService->RevokeService(dwCookie)));
+		_TearDownServiceProviderChain(rgProviders);
+	}
+
+	struct ThreadChurnTestTag {};
+	typedef ServiceLookupInstrumentationT<ThreadChurnTestTag> ThreadChurnInstrumentation;
+
+	DWORD WINAPI _RecordQuery(_In_ void *pguidService)
+	{
+		ThreadChurnInstrumentation::OnQueryService(*static_cast<GUID *>(pguidService), SRP_REGISTRY, 0);
+		return 0;
+	}
+
+	void TestObjectWithSite::TestInstrumentationThreadChurn()
+	{
+		// Far more threads than there are buffers, one after the other like a thread pool replacing its
+		// threads; each hands its buffer on as it exits
+		GUID guidService;
+		Assert::IsTrue(SUCCEEDED(CoCreateGuid(&guidService)));
+		UINT const cThreads = 200;
+		for (UINT idxThread = 0; idxThread < cThreads; idxThread++)
+		{
+			HANDLE hThread = CreateThread(nullptr, 0, _RecordQuery, &guidService, 0, nullptr);
+			Assert::IsNotNull(hThread);
+			WaitForSingleObject(hThread, INFINITE);
+			CloseHandle(hThread);
+		}
+
+		ServiceLookupSnapshot snapshot;
+		ThreadChurnInstrumentation::Snapshot(&snapshot);
+		Assert::AreEqual(0ULL, snapshot.cDroppedEvents);
+		Assert::AreEqual(1U, snapshot.cThreads);
+		auto pCounts = _FindServiceCounts(snapshot, guidService);
+		Assert::IsNotNull(pCounts);
+		Assert::AreEqual(static_cast<ULONGLONG>(cThreads), pCounts->rgcQueries[SRP_REGISTRY]);
+	}
+
+	struct GetSiteWorkerData
+	{
+		IObjectWithSite *pObject;
+		IServiceProvider *rgpSites[2];
+		LONG volatile fStop;
+	};
+
+	DWORD WINAPI _GetSiteWorker(_In_ void *pGetSiteWorkerData)
+	{
+		Assert::IsTrue(SUCCEEDED(CoInitializeEx(nullptr, COINIT_MULTITHREADED)));
+		auto pData = reinterpret_cast<GetSiteWorkerData *>(pGetSiteWorkerData);
+		while (InterlockedCompareExchange(&pData->fStop, 0, 0) == 0)
+		{
+			ComPtr<IServiceProvider> spSite;
+			Assert::IsTrue(SUCCEEDED(pData->pObject->GetSite(IID_PPV_ARGS(&spSite))));
+			Assert::IsTrue((spSite.Get() == pData->rgpSites[0]) || (spSite.Get() == pData->rgpSites[1]));
+		}
+		CoUninitialize();
+		return 0;
+	}
+
+	void TestObjectWithSite::TestLockFreeObjectWithSite()
+	{
+		ComPtr<IObjectWithSite> spObject;
+		Assert::IsTrue(SUCCEEDED(MakeAndInitialize<CLockFreeSitedObject>(&spObject)));
+		ComPtr<IServiceProvider> rgspSites[2];
+		for (auto &spSite : rgspSites)
+		{
+			Assert::IsTrue(SUCCEEDED(MakeAndInitialize<CAgileServiceProvider>(&spSite)));
+		}
+
+		ComPtr<IServiceProvider> spSite;
+		Assert::AreEqual(E_NOTIMPL, spObject->GetSite(IID_PPV_ARGS(&spSite)));
+		Assert::IsTrue(SUCCEEDED(spObject->SetSite(rgspSites[0].Get())));
+		Assert::IsTrue(SUCCEEDED(spObject->GetSite(IID_PPV_ARGS(&spSite))));
+		Assert::IsTrue(spSite.Get() == rgspSites[0].Get());
+		spSite.Reset();
+
+		// Readers must only ever see one of the two sites while the object moves between them
+		GetSiteWorkerData data = { spObject.Get(), { rgspSites[0].Get(), rgspSites[1].Get() }, 0 };
+		vector<HANDLE> rgThreads;
+		for (unsigned int idxThread = 0; idxThread < 4; idxThread++)
+		{
+			HANDLE hThread = CreateThread(nullptr, 0, _GetSiteWorker, &data, 0, nullptr);
+			Assert::IsNotNull(hThread);
+			rgThreads.push_back(hThread);
+		}
+
+		for (unsigned int idxSetSite = 0; idxSetSite < 10000; idxSetSite++)
+		{
+			Assert::IsTrue(SUCCEEDED(spObject->SetSite(rgspSites[idxSetSite % 2].Get())));
+		}
+
+		InterlockedExchange(&data.fStop, 1);
+		WaitForMultipleObjects(static_cast<DWORD>(rgThreads.size()), rgThreads.data(), TRUE, INFINITE);
+		for (auto hThread : rgThreads)
+		{
+			CloseHandle(hThread);
+		}
+
+		// With no reader left, clearing the site releases every reference the object took on either site
+		Assert::IsTrue(SUCCEEDED(spObject->SetSite(nullptr)));
+		Assert::AreEqual(E_NOTIMPL, spObject->GetSite(IID_PPV_ARGS(&spSite)));
+		for (auto &spSite : rgspSites)
+		{
+			spSite.Get()->AddRef();
+			Assert::AreEqual(1UL, spSite.Get()->Release());
+		}
+	}
+
+	void TestObjectWithSite::TestHazardSlotsExhausted()
+	{
+		ComPtr<IServiceProvider> spProvider;
+		Assert::IsTrue(SUCCEEDED(MakeAndInitialize<CAgileServiceProvider>(&spProvider)));
+		ComPtr<CAgileBroker<SnapshotAgileProfferService>> spBroker;
+		Assert::IsTrue(SUCCEEDED(MakeAndInitialize<CAgileBroker<SnapshotAgileProfferService>>(&spBroker)));
+		GUID guidService;
+		Assert::IsTrue(SUCCEEDED(CoCreateGuid(&guidService)));
+		DWORD dwCookie;
+		Assert::IsTrue(SUCCEEDED(spBroker->ProfferService(guidService, spProvider.Get(), &dwCookie)));
+		ComPtr<IObjectWithSite> spObject;
+		Assert::IsTrue(SUCCEEDED(MakeAndInitialize<CLockFreeSitedObject>(&spObject)));
+		Assert::IsTrue(SUCCEEDED(spObject->SetSite(spProvider.Get())));
+
+		// With every hazard slot of the process taken the readers fall back to the lock rather than wait
+		{
+			Windows::Internal::WRL::Details::HazardPointer rgHazards[Windows::Internal::WRL::Details::HazardPointerDomain::c_cSlots];
+			Windows::Internal::WRL::Details::HazardPointer hazard;
+			Assert::IsFalse(hazard.IsValid());
+
+			ComPtr<IServiceProvider> spService;
+			Assert::IsTrue(SUCCEEDED(spBroker->QueryService(guidService, IID_PPV_ARGS(&spService))));
+			Assert::IsTrue(spService.Get() == spProvider.Get());
+			ServiceQuery query = { &guidService, &__uuidof(IServiceProvider), nullptr, E_FAIL };
+			Assert::AreEqual(S_OK, spBroker->QueryServices(&query, 1));
+			query.punkService->Release();
+
+			ComPtr<IServiceProvider> spSite;
+			Assert::IsTrue(SUCCEEDED(spObject->GetSite(IID_PPV_ARGS(&spSite))));
+			Assert::IsTrue(spSite.Get() == spProvider.Get());
+		}
+
+		Assert::IsTrue(Windows::Internal::WRL::Details::HazardPointer().IsValid());
+		Assert::IsTrue(SUCCEEDED(spObject->SetSite(nullptr)));
+		Assert::IsTrue(SUCCEEDED(spBroker->RevokeService(dwCookie)));
+
+		// Resolving may block or re-enter, so neither reader holds its hazard slot meanwhile
+		ComPtr<CHazardCheckingServiceProvider> spChecking;
+		Assert::IsTrue(SUCCEEDED(MakeAndInitialize<CHazardCheckingServiceProvider>(&spChecking)));
+		Assert::IsTrue(SUCCEEDED(spBroker->ProfferService(guidService, spChecking.Get(), &dwCookie)));
+		Assert::IsTrue(SUCCEEDED(spObject->SetSite(spChecking->CastToUnknown())));
+		ComPtr<IServiceProvider> spService, spSite;
+		Assert::IsTrue(SUCCEEDED(spBroker->QueryService(guidService, IID_PPV_ARGS(&spService))));
+		Assert::IsTrue(SUCCEEDED(spObject->GetSite(IID_PPV_ARGS(&spSite))));
+		Assert::AreEqual(0u, spChecking->UnderHazard());
+		Assert::IsTrue(SUCCEEDED(spObject->SetSite(nullptr)));
+		Assert::IsTrue(SUCCEEDED(spBroker->RevokeService(dwCookie)));
+	}
+
+	DWORD WINAPI _GetSiteInNewSta(_In_ void *pObjectWithSite)
+	{
+		Assert::IsTrue(SUCCEEDED(CoInitializeEx(nullptr, COINIT_APARTMENTTHREADED)));
+		ComPtr<IServiceProvider> spSite;
+		Assert::IsTrue(SUCCEEDED(reinterpret_cast<IObjectWithSite *>(pObjectWithSite)->GetSite(IID_PPV_ARGS(&spSite))));
+		spSite.Reset();
+		CoUninitialize();
+		return 0;
+	}
+
+	void TestObjectWithSite::TestResolvedSiteCache()
+	{
+		ComPtr<CCachingSitedObject> spObject;
+		Assert::IsTrue(SUCCEEDED(MakeAndInitialize<CCachingSitedObject>(&spObject)));
+		ComPtr<IServiceProvider> rgspSites[2];
+		for (auto &spSite : rgspSites)
+		{
+			Assert::IsTrue(SUCCEEDED(MakeAndInitialize<CAgileServiceProvider>(&spSite)));
+		}
+
+		Assert::IsTrue(SUCCEEDED(spObject->SetSite(rgspSites[0].Get())));
+		for (int idxGetSite = 0; idxGetSite < 2; idxGetSite++)
+		{
+			ComPtr<IServiceProvider> spSite;
+			Assert::IsTrue(SUCCEEDED(spObject->GetSite(IID_PPV_ARGS(&spSite))));
+			Assert::IsTrue(spSite.Get() == rgspSites[0].Get());
+		}
+
+		ULONGLONG cHits, cMisses;
+		spObject->GetResolvedSiteCacheStatistics(&cHits, &cMisses);
+		Assert::AreEqual(1ULL, cHits);
+		Assert::AreEqual(1ULL, cMisses);
+
+		// Another apartment must resolve the site for itself
+		HANDLE hThread = CreateThread(nullptr, 0, _GetSiteInNewSta, static_cast<IObjectWithSite *>(spObject.Get()), 0, nullptr);
+		Assert::IsNotNull(hThread);
+		DWORD dwIndex;
+		CoWaitForMultipleHandles(COWAIT_DISPATCH_CALLS | COWAIT_DISPATCH_WINDOW_MESSAGES, INFINITE, 1, &hThread, &dwIndex);
+		CloseHandle(hThread);
+		spObject->GetResolvedSiteCacheStatistics(&cHits, &cMisses);
+		Assert::AreEqual(1ULL, cHits);
+		Assert::AreEqual(2ULL, cMisses);
+
+		// A new site makes every entry stale, and hands the entry of the other apartment to the deferred
+		// release queue
+		Assert::IsTrue(SUCCEEDED(spObject->SetSite(rgspSites[1].Get())));
+		DeferredReleaseQueue::Drain();
+		Assert::AreEqual(1UL, _RefCount(rgspSites[0].Get()));
+		ComPtr<IServiceProvider> spSite;
+		Assert::IsTrue(SUCCEEDED(spObject->GetSite(IID_PPV_ARGS(&spSite))));
+		Assert::IsTrue(spSite.Get() == rgspSites[1].Get());
+		spSite.Reset();
+
+		Assert::IsTrue(SUCCEEDED(spObject->SetSite(nullptr)));
+		Assert::AreEqual(E_NOTIMPL, spObject->GetSite(IID_PPV_ARGS(&spSite)));
+
+		spObject.Reset();
+		for (auto &spSite : rgspSites)
+		{
+			spSite.Get()->AddRef();
+			Assert::AreEqual(1UL, spSite.Get()->Release());
+		}
+	}
+
+	void TestObjectWithSite::TestInlineServiceEntries()
+	{
+		ComPtr<IServiceProvider> spProvider;
+		Assert::IsTrue(SUCCEEDED(MakeAndInitialize<CAgileServiceProvider>(&spProvider)));
+		typedef CAgileBroker<AgileProfferServiceT<NoServiceInstrumentation, 4>> CInlineBroker;
+		ComPtr<CInlineBroker> spBroker;
+		Assert::IsTrue(SUCCEEDED(MakeAndInitialize<CInlineBroker>(&spBroker)));
+
+		GUID rgServices[12];
+		DWORD rgCookies[ARRAYSIZE(rgServices)];
+		for (auto &guidService : rgServices)
+		{
+			Assert::IsTrue(SUCCEEDED(CoCreateGuid(&guidService)));
+		}
+
+		// Revoking from the middle of the inline entries must keep the others reachable
+		for (unsigned int idx = 0; idx < 3; idx++)
+		{
+			Assert::IsTrue(SUCCEEDED(spBroker->ProfferService(rgServices[idx], spProvider.Get(), &rgCookies[idx])));
+		}
+		Assert::IsTrue(SUCCEEDED(spBroker->RevokeService(rgCookies[1])));
+		ComPtr<IServiceProvider> spService;
+		Assert::AreEqual(E_NOTIMPL, spBroker->QueryService(rgServices[1], IID_PPV_ARGS(&spService)));
+		for (auto idx : { 0, 2 })
+		{
+			spService.Reset();
+			Assert::IsTrue(SUCCEEDED(spBroker->QueryService(rgServices[idx], IID_PPV_ARGS(&spService))));
+		}
+		DWORD dwCookie;
+		Assert::AreEqual(HRESULT_FROM_WIN32(ERROR_ALREADY_REGISTERED), spBroker->ProfferService(rgServices[2], spProvider.Get(), &dwCookie));
+
+		// Outgrowing the inline entries moves every service over, cookies handed out before included
+		for (unsigned int idx = 1; idx < ARRAYSIZE(rgServices); idx++)
+		{
+			if (idx != 2)
+			{
+				Assert::IsTrue(SUCCEEDED(spBroker->ProfferService(rgServices[idx], spProvider.Get(), &rgCookies[idx])));
+			}
+		}
+		for (auto guidService : rgServices)
+		{
+			spService.Reset();
+			Assert::IsTrue(SUCCEEDED(spBroker->QueryService(guidService, IID_PPV_ARGS(&spService))));
+		}
+
+		Assert::IsTrue(SUCCEEDED(spBroker->RevokeServices(rgCookies, ARRAYSIZE(rgCookies))));
+		for (auto guidService : rgServices)
+		{
+			spService.Reset();
+			Assert::AreEqual(E_NOTIMPL, spBroker->QueryService(guidService, IID_PPV_ARGS(&spService)));
+		}
+	}
+
+	struct QueryServiceAsyncTestData
+	{
+		LONG volatile cPending;
+		HANDLE hDone;
+		HRESULT rghr[2];
+		IUnknown *rgpunkService[2];
+	};
+
+	void TestObjectWithSite::TestQueryServiceAsync()
+	{
+		ComPtr<IServiceProvider> spProvider;
+		Assert::IsTrue(SUCCEEDED(MakeAndInitialize<CAgileServiceProvider>(&spProvider)));
+		ComPtr<CAgileBroker<AgileProfferService>> spBroker;
+		Assert::IsTrue(SUCCEEDED(MakeAndInitialize<CAgileBroker<AgileProfferService>>(&spBroker)));
+
+		GUID rgServices[2];
+		for (auto &guidService : rgServices)
+		{
+			Assert::IsTrue(SUCCEEDED(CoCreateGuid(&guidService)));
+		}
+		DWORD dwCookie;
+		Assert::IsTrue(SUCCEEDED(spBroker->ProfferService(rgServices[0], spProvider.Get(), &dwCookie)));
+
+		// The first service is proffered, nobody answers the second one
+		QueryServiceAsyncTestData data = { ARRAYSIZE(rgServices), CreateEvent(nullptr, TRUE, FALSE, nullptr), { S_OK, S_OK }, { nullptr, nullptr } };
+		Assert::IsTrue(data.hDone != nullptr);
+		for (unsigned int idx = 0; idx < ARRAYSIZE(rgServices); idx++)
+		{
+			Assert::IsTrue(SUCCEEDED(QueryServiceAsync(spBroker.Get(), rgServices[idx], IID_IServiceProvider,
+				[&data, idx](HRESULT hr, _In_opt_ IUnknown *punkService)
+				{
+					data.rghr[idx] = hr;
+					data.rgpunkService[idx] = punkService;
+					if (punkService != nullptr)
+					{
+						punkService->AddRef();
+					}
+
+					if (InterlockedDecrement(&data.cPending) == 0)
+					{
+						SetEvent(data.hDone);
+					}
+				})));
+		}
+		WaitForSingleObject(data.hDone, INFINITE);
+		CloseHandle(data.hDone);
+
+		Assert::AreEqual(S_OK, data.rghr[0]);
+		Assert::IsTrue(data.rgpunkService[0] == static_cast<IUnknown *>(spProvider.Get()));
+		data.rgpunkService[0]->Release();
+		Assert::AreEqual(E_NOTIMPL, data.rghr[1]);
+		Assert::IsTrue(data.rgpunkService[1] == nullptr);
+		Assert::IsTrue(SUCCEEDED(spBroker->RevokeService(dwCookie)));
+	}
+
+	void TestObjectWithSite::TestQueryServicesBatch()
+	{
+		auto rgProviders = _BuildServiceProviderChain<CSimpleServiceProvider>(5);
+		CSimpleServiceProvider *pBottom = static_cast<CSimpleServiceProvider *>(rgProviders.back().spProvider.Get());
+
+		// A service proffered on the bottom of the chain, the service of every layer and one nobody has
+		ComPtr<IServiceProvider> spProvider;
+		Assert::IsTrue(SUCCEEDED(MakeAndInitialize<CAgileServiceProvider>(&spProvider)));
+		GUID guidProffered, guidMissing;
+		Assert::IsTrue(SUCCEEDED(CoCreateGuid(&guidProffered)));
+		Assert::IsTrue(SUCCEEDED(CoCreateGuid(&guidMissing)));
+		ComPtr<IProfferService> spProfferService;
+		Assert::IsTrue(SUCCEEDED(rgProviders.back().spProvider.As(&spProfferService)));
+		DWORD dwCookie;
+		Assert::IsTrue(SUCCEEDED(spProfferService->ProfferService(guidProffered, spProvider.Get(), &dwCookie)));
+
+		vector<ServiceQuery> rgQueries;
+		ServiceQuery query = { &guidProffered, &IID_IServiceProvider, nullptr, S_OK };
+		rgQueries.push_back(query);
+		for (auto const &info : rgProviders)
+		{
+			query.pguidService = &info.serviceGUID;
+			rgQueries.push_back(query);
+		}
+		query.pguidService = &guidMissing;
+		rgQueries.push_back(query);
+
+		Assert::AreEqual(S_FALSE, pBottom->QueryServices(rgQueries.data(), static_cast<UINT>(rgQueries.size())));
+		Assert::IsTrue(rgQueries[0].punkService == static_cast<IUnknown *>(spProvider.Get()));
+		for (size_t idx = 0; idx < rgProviders.size(); idx++)
+		{
+			Assert::AreEqual(S_OK, rgQueries[idx + 1].hr);
+			Assert::IsTrue(rgQueries[idx + 1].punkService == static_cast<IUnknown *>(rgProviders[idx].spProvider.Get()));
+		}
+		Assert::AreEqual(E_NOTIMPL, rgQueries.back().hr);
+		Assert::IsTrue(rgQueries.back().punkService == nullptr);
+
+		for (auto &queryDone : rgQueries)
+		{
+			if (queryDone.punkService != nullptr)
+			{
+				queryDone.punkService->Release();
+			}
+		}
+		Assert::IsTrue(SUCCEEDED(pBottom->RevokeService(dwCookie)));
+		_TearDownServiceProviderChain(rgProviders);
+	}
+
+	void TestObjectWithSite::TestSummarizedSiteChain()
+	{
+		auto rgProviders = _BuildServiceProviderChain<CSummarizingServiceProvider>(10);
+		auto spBottom = rgProviders.back().spProvider;
+
+		// The services the nodes answer from v_QueryService aren't declared, only the proffered ones
+		// and those of the service map at the root count
+		ComPtr<IServiceProvider> spMap;
+		Assert::IsTrue(SUCCEEDED(MakeAndInitialize<CServiceMapProvider>(&spMap)));
+		ComPtr<IObjectWithSite> spRoot;
+		Assert::IsTrue(SUCCEEDED(rgProviders.front().spProvider.As(&spRoot)));
+		Assert::IsTrue(SUCCEEDED(spRoot->SetSite(spMap.Get())));
+
+		ComPtr<IServiceProvider> spAgileProvider;
+		Assert::IsTrue(SUCCEEDED(MakeAndInitialize<CAgileServiceProvider>(&spAgileProvider)));
+		vector<GUID> rgguidProffered(rgProviders.size());
+		vector<DWORD> rgdwCookies(rgProviders.size());
+		for (unsigned int idxProvider = 0; idxProvider < rgProviders.size(); idxProvider++)
+		{
+			ComPtr<IProfferService> spProfferService;
+			Assert::IsTrue(SUCCEEDED(rgProviders[idxProvider].spProvider.As(&spProfferService)));
+			Assert::IsTrue(SUCCEEDED(CoCreateGuid(&rgguidProffered[idxProvider])));
+			Assert::IsTrue(SUCCEEDED(spProfferService->ProfferService(rgguidProffered[idxProvider], spAgileProvider.Get(), &rgdwCookies[idxProvider])));
+		}
+
+		// Twice, the second time around the summary is already built
+		for (int idxPass = 0; idxPass < 2; idxPass++)
+		{
+			for (auto const &guidService : rgguidProffered)
+			{
+				ComPtr<IServiceProvider> spService;
+				Assert::IsTrue(SUCCEEDED(spBottom->QueryService(guidService, IID_PPV_ARGS(&spService))));
+				Assert::IsTrue(spService.Get() == spAgileProvider.Get());
+			}
+
+			ComPtr<IServiceProvider> spService;
+			Assert::IsTrue(SUCCEEDED(spBottom->QueryService(TestServiceId<2>::guid, IID_PPV_ARGS(&spService))));
+			Assert::IsTrue(spService.Get() == spMap.Get());
+
+			GUID guidUnknown;
+			Assert::IsTrue(SUCCEEDED(CoCreateGuid(&guidUnknown)));
+			spService.Reset();
+			Assert::AreEqual(E_NOTIMPL, spBottom->QueryService(guidUnknown, IID_PPV_ARGS(&spService)));
+		}
+
+		// A revoked service is gone, one proffered since is found
+		ComPtr<IProfferService> spMiddle;
+		Assert::IsTrue(SUCCEEDED(rgProviders[5].spProvider.As(&spMiddle)));
+		Assert::IsTrue(SUCCEEDED(spMiddle->RevokeService(rgdwCookies[5])));
+		ComPtr<IServiceProvider> spService;
+		Assert::AreEqual(E_NOTIMPL, spBottom->QueryService(rgguidProffered[5], IID_PPV_ARGS(&spService)));
+		Assert::IsTrue(SUCCEEDED(CoCreateGuid(&rgguidProffered[5])));
+		Assert::IsTrue(SUCCEEDED(spMiddle->ProfferService(rgguidProffered[5], spAgileProvider.Get(), &rgdwCookies[5])));
+		Assert::IsTrue(SUCCEEDED(spBottom->QueryService(rgguidProffered[5], IID_PPV_ARGS(&spService))));
+
+		// Cut the chain in the middle, the services above the cut must no longer be found
+		ComPtr<IObjectWithSite> spCut;
+		Assert::IsTrue(SUCCEEDED(spMiddle.As(&spCut)));
+		Assert::IsTrue(SUCCEEDED(spCut->SetSite(nullptr)));
+		for (unsigned int idxProvider = 0; idxProvider < rgProviders.size(); idxProvider++)
+		{
+			spService.Reset();
+			HRESULT hr = spBottom->QueryService(rgguidProffered[idxProvider], IID_PPV_ARGS(&spService));
+			Assert::AreEqual(idxProvider >= 5, SUCCEEDED(hr));
+		}
+		spService.Reset();
+		Assert::AreEqual(E_NOTIMPL, spBottom->QueryService(TestServiceId<2>::guid, IID_PPV_ARGS(&spService)));
+
+		for (unsigned int idxProvider = 0; idxProvider < rgProviders.size(); idxProvider++)
+		{
+			ComPtr<IProfferService> spProfferService;
+			Assert::IsTrue(SUCCEEDED(rgProviders[idxProvider].spProvider.As(&spProfferService)));
+			Assert::IsTrue(SUCCEEDED(spProfferService->RevokeService(rgdwCookies[idxProvider])));
+		}
+		_TearDownServiceProviderChain(rgProviders);
+	}
+
+	// Counts its calls, and fails them while *phrResult is a failure
+	struct CountingProviderFactory
+	{
+		HRESULT operator()(_COM_Outptr_ IServiceProvider **ppProvider) const
+		{
+			*ppProvider = nullptr;
+			InterlockedIncrement(pcCalls);
+			Sleep(10);	// so that the first QueryServices of the workers overlap
+			return SUCCEEDED(*phrResult) ? MakeAndInitialize<CAgileServiceProvider>(ppProvider) : *phrResult;
+		}
+
+		LONG volatile *pcCalls;
+		HRESULT const *phrResult;
+	};
+
+	struct LazyServiceWorkerData
+	{
+		IServiceProvider *pBroker;
+		GUID guidService;
+		ComPtr<IServiceProvider> spService;
+	};
+
+	DWORD WINAPI _LazyServiceWorker(_In_ void *pvData)
+	{
+		LazyServiceWorkerData *pData = static_cast<LazyServiceWorkerData *>(pvData);
+		Assert::IsTrue(SUCCEEDED(pData->pBroker->QueryService(pData->guidService, IID_PPV_ARGS(&pData->spService))));
+		return 0;
+	}
+
+	void TestObjectWithSite::TestLazyService()
+	{
+		ComPtr<CAgileBroker<AgileProfferService>> spBroker;
+		Assert::IsTrue(SUCCEEDED(MakeAndInitialize<CAgileBroker<AgileProfferService>>(&spBroker)));
+		LONG volatile cCalls = 0;
+		HRESULT hrResult = E_FAIL;
+		CountingProviderFactory const factory = { &cCalls, &hrResult };
+
+		// Nothing is created by proffering, or by revoking a service nobody asked for
+		GUID guidUnused, guidService;
+		Assert::IsTrue(SUCCEEDED(CoCreateGuid(&guidUnused)));
+		Assert::IsTrue(SUCCEEDED(CoCreateGuid(&guidService)));
+		DWORD dwUnusedCookie, dwCookie;
+		Assert::IsTrue(SUCCEEDED(spBroker->ProfferLazyService(guidUnused, factory, &dwUnusedCookie)));
+		Assert::IsTrue(SUCCEEDED(spBroker->ProfferLazyService(guidService, factory, &dwCookie)));
+		Assert::IsTrue(SUCCEEDED(spBroker->RevokeService(dwUnusedCookie)));
+		Assert::AreEqual(0L, static_cast<LONG>(cCalls));
+
+		// A failed creation is retried by the next QueryService
+		ComPtr<IServiceProvider> spService;
+		Assert::IsTrue(FAILED(spBroker->QueryService(guidService, IID_PPV_ARGS(&spService))));
+		Assert::AreEqual(1L, static_cast<LONG>(cCalls));
+		hrResult = S_OK;
+
+		// Threads asking at once all get the single provider it creates
+		LazyServiceWorkerData rgData[8];
+		vector<HANDLE> rgThreads;
+		for (auto &data : rgData)
+		{
+			data.pBroker = spBroker.Get();
+			data.guidService = guidService;
+			HANDLE hThread = CreateThread(nullptr, 0, _LazyServiceWorker, &data, 0, nullptr);
+			Assert::IsNotNull(hThread);
+			rgThreads.push_back(hThread);
+		}
+
+		WaitForMultipleObjects(static_cast<DWORD>(rgThreads.size()), rgThreads.data(), TRUE, INFINITE);
+		for (auto hThread : rgThreads)
+		{
+			CloseHandle(hThread);
+		}
+
+		Assert::AreEqual(2L, static_cast<LONG>(cCalls));
+		Assert::IsTrue(SUCCEEDED(spBroker->QueryService(guidService, IID_PPV_ARGS(&spService))));
+		for (auto const &data : rgData)
+		{
+			Assert::IsTrue(data.spService.Get() == spService.Get());
+		}
+		Assert::AreEqual(2L, static_cast<LONG>(cCalls));
+		Assert::IsTrue(SUCCEEDED(spBroker->RevokeService(dwCookie)));
+	}
+
+	void TestObjectWithSite::TestDeferredRelease()
+	{
+		GUID guidService;
+		Assert::IsTrue(SUCCEEDED(CoCreateGuid(&guidService)));
+		ComPtr<IServiceProvider> spObject, spSite, spProvider;
+		Assert::IsTrue(SUCCEEDED(MakeAndInitialize<CDeferringServiceProvider>(&spObject, guidService)));
+		Assert::IsTrue(SUCCEEDED(MakeAndInitialize<CSimpleServiceProvider>(&spSite, guidService)));
+		Assert::IsTrue(SUCCEEDED(MakeAndInitialize<CAgileServiceProvider>(&spProvider)));
+		ULONG const cSiteRefs = _RefCount(spSite.Get());
+		ULONG const cProviderRefs = _RefCount(spProvider.Get());
+
+		ComPtr<IObjectWithSite> spObjectWithSite;
+		ComPtr<IProfferService> spProfferService;
+		Assert::IsTrue(SUCCEEDED(spObject.As(&spObjectWithSite)));
+		Assert::IsTrue(SUCCEEDED(spObject.As(&spProfferService)));
+		Assert::IsTrue(SUCCEEDED(spObjectWithSite->SetSite(spSite.Get())));
+		DWORD rgdwCookies[3];
+		for (auto &dwCookie : rgdwCookies)
+		{
+			GUID guidProffered;
+			Assert::IsTrue(SUCCEEDED(CoCreateGuid(&guidProffered)));
+			Assert::IsTrue(SUCCEEDED(spProfferService->ProfferService(guidProffered, spProvider.Get(), &dwCookie)));
+		}
+
+		// Whether the thread pool got to them or not, once drained the references are all gone
+		for (auto dwCookie : rgdwCookies)
+		{
+			Assert::IsTrue(SUCCEEDED(spProfferService->RevokeService(dwCookie)));
+		}
+		Assert::IsTrue(SUCCEEDED(spObjectWithSite->SetSite(nullptr)));
+		ComPtr<IServiceProvider> spNoSite;
+		Assert::AreEqual(E_NOTIMPL, spObjectWithSite->GetSite(IID_PPV_ARGS(&spNoSite)));
+		DeferredReleaseQueue::Drain();
+		Assert::AreEqual(0U, DeferredReleaseQueue::Pending());
+		Assert::AreEqual(cSiteRefs, _RefCount(spSite.Get()));
+		Assert::AreEqual(cProviderRefs, _RefCount(spProvider.Get()));
+	}
+
+	struct AdaptiveReferenceTestData
+	{
+		IServiceProvider *pBroker;
+		GUID guidService;
+		IUnknown *punkProvider;
+	};
+
+	DWORD WINAPI _QueryFromNewSta(_In_ void *pAdaptiveReferenceTestData)
+	{
+		Assert::IsTrue(SUCCEEDED(CoInitializeEx(nullptr, COINIT_APARTMENTTHREADED)));
+		auto pData = reinterpret_cast<AdaptiveReferenceTestData *>(pAdaptiveReferenceTestData);
+		for (int idxQuery = 0; idxQuery < 2; idxQuery++)
+		{
+			ComPtr<IUnknown> spService;
+			Assert::IsTrue(SUCCEEDED(pData->pBroker->QueryService(pData->guidService, IID_PPV_ARGS(&spService))));
+			Assert::IsTrue(spService.Get() != pData->punkProvider);
+		}
+		CoUninitialize();
+		return 0;
+	}
+
+	void TestObjectWithSite::TestAdaptiveAgileReference()
+	{
+		GUID guidAgile, guidBound;
+		Assert::IsTrue(SUCCEEDED(CoCreateGuid(&guidAgile)));
+		Assert::IsTrue(SUCCEEDED(CoCreateGuid(&guidBound)));
+		ComPtr<IServiceProvider> spAgileProvider, spBoundProvider;
+		Assert::IsTrue(SUCCEEDED(MakeAndInitialize<CAgileServiceProvider>(&spAgileProvider)));
+		Assert::IsTrue(SUCCEEDED(MakeAndInitialize<CApartmentServiceProvider>(&spBoundProvider)));
+		ComPtr<CAgileBroker<CAdaptiveAgileProfferService>> spBroker;
+		Assert::IsTrue(SUCCEEDED(MakeAndInitialize<CAgileBroker<CAdaptiveAgileProfferService>>(&spBroker)));
+
+		AdaptiveAgileReferenceStatistics start, statistics;
+		GetAdaptiveAgileReferenceStatistics(&start);
+		DWORD dwAgileCookie, dwBoundCookie;
+		Assert::IsTrue(SUCCEEDED(spBroker->ProfferService(guidAgile, spAgileProvider.Get(), &dwAgileCookie)));
+		Assert::IsTrue(SUCCEEDED(spBroker->ProfferService(guidBound, spBoundProvider.Get(), &dwBoundCookie)));
+
+		// In their own apartment both providers are handed out as they are, nothing is upgraded
+		ComPtr<IServiceProvider> spService;
+		Assert::IsTrue(SUCCEEDED(spBroker->QueryService(guidAgile, IID_PPV_ARGS(&spService))));
+		Assert::IsTrue(spService.Get() == spAgileProvider.Get());
+		Assert::IsTrue(SUCCEEDED(spBroker->QueryService(guidBound, IID_PPV_ARGS(&spService))));
+		Assert::IsTrue(spService.Get() == spBoundProvider.Get());
+		GetAdaptiveAgileReferenceStatistics(&statistics);
+		Assert::AreEqual(1ULL, statistics.cAgile - start.cAgile);
+		Assert::AreEqual(1ULL, statistics.cApartmentBound - start.cApartmentBound);
+		Assert::AreEqual(0ULL, statistics.cUpgraded - start.cUpgraded);
+
+		// Another apartment gets a proxy, and the reference is upgraded once however often it asks
+		AdaptiveReferenceTestData data = { spBroker.Get(), guidBound, spBoundProvider.Get() };
+		HANDLE hThread = CreateThread(nullptr, 0, _QueryFromNewSta, &data, 0, nullptr);
+		Assert::IsNotNull(hThread);
+		DWORD dwIndex;
+		CoWaitForMultipleHandles(COWAIT_DISPATCH_CALLS | COWAIT_DISPATCH_WINDOW_MESSAGES, INFINITE, 1, &hThread, &dwIndex);
+		CloseHandle(hThread);
+		GetAdaptiveAgileReferenceStatistics(&statistics);
+		Assert::AreEqual(1ULL, statistics.cUpgraded - start.cUpgraded);
+		Assert::IsTrue(SUCCEEDED(spBroker->QueryService(guidBound, IID_PPV_ARGS(&spService))));
+		Assert::IsTrue(spService.Get() == spBoundProvider.Get());
+
+		// Each service tells how its own provider was reached
+		AdaptiveAgileReferenceUsage usage;
+		Assert::IsTrue(SUCCEEDED(spBroker->GetServiceReferenceUsage(guidAgile, &usage)));
+		Assert::IsTrue(usage.fAgile);
+		Assert::IsFalse(usage.fUpgraded);
+		Assert::AreEqual(1ULL, usage.cDirectResolves);
+		Assert::IsTrue(SUCCEEDED(spBroker->GetServiceReferenceUsage(guidBound, &usage)));
+		Assert::IsFalse(usage.fAgile);
+		Assert::IsTrue(usage.fUpgraded);
+		Assert::AreEqual(2ULL, usage.cDirectResolves);
+		Assert::AreEqual(2ULL, usage.cMarshaledResolves);
+		Assert::IsTrue(SUCCEEDED(spBroker->RevokeService(dwAgileCookie)));
+		Assert::IsTrue(SUCCEEDED(spBroker->RevokeService(dwBoundCookie)));
+		Assert::AreEqual(E_NOTIMPL, spBroker->GetServiceReferenceUsage(guidBound, &usage));
+
+		// The site of OWSO_ADAPTIVE_SITE_REFERENCE goes the same way
+		ComPtr<CAdaptiveSiteServiceProvider> spObjectWithSite;
+		Assert::IsTrue(SUCCEEDED(MakeAndInitialize<CAdaptiveSiteServiceProvider>(&spObjectWithSite, guidAgile)));
+		Assert::AreEqual(E_NOTIMPL, spObjectWithSite->GetSiteReferenceUsage(&usage));
+		Assert::IsTrue(SUCCEEDED(spObjectWithSite->SetSite(spBoundProvider.Get())));
+		Assert::IsTrue(SUCCEEDED(spObjectWithSite->GetSite(IID_PPV_ARGS(&spService))));
+		Assert::IsTrue(spService.Get() == spBoundProvider.Get());
+		GetAdaptiveAgileReferenceStatistics(&statistics);
+		Assert::AreEqual(2ULL, statistics.cApartmentBound - start.cApartmentBound);
+		Assert::IsTrue(SUCCEEDED(spObjectWithSite->GetSiteReferenceUsage(&usage)));
+		Assert::IsFalse(usage.fUpgraded);
+		Assert::AreEqual(1ULL, usage.cDirectResolves);
+		Assert::IsTrue(SUCCEEDED(spObjectWithSite->SetSite(nullptr)));
+	}
+
+	void TestObjectWithSite::TestSiteChainWalker()
+	{
+		// Deeper than the stack would allow going through every QueryService
+		auto rgProviders = _BuildServiceProviderChain<CWalkingServiceProvider>(1000);
+		ComPtr<IServiceProvider> spService;
+		Assert::IsTrue(SUCCEEDED(rgProviders.back().spProvider->QueryService(rgProviders.front().serviceGUID, IID_PPV_ARGS(&spService))));
+
+		// Walks go as far as the chain unless given a limit
+		ComPtr<IObjectWithSite> spLeaf;
+		Assert::IsTrue(SUCCEEDED(rgProviders.back().spProvider.As(&spLeaf)));
+		SiteChainWalker walker(spLeaf.Get());
+		while (walker.Next())
+		{
+			Assert::IsNotNull(walker.Node());
+		}
+		Assert::AreEqual(S_OK, walker.Status());
+		Assert::AreEqual(999U, walker.Hops());
+
+		SiteChainWalker limitedWalker(spLeaf.Get(), 500);
+		while (limitedWalker.Next())
+		{
+		}
+		Assert::AreEqual(E_BOUNDS, limitedWalker.Status());
+		Assert::AreEqual(500U, limitedWalker.Hops());
+		_TearDownServiceProviderChain(rgProviders);
+
+		// Without PSO_WALK_SITE_CHAIN each ancestor is asked through its QueryService, overrides included
+		rgProviders = _BuildServiceProviderChain<CSimpleServiceProvider>(3);
+		ComPtr<CQueryServiceOverride> spOverride;
+		Assert::IsTrue(SUCCEEDED(MakeAndInitialize<CQueryServiceOverride>(&spOverride, rgProviders.front().serviceGUID)));
+		ComPtr<IObjectWithSite> spRoot;
+		Assert::IsTrue(SUCCEEDED(rgProviders.front().spProvider.As(&spRoot)));
+		Assert::IsTrue(SUCCEEDED(spRoot->SetSite(spOverride->CastToUnknown())));
+		Assert::IsTrue(SUCCEEDED(rgProviders.back().spProvider->QueryService(TestServiceId<4>::guid, IID_PPV_ARGS(&spService))));
+		Assert::IsTrue(spService.Get() == static_cast<IServiceProvider *>(spOverride.Get()));
+		_TearDownServiceProviderChain(rgProviders);
+
+		// Closing the chain into a loop, a service nobody has is a cycle rather than a stack overflow
+		rgProviders = _BuildServiceProviderChain<CWalkingServiceProvider>(5);
+		Assert::IsTrue(SUCCEEDED(rgProviders.front().spProvider.As(&spRoot)));
+		Assert::IsTrue(SUCCEEDED(spRoot->SetSite(rgProviders.back().spProvider.Get())));
+		GUID guidMissing;
+		Assert::IsTrue(SUCCEEDED(CoCreateGuid(&guidMissing)));
+		for (auto info : rgProviders)
+		{
+			Assert::AreEqual(HRESULT_FROM_WIN32(ERROR_CIRCULAR_DEPENDENCY), info.spProvider->QueryService(guidMissing, IID_PPV_ARGS(&spService)));
+			Assert::IsTrue(SUCCEEDED(info.spProvider->QueryService(rgProviders[2].serviceGUID, IID_PPV_ARGS(&spService))));
+		}
+		_TearDownServiceProviderChain(rgProviders);
+	}
+
+	void TestObjectWithSite::TestServiceRef()
+	{
+		GUID guidService;
+		Assert::IsTrue(SUCCEEDED(CoCreateGuid(&guidService)));
+		ComPtr<CCountingServiceProvider> spFirst, spSecond;
+		Assert::IsTrue(SUCCEEDED(MakeAndInitialize<CCountingServiceProvider>(&spFirst)));
+		Assert::IsTrue(SUCCEEDED(MakeAndInitialize<CCountingServiceProvider>(&spSecond)));
+		ComPtr<CAgileBroker<AgileProfferService>> spBroker;
+		Assert::IsTrue(SUCCEEDED(MakeAndInitialize<CAgileBroker<AgileProfferService>>(&spBroker)));
+		DWORD dwCookie;
+		Assert::IsTrue(SUCCEEDED(spBroker->ProfferService(guidService, spFirst.Get(), &dwCookie)));
+
+		// Looked up once, then handed out as it is
+		ServiceRef<IServiceProvider> serviceRef;
+		IServiceProvider *pService;
+		Assert::AreEqual(E_UNEXPECTED, serviceRef.Get(&pService));
+		serviceRef.Bind(spBroker.Get(), guidService);
+		for (int idxUse = 0; idxUse < 3; idxUse++)
+		{
+			Assert::IsTrue(SUCCEEDED(serviceRef.Get(&pService)));
+			Assert::IsTrue(pService == spFirst.Get());
+		}
+		Assert::AreEqual(1u, spFirst->Queries());
+
+		// Revoking the service is noticed by the next use, and so is proffering another one
+		Assert::IsTrue(SUCCEEDED(spBroker->RevokeService(dwCookie)));
+		Assert::IsTrue(FAILED(serviceRef.Get(&pService)));
+		Assert::IsNull(pService);
+		Assert::IsTrue(SUCCEEDED(spBroker->ProfferService(guidService, spSecond.Get(), &dwCookie)));
+		Assert::IsTrue(SUCCEEDED(serviceRef.Get(&pService)));
+		Assert::IsTrue(pService == spSecond.Get());
+		serviceRef.Invalidate();
+		Assert::IsTrue(SUCCEEDED(serviceRef.Get(&pService)));
+		Assert::AreEqual(2u, spSecond->Queries());
+
+		// Bound to the site of an object, every SetSite is noticed
+		GUID guidObject;
+		Assert::IsTrue(SUCCEEDED(CoCreateGuid(&guidObject)));
+		ComPtr<IObjectWithSite> spObjectWithSite;
+		Assert::IsTrue(SUCCEEDED(MakeAndInitialize<CSimpleServiceProvider>(&spObjectWithSite, guidObject)));
+		ServiceRef<IServiceProvider> siteRef;
+		siteRef.BindToSite(spObjectWithSite.Get(), guidService);
+		Assert::IsTrue(FAILED(siteRef.Get(&pService)));
+		Assert::IsTrue(SUCCEEDED(spObjectWithSite->SetSite(spBroker->CastToUnknown())));
+		Assert::IsTrue(SUCCEEDED(siteRef.Get(&pService)));
+		Assert::IsTrue(pService == spSecond.Get());
+
+		ComPtr<CAgileBroker<AgileProfferService>> spOtherBroker;
+		Assert::IsTrue(SUCCEEDED(MakeAndInitialize<CAgileBroker<AgileProfferService>>(&spOtherBroker)));
+		DWORD dwOtherCookie;
+		Assert::IsTrue(SUCCEEDED(spOtherBroker->ProfferService(guidService, spFirst.Get(), &dwOtherCookie)));
+		Assert::IsTrue(SUCCEEDED(spObjectWithSite->SetSite(spOtherBroker->CastToUnknown())));
+		Assert::IsTrue(SUCCEEDED(siteRef.Get(&pService)));
+		Assert::IsTrue(pService == spFirst.Get());
+
+		Assert::IsTrue(SUCCEEDED(spObjectWithSite->SetSite(nullptr)));
+		Assert::IsTrue(FAILED(siteRef.Get(&pService)));
+
+		// Only the objects the lookup went through count, changes to any other leave the handle alone
+		ComPtr<IObjectWithSite> spLeaf, spMiddle;
+		Assert::IsTrue(SUCCEEDED(MakeAndInitialize<CSimpleServiceProvider>(&spLeaf, guidObject)));
+		Assert::IsTrue(SUCCEEDED(MakeAndInitialize<CSimpleServiceProvider>(&spMiddle, guidObject)));
+		Assert::IsTrue(SUCCEEDED(spMiddle->SetSite(spBroker->CastToUnknown())));
+		Assert::IsTrue(SUCCEEDED(spLeaf->SetSite(spMiddle.Get())));
+		ServiceRef<IServiceProvider> leafRef;
+		leafRef.BindToSite(spLeaf.Get(), guidService);
+		Assert::IsTrue(SUCCEEDED(leafRef.Get(&pService)));
+		Assert::IsTrue(pService == spSecond.Get());
+		unsigned int const cQueries = spSecond->Queries();
+
+		DWORD dwUnrelatedCookie;
+		Assert::IsTrue(SUCCEEDED(spOtherBroker->ProfferService(guidObject, spFirst.Get(), &dwUnrelatedCookie)));
+		Assert::IsTrue(SUCCEEDED(spOtherBroker->RevokeService(dwUnrelatedCookie)));
+		Assert::IsTrue(SUCCEEDED(spObjectWithSite->SetSite(spOtherBroker->CastToUnknown())));
+		Assert::IsTrue(SUCCEEDED(leafRef.Get(&pService)));
+		Assert::IsTrue(pService == spSecond.Get());
+		Assert::AreEqual(cQueries, spSecond->Queries());
+
+		// A service proffered or revoked on the way up is noticed, and so is the SetSite of any object on it
+		ComPtr<IProfferService> spMiddleProfferService;
+		Assert::IsTrue(SUCCEEDED(spMiddle.As(&spMiddleProfferService)));
+		DWORD dwMiddleCookie;
+		Assert::IsTrue(SUCCEEDED(spMiddleProfferService->ProfferService(guidService, spFirst.Get(), &dwMiddleCookie)));
+		Assert::IsTrue(SUCCEEDED(leafRef.Get(&pService)));
+		Assert::IsTrue(pService == spFirst.Get());
+		Assert::IsTrue(SUCCEEDED(spMiddleProfferService->RevokeService(dwMiddleCookie)));
+		Assert::IsTrue(SUCCEEDED(leafRef.Get(&pService)));
+		Assert::IsTrue(pService == spSecond.Get());
+		Assert::AreEqual(cQueries + 1, spSecond->Queries());
+
+		Assert::IsTrue(SUCCEEDED(spMiddle->SetSite(spOtherBroker->CastToUnknown())));
+		Assert::IsTrue(SUCCEEDED(leafRef.Get(&pService)));
+		Assert::IsTrue(pService == spFirst.Get());
+
+		Assert::IsTrue(SUCCEEDED(spLeaf->SetSite(nullptr)));
+		Assert::IsTrue(FAILED(leafRef.Get(&pService)));
+		Assert::IsTrue(SUCCEEDED(spMiddle->SetSite(nullptr)));
+		Assert::IsTrue(SUCCEEDED(spObjectWithSite->SetSite(nullptr)));
+		Assert::IsTrue(SUCCEEDED(spBroker->RevokeService(dwCookie)));
+		Assert::IsTrue(SUCCEEDED(spOtherBroker->RevokeService(dwOtherCookie)));
+	}
+
+	// Two objects started off with pTemplate, whose services rgguidServices (with cookies rgdwCookies) are
+	// all served by pProvider. Each changes its own services without the other, or the template, noticing.
+	template <typename TProfferService>
+	void _CheckServiceTemplate(_In_ ProfferServiceTemplate *pTemplate, vector<GUID> const &rgguidServices, vector<DWORD> const &rgdwCookies, _In_ IServiceProvider *pProvider)
+	{
+		ComPtr<CAgileBroker<TProfferService>> spFirst, spSecond;
+		Assert::IsTrue(SUCCEEDED(MakeAndInitialize<CAgileBroker<TProfferService>>(&spFirst)));
+		Assert::IsTrue(SUCCEEDED(MakeAndInitialize<CAgileBroker<TProfferService>>(&spSecond)));
+		Assert::IsTrue(SUCCEEDED(spFirst->UseServiceTemplate(pTemplate)));
+		Assert::IsTrue(SUCCEEDED(spSecond->UseServiceTemplate(pTemplate)));
+		Assert::AreEqual(HRESULT_FROM_WIN32(ERROR_INVALID_STATE), spFirst->UseServiceTemplate(pTemplate));
+		for (auto const &guidService : rgguidServices)
+		{
+			ComPtr<IServiceProvider> spService;
+			Assert::IsTrue(SUCCEEDED(spFirst->QueryService(guidService, IID_PPV_ARGS(&spService))));
+			Assert::IsTrue(spService.Get() == pProvider);
+		}
+
+		// A cookie of the template revokes the service from the first object only
+		ComPtr<IServiceProvider> spService;
+		Assert::IsTrue(SUCCEEDED(spFirst->RevokeService(rgdwCookies[0])));
+		Assert::AreEqual(E_INVALIDARG, spFirst->RevokeService(rgdwCookies[0]));
+		Assert::IsTrue(FAILED(spFirst->QueryService(rgguidServices[0], IID_PPV_ARGS(&spService))));
+		Assert::IsTrue(SUCCEEDED(spFirst->QueryService(rgguidServices[1], IID_PPV_ARGS(&spService))));
+		Assert::IsTrue(SUCCEEDED(spSecond->QueryService(rgguidServices[0], IID_PPV_ARGS(&spService))));
+
+		// Proffering copies the template's services along, which are still registered
+		GUID guidOwn;
+		Assert::IsTrue(SUCCEEDED(CoCreateGuid(&guidOwn)));
+		ComPtr<IProfferService> spProfferService;
+		Assert::IsTrue(SUCCEEDED(spSecond.As(&spProfferService)));
+		DWORD dwCookie;
+		Assert::IsTrue(SUCCEEDED(spProfferService->ProfferService(guidOwn, pProvider, &dwCookie)));
+		Assert::AreEqual(HRESULT_FROM_WIN32(ERROR_ALREADY_REGISTERED), spProfferService->ProfferService(rgguidServices[1], pProvider, &dwCookie));
+		Assert::IsTrue(SUCCEEDED(spSecond->QueryService(guidOwn, IID_PPV_ARGS(&spService))));
+		Assert::IsTrue(SUCCEEDED(spSecond->QueryService(rgguidServices[0], IID_PPV_ARGS(&spService))));
+		Assert::IsTrue(FAILED(spFirst->QueryService(guidOwn, IID_PPV_ARGS(&spService))));
+		Assert::IsTrue(SUCCEEDED(spSecond->RevokeService(rgdwCookies[1])));
+		Assert::IsTrue(FAILED(spSecond->QueryService(rgguidServices[1], IID_PPV_ARGS(&spService))));
+		Assert::IsTrue(SUCCEEDED(spFirst->QueryService(rgguidServices[1], IID_PPV_ARGS(&spService))));
+	}
+
+	void TestObjectWithSite::TestServiceTemplate()
+	{
+		ComPtr<IServiceProvider> spProvider;
+		Assert::IsTrue(SUCCEEDED(MakeAndInitialize<CAgileServiceProvider>(&spProvider)));
+		ComPtr<ProfferServiceTemplate> spTemplate;
+		Assert::IsTrue(SUCCEEDED(ProfferServiceTemplate::Create(AgileReferenceOptions::AGILEREFERENCE_DEFAULT, PSO_NONE, &spTemplate)));
+
+		// More than the objects keep inline
+		vector<GUID> rgguidServices(6);
+		vector<DWORD> rgdwCookies(rgguidServices.size());
+		for (size_t idx = 0; idx < rgguidServices.size(); idx++)
+		{
+			Assert::IsTrue(SUCCEEDED(CoCreateGuid(&rgguidServices[idx])));
+			Assert::IsTrue(SUCCEEDED(spTemplate->ProfferService(rgguidServices[idx], spProvider.Get(), &rgdwCookies[idx])));
+		}
+
+		_CheckServiceTemplate<ProfferService>(spTemplate.Get(), rgguidServices, rgdwCookies, spProvider.Get());
+		_CheckServiceTemplate<AgileProfferService>(spTemplate.Get(), rgguidServices, rgdwCookies, spProvider.Get());
+		_CheckServiceTemplate<SnapshotAgileProfferService>(spTemplate.Get(), rgguidServices, rgdwCookies, spProvider.Get());
+
+		// Read only once in use
+		GUID guidLate;
+		Assert::IsTrue(SUCCEEDED(CoCreateGuid(&guidLate)));
+		DWORD dwCookie;
+		Assert::AreEqual(HRESULT_FROM_WIN32(ERROR_INVALID_STATE), spTemplate->ProfferService(guidLate, spProvider.Get(), &dwCookie));
+
+		// Only for objects that haven't proffered anything yet
+		ComPtr<CAgileBroker<AgileProfferService>> spBroker;
+		Assert::IsTrue(SUCCEEDED(MakeAndInitialize<CAgileBroker<AgileProfferService>>(&spBroker)));
+		Assert::IsTrue(SUCCEEDED(spBroker->ProfferService(guidLate, spProvider.Get(), &dwCookie)));
+		Assert::IsTrue(SUCCEEDED(spBroker->RevokeService(dwCookie)));
+		Assert::AreEqual(HRESULT_FROM_WIN32(ERROR_INVALID_STATE), spBroker->UseServiceTemplate(spTemplate.Get()));
+	}
+}
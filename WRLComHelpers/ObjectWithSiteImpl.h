@@ -2,10 +2,15 @@
 //    Copyright (C) Microsoft.  All rights reserved.
 //
 #pragma once
+#include <new>                               // For std::nothrow
 #include <wrl.h>                             // ComPtr, Runtimeclass, etc.
-#include <wrl\Wrappers\CoreWrappers.h>       // For SRWLock
+#include <wrl/wrappers/corewrappers.h>       // For SRWLock
 #include <ObjIdlbase.h>                      // For IAgileReference
 #include <ShObjIdl.h>                        // For IObjectWithSite
+#include "HazardPointerImpl.h"               // For the lock free reads of LockFreeObjectWithSite
+#include "DeferredReleaseImpl.h"             // For OWSO_DEFER_RELEASE
+#include "AdaptiveAgileReferenceImpl.h"      // For OWSO_ADAPTIVE_SITE_REFERENCE
+#include "SiteChainImpl.h"                   // For ISiteChainNode
 
 // Class usage:
 // Derive from this class when your object wants to be "sited" to another object.
@@ -26,35 +31,486 @@
 // run inside Object 2.
 //
 
+// Choose LockFreeObjectWithSite instead for agile objects whose site is read from many threads at once.
+// GetSite (and so _spunkSite) takes no lock there, readers protect the site reference with a hazard
+// pointer just long enough to AddRef it, and resolve it once the hazard is gone. SetSite retires the
+// reference it replaces until no reader holds it anymore. The price is that a site released by SetSite
+// may be kept alive until a later SetSite, or the destruction of the object, if a reader was reading
+// it at that very moment.
+//
+// GetSite resolves the site's agile reference on every call, which means a new proxy every time for a
+// site in another apartment. Pass OWSO_CACHE_RESOLVED_SITE to keep the interfaces it resolved instead,
+// by deriving your own class the same way as for ProfferServiceOptions:
+//
+// class CCachingObjectWithSite : public ObjectWithSite
+// {
+// public:
+//     CCachingObjectWithSite() : ObjectWithSite(OWSO_CACHE_RESOLVED_SITE)
+//     {
+//     }
+// };
+//
+// SetSite releases the reference to the site it replaces, which for a site in another apartment means
+// a call into that apartment. OWSO_DEFER_RELEASE leaves that to DeferredReleaseQueue instead.
+//
+// An object that keeps asking its site for the same service can hold a ServiceRef (ServiceRefImpl.h)
+// bound to its site with BindToSite, which only asks again once a SetSite, ProfferService or
+// RevokeService may have changed the answer.
+//
+// TInstrumentation is told how long resolving the site takes, see NoServiceInstrumentation in
+// SiteChainImpl.h. Most code uses ObjectWithSite, which is not instrumented.
+
 namespace Windows { namespace Internal { namespace WRL {
-class ObjectWithSite :
+
+// Optional behaviors of ObjectWithSite and LockFreeObjectWithSite
+enum ObjectWithSiteOptions
+{
+    OWSO_NONE                       = 0x0,
+    // Keep the interfaces GetSite resolved, per requested IID and calling apartment, so that asking again
+    // skips IAgileReference::Resolve. SetSite invalidates them. An apartment only ever gets back what was
+    // resolved in it. SetSite and the destructor release the interfaces of the calling apartment and
+    // hand those of other apartments to DeferredReleaseQueue, which releases them in their apartment.
+    OWSO_CACHE_RESOLVED_SITE        = 0x1,
+    // Hand the reference to the site that SetSite replaced to DeferredReleaseQueue (DeferredReleaseImpl.h)
+    // rather than releasing it on the calling thread. The interfaces OWSO_CACHE_RESOLVED_SITE kept for
+    // the calling apartment are not agile and are still released by SetSite.
+    OWSO_DEFER_RELEASE              = 0x2,
+    // Reach the site through an AdaptiveAgileReference (AdaptiveAgileReferenceImpl.h) instead of an
+    // AGILEREFERENCE_DEFAULT one, so that SetSite marshals nothing and the site is only marshaled when
+    // GetSite is first called from another apartment. GetSiteReferenceUsage tells how it went.
+    OWSO_ADAPTIVE_SITE_REFERENCE    = 0x4,
+};
+DEFINE_ENUM_FLAG_OPERATORS(ObjectWithSiteOptions);
+
+namespace Details
+{
+
+// The interfaces GetSite resolved, for OWSO_CACHE_RESOLVED_SITE. Small and inline since an object
+// normally asks its site for a couple of interfaces from a couple of apartments.
+//
+// A slot belongs to the apartment (COM context) that filled it and is only handed out to or replaced
+// by that apartment. Entries carry the generation of the site at the time they were resolved, SetSite
+// bumps the generation which makes every older entry a miss. Other apartments never release an entry
+// on their own thread, they hand it to DeferredReleaseQueue along with the object context of the
+// apartment it belongs to, which releases it there.
+class ResolvedSiteCache
+{
+public:
+    ResolvedSiteCache() : _lGeneration(0)
+    {
+    }
+
+    ~ResolvedSiteCache()
+    {
+        ULONG_PTR ulContextToken = 0;
+        CoGetContextToken(&ulContextToken);
+        for (UINT idx = 0; idx < c_cSlots; idx++)
+        {
+            _Release(&_rgSlots[idx], ulContextToken);
+        }
+    }
+
+    // Read before resolving, and passed to Store along with what was resolved
+    LONG Generation() const
+    {
+        return ReadAcquire(&_lGeneration);
+    }
+
+    bool Lookup(_In_ REFIID riid, _COM_Outptr_ void **ppv)
+    {
+        *ppv = nullptr;
+        ULONG_PTR ulContextToken = 0;
+        CoGetContextToken(&ulContextToken);
+        LONG const lGeneration = Generation();
+        UINT const idxStart = _SlotIndex(riid, ulContextToken);
+        Microsoft::WRL::ComPtr<IUnknown> spStale;
+        bool fHit = false;
+        for (UINT idxProbe = 0; !fHit && (idxProbe < c_cSlots); idxProbe++)
+        {
+            Slot &slot = _rgSlots[(idxStart + idxProbe) % c_cSlots];
+            if (_TryLockSlot(slot))
+            {
+                if ((slot.ulContextToken == ulContextToken) && (slot.iid == riid) && slot.spInterface)
+                {
+                    if (slot.lGeneration == lGeneration)
+                    {
+                        fHit = true;
+                        slot.spInterface.CopyTo(reinterpret_cast<IUnknown **>(ppv));
+                        _Count(&slot.cHits);
+                    }
+                    else
+                    {
+                        // Ours, so release it here rather than leave it to another apartment
+                        spStale.Swap(slot.spInterface);
+                    }
+                }
+                _UnlockSlot(slot);
+            }
+        }
+
+        // Charge the miss to the home slot
+        if (!fHit && _TryLockSlot(_rgSlots[idxStart]))
+        {
+            _Count(&_rgSlots[idxStart].cMisses);
+            _UnlockSlot(_rgSlots[idxStart]);
+        }
+        return fHit;
+    }
+
+    // pInterface is the riid interface resolved in the calling apartment
+    void Store(_In_ REFIID riid, _In_ LONG lGeneration, _In_ IUnknown *pInterface)
+    {
+        ULONG_PTR ulContextToken = 0;
+        CoGetContextToken(&ulContextToken);
+        UINT const idxStart = _SlotIndex(riid, ulContextToken);
+
+        // Released in its apartment by whoever lets go of the entry, if that's another apartment
+        Microsoft::WRL::ComPtr<IContextCallback> spContext;
+        if (FAILED(CoGetObjectContext(IID_PPV_ARGS(&spContext))))
+        {
+            return;
+        }
+
+        // Replace our entry for the IID, otherwise take a free slot, otherwise one of our other entries.
+        // Slots of other apartments are left alone since their interfaces have to be released there.
+        // What was resolved before an Invalidate isn't stored, the generation is read under the slot
+        // lock so that either this sees the new one or Invalidate sees the entry.
+        Microsoft::WRL::ComPtr<IUnknown> spReplaced;
+        for (UINT idxPass = 0; idxPass < 3; idxPass++)
+        {
+            for (UINT idxProbe = 0; idxProbe < c_cSlots; idxProbe++)
+            {
+                Slot &slot = _rgSlots[(idxStart + idxProbe) % c_cSlots];
+                if (_TryLockSlot(slot))
+                {
+                    bool const fTake = (idxPass == 0) ? (slot.spInterface && (slot.ulContextToken == ulContextToken) && (slot.iid == riid)) :
+                                       (idxPass == 1) ? !slot.spInterface :
+                                                        (slot.ulContextToken == ulContextToken);
+                    if (fTake && (lGeneration == Generation()))
+                    {
+                        slot.ulContextToken = ulContextToken;
+                        slot.lGeneration = lGeneration;
+                        slot.iid = riid;
+                        spReplaced.Swap(slot.spInterface);
+                        slot.spInterface = pInterface;
+                        slot.spContext.Swap(spContext);
+                    }
+                    _UnlockSlot(slot);
+                    if (fTake)
+                    {
+                        // spReplaced is released outside of the slot lock
+                        return;
+                    }
+                }
+            }
+        }
+    }
+
+    // Makes every entry stale and lets go of all of them, those of the calling apartment are released
+    // here and those of other apartments handed to DeferredReleaseQueue. Call it after the site was
+    // replaced, a GetSite racing with it then can't store what it resolved from the old one.
+    void Invalidate()
+    {
+        InterlockedIncrement(&_lGeneration);
+
+        ULONG_PTR ulContextToken = 0;
+        CoGetContextToken(&ulContextToken);
+        for (UINT idx = 0; idx < c_cSlots; idx++)
+        {
+            // Wait for the slot rather than skip it, a Store holding it may be about to fill it
+            Slot &slot = _rgSlots[idx];
+            while (!_TryLockSlot(slot))
+            {
+                YieldProcessor();
+            }
+            Slot released;
+            released.ulContextToken = slot.ulContextToken;
+            released.spInterface.Swap(slot.spInterface);
+            released.spContext.Swap(slot.spContext);
+            _UnlockSlot(slot);
+            _Release(&released, ulContextToken);
+        }
+    }
+
+    // The counts are gathered per slot without further synchronization, treat them as approximate
+    void GetStatistics(_Out_ ULONGLONG *pcHits, _Out_ ULONGLONG *pcMisses) const
+    {
+        *pcHits = 0;
+        *pcMisses = 0;
+        for (UINT idx = 0; idx < c_cSlots; idx++)
+        {
+            *pcHits += ReadULongNoFence(&_rgSlots[idx].cHits);
+            *pcMisses += ReadULongNoFence(&_rgSlots[idx].cMisses);
+        }
+    }
+
+private:
+    static const UINT c_cSlots = 4;
+
+    struct Slot
+    {
+        Slot() : lBusy(0), ulContextToken(0), lGeneration(0), cHits(0), cMisses(0)
+        {
+            ZeroMemory(&iid, sizeof(iid));
+        }
+
+        LONG volatile lBusy;
+        ULONG_PTR ulContextToken;
+        LONG lGeneration;
+        IID iid;
+        Microsoft::WRL::ComPtr<IUnknown> spInterface;           // the riid interface, null while the slot is free
+        Microsoft::WRL::ComPtr<IContextCallback> spContext;     // the object context of the slot's apartment
+        ULONG volatile cHits;                                   // written with the lock held, read by GetStatistics without it
+        ULONG volatile cMisses;
+    };
+
+    // Releases the interface of a slot no one else can reach anymore, in its apartment
+    static void _Release(_Inout_ Slot *pSlot, _In_ ULONG_PTR ulContextToken)
+    {
+        if (pSlot->spInterface && (pSlot->ulContextToken != ulContextToken))
+        {
+            DeferredReleaseQueue::DeferInContext(pSlot->spContext.Get(), pSlot->spInterface.GetAddressOf());
+        }
+        pSlot->spInterface.Reset();
+    }
+
+    static void _Count(_Inout_ ULONG volatile *pcCount)
+    {
+        WriteULongNoFence(pcCount, ReadULongNoFence(pcCount) + 1);
+    }
+
+    static UINT _SlotIndex(_In_ REFIID riid, _In_ ULONG_PTR ulContextToken)
+    {
+        return static_cast<UINT>((riid.Data1 ^ static_cast<ULONG>(ulContextToken)) * 2654435761u) % c_cSlots;
+    }
+
+    // A slot is only ever contended when two threads of an apartment use it at once, in which case the
+    // loser just treats it as a miss rather than waiting.
+    static bool _TryLockSlot(_In_ Slot &slot)
+    {
+        return InterlockedCompareExchange(&slot.lBusy, 1, 0) == 0;
+    }
+
+    static void _UnlockSlot(_In_ Slot &slot)
+    {
+        InterlockedExchange(&slot.lBusy, 0);
+    }
+
+    Slot _rgSlots[c_cSlots];
+    LONG volatile _lGeneration;
+
+    ResolvedSiteCache(const ResolvedSiteCache &);
+    ResolvedSiteCache & operator=(const ResolvedSiteCache &);
+};
+
+// Writer lock of LockFreeObjectWithSite, the distinct type selects the lock free SiteReferenceHolder
+class ObjectWithSiteLockFreeLock : public Microsoft::WRL::Wrappers::SRWLock
+{
+};
+
+// Holds the agile reference to the site. Both versions release the reference they replace after
+// dropping their lock, or defer that to DeferredReleaseQueue.
+template <typename LockType>
+class SiteReferenceHolder
+{
+public:
+    HRESULT Set(_In_opt_ IAgileReference *pReference, _In_ bool fDeferRelease)
+    {
+        Microsoft::WRL::ComPtr<IAgileReference> spunkSiteOldReference;
+        {
+            auto lock = _srwLock.LockExclusive();
+            spunkSiteOldReference.Attach(_spunkSiteReference.Detach());
+            _spunkSiteReference = pReference;
+        }
+
+        if (fDeferRelease)
+        {
+            DeferredReleaseQueue::Defer(spunkSiteOldReference.GetAddressOf());
+        }
+        return S_OK;
+    }
+
+    // The agile reference to the site, E_NOTIMPL when there is none
+    HRESULT GetReference(_COM_Outptr_ IAgileReference **ppReference)
+    {
+        *ppReference = nullptr;
+        auto lock = _srwLock.LockShared();
+        return _spunkSiteReference ? _spunkSiteReference.CopyTo(ppReference) : E_NOTIMPL;
+    }
+
+    template <typename TInstrumentation>
+    HRESULT Resolve(_In_ REFIID riid, _COM_Outptr_ void **ppvSite)
+    {
+        *ppvSite = nullptr;
+
+        // Resolve reference outside the lock
+        Microsoft::WRL::ComPtr<IAgileReference> spunkSiteReference;
+        if (FAILED(GetReference(&spunkSiteReference)))
+        {
+            return E_NOTIMPL;
+        }
+
+        auto const start = TInstrumentation::BeginResolve();
+        HRESULT hr = spunkSiteReference->Resolve(riid, ppvSite);
+        TInstrumentation::EndResolve(ARK_SITE, start);
+        return hr;
+    }
+
+private:
+    _Guarded_by_(_srwLock)
+    Microsoft::WRL::ComPtr<IAgileReference> _spunkSiteReference;
+    LockType _srwLock;
+};
+
+// An agile reference to a site, as published to the readers of LockFreeObjectWithSite
+struct SiteReference
+{
+    Microsoft::WRL::ComPtr<IAgileReference> spReference;
+    SiteReference *pNextRetired;
+
+    void Release()
+    {
+        delete this;
+    }
+};
+
+template <>
+class SiteReferenceHolder<ObjectWithSiteLockFreeLock>
+{
+public:
+    SiteReferenceHolder() : _pCurrent(nullptr)
+    {
+    }
+
+    ~SiteReferenceHolder()
+    {
+        if (_pCurrent != nullptr)
+        {
+            _pCurrent->Release();
+        }
+    }
+
+    HRESULT Set(_In_opt_ IAgileReference *pReference, _In_ bool fDeferRelease)
+    {
+        SiteReference *pNew = nullptr;
+        if (pReference != nullptr)
+        {
+            pNew = new (std::nothrow) SiteReference();
+            if (pNew == nullptr)
+            {
+                return E_OUTOFMEMORY;
+            }
+            pNew->spReference = pReference;
+        }
+
+        SiteReference *pRelease;
+        {
+            auto lock = _srwLock.LockExclusive();
+            SiteReference *pOld = reinterpret_cast<SiteReference *>(InterlockedExchangePointer(reinterpret_cast<void * volatile *>(&_pCurrent), pNew));
+            if (pOld != nullptr)
+            {
+                _retired.Retire(pOld);
+            }
+            pRelease = _retired.DetachReclaimable();
+        }
+        // Releasing the references may release the old site chain, keep that outside of the lock
+        for (SiteReference *pReleased = pRelease; fDeferRelease && (pReleased != nullptr); pReleased = pReleased->pNextRetired)
+        {
+            DeferredReleaseQueue::Defer(pReleased->spReference.GetAddressOf());
+        }
+        HazardRetireList<SiteReference>::ReleaseChain(pRelease);
+        return S_OK;
+    }
+
+    // Only a reference is taken under the hazard (or, when no hazard slot is free, the writer lock)
+    HRESULT GetReference(_COM_Outptr_ IAgileReference **ppReference)
+    {
+        *ppReference = nullptr;
+        HazardPointer hazard;
+        if (hazard.IsValid())
+        {
+            SiteReference *pCurrent = hazard.Protect(&_pCurrent);
+            if (pCurrent != nullptr)
+            {
+                pCurrent->spReference.CopyTo(ppReference);
+            }
+        }
+        else
+        {
+            auto lock = _srwLock.LockShared();
+            if (_pCurrent != nullptr)
+            {
+                _pCurrent->spReference.CopyTo(ppReference);
+            }
+        }
+        return (*ppReference != nullptr) ? S_OK : E_NOTIMPL;
+    }
+
+    template <typename TInstrumentation>
+    HRESULT Resolve(_In_ REFIID riid, _COM_Outptr_ void **ppvSite)
+    {
+        *ppvSite = nullptr;
+
+        // Resolve may block on an unmarshal or re-enter, so the site is resolved once the hazard is gone
+        Microsoft::WRL::ComPtr<IAgileReference> spReference;
+        if (FAILED(GetReference(&spReference)))
+        {
+            return E_NOTIMPL;
+        }
+
+        auto const start = TInstrumentation::BeginResolve();
+        HRESULT hr = spReference->Resolve(riid, ppvSite);
+        TInstrumentation::EndResolve(ARK_SITE, start);
+        return hr;
+    }
+
+private:
+    SiteReference * volatile _pCurrent;
+    HazardRetireList<SiteReference> _retired;
+    ObjectWithSiteLockFreeLock _srwLock;
+
+    SiteReferenceHolder(const SiteReferenceHolder &);
+    SiteReferenceHolder & operator=(const SiteReferenceHolder &);
+};
+
+template <typename LockType, typename TInstrumentation>
+class ObjectWithSiteBase :
     public Microsoft::WRL::Implements<Microsoft::WRL::RuntimeClassFlags<Microsoft::WRL::RuntimeClassType::ClassicCom>,
                 IObjectWithSite>
 {
 public:
     IFACEMETHODIMP SetSite(_In_opt_ IUnknown *punkSite)
     {
-        HRESULT hr;
-        Microsoft::WRL::ComPtr<IAgileReference> spunkSiteOldReference;
+        HRESULT hr = S_OK;
 
-        if (punkSite == nullptr)
+        // Acquire new reference outside of any locks
+        Microsoft::WRL::ComPtr<IAgileReference> spunkNewSiteReference;
+        if (punkSite != nullptr)
         {
-            // Let the release occur outside of the lock
-            auto lock = srwLock.LockExclusive();
-            spunkSiteOldReference.Attach(_spunkSiteReference.Detach());
-            hr = S_OK;
+            hr = GetAgileReference((_options & OWSO_ADAPTIVE_SITE_REFERENCE) != 0, AgileReferenceOptions::AGILEREFERENCE_DEFAULT,
+                __uuidof(punkSite), punkSite, &spunkNewSiteReference);
         }
-        else
+
+        if (SUCCEEDED(hr))
+        {
+            hr = _siteReference.Set(spunkNewSiteReference.Get(), (_options & OWSO_DEFER_RELEASE) != 0);
+        }
+
+        if (SUCCEEDED(hr) && ((_options & OWSO_CACHE_RESOLVED_SITE) != 0))
         {
-            // Acquire new reference outside of any locks
-            Microsoft::WRL::ComPtr<IAgileReference> spunkNewSiteReference;
-            hr = RoGetAgileReference(AgileReferenceOptions::AGILEREFERENCE_DEFAULT, __uuidof(punkSite), punkSite, &spunkNewSiteReference);
-            if (SUCCEEDED(hr))
+            // Only after the new site is set, a GetSite racing with us must not keep the old site
+            // under the new generation.
+            _siteCache.Invalidate();
+        }
+
+        if (SUCCEEDED(hr))
+        {
+            // Whatever was learned about the old site chain, here or in any descendant, no longer holds.
+            // The descendants find out through our node generation.
+            Microsoft::WRL::ComPtr<ISiteChainNode> spNode;
+            if (SUCCEEDED(this->CastToUnknown()->QueryInterface(IID_PPV_ARGS(&spNode))))
             {
-                // Let the release occur outside of the lock
-                auto lock = srwLock.LockExclusive();
-                spunkSiteOldReference.Attach(_spunkSiteReference.Detach());
-                _spunkSiteReference.Attach(spunkNewSiteReference.Detach());
+                spNode->SiteChanged();
             }
         }
         return hr;
@@ -62,23 +518,60 @@ public:
 
     IFACEMETHODIMP GetSite(_In_ REFIID riid, _COM_Outptr_ void **ppvSite)
     {
-        *ppvSite = nullptr;
-        Microsoft::WRL::ComPtr<IAgileReference> spunkSiteReference;
-        
-        // Resolve reference outside the lock
+        if ((_options & OWSO_CACHE_RESOLVED_SITE) == 0)
+        {
+            return _siteReference.template Resolve<TInstrumentation>(riid, ppvSite);
+        }
+
+        if (_siteCache.Lookup(riid, ppvSite))
         {
-            auto lock = srwLock.LockShared();
-            spunkSiteReference = _spunkSiteReference;
+            return S_OK;
         }
 
-        return spunkSiteReference ? spunkSiteReference->Resolve(riid, ppvSite) : E_NOTIMPL;
+        // Read the generation before resolving, if the site changes meanwhile the entry stored
+        // below is already stale.
+        LONG const lGeneration = _siteCache.Generation();
+        HRESULT hr = _siteReference.template Resolve<TInstrumentation>(riid, ppvSite);
+        if (SUCCEEDED(hr))
+        {
+            _siteCache.Store(riid, lGeneration, static_cast<IUnknown *>(*ppvSite));
+        }
+        return hr;
+    }
+
+    // Hits and misses of the OWSO_CACHE_RESOLVED_SITE cache, both zero when it isn't enabled.
+    // The counts are gathered without synchronization so treat them as approximate.
+    void GetResolvedSiteCacheStatistics(_Out_ ULONGLONG *pcHits, _Out_ ULONGLONG *pcMisses) const
+    {
+        _siteCache.GetStatistics(pcHits, pcMisses);
+    }
+
+    // How the site was reached through its AdaptiveAgileReference, for OWSO_ADAPTIVE_SITE_REFERENCE.
+    // Fails with E_NOTIMPL when there is no site and with E_NOINTERFACE without the option.
+    HRESULT GetSiteReferenceUsage(_Out_ AdaptiveAgileReferenceUsage *pUsage)
+    {
+        ZeroMemory(pUsage, sizeof(*pUsage));
+        Microsoft::WRL::ComPtr<IAgileReference> spReference;
+        HRESULT hr = _siteReference.GetReference(&spReference);
+        if (SUCCEEDED(hr))
+        {
+            hr = GetAdaptiveAgileReferenceUsage(spReference.Get(), pUsage);
+        }
+        return hr;
     }
 
 protected:
+    ObjectWithSiteBase(ObjectWithSiteOptions options) : _options(options)
+    {
+    }
+
     // This bit of trickery allows for you to do _spunkSite.Get() on your derived class which in turn
     // calls the function above. Yes, it is possible for this function to return a nullptr, but in reality
     // your "naked" site pointer (_spunkSite) can also be nullptr at any time as well.
+    // Other compilers don't have properties, call _GetSitePtr() there.
+#ifdef _MSC_VER
     __declspec(property(get = _GetSitePtr)) Microsoft::WRL::ComPtr<IUnknown> _spunkSite;
+#endif
 
     Microsoft::WRL::ComPtr<IUnknown> _GetSitePtr()
     {
@@ -86,12 +579,51 @@ protected:
         GetSite(IID_PPV_ARGS(&spSite));
         return spSite;
     }
-    
+
 private:
-    _Guarded_by_(srwLock)
-    Microsoft::WRL::ComPtr<IAgileReference> _spunkSiteReference;
-    Microsoft::WRL::Wrappers::SRWLock srwLock;
+    SiteReferenceHolder<LockType> _siteReference;
+    ObjectWithSiteOptions const _options;
+    ResolvedSiteCache _siteCache;
 };
+
+} // namespace Details
+
+template <typename TInstrumentation = NoServiceInstrumentation>
+class ObjectWithSiteT : public Details::ObjectWithSiteBase<Microsoft::WRL::Wrappers::SRWLock, TInstrumentation>
+{
+public:
+    ObjectWithSiteT(ObjectWithSiteOptions options = OWSO_NONE) : Details::ObjectWithSiteBase<Microsoft::WRL::Wrappers::SRWLock, TInstrumentation>(options)
+    {
+    }
+};
+
+template <typename TInstrumentation = NoServiceInstrumentation>
+class LockFreeObjectWithSiteT : public Details::ObjectWithSiteBase<Details::ObjectWithSiteLockFreeLock, TInstrumentation>
+{
+public:
+    LockFreeObjectWithSiteT(ObjectWithSiteOptions options = OWSO_NONE) : Details::ObjectWithSiteBase<Details::ObjectWithSiteLockFreeLock, TInstrumentation>(options)
+    {
+    }
+};
+
+// ObjectWithSiteT with the defaults. A class rather than a typedef, like ProfferService, so that
+// deriving classes name it in their constructors.
+class ObjectWithSite : public ObjectWithSiteT<>
+{
+public:
+    ObjectWithSite(ObjectWithSiteOptions options = OWSO_NONE) : ObjectWithSiteT<>(options)
+    {
+    }
+};
+
+class LockFreeObjectWithSite : public LockFreeObjectWithSiteT<>
+{
+public:
+    LockFreeObjectWithSite(ObjectWithSiteOptions options = OWSO_NONE) : LockFreeObjectWithSiteT<>(options)
+    {
+    }
+};
+
 } // namespace Windows
 } // namespace Internal
 } // namespace WRL
@@ -0,0 +1,1771 @@
+// Latency and throughput of ObjectWithSite and the ProfferService family, built against the COM
+// stand-in in Portable/include. Cross apartment numbers include the simulated marshaling cost, set it
+// with --marshal_ns=<n>, --unmarshal_ns=<n> and --call_ns=<n> (0 turns that part off).
+//
+// Exits with a failure if any benchmark saw a COM call fail, so that a quick run doubles as a test.
+
+#include <benchmark/benchmark.h>
+#include <atomic>
+#include <condition_variable>
+#include <cstdlib>
+#include <cstring>
+#include <functional>
+#include <mutex>
+#include <thread>
+#include <vector>
+#include "ObjectWithSiteImpl.h"
+#include "ProfferServiceImpl.h"
+#include "QueryServiceAsyncImpl.h"
+#include "ServiceInstrumentationImpl.h"
+#include "ServiceMapImpl.h"
+#include "ServiceRefImpl.h"
+
+using namespace Microsoft::WRL;
+using namespace Windows::Internal::WRL;
+
+// Every heap allocation of the process is counted, for the benchmarks that report allocations.
+// GCC can't tell that the replacements below pair malloc with free.
+#if defined(__GNUC__) && !defined(__clang__)
+#pragma GCC diagnostic ignored "-Wmismatched-new-delete"
+#endif
+static std::atomic<long long> g_cHeapAllocations(0);
+static std::atomic<long long> g_cbHeapAllocated(0);
+
+void *operator new(size_t cb)
+{
+    g_cHeapAllocations.fetch_add(1, std::memory_order_relaxed);
+    g_cbHeapAllocated.fetch_add(static_cast<long long>(cb), std::memory_order_relaxed);
+    void *p = malloc((cb != 0) ? cb : 1);
+    if (p == nullptr)
+    {
+        throw std::bad_alloc();
+    }
+    return p;
+}
+
+void *operator new(size_t cb, const std::nothrow_t &) noexcept
+{
+    g_cHeapAllocations.fetch_add(1, std::memory_order_relaxed);
+    g_cbHeapAllocated.fetch_add(static_cast<long long>(cb), std::memory_order_relaxed);
+    return malloc((cb != 0) ? cb : 1);
+}
+
+void operator delete(void *p) noexcept
+{
+    free(p);
+}
+
+void operator delete(void *p, size_t) noexcept
+{
+    free(p);
+}
+
+void operator delete(void *p, const std::nothrow_t &) noexcept
+{
+    free(p);
+}
+
+namespace
+{
+
+std::atomic<bool> g_fFailed(false);
+
+bool _Succeeded(benchmark::State &state, HRESULT hr, const char *pszCall)
+{
+    if (FAILED(hr))
+    {
+        g_fFailed = true;
+        state.SkipWithError(pszCall);
+        return false;
+    }
+    return true;
+}
+
+// Within a class deriving from ProfferService that name is the class, call the method through the interface
+IProfferService *_ProfferServiceOf(_In_ IProfferService *pProfferService)
+{
+    return pProfferService;
+}
+
+// Runs fn on a new thread in a new single threaded apartment, which makes every object created there
+// non agile to the benchmark threads. fn returns the object the caller gets a proxy to.
+HRESULT _RunInNewSta(const std::function<HRESULT(ComPtr<IUnknown> *)> &fn, _COM_Outptr_ IUnknown **ppunkProxy)
+{
+    *ppunkProxy = nullptr;
+    ComPtr<IAgileReference> spReference;
+    HRESULT hr;
+    std::thread thread([&fn, &spReference, &hr]()
+    {
+        CoInitializeEx(nullptr, COINIT_APARTMENTTHREADED);
+        ComPtr<IUnknown> spUnknown;
+        hr = fn(&spUnknown);
+        if (SUCCEEDED(hr))
+        {
+            hr = RoGetAgileReference(AgileReferenceOptions::AGILEREFERENCE_DEFAULT, IID_IUnknown, spUnknown.Get(), &spReference);
+        }
+        CoUninitialize();
+    });
+    thread.join();
+    return SUCCEEDED(hr) ? spReference->Resolve(IID_IUnknown, reinterpret_cast<void **>(ppunkProxy)) : hr;
+}
+
+GUID _NewServiceId()
+{
+    GUID guid;
+    CoCreateGuid(&guid);
+    return guid;
+}
+
+class CAgileServiceProvider : public RuntimeClass<RuntimeClassFlags<RuntimeClassType::ClassicCom>, FtmBase, IServiceProvider>
+{
+public:
+    IFACEMETHODIMP QueryService(_In_ REFGUID /*guidService*/, _In_ REFIID riid, _COM_Outptr_ void **ppv)
+    {
+        return QueryInterface(riid, ppv);
+    }
+};
+
+template <typename TInstrumentation = NoServiceInstrumentation>
+class CMemoizingProfferServiceT : public ProfferServiceT<TInstrumentation>
+{
+public:
+    CMemoizingProfferServiceT() : ProfferServiceT<TInstrumentation>(AgileReferenceOptions::AGILEREFERENCE_DEFAULT, PSO_MEMOIZE_SITE_CHAIN)
+    {
+    }
+};
+
+typedef CMemoizingProfferServiceT<> CMemoizingProfferService;
+typedef CMemoizingProfferServiceT<ServiceLookupInstrumentation> CInstrumentedMemoizingProfferService;
+
+class CWalkingProfferService : public ProfferService
+{
+public:
+    CWalkingProfferService() : ProfferService(AgileReferenceOptions::AGILEREFERENCE_DEFAULT, PSO_WALK_SITE_CHAIN)
+    {
+    }
+};
+
+class CCachingAgileProfferService : public AgileProfferService
+{
+public:
+    CCachingAgileProfferService() : AgileProfferService(AgileReferenceOptions::AGILEREFERENCE_DEFAULT, PSO_CACHE_RESOLVED_PROVIDERS)
+    {
+    }
+};
+
+// A sited object that proffers services, the usual node of a site chain
+template <typename TProfferService, typename TObjectWithSite = Windows::Internal::WRL::ObjectWithSite>
+class CSitedProfferServiceT : public RuntimeClass<
+    RuntimeClassFlags<RuntimeClassType::ClassicCom>,
+    Implements<RuntimeClassFlags<RuntimeClassType::ClassicCom>,
+    TObjectWithSite,
+    TProfferService>>
+{
+};
+
+typedef CSitedProfferServiceT<ProfferService> CSitedProfferService;
+typedef CSitedProfferServiceT<AgileProfferService> CSitedAgileProfferService;
+typedef CSitedProfferServiceT<SnapshotAgileProfferService> CSitedSnapshotAgileProfferService;
+typedef CSitedProfferServiceT<CMemoizingProfferService> CSitedMemoizingProfferService;
+typedef CSitedProfferServiceT<CWalkingProfferService> CSitedWalkingProfferService;
+typedef CSitedProfferServiceT<CInstrumentedMemoizingProfferService> CSitedInstrumentedMemoizingProfferService;
+
+// An agile sited object, so that several benchmark threads can share it
+template <typename TProfferService, typename TObjectWithSite = Windows::Internal::WRL::ObjectWithSite>
+class CAgileSitedProfferServiceT : public RuntimeClass<
+    RuntimeClassFlags<RuntimeClassType::ClassicCom>,
+    FtmBase,
+    Implements<RuntimeClassFlags<RuntimeClassType::ClassicCom>,
+    TObjectWithSite,
+    TProfferService>>
+{
+};
+
+// Chain of cDepth sited objects, rgNodes[0] is the root and rgNodes.back() the leaf
+template <typename TNode>
+HRESULT _BuildChain(UINT cDepth, std::vector<ComPtr<TNode>> *prgNodes)
+{
+    HRESULT hr = S_OK;
+    for (UINT idx = 0; SUCCEEDED(hr) && (idx < cDepth); idx++)
+    {
+        ComPtr<TNode> spNode = Make<TNode>();
+        hr = spNode ? S_OK : E_OUTOFMEMORY;
+        if (SUCCEEDED(hr) && !prgNodes->empty())
+        {
+            hr = spNode->SetSite(prgNodes->back()->CastToUnknown());
+        }
+
+        if (SUCCEEDED(hr))
+        {
+            prgNodes->push_back(spNode);
+        }
+    }
+    return hr;
+}
+
+// Unsites the chain so that the reference cycles of the nodes are broken
+template <typename TNode>
+void _TearDownChain(std::vector<ComPtr<TNode>> *prgNodes)
+{
+    for (auto &spNode : *prgNodes)
+    {
+        spNode->SetSite(nullptr);
+    }
+    prgNodes->clear();
+}
+
+// SetSite
+
+template <typename TSite>
+void BM_SetSite(benchmark::State &state)
+{
+    ComPtr<CSitedProfferService> spObject = Make<CSitedProfferService>();
+    ComPtr<TSite> spSite = Make<TSite>();
+    for (auto _ : state)
+    {
+        if (!_Succeeded(state, spObject->SetSite(spSite->CastToUnknown()), "SetSite"))
+        {
+            break;
+        }
+    }
+    spObject->SetSite(nullptr);
+}
+BENCHMARK_TEMPLATE(BM_SetSite, CAgileServiceProvider);
+BENCHMARK_TEMPLATE(BM_SetSite, CSitedProfferService);
+
+void BM_SetSiteAndClear(benchmark::State &state)
+{
+    ComPtr<CSitedProfferService> spObject = Make<CSitedProfferService>();
+    ComPtr<CAgileServiceProvider> spSite = Make<CAgileServiceProvider>();
+    for (auto _ : state)
+    {
+        if (!_Succeeded(state, spObject->SetSite(spSite->CastToUnknown()), "SetSite") ||
+            !_Succeeded(state, spObject->SetSite(nullptr), "SetSite(nullptr)"))
+        {
+            break;
+        }
+    }
+}
+BENCHMARK(BM_SetSiteAndClear);
+
+// GetSite
+
+template <typename TSite>
+void BM_GetSite(benchmark::State &state)
+{
+    typedef CAgileSitedProfferServiceT<AgileProfferService> TNode;
+    static TNode *s_pObject;
+
+    // Every thread waits for this setup at the start of the loop
+    ComPtr<TNode> spObject;
+    if (state.thread_index() == 0)
+    {
+        spObject = Make<TNode>();
+        ComPtr<TSite> spSite = Make<TSite>();
+        _Succeeded(state, spObject->SetSite(spSite->CastToUnknown()), "SetSite");
+        s_pObject = spObject.Get();
+    }
+
+    for (auto _ : state)
+    {
+        ComPtr<IServiceProvider> spProvider;
+        if (!_Succeeded(state, s_pObject->GetSite(IID_PPV_ARGS(&spProvider)), "GetSite"))
+        {
+            break;
+        }
+    }
+
+    if (state.thread_index() == 0)
+    {
+        spObject->SetSite(nullptr);
+    }
+}
+BENCHMARK_TEMPLATE(BM_GetSite, CAgileServiceProvider)->ThreadRange(1, 4)->UseRealTime();
+BENCHMARK_TEMPLATE(BM_GetSite, CSitedProfferService)->ThreadRange(1, 4)->UseRealTime();
+
+// GetSite of an agile object read by state.threads() threads, ObjectWithSite against LockFreeObjectWithSite
+template <typename TObjectWithSite>
+void BM_GetSiteReaders(benchmark::State &state)
+{
+    typedef CAgileSitedProfferServiceT<AgileProfferService, TObjectWithSite> TNode;
+    static TNode *s_pObject;
+
+    ComPtr<TNode> spObject;
+    if (state.thread_index() == 0)
+    {
+        spObject = Make<TNode>();
+        ComPtr<CAgileServiceProvider> spSite = Make<CAgileServiceProvider>();
+        _Succeeded(state, spObject->SetSite(spSite->CastToUnknown()), "SetSite");
+        s_pObject = spObject.Get();
+    }
+
+    for (auto _ : state)
+    {
+        ComPtr<IServiceProvider> spProvider;
+        if (!_Succeeded(state, s_pObject->GetSite(IID_PPV_ARGS(&spProvider)), "GetSite"))
+        {
+            break;
+        }
+    }
+    state.SetItemsProcessed(static_cast<int64_t>(state.iterations()));
+
+    if (state.thread_index() == 0)
+    {
+        spObject->SetSite(nullptr);
+    }
+}
+BENCHMARK_TEMPLATE(BM_GetSiteReaders, Windows::Internal::WRL::ObjectWithSite)->ThreadRange(1, 8)->UseRealTime();
+BENCHMARK_TEMPLATE(BM_GetSiteReaders, LockFreeObjectWithSite)->ThreadRange(1, 8)->UseRealTime();
+
+// Same, while the first thread keeps moving the object between two sites
+template <typename TObjectWithSite>
+void BM_GetSiteWhileSiting(benchmark::State &state)
+{
+    typedef CAgileSitedProfferServiceT<AgileProfferService, TObjectWithSite> TNode;
+    static TNode *s_pObject;
+    static ComPtr<CAgileServiceProvider> *s_rgspSites;
+
+    ComPtr<TNode> spObject;
+    ComPtr<CAgileServiceProvider> rgspSites[2];
+    if (state.thread_index() == 0)
+    {
+        spObject = Make<TNode>();
+        rgspSites[0] = Make<CAgileServiceProvider>();
+        rgspSites[1] = Make<CAgileServiceProvider>();
+        _Succeeded(state, spObject->SetSite(rgspSites[0]->CastToUnknown()), "SetSite");
+        s_pObject = spObject.Get();
+        s_rgspSites = rgspSites;
+    }
+
+    UINT idxSite = 0;
+    for (auto _ : state)
+    {
+        if (state.thread_index() == 0)
+        {
+            idxSite ^= 1;
+            if (!_Succeeded(state, s_pObject->SetSite(s_rgspSites[idxSite]->CastToUnknown()), "SetSite"))
+            {
+                break;
+            }
+        }
+        else
+        {
+            ComPtr<IServiceProvider> spProvider;
+            if (!_Succeeded(state, s_pObject->GetSite(IID_PPV_ARGS(&spProvider)), "GetSite"))
+            {
+                break;
+            }
+        }
+    }
+
+    if (state.thread_index() == 0)
+    {
+        spObject->SetSite(nullptr);
+    }
+}
+BENCHMARK_TEMPLATE(BM_GetSiteWhileSiting, Windows::Internal::WRL::ObjectWithSite)->ThreadRange(2, 8)->UseRealTime();
+BENCHMARK_TEMPLATE(BM_GetSiteWhileSiting, LockFreeObjectWithSite)->ThreadRange(2, 8)->UseRealTime();
+
+// The site lives in another apartment, so every GetSite pays for unmarshaling it unless the object
+// keeps what it resolved. Reports the IAgileReference::Resolve calls per GetSite.
+
+template <typename TInstrumentation, ObjectWithSiteOptions options>
+class CGetSiteObjectWithSite : public ObjectWithSiteT<TInstrumentation>
+{
+public:
+    CGetSiteObjectWithSite() : ObjectWithSiteT<TInstrumentation>(options)
+    {
+    }
+};
+
+struct GetSiteUncachedTag {};
+struct GetSiteCachedTag {};
+typedef CSitedProfferServiceT<ProfferService, CGetSiteObjectWithSite<ServiceLookupInstrumentationT<GetSiteUncachedTag>, OWSO_NONE>> CGetSiteUncached;
+typedef CSitedProfferServiceT<ProfferService, CGetSiteObjectWithSite<ServiceLookupInstrumentationT<GetSiteCachedTag>, OWSO_CACHE_RESOLVED_SITE>> CGetSiteCached;
+
+template <typename TInstrumentation>
+ULONGLONG _SiteResolves()
+{
+    ServiceLookupSnapshot snapshot;
+    TInstrumentation::Snapshot(&snapshot);
+    ULONGLONG cResolves = 0;
+    for (UINT idxBucket = 0; idxBucket < ServiceLookupSnapshot::c_cLatencyBuckets; idxBucket++)
+    {
+        cResolves += snapshot.rgcResolves[ARK_SITE][idxBucket];
+    }
+    return cResolves;
+}
+
+template <typename TNode, typename TInstrumentation>
+void BM_GetSiteCrossApartment(benchmark::State &state)
+{
+    ComPtr<TNode> spObject = Make<TNode>();
+    ComPtr<CSitedProfferService> spSite;
+    ComPtr<IUnknown> spSiteProxy;
+    HRESULT hr = _RunInNewSta([&spSite](ComPtr<IUnknown> *pspUnknown)
+    {
+        spSite = Make<CSitedProfferService>();
+        *pspUnknown = spSite->CastToUnknown();
+        return S_OK;
+    }, &spSiteProxy);
+
+    ULONGLONG const cResolvesBefore = _SiteResolves<TInstrumentation>();
+    if (_Succeeded(state, hr, "Creating the site") &&
+        _Succeeded(state, spObject->SetSite(spSiteProxy.Get()), "SetSite"))
+    {
+        for (auto _ : state)
+        {
+            ComPtr<IServiceProvider> spProvider;
+            if (!_Succeeded(state, spObject->GetSite(IID_PPV_ARGS(&spProvider)), "GetSite"))
+            {
+                break;
+            }
+        }
+    }
+    state.counters["Resolves"] = benchmark::Counter(static_cast<double>(_SiteResolves<TInstrumentation>() - cResolvesBefore),
+                                                    benchmark::Counter::kAvgIterations);
+    spObject->SetSite(nullptr);
+}
+BENCHMARK_TEMPLATE(BM_GetSiteCrossApartment, CGetSiteUncached, ServiceLookupInstrumentationT<GetSiteUncachedTag>);
+BENCHMARK_TEMPLATE(BM_GetSiteCrossApartment, CGetSiteCached, ServiceLookupInstrumentationT<GetSiteCachedTag>);
+
+// ProfferService and RevokeService, with state.range(0) services already proffered. The services are
+// proffered and revoked in batches so the timer is only paused once per batch.
+
+const UINT c_cBatch = 256;
+
+template <typename TNode>
+void _ProfferBaseline(benchmark::State &state, TNode *pNode, IServiceProvider *pProvider, std::vector<DWORD> *prgdwCookies)
+{
+    prgdwCookies->resize(static_cast<size_t>(state.range(0)));
+    for (auto &dwCookie : *prgdwCookies)
+    {
+        if (!_Succeeded(state, _ProfferServiceOf(pNode)->ProfferService(_NewServiceId(), pProvider, &dwCookie), "ProfferService"))
+        {
+            break;
+        }
+    }
+}
+
+template <typename TNode>
+void BM_ProfferService(benchmark::State &state)
+{
+    ComPtr<TNode> spNode = Make<TNode>();
+    ComPtr<CAgileServiceProvider> spProvider = Make<CAgileServiceProvider>();
+    std::vector<DWORD> rgdwBaseline;
+    _ProfferBaseline(state, spNode.Get(), spProvider.Get(), &rgdwBaseline);
+
+    GUID rgguidServices[c_cBatch];
+    for (auto &guidService : rgguidServices)
+    {
+        guidService = _NewServiceId();
+    }
+
+    DWORD rgdwCookies[c_cBatch];
+    for (auto _ : state)
+    {
+        for (UINT idx = 0; idx < c_cBatch; idx++)
+        {
+            if (!_Succeeded(state, _ProfferServiceOf(spNode.Get())->ProfferService(rgguidServices[idx], spProvider.Get(), &rgdwCookies[idx]), "ProfferService"))
+            {
+                return;
+            }
+        }
+
+        state.PauseTiming();
+        for (UINT idx = 0; idx < c_cBatch; idx++)
+        {
+            spNode->RevokeService(rgdwCookies[idx]);
+        }
+        state.ResumeTiming();
+    }
+    state.SetItemsProcessed(static_cast<int64_t>(state.iterations()) * c_cBatch);
+}
+BENCHMARK_TEMPLATE(BM_ProfferService, CSitedProfferService)->Arg(0)->Arg(64)->Arg(1024);
+BENCHMARK_TEMPLATE(BM_ProfferService, CSitedAgileProfferService)->Arg(0)->Arg(64)->Arg(1024);
+BENCHMARK_TEMPLATE(BM_ProfferService, CSitedSnapshotAgileProfferService)->Arg(0)->Arg(64)->Arg(1024);
+
+template <typename TNode>
+void BM_RevokeService(benchmark::State &state)
+{
+    ComPtr<TNode> spNode = Make<TNode>();
+    ComPtr<CAgileServiceProvider> spProvider = Make<CAgileServiceProvider>();
+    std::vector<DWORD> rgdwBaseline;
+    _ProfferBaseline(state, spNode.Get(), spProvider.Get(), &rgdwBaseline);
+
+    GUID rgguidServices[c_cBatch];
+    for (auto &guidService : rgguidServices)
+    {
+        guidService = _NewServiceId();
+    }
+
+    DWORD rgdwCookies[c_cBatch];
+    for (auto _ : state)
+    {
+        state.PauseTiming();
+        for (UINT idx = 0; idx < c_cBatch; idx++)
+        {
+            _ProfferServiceOf(spNode.Get())->ProfferService(rgguidServices[idx], spProvider.Get(), &rgdwCookies[idx]);
+        }
+        state.ResumeTiming();
+
+        for (UINT idx = 0; idx < c_cBatch; idx++)
+        {
+            if (!_Succeeded(state, spNode->RevokeService(rgdwCookies[idx]), "RevokeService"))
+            {
+                return;
+            }
+        }
+    }
+    state.SetItemsProcessed(static_cast<int64_t>(state.iterations()) * c_cBatch);
+}
+BENCHMARK_TEMPLATE(BM_RevokeService, CSitedProfferService)->Arg(0)->Arg(64)->Arg(1024);
+BENCHMARK_TEMPLATE(BM_RevokeService, CSitedAgileProfferService)->Arg(0)->Arg(64)->Arg(1024);
+BENCHMARK_TEMPLATE(BM_RevokeService, CSitedSnapshotAgileProfferService)->Arg(0)->Arg(64)->Arg(1024);
+
+// A revoke and a proffer of the same service, round robin over the state.range(0) services proffered:
+// a population that churns without growing, so the table keeps reusing the slots and cookies it freed.
+template <typename TNode>
+void BM_ProfferRevokeChurn(benchmark::State &state)
+{
+    ComPtr<TNode> spNode = Make<TNode>();
+    ComPtr<CAgileServiceProvider> spProvider = Make<CAgileServiceProvider>();
+    std::vector<GUID> rgguidServices(static_cast<size_t>(state.range(0)));
+    std::vector<DWORD> rgdwCookies(rgguidServices.size());
+    for (size_t idx = 0; idx < rgguidServices.size(); idx++)
+    {
+        rgguidServices[idx] = _NewServiceId();
+        if (!_Succeeded(state, _ProfferServiceOf(spNode.Get())->ProfferService(rgguidServices[idx], spProvider.Get(), &rgdwCookies[idx]), "ProfferService"))
+        {
+            return;
+        }
+    }
+
+    size_t idxService = 0;
+    for (auto _ : state)
+    {
+        size_t const idx = idxService++ % rgguidServices.size();
+        if (!_Succeeded(state, spNode->RevokeService(rgdwCookies[idx]), "RevokeService") ||
+            !_Succeeded(state, _ProfferServiceOf(spNode.Get())->ProfferService(rgguidServices[idx], spProvider.Get(), &rgdwCookies[idx]), "ProfferService"))
+        {
+            break;
+        }
+    }
+    state.SetItemsProcessed(static_cast<int64_t>(state.iterations()));
+}
+BENCHMARK_TEMPLATE(BM_ProfferRevokeChurn, CSitedProfferService)->Arg(1000);
+BENCHMARK_TEMPLATE(BM_ProfferRevokeChurn, CSitedAgileProfferService)->Arg(1000);
+BENCHMARK_TEMPLATE(BM_ProfferRevokeChurn, CSitedSnapshotAgileProfferService)->Arg(1000);
+
+// A new object proffering state.range(0) services served by the same provider, one ProfferService
+// call at a time or all of them with a single ProfferServices call.
+template <typename TNode, bool fBatch>
+void BM_ProfferServicesBatch(benchmark::State &state)
+{
+    ComPtr<CAgileServiceProvider> spProvider = Make<CAgileServiceProvider>();
+    std::vector<GUID> rgguidServices(static_cast<size_t>(state.range(0)));
+    for (auto &guidService : rgguidServices)
+    {
+        guidService = _NewServiceId();
+    }
+
+    std::vector<DWORD> rgdwCookies(rgguidServices.size());
+    for (auto _ : state)
+    {
+        ComPtr<TNode> spNode = Make<TNode>();
+        HRESULT hr = spNode ? S_OK : E_OUTOFMEMORY;
+        if (SUCCEEDED(hr) && fBatch)
+        {
+            hr = spNode->ProfferServices(rgguidServices.data(), static_cast<UINT>(rgguidServices.size()), spProvider.Get(), rgdwCookies.data());
+        }
+
+        for (size_t idx = 0; SUCCEEDED(hr) && !fBatch && (idx < rgguidServices.size()); idx++)
+        {
+            hr = _ProfferServiceOf(spNode.Get())->ProfferService(rgguidServices[idx], spProvider.Get(), &rgdwCookies[idx]);
+        }
+
+        if (!_Succeeded(state, hr, "ProfferServices"))
+        {
+            break;
+        }
+
+        state.PauseTiming();
+        spNode.Reset();
+        state.ResumeTiming();
+    }
+    state.SetItemsProcessed(static_cast<int64_t>(state.iterations()) * state.range(0));
+}
+BENCHMARK_TEMPLATE(BM_ProfferServicesBatch, CSitedAgileProfferService, false)->Arg(32)->Arg(128)->Arg(512);
+BENCHMARK_TEMPLATE(BM_ProfferServicesBatch, CSitedAgileProfferService, true)->Arg(32)->Arg(128)->Arg(512);
+BENCHMARK_TEMPLATE(BM_ProfferServicesBatch, CSitedSnapshotAgileProfferService, false)->Arg(32)->Arg(128)->Arg(512);
+BENCHMARK_TEMPLATE(BM_ProfferServicesBatch, CSitedSnapshotAgileProfferService, true)->Arg(32)->Arg(128)->Arg(512);
+
+// Memory of many small brokers: c_cBrokers objects each proffering state.range(0) services, with the
+// services kept inline (the default of 4) or not at all. Allocations and heap bytes are per broker and
+// include the object and the agile reference of every service, which no table layout can avoid.
+// PoolBytes/broker is what the tables took from the ServiceBlockPool, which only goes to the heap in
+// the first iteration and recycles what the previous one freed after that.
+
+const UINT c_cBrokers = 100000;
+
+template <UINT cInlineServices>
+class CBroker : public RuntimeClass<RuntimeClassFlags<RuntimeClassType::ClassicCom>, ProfferServiceT<NoServiceInstrumentation, cInlineServices>>
+{
+};
+
+template <UINT cInlineServices>
+void BM_ProfferServiceBrokers(benchmark::State &state)
+{
+    UINT const cServices = static_cast<UINT>(state.range(0));
+    ComPtr<CAgileServiceProvider> spProvider = Make<CAgileServiceProvider>();
+    std::vector<GUID> rgguidServices(cServices);
+    for (auto &guidService : rgguidServices)
+    {
+        guidService = _NewServiceId();
+    }
+
+    std::vector<ComPtr<CBroker<cInlineServices>>> rgspBrokers;
+    rgspBrokers.reserve(c_cBrokers);
+    long long cAllocations = 0;
+    long long cbAllocated = 0;
+    long long cbPool = 0;
+    for (auto _ : state)
+    {
+        long long const cAllocationsStart = g_cHeapAllocations.load();
+        long long const cbAllocatedStart = g_cbHeapAllocated.load();
+        for (UINT idxBroker = 0; idxBroker < c_cBrokers; idxBroker++)
+        {
+            ComPtr<CBroker<cInlineServices>> spBroker = Make<CBroker<cInlineServices>>();
+            for (UINT idx = 0; idx < cServices; idx++)
+            {
+                DWORD dwCookie;
+                if (!_Succeeded(state, spBroker->ProfferService(rgguidServices[idx], spProvider.Get(), &dwCookie), "ProfferService"))
+                {
+                    return;
+                }
+            }
+            rgspBrokers.push_back(spBroker);
+        }
+        cAllocations += g_cHeapAllocations.load() - cAllocationsStart;
+        cbAllocated += g_cbHeapAllocated.load() - cbAllocatedStart;
+        cbPool += static_cast<long long>(Windows::Internal::WRL::Details::ServiceBlockPool::BytesInUse());
+
+        state.PauseTiming();
+        rgspBrokers.clear();
+        state.ResumeTiming();
+    }
+
+    double const cBrokers = static_cast<double>(state.iterations()) * c_cBrokers;
+    state.counters["Allocs/broker"] = static_cast<double>(cAllocations) / cBrokers;
+    state.counters["Bytes/broker"] = static_cast<double>(cbAllocated) / cBrokers;
+    state.counters["PoolBytes/broker"] = static_cast<double>(cbPool) / cBrokers;
+    state.counters["sizeof"] = sizeof(CBroker<cInlineServices>);
+    state.SetItemsProcessed(static_cast<int64_t>(cBrokers));
+}
+BENCHMARK_TEMPLATE(BM_ProfferServiceBrokers, 0)->Arg(2)->Arg(4)->Arg(8)->Iterations(3);
+BENCHMARK_TEMPLATE(BM_ProfferServiceBrokers, 4)->Arg(2)->Arg(4)->Arg(8)->Iterations(3);
+
+// Creating state.range(0) sited objects that each start with the same c_cTemplateServices services,
+// kept alive until all are created. Either every object proffers them itself or all of them share a
+// ProfferServiceTemplate. Allocations and heap bytes are per object and include the object itself,
+// PoolBytes/object is what the service tables took from the ServiceBlockPool.
+
+const UINT c_cTemplateServices = 8;
+
+template <bool fTemplate>
+void BM_CreateSitedObjects(benchmark::State &state)
+{
+    UINT const cObjects = static_cast<UINT>(state.range(0));
+    ComPtr<CAgileServiceProvider> spProvider = Make<CAgileServiceProvider>();
+    GUID rgguidServices[c_cTemplateServices];
+    for (auto &guidService : rgguidServices)
+    {
+        guidService = _NewServiceId();
+    }
+
+    ComPtr<ProfferServiceTemplate> spTemplate;
+    DWORD rgdwCookies[c_cTemplateServices];
+    if (!_Succeeded(state, ProfferServiceTemplate::Create(AgileReferenceOptions::AGILEREFERENCE_DEFAULT, PSO_NONE, &spTemplate), "ProfferServiceTemplate::Create") ||
+        !_Succeeded(state, spTemplate->ProfferServices(rgguidServices, c_cTemplateServices, spProvider.Get(), rgdwCookies), "ProfferServices"))
+    {
+        return;
+    }
+
+    std::vector<ComPtr<CSitedProfferService>> rgspObjects;
+    rgspObjects.reserve(cObjects);
+    long long cAllocations = 0;
+    long long cbAllocated = 0;
+    long long cbPool = 0;
+    for (auto _ : state)
+    {
+        long long const cAllocationsStart = g_cHeapAllocations.load();
+        long long const cbAllocatedStart = g_cbHeapAllocated.load();
+        for (UINT idxObject = 0; idxObject < cObjects; idxObject++)
+        {
+            ComPtr<CSitedProfferService> spObject = Make<CSitedProfferService>();
+            HRESULT hr = spObject ? S_OK : E_OUTOFMEMORY;
+            for (UINT idx = 0; !fTemplate && SUCCEEDED(hr) && (idx < c_cTemplateServices); idx++)
+            {
+                hr = _ProfferServiceOf(spObject.Get())->ProfferService(rgguidServices[idx], spProvider.Get(), &rgdwCookies[idx]);
+            }
+
+            if (fTemplate && SUCCEEDED(hr))
+            {
+                hr = spObject->UseServiceTemplate(spTemplate.Get());
+            }
+
+            if (!_Succeeded(state, hr, fTemplate ? "UseServiceTemplate" : "ProfferService"))
+            {
+                return;
+            }
+            rgspObjects.push_back(spObject);
+        }
+        cAllocations += g_cHeapAllocations.load() - cAllocationsStart;
+        cbAllocated += g_cbHeapAllocated.load() - cbAllocatedStart;
+        cbPool += static_cast<long long>(Windows::Internal::WRL::Details::ServiceBlockPool::BytesInUse());
+
+        state.PauseTiming();
+        rgspObjects.clear();
+        state.ResumeTiming();
+    }
+
+    double const cCreated = static_cast<double>(state.iterations()) * cObjects;
+    state.counters["Allocs/object"] = static_cast<double>(cAllocations) / cCreated;
+    state.counters["Bytes/object"] = static_cast<double>(cbAllocated) / cCreated;
+    state.counters["PoolBytes/object"] = static_cast<double>(cbPool) / cCreated;
+    state.SetItemsProcessed(static_cast<int64_t>(cCreated));
+}
+BENCHMARK_TEMPLATE(BM_CreateSitedObjects, false)->Arg(10000)->Arg(100000)->Iterations(3);
+BENCHMARK_TEMPLATE(BM_CreateSitedObjects, true)->Arg(10000)->Arg(100000)->Iterations(3);
+
+// Startup of a host proffering 200 services of which only state.range(0) are ever looked up, each
+// provider holding some state it fills in when created. Either every provider is created and proffered
+// up front, or each is proffered with a factory and created by its first QueryService. Reports what
+// startup allocated, which is about what it left resident since everything stays alive until shutdown.
+
+const UINT c_cStartupServices = 200;
+
+class CStatefulServiceProvider : public RuntimeClass<RuntimeClassFlags<RuntimeClassType::ClassicCom>, FtmBase, IServiceProvider>
+{
+public:
+    CStatefulServiceProvider() : _rgbState(16 * 1024)
+    {
+        for (size_t idx = 0; idx < _rgbState.size(); idx++)
+        {
+            _rgbState[idx] = static_cast<BYTE>(idx * 31);
+        }
+    }
+
+    IFACEMETHODIMP QueryService(_In_ REFGUID /*guidService*/, _In_ REFIID riid, _COM_Outptr_ void **ppv)
+    {
+        return QueryInterface(riid, ppv);
+    }
+
+private:
+    std::vector<BYTE> _rgbState;
+};
+
+struct StatefulServiceProviderFactory
+{
+    HRESULT operator()(_COM_Outptr_ IServiceProvider **ppProvider) const
+    {
+        return MakeAndInitialize<CStatefulServiceProvider>(ppProvider);
+    }
+};
+
+template <bool fLazy>
+void BM_ProfferServicesStartup(benchmark::State &state)
+{
+    std::vector<GUID> rgguidServices(c_cStartupServices);
+    for (auto &guidService : rgguidServices)
+    {
+        guidService = _NewServiceId();
+    }
+
+    long long cAllocations = 0;
+    long long cbAllocated = 0;
+    for (auto _ : state)
+    {
+        long long const cAllocationsStart = g_cHeapAllocations.load();
+        long long const cbAllocatedStart = g_cbHeapAllocated.load();
+        ComPtr<CSitedAgileProfferService> spHost = Make<CSitedAgileProfferService>();
+        HRESULT hr = spHost ? S_OK : E_OUTOFMEMORY;
+        for (UINT idx = 0; SUCCEEDED(hr) && (idx < c_cStartupServices); idx++)
+        {
+            DWORD dwCookie;
+            if (fLazy)
+            {
+                hr = spHost->ProfferLazyService(rgguidServices[idx], StatefulServiceProviderFactory(), &dwCookie);
+            }
+            else
+            {
+                ComPtr<IServiceProvider> spProvider;
+                hr = StatefulServiceProviderFactory()(&spProvider);
+                if (SUCCEEDED(hr))
+                {
+                    hr = spHost->ProfferService(rgguidServices[idx], spProvider.Get(), &dwCookie);
+                }
+            }
+        }
+
+        for (UINT idx = 0; SUCCEEDED(hr) && (idx < static_cast<UINT>(state.range(0))); idx++)
+        {
+            ComPtr<IServiceProvider> spService;
+            hr = spHost->QueryService(rgguidServices[idx], IID_PPV_ARGS(&spService));
+        }
+
+        if (!_Succeeded(state, hr, "Startup"))
+        {
+            break;
+        }
+        cAllocations += g_cHeapAllocations.load() - cAllocationsStart;
+        cbAllocated += g_cbHeapAllocated.load() - cbAllocatedStart;
+
+        state.PauseTiming();
+        spHost.Reset();
+        state.ResumeTiming();
+    }
+
+    state.counters["Allocs"] = benchmark::Counter(static_cast<double>(cAllocations), benchmark::Counter::kAvgIterations);
+    state.counters["KB"] = benchmark::Counter(static_cast<double>(cbAllocated) / 1024, benchmark::Counter::kAvgIterations);
+}
+BENCHMARK_TEMPLATE(BM_ProfferServicesStartup, false)->Arg(0)->Arg(10)->Arg(200);
+BENCHMARK_TEMPLATE(BM_ProfferServicesStartup, true)->Arg(0)->Arg(10)->Arg(200);
+
+// Caller side cost of tearing down c_cTeardownItems services proffered by, or objects sited to, an
+// object living in another STA: revoking every service, or SetSite(nullptr) on every object. Each
+// release of an agile reference to the STA object calls into the STA unless it is deferred to
+// DeferredReleaseQueue. The queue is drained, and everything set up again, with the timer paused.
+
+const UINT c_cTeardownItems = 500;
+
+template <typename TInstrumentation, ProfferServiceOptions options>
+class CTeardownProfferService : public ProfferServiceT<TInstrumentation>
+{
+public:
+    CTeardownProfferService() : ProfferServiceT<TInstrumentation>(AgileReferenceOptions::AGILEREFERENCE_DEFAULT, options)
+    {
+    }
+};
+
+template <typename TInstrumentation, ObjectWithSiteOptions options>
+class CTeardownObjectWithSite : public ObjectWithSiteT<TInstrumentation>
+{
+public:
+    CTeardownObjectWithSite() : ObjectWithSiteT<TInstrumentation>(options)
+    {
+    }
+};
+
+typedef CSitedProfferServiceT<CTeardownProfferService<NoServiceInstrumentation, PSO_NONE>> CRevokingNode;
+typedef CSitedProfferServiceT<CTeardownProfferService<NoServiceInstrumentation, PSO_DEFER_RELEASE>> CDeferredRevokingNode;
+typedef CSitedProfferServiceT<ProfferService, CTeardownObjectWithSite<NoServiceInstrumentation, OWSO_NONE>> CUnsitingNode;
+typedef CSitedProfferServiceT<ProfferService, CTeardownObjectWithSite<NoServiceInstrumentation, OWSO_DEFER_RELEASE>> CDeferredUnsitingNode;
+
+HRESULT _MakeStaServiceProvider(_COM_Outptr_ IUnknown **ppunkProxy)
+{
+    return _RunInNewSta([](ComPtr<IUnknown> *pspUnknown)
+    {
+        *pspUnknown = Make<CSitedProfferService>()->CastToUnknown();
+        return S_OK;
+    }, ppunkProxy);
+}
+
+template <typename TNode>
+void BM_MassRevokeService(benchmark::State &state)
+{
+    ComPtr<TNode> spHost = Make<TNode>();
+    ComPtr<IUnknown> spProviderProxy;
+    ComPtr<IServiceProvider> spProvider;
+    HRESULT hr = _MakeStaServiceProvider(&spProviderProxy);
+    if (SUCCEEDED(hr))
+    {
+        hr = spProviderProxy.As(&spProvider);
+    }
+
+    std::vector<DWORD> rgdwCookies(c_cTeardownItems);
+    for (auto _ : state)
+    {
+        state.PauseTiming();
+        for (UINT idx = 0; SUCCEEDED(hr) && (idx < c_cTeardownItems); idx++)
+        {
+            hr = spHost->ProfferService(_NewServiceId(), spProvider.Get(), &rgdwCookies[idx]);
+        }
+        state.ResumeTiming();
+
+        if (!_Succeeded(state, hr, "ProfferService"))
+        {
+            break;
+        }
+
+        for (auto dwCookie : rgdwCookies)
+        {
+            spHost->RevokeService(dwCookie);
+        }
+
+        state.PauseTiming();
+        DeferredReleaseQueue::Drain();
+        state.ResumeTiming();
+    }
+    state.SetItemsProcessed(static_cast<int64_t>(state.iterations()) * c_cTeardownItems);
+}
+BENCHMARK_TEMPLATE(BM_MassRevokeService, CRevokingNode);
+BENCHMARK_TEMPLATE(BM_MassRevokeService, CDeferredRevokingNode);
+
+template <typename TNode>
+void BM_MassUnsite(benchmark::State &state)
+{
+    ComPtr<IUnknown> spSiteProxy;
+    HRESULT hr = _MakeStaServiceProvider(&spSiteProxy);
+    std::vector<ComPtr<TNode>> rgspNodes(c_cTeardownItems);
+    for (auto &spNode : rgspNodes)
+    {
+        spNode = Make<TNode>();
+    }
+
+    for (auto _ : state)
+    {
+        state.PauseTiming();
+        for (size_t idx = 0; SUCCEEDED(hr) && (idx < rgspNodes.size()); idx++)
+        {
+            hr = rgspNodes[idx]->SetSite(spSiteProxy.Get());
+        }
+        state.ResumeTiming();
+
+        if (!_Succeeded(state, hr, "SetSite"))
+        {
+            break;
+        }
+
+        for (auto &spNode : rgspNodes)
+        {
+            spNode->SetSite(nullptr);
+        }
+
+        state.PauseTiming();
+        DeferredReleaseQueue::Drain();
+        state.ResumeTiming();
+    }
+    state.SetItemsProcessed(static_cast<int64_t>(state.iterations()) * c_cTeardownItems);
+}
+BENCHMARK_TEMPLATE(BM_MassUnsite, CUnsitingNode);
+BENCHMARK_TEMPLATE(BM_MassUnsite, CDeferredUnsitingNode);
+
+// Services whose providers are not agile and live in the benchmark thread's apartment, proffered on an
+// agile object with AGILEREFERENCE_DEFAULT, AGILEREFERENCE_DELAYEDMARSHAL or PSO_ADAPTIVE_AGILE_REFERENCES.
+// BM_ProfferApartmentServices times proffering c_cApartmentServices of them. BM_QueryServiceMixedApartments
+// looks them up round robin, with state.range(0) percent of the lookups made from another apartment and
+// those only ever for the first c_cHotServices, and reports how many providers had to be marshaled.
+
+const UINT c_cApartmentServices = 64;
+const UINT c_cHotServices = 8;
+
+class CApartmentServiceProvider : public RuntimeClass<RuntimeClassFlags<RuntimeClassType::ClassicCom>, IServiceProvider>
+{
+public:
+    IFACEMETHODIMP QueryService(_In_ REFGUID /*guidService*/, _In_ REFIID riid, _COM_Outptr_ void **ppv)
+    {
+        return QueryInterface(riid, ppv);
+    }
+};
+
+template <AgileReferenceOptions agileReferenceOptions, ProfferServiceOptions options>
+class CReferencingProfferService : public AgileProfferService
+{
+public:
+    CReferencingProfferService() : AgileProfferService(agileReferenceOptions, options)
+    {
+    }
+};
+
+typedef CSitedProfferServiceT<CReferencingProfferService<AgileReferenceOptions::AGILEREFERENCE_DEFAULT, PSO_NONE>> CDefaultReferenceHost;
+typedef CSitedProfferServiceT<CReferencingProfferService<AgileReferenceOptions::AGILEREFERENCE_DELAYEDMARSHAL, PSO_NONE>> CDelayedReferenceHost;
+typedef CSitedProfferServiceT<CReferencingProfferService<AgileReferenceOptions::AGILEREFERENCE_DEFAULT, PSO_ADAPTIVE_AGILE_REFERENCES>> CAdaptiveReferenceHost;
+
+// The id of a new STA, for PortableCom::ApartmentScope to make calls as if from there
+ULONG_PTR _NewStaId()
+{
+    ULONG_PTR idApartment = 0;
+    std::thread thread([&idApartment]()
+    {
+        CoInitializeEx(nullptr, COINIT_APARTMENTTHREADED);
+        CoGetContextToken(&idApartment);
+        CoUninitialize();
+    });
+    thread.join();
+    return idApartment;
+}
+
+template <typename THost>
+void BM_ProfferApartmentServices(benchmark::State &state)
+{
+    ComPtr<THost> spHost = Make<THost>();
+    std::vector<ComPtr<IServiceProvider>> rgspProviders(c_cApartmentServices);
+    std::vector<GUID> rgguidServices(c_cApartmentServices);
+    for (UINT idx = 0; idx < c_cApartmentServices; idx++)
+    {
+        rgspProviders[idx] = Make<CApartmentServiceProvider>();
+        rgguidServices[idx] = _NewServiceId();
+    }
+
+    std::vector<DWORD> rgdwCookies(c_cApartmentServices);
+    HRESULT hr = S_OK;
+    for (auto _ : state)
+    {
+        for (UINT idx = 0; SUCCEEDED(hr) && (idx < c_cApartmentServices); idx++)
+        {
+            hr = spHost->ProfferService(rgguidServices[idx], rgspProviders[idx].Get(), &rgdwCookies[idx]);
+        }
+
+        if (!_Succeeded(state, hr, "ProfferService"))
+        {
+            break;
+        }
+
+        state.PauseTiming();
+        spHost->RevokeServices(rgdwCookies.data(), c_cApartmentServices);
+        state.ResumeTiming();
+    }
+    state.SetItemsProcessed(static_cast<int64_t>(state.iterations()) * c_cApartmentServices);
+}
+BENCHMARK_TEMPLATE(BM_ProfferApartmentServices, CDefaultReferenceHost);
+BENCHMARK_TEMPLATE(BM_ProfferApartmentServices, CDelayedReferenceHost);
+BENCHMARK_TEMPLATE(BM_ProfferApartmentServices, CAdaptiveReferenceHost);
+
+template <typename THost>
+void BM_QueryServiceMixedApartments(benchmark::State &state)
+{
+    AdaptiveAgileReferenceStatistics statisticsStart;
+    GetAdaptiveAgileReferenceStatistics(&statisticsStart);
+
+    ComPtr<THost> spHost = Make<THost>();
+    std::vector<GUID> rgguidServices(c_cApartmentServices);
+    HRESULT hr = spHost ? S_OK : E_OUTOFMEMORY;
+    for (UINT idx = 0; SUCCEEDED(hr) && (idx < c_cApartmentServices); idx++)
+    {
+        DWORD dwCookie;
+        rgguidServices[idx] = _NewServiceId();
+        hr = spHost->ProfferService(rgguidServices[idx], Make<CApartmentServiceProvider>().Get(), &dwCookie);
+    }
+
+    ULONG_PTR const idForeign = _NewStaId();
+    UINT const cForeignPercent = static_cast<UINT>(state.range(0));
+    UINT idxQuery = 0;
+    UINT idxService = 0;
+    UINT idxHotService = 0;
+    if (_Succeeded(state, hr, "ProfferService"))
+    {
+        for (auto _ : state)
+        {
+            ComPtr<IServiceProvider> spService;
+            if ((idxQuery++ % 100) < cForeignPercent)
+            {
+                PortableCom::ApartmentScope scope(idForeign);
+                hr = spHost->QueryService(rgguidServices[idxHotService++ % c_cHotServices], IID_PPV_ARGS(&spService));
+                spService.Reset();
+            }
+            else
+            {
+                hr = spHost->QueryService(rgguidServices[idxService++ % c_cApartmentServices], IID_PPV_ARGS(&spService));
+            }
+
+            if (!_Succeeded(state, hr, "QueryService"))
+            {
+                break;
+            }
+        }
+    }
+
+    AdaptiveAgileReferenceStatistics statistics;
+    GetAdaptiveAgileReferenceStatistics(&statistics);
+    state.counters["Upgraded"] = static_cast<double>(statistics.cUpgraded - statisticsStart.cUpgraded);
+}
+BENCHMARK_TEMPLATE(BM_QueryServiceMixedApartments, CDefaultReferenceHost)->Arg(0)->Arg(10)->Arg(50);
+BENCHMARK_TEMPLATE(BM_QueryServiceMixedApartments, CDelayedReferenceHost)->Arg(0)->Arg(10)->Arg(50);
+BENCHMARK_TEMPLATE(BM_QueryServiceMixedApartments, CAdaptiveReferenceHost)->Arg(0)->Arg(10)->Arg(50);
+
+// Finding one of state.range(0) services in the ServiceTable of a ProfferService, or in the singly
+// linked list ProfferServiceBase used to keep its services in, kept here to be measured against.
+
+struct ListServiceItem
+{
+    ListServiceItem(REFGUID serviceId, ListServiceItem *pNextItem) : guidService(serviceId), pNext(pNextItem)
+    {
+    }
+
+    REFGUID guidService;
+    ListServiceItem *pNext;
+
+private:
+    ListServiceItem & operator=(const ListServiceItem &);
+};
+
+template <bool fList>
+void BM_ServiceTableFind(benchmark::State &state)
+{
+    std::vector<GUID> rgguidServices(static_cast<size_t>(state.range(0)));
+    Windows::Internal::WRL::Details::ServiceTable table;
+    ListServiceItem *pList = nullptr;
+    for (size_t idx = 0; idx < rgguidServices.size(); idx++)
+    {
+        rgguidServices[idx] = _NewServiceId();
+        if (!_Succeeded(state, table.Insert(rgguidServices[idx], static_cast<DWORD>(idx + 1), nullptr), "ServiceTable::Insert"))
+        {
+            break;
+        }
+        pList = new ListServiceItem(rgguidServices[idx], pList);
+    }
+
+    size_t idxService = 0;
+    for (auto _ : state)
+    {
+        GUID const &guidService = rgguidServices[idxService++ % rgguidServices.size()];
+        bool fFound = false;
+        if (fList)
+        {
+            for (auto pWalk = pList; !fFound && (pWalk != nullptr); pWalk = pWalk->pNext)
+            {
+                fFound = (pWalk->guidService == guidService);
+            }
+        }
+        else
+        {
+            fFound = (table.Find(guidService) != nullptr);
+        }
+
+        if (!_Succeeded(state, fFound ? S_OK : E_NOTIMPL, "Find"))
+        {
+            break;
+        }
+    }
+    state.SetItemsProcessed(static_cast<int64_t>(state.iterations()));
+
+    while (pList != nullptr)
+    {
+        auto pDelete = pList;
+        pList = pList->pNext;
+        delete pDelete;
+    }
+}
+BENCHMARK_TEMPLATE(BM_ServiceTableFind, true)->Arg(1)->Arg(16)->Arg(256)->Arg(4096);
+BENCHMARK_TEMPLATE(BM_ServiceTableFind, false)->Arg(1)->Arg(16)->Arg(256)->Arg(4096);
+
+// Finding a service in the dispatch table of a ServiceMap of cServices services, or in the if chain a
+// hand written v_QueryService amounts to. Every other lookup is for a service that isn't in the map.
+
+template <UINT idService>
+struct BenchmarkServiceId
+{
+    static const GUID guid;
+};
+
+template <UINT idService>
+const GUID BenchmarkServiceId<idService>::guid = { 0x3f5a8e41, 0x9b2c, 0x4d07, { 0xa6, 0x1e, 0x58, 0xc4, static_cast<unsigned char>(idService >> 24), static_cast<unsigned char>(idService >> 16), static_cast<unsigned char>(idService >> 8), static_cast<unsigned char>(idService) } };
+
+struct NullServiceHandler
+{
+    template <typename T>
+    static HRESULT QueryService(_In_ T * /*pThis*/, _In_ REFGUID /*guidService*/, _In_ REFIID /*riid*/, _COM_Outptr_ void **ppv)
+    {
+        *ppv = nullptr;
+        return S_OK;
+    }
+};
+
+// The dispatch table of a ServiceMap with the services BenchmarkServiceId<0> through BenchmarkServiceId<cServices - 1>
+template <UINT cServices, typename... TEntries>
+struct BenchmarkDispatchTable
+{
+    typedef typename BenchmarkDispatchTable<cServices - 1, ServiceEntry<BenchmarkServiceId<cServices - 1>::guid, NullServiceHandler>, TEntries...>::Type Type;
+};
+
+template <typename... TEntries>
+struct BenchmarkDispatchTable<0, TEntries...>
+{
+    typedef Windows::Internal::WRL::Details::ServiceDispatchTable<IUnknown, TEntries...> Type;
+};
+
+GUID _BenchmarkServiceId(UINT idService)
+{
+    GUID guid = BenchmarkServiceId<0>::guid;
+    guid.Data4[6] = static_cast<unsigned char>(idService >> 8);
+    guid.Data4[7] = static_cast<unsigned char>(idService);
+    return guid;
+}
+
+template <UINT cServices, bool fMap>
+void BM_ServiceMapDispatch(benchmark::State &state)
+{
+    typedef typename BenchmarkDispatchTable<cServices>::Type DispatchTable;
+    std::vector<GUID> rgguidLookups;
+    for (UINT idService = 0; idService < cServices; idService++)
+    {
+        rgguidLookups.push_back(_BenchmarkServiceId(idService));
+        rgguidLookups.push_back(_NewServiceId());
+    }
+
+    size_t idxLookup = 0;
+    for (auto _ : state)
+    {
+        size_t const idx = idxLookup++ % rgguidLookups.size();
+        GUID const &guidService = rgguidLookups[idx];
+        bool fFound = false;
+        if (fMap)
+        {
+            fFound = (DispatchTable::Find(guidService) != nullptr);
+        }
+        else
+        {
+            for (UINT idService = 0; !fFound && (idService < cServices); idService++)
+            {
+                fFound = (_BenchmarkServiceId(idService) == guidService);
+            }
+        }
+
+        if (!_Succeeded(state, (fFound == ((idx % 2) == 0)) ? S_OK : E_UNEXPECTED, "Find"))
+        {
+            break;
+        }
+    }
+    state.SetItemsProcessed(static_cast<int64_t>(state.iterations()));
+}
+BENCHMARK_TEMPLATE(BM_ServiceMapDispatch, 4, false);
+BENCHMARK_TEMPLATE(BM_ServiceMapDispatch, 4, true);
+BENCHMARK_TEMPLATE(BM_ServiceMapDispatch, 32, false);
+BENCHMARK_TEMPLATE(BM_ServiceMapDispatch, 32, true);
+BENCHMARK_TEMPLATE(BM_ServiceMapDispatch, 128, false);
+BENCHMARK_TEMPLATE(BM_ServiceMapDispatch, 128, true);
+
+// QueryService answered by the object itself, state.range(0) services proffered and queried round
+// robin by every thread.
+
+template <typename TProfferService>
+void BM_QueryServiceLocal(benchmark::State &state)
+{
+    typedef CAgileSitedProfferServiceT<TProfferService> TNode;
+    static TNode *s_pNode;
+    static std::vector<GUID> *s_prgguidServices;
+
+    // Every thread waits for this setup at the start of the loop
+    ComPtr<TNode> spNode;
+    ComPtr<CAgileServiceProvider> spProvider;
+    std::vector<GUID> rgguidServices;
+    if (state.thread_index() == 0)
+    {
+        spNode = Make<TNode>();
+        spProvider = Make<CAgileServiceProvider>();
+        rgguidServices.resize(static_cast<size_t>(state.range(0)));
+        for (auto &guidService : rgguidServices)
+        {
+            DWORD dwCookie;
+            guidService = _NewServiceId();
+            _Succeeded(state, _ProfferServiceOf(spNode.Get())->ProfferService(guidService, spProvider.Get(), &dwCookie), "ProfferService");
+        }
+        s_pNode = spNode.Get();
+        s_prgguidServices = &rgguidServices;
+    }
+
+    size_t idxService = static_cast<size_t>(state.thread_index());
+    for (auto _ : state)
+    {
+        GUID const &guidService = (*s_prgguidServices)[idxService++ % s_prgguidServices->size()];
+        ComPtr<IServiceProvider> spService;
+        if (!_Succeeded(state, s_pNode->QueryService(guidService, IID_PPV_ARGS(&spService)), "QueryService"))
+        {
+            break;
+        }
+    }
+    state.SetItemsProcessed(static_cast<int64_t>(state.iterations()));
+}
+BENCHMARK_TEMPLATE(BM_QueryServiceLocal, ProfferService)->Arg(1)->Arg(16)->Arg(256);
+BENCHMARK_TEMPLATE(BM_QueryServiceLocal, AgileProfferService)->Arg(1)->Arg(16)->Arg(256)->ThreadRange(1, 4)->UseRealTime();
+BENCHMARK_TEMPLATE(BM_QueryServiceLocal, SnapshotAgileProfferService)->Arg(1)->Arg(16)->Arg(256)->ThreadRange(1, 4)->UseRealTime();
+// Resolving the provider's agile reference once per thread instead of on every lookup
+BENCHMARK_TEMPLATE(BM_QueryServiceLocal, CCachingAgileProfferService)->Arg(1)->Arg(16)->Arg(256)->ThreadRange(1, 4)->UseRealTime();
+// How the lock and the snapshot hold up with many more readers than cores
+BENCHMARK_TEMPLATE(BM_QueryServiceLocal, AgileProfferService)->Arg(16)->Threads(16)->Threads(64)->UseRealTime();
+BENCHMARK_TEMPLATE(BM_QueryServiceLocal, SnapshotAgileProfferService)->Arg(16)->Threads(16)->Threads(64)->UseRealTime();
+// What recording every lookup costs against AgileProfferService above, mostly the two clock reads
+// around IAgileReference::Resolve
+BENCHMARK_TEMPLATE(BM_QueryServiceLocal, AgileProfferServiceT<ServiceLookupInstrumentation>)->Arg(1)->Arg(16)->Arg(256)->ThreadRange(1, 4)->UseRealTime();
+
+// QueryService from the leaf of a chain of state.range(0) objects, answered by the root
+
+template <typename TNode>
+void BM_QueryServiceChain(benchmark::State &state)
+{
+    std::vector<ComPtr<TNode>> rgNodes;
+    ComPtr<CAgileServiceProvider> spProvider = Make<CAgileServiceProvider>();
+    GUID const guidService = _NewServiceId();
+    DWORD dwCookie;
+    if (_Succeeded(state, _BuildChain(static_cast<UINT>(state.range(0)), &rgNodes), "SetSite") &&
+        _Succeeded(state, _ProfferServiceOf(rgNodes.front().Get())->ProfferService(guidService, spProvider.Get(), &dwCookie), "ProfferService"))
+    {
+        for (auto _ : state)
+        {
+            ComPtr<IServiceProvider> spService;
+            if (!_Succeeded(state, rgNodes.back()->QueryService(guidService, IID_PPV_ARGS(&spService)), "QueryService"))
+            {
+                break;
+            }
+        }
+    }
+    _TearDownChain(&rgNodes);
+}
+BENCHMARK_TEMPLATE(BM_QueryServiceChain, CSitedProfferService)->Arg(2)->Arg(10)->Arg(50);
+BENCHMARK_TEMPLATE(BM_QueryServiceChain, CSitedWalkingProfferService)->Arg(2)->Arg(10)->Arg(50);
+BENCHMARK_TEMPLATE(BM_QueryServiceChain, CSitedAgileProfferService)->Arg(2)->Arg(10)->Arg(50);
+BENCHMARK_TEMPLATE(BM_QueryServiceChain, CSitedMemoizingProfferService)->Arg(2)->Arg(10)->Arg(50);
+BENCHMARK_TEMPLATE(BM_QueryServiceChain, CSitedInstrumentedMemoizingProfferService)->Arg(2)->Arg(10)->Arg(50);
+
+// Same, for a service nobody in the chain proffers
+template <typename TNode>
+void BM_QueryServiceChainMiss(benchmark::State &state)
+{
+    std::vector<ComPtr<TNode>> rgNodes;
+    GUID const guidService = _NewServiceId();
+    if (_Succeeded(state, _BuildChain(static_cast<UINT>(state.range(0)), &rgNodes), "SetSite"))
+    {
+        for (auto _ : state)
+        {
+            ComPtr<IServiceProvider> spService;
+            benchmark::DoNotOptimize(rgNodes.back()->QueryService(guidService, IID_PPV_ARGS(&spService)));
+        }
+    }
+    _TearDownChain(&rgNodes);
+}
+BENCHMARK_TEMPLATE(BM_QueryServiceChainMiss, CSitedProfferService)->Arg(2)->Arg(10)->Arg(50);
+BENCHMARK_TEMPLATE(BM_QueryServiceChainMiss, CSitedWalkingProfferService)->Arg(2)->Arg(10)->Arg(50);
+BENCHMARK_TEMPLATE(BM_QueryServiceChainMiss, CSitedMemoizingProfferService)->Arg(2)->Arg(10)->Arg(50);
+
+// A service proffered by the root of a state.range(0) deep chain, looked up from the leaf. By default
+// each node hands the lookup to its site's QueryService, a stack frame, a QueryInterface and a GetSite
+// per ancestor; with PSO_WALK_SITE_CHAIN SiteChainWalker goes up the chain in a loop instead.
+
+template <typename TNode>
+void BM_QueryServiceChainDepth(benchmark::State &state)
+{
+    std::vector<ComPtr<TNode>> rgNodes;
+    ComPtr<CAgileServiceProvider> spProvider = Make<CAgileServiceProvider>();
+    GUID const guidService = _NewServiceId();
+    DWORD dwCookie;
+    if (_Succeeded(state, _BuildChain(static_cast<UINT>(state.range(0)), &rgNodes), "SetSite") &&
+        _Succeeded(state, _ProfferServiceOf(rgNodes.front().Get())->ProfferService(guidService, spProvider.Get(), &dwCookie), "ProfferService"))
+    {
+        for (auto _ : state)
+        {
+            ComPtr<IServiceProvider> spService;
+            if (!_Succeeded(state, rgNodes.back()->QueryService(guidService, IID_PPV_ARGS(&spService)), "QueryService"))
+            {
+                break;
+            }
+        }
+    }
+    state.SetItemsProcessed(static_cast<int64_t>(state.iterations()) * (state.range(0) - 1));
+    _TearDownChain(&rgNodes);
+}
+BENCHMARK_TEMPLATE(BM_QueryServiceChainDepth, CSitedProfferService)->Arg(10)->Arg(100)->Arg(1000);
+BENCHMARK_TEMPLATE(BM_QueryServiceChainDepth, CSitedWalkingProfferService)->Arg(10)->Arg(100)->Arg(1000);
+
+// state.range(0) services looked up from the leaf of a 10 deep chain, proffered round robin by the
+// nodes from the root down. Either with a QueryService each or with one QueryServices for all of them.
+
+const UINT c_cBatchChainDepth = 10;
+
+template <typename TNode, bool fBatch>
+void BM_QueryServicesChain(benchmark::State &state)
+{
+    std::vector<ComPtr<TNode>> rgNodes;
+    ComPtr<CAgileServiceProvider> spProvider = Make<CAgileServiceProvider>();
+    std::vector<GUID> rgguidServices(static_cast<size_t>(state.range(0)));
+    HRESULT hr = _BuildChain(c_cBatchChainDepth, &rgNodes);
+    for (size_t idx = 0; SUCCEEDED(hr) && (idx < rgguidServices.size()); idx++)
+    {
+        DWORD dwCookie;
+        rgguidServices[idx] = _NewServiceId();
+        hr = _ProfferServiceOf(rgNodes[idx % c_cBatchChainDepth].Get())->ProfferService(rgguidServices[idx], spProvider.Get(), &dwCookie);
+    }
+
+    if (_Succeeded(state, hr, "ProfferService"))
+    {
+        std::vector<ServiceQuery> rgQueries(rgguidServices.size());
+        for (size_t idx = 0; idx < rgQueries.size(); idx++)
+        {
+            rgQueries[idx].pguidService = &rgguidServices[idx];
+            rgQueries[idx].piid = &IID_IServiceProvider;
+        }
+
+        for (auto _ : state)
+        {
+            if (fBatch)
+            {
+                if (!_Succeeded(state, rgNodes.back()->QueryServices(rgQueries.data(), static_cast<UINT>(rgQueries.size())), "QueryServices"))
+                {
+                    break;
+                }
+
+                for (auto &query : rgQueries)
+                {
+                    query.punkService->Release();
+                }
+            }
+            else
+            {
+                for (auto const &guidService : rgguidServices)
+                {
+                    ComPtr<IServiceProvider> spService;
+                    if (!_Succeeded(state, rgNodes.back()->QueryService(guidService, IID_PPV_ARGS(&spService)), "QueryService"))
+                    {
+                        return;
+                    }
+                }
+            }
+        }
+    }
+    state.SetItemsProcessed(static_cast<int64_t>(state.iterations()) * state.range(0));
+    _TearDownChain(&rgNodes);
+}
+BENCHMARK_TEMPLATE(BM_QueryServicesChain, CSitedProfferService, false)->Arg(5)->Arg(15);
+BENCHMARK_TEMPLATE(BM_QueryServicesChain, CSitedProfferService, true)->Arg(5)->Arg(15);
+BENCHMARK_TEMPLATE(BM_QueryServicesChain, CSitedWalkingProfferService, false)->Arg(5)->Arg(15);
+BENCHMARK_TEMPLATE(BM_QueryServicesChain, CSitedWalkingProfferService, true)->Arg(5)->Arg(15);
+BENCHMARK_TEMPLATE(BM_QueryServicesChain, CSitedMemoizingProfferService, false)->Arg(5)->Arg(15);
+BENCHMARK_TEMPLATE(BM_QueryServicesChain, CSitedMemoizingProfferService, true)->Arg(5)->Arg(15);
+
+// QueryService from the leaf of a chain of state.range(0) objects for a service only the root proffers
+// (fHit) or nobody does, walking the chain, following memoized routes or consulting the summary of the
+// chain. Reports the ancestors asked per lookup.
+
+template <typename TInstrumentation, ProfferServiceOptions options>
+class CChainLookupProfferService : public ProfferServiceT<TInstrumentation>
+{
+public:
+    CChainLookupProfferService() : ProfferServiceT<TInstrumentation>(AgileReferenceOptions::AGILEREFERENCE_DEFAULT, options)
+    {
+    }
+};
+
+struct ChainWalkTag {};
+struct ChainMemoizeTag {};
+struct ChainSummaryTag {};
+typedef ServiceLookupInstrumentationT<ChainWalkTag> ChainWalkInstrumentation;
+typedef ServiceLookupInstrumentationT<ChainMemoizeTag> ChainMemoizeInstrumentation;
+typedef ServiceLookupInstrumentationT<ChainSummaryTag> ChainSummaryInstrumentation;
+typedef CSitedProfferServiceT<CChainLookupProfferService<ChainWalkInstrumentation, PSO_NONE>> CChainWalkNode;
+typedef CSitedProfferServiceT<CChainLookupProfferService<ChainMemoizeInstrumentation, PSO_MEMOIZE_SITE_CHAIN>> CChainMemoizeNode;
+typedef CSitedProfferServiceT<CChainLookupProfferService<ChainSummaryInstrumentation, PSO_SUMMARIZE_SITE_CHAIN>> CChainSummaryNode;
+
+template <typename TInstrumentation>
+void _ServiceHops(_In_ REFGUID guidService, _Out_ ULONGLONG *pcQueries, _Out_ ULONGLONG *pcHops)
+{
+    ServiceLookupSnapshot snapshot;
+    TInstrumentation::Snapshot(&snapshot);
+    *pcQueries = 0;
+    *pcHops = 0;
+    for (UINT idx = 0; idx < snapshot.cServices; idx++)
+    {
+        if (snapshot.rgServices[idx].guidService == guidService)
+        {
+            for (UINT path = 0; path < SRP_COUNT; path++)
+            {
+                *pcQueries += snapshot.rgServices[idx].rgcQueries[path];
+            }
+            *pcHops = snapshot.rgServices[idx].cHops;
+        }
+    }
+}
+
+template <typename TNode, typename TInstrumentation, bool fHit>
+void BM_QueryServiceChainHops(benchmark::State &state)
+{
+    std::vector<ComPtr<TNode>> rgNodes;
+    ComPtr<CAgileServiceProvider> spProvider = Make<CAgileServiceProvider>();
+    GUID const guidService = _NewServiceId();
+    DWORD dwCookie;
+    HRESULT hr = _BuildChain(static_cast<UINT>(state.range(0)), &rgNodes);
+    if (SUCCEEDED(hr) && fHit)
+    {
+        hr = rgNodes.front()->ProfferService(guidService, spProvider.Get(), &dwCookie);
+    }
+
+    if (_Succeeded(state, hr, "ProfferService"))
+    {
+        for (auto _ : state)
+        {
+            ComPtr<IServiceProvider> spService;
+            HRESULT hrQuery = rgNodes.back()->QueryService(guidService, IID_PPV_ARGS(&spService));
+            if (fHit && !_Succeeded(state, hrQuery, "QueryService"))
+            {
+                break;
+            }
+        }
+    }
+
+    // Every ancestor the walk recurses into records its own QueryService, the sum is the length of the walk
+    ULONGLONG cQueries;
+    ULONGLONG cHops;
+    _ServiceHops<TInstrumentation>(guidService, &cQueries, &cHops);
+    state.counters["Hops"] = benchmark::Counter(static_cast<double>(cHops), benchmark::Counter::kAvgIterations);
+    _TearDownChain(&rgNodes);
+}
+BENCHMARK_TEMPLATE(BM_QueryServiceChainHops, CChainWalkNode, ChainWalkInstrumentation, false)->Arg(10)->Arg(50)->Arg(200);
+BENCHMARK_TEMPLATE(BM_QueryServiceChainHops, CChainMemoizeNode, ChainMemoizeInstrumentation, false)->Arg(10)->Arg(50)->Arg(200);
+BENCHMARK_TEMPLATE(BM_QueryServiceChainHops, CChainSummaryNode, ChainSummaryInstrumentation, false)->Arg(10)->Arg(50)->Arg(200);
+BENCHMARK_TEMPLATE(BM_QueryServiceChainHops, CChainWalkNode, ChainWalkInstrumentation, true)->Arg(10)->Arg(50)->Arg(200);
+BENCHMARK_TEMPLATE(BM_QueryServiceChainHops, CChainMemoizeNode, ChainMemoizeInstrumentation, true)->Arg(10)->Arg(50)->Arg(200);
+BENCHMARK_TEMPLATE(BM_QueryServiceChainHops, CChainSummaryNode, ChainSummaryInstrumentation, true)->Arg(10)->Arg(50)->Arg(200);
+
+// Every object but the leaf lives in another apartment, so the walk crosses into it once
+template <typename TNode>
+void BM_QueryServiceChainCrossApartment(benchmark::State &state)
+{
+    std::vector<ComPtr<TNode>> rgNodes;
+    ComPtr<CAgileServiceProvider> spProvider = Make<CAgileServiceProvider>();
+    GUID const guidService = _NewServiceId();
+    ComPtr<IUnknown> spParentProxy;
+    HRESULT hr = _RunInNewSta([&](ComPtr<IUnknown> *pspUnknown)
+    {
+        DWORD dwCookie;
+        HRESULT hr = _BuildChain(static_cast<UINT>(state.range(0)) - 1, &rgNodes);
+        if (SUCCEEDED(hr))
+        {
+            hr = _ProfferServiceOf(rgNodes.front().Get())->ProfferService(guidService, spProvider.Get(), &dwCookie);
+        }
+
+        if (SUCCEEDED(hr))
+        {
+            *pspUnknown = rgNodes.back()->CastToUnknown();
+        }
+        return hr;
+    }, &spParentProxy);
+
+    ComPtr<TNode> spLeaf = Make<TNode>();
+    if (_Succeeded(state, hr, "Building the chain") &&
+        _Succeeded(state, spLeaf->SetSite(spParentProxy.Get()), "SetSite"))
+    {
+        for (auto _ : state)
+        {
+            ComPtr<IServiceProvider> spService;
+            if (!_Succeeded(state, spLeaf->QueryService(guidService, IID_PPV_ARGS(&spService)), "QueryService"))
+            {
+                break;
+            }
+        }
+    }
+    spLeaf->SetSite(nullptr);
+    _TearDownChain(&rgNodes);
+}
+BENCHMARK_TEMPLATE(BM_QueryServiceChainCrossApartment, CSitedProfferService)->Arg(2)->Arg(10);
+BENCHMARK_TEMPLATE(BM_QueryServiceChainCrossApartment, CSitedWalkingProfferService)->Arg(2)->Arg(10);
+BENCHMARK_TEMPLATE(BM_QueryServiceChainCrossApartment, CSitedMemoizingProfferService)->Arg(2)->Arg(10);
+
+// A pool of worker threads looking up c_cWorkerLookups services through one agile broker, where
+// state.range(0) percent of the services are answered by providers in STAs that take c_usSlowProvider
+// to get to the call. Each worker either waits for every QueryService in turn or issues all of its
+// lookups with QueryServiceAsync and then waits for them to complete. The slow lookups still block a
+// pool thread each, this measures what the offload costs rather than a speedup.
+
+const UINT c_cWorkerLookups = 100;
+const UINT c_usSlowProvider = 200;
+
+class CSlowServiceProvider : public RuntimeClass<RuntimeClassFlags<RuntimeClassType::ClassicCom>, IServiceProvider>
+{
+public:
+    IFACEMETHODIMP QueryService(_In_ REFGUID /*guidService*/, _In_ REFIID riid, _COM_Outptr_ void **ppv)
+    {
+        std::this_thread::sleep_for(std::chrono::microseconds(c_usSlowProvider));
+        return QueryInterface(riid, ppv);
+    }
+};
+
+// Counts the lookups of one worker still in flight
+class CPendingLookups
+{
+public:
+    explicit CPendingLookups(UINT cPending) : _cPending(cPending), _fFailed(false)
+    {
+    }
+
+    void Complete(HRESULT hr)
+    {
+        std::lock_guard<std::mutex> lock(_mutex);
+        _fFailed = _fFailed || FAILED(hr);
+        if (--_cPending == 0)
+        {
+            _condition.notify_one();
+        }
+    }
+
+    // Returns whether every lookup succeeded
+    bool Wait()
+    {
+        std::unique_lock<std::mutex> lock(_mutex);
+        _condition.wait(lock, [this]() { return _cPending == 0; });
+        return !_fFailed;
+    }
+
+private:
+    std::mutex _mutex;
+    std::condition_variable _condition;
+    UINT _cPending;
+    bool _fFailed;
+};
+
+template <bool fAsync>
+void BM_QueryServiceWorkers(benchmark::State &state)
+{
+    typedef CAgileSitedProfferServiceT<AgileProfferService> TNode;
+    static TNode *s_pNode;
+    static std::vector<GUID> *s_prgguidServices;
+
+    // Every thread waits for this setup at the start of the loop
+    ComPtr<TNode> spNode;
+    std::vector<GUID> rgguidServices;
+    if (state.thread_index() == 0)
+    {
+        spNode = Make<TNode>();
+        ComPtr<CAgileServiceProvider> spFastProvider = Make<CAgileServiceProvider>();
+        UINT const cSlow = static_cast<UINT>(state.range(0)) * c_cWorkerLookups / 100;
+        rgguidServices.resize(c_cWorkerLookups);
+        for (UINT idx = 0; idx < c_cWorkerLookups; idx++)
+        {
+            // Spread the slow services out, every tenth one first
+            bool const fSlow = ((idx % 10) * 10 + idx / 10) < cSlow;
+            ComPtr<IServiceProvider> spProvider = spFastProvider;
+            if (fSlow)
+            {
+                ComPtr<IUnknown> spProxy;
+                _Succeeded(state, _RunInNewSta([](ComPtr<IUnknown> *pspUnknown)
+                {
+                    *pspUnknown = Make<CSlowServiceProvider>();
+                    return S_OK;
+                }, &spProxy), "Make") && _Succeeded(state, spProxy.As(&spProvider), "QueryInterface");
+            }
+
+            DWORD dwCookie;
+            rgguidServices[idx] = _NewServiceId();
+            _Succeeded(state, spNode->ProfferService(rgguidServices[idx], spProvider.Get(), &dwCookie), "ProfferService");
+        }
+        s_pNode = spNode.Get();
+        s_prgguidServices = &rgguidServices;
+    }
+
+    for (auto _ : state)
+    {
+        if (fAsync)
+        {
+            CPendingLookups pending(c_cWorkerLookups);
+            for (auto const &guidService : *s_prgguidServices)
+            {
+                if (!_Succeeded(state, QueryServiceAsync(s_pNode, guidService, IID_IServiceProvider,
+                    [&pending](HRESULT hr, _In_opt_ IUnknown * /*punkService*/) { pending.Complete(hr); }), "QueryServiceAsync"))
+                {
+                    pending.Complete(E_FAIL);
+                }
+            }
+
+            if (!_Succeeded(state, pending.Wait() ? S_OK : E_FAIL, "QueryServiceAsync completion"))
+            {
+                break;
+            }
+        }
+        else
+        {
+            for (auto const &guidService : *s_prgguidServices)
+            {
+                ComPtr<IServiceProvider> spService;
+                if (!_Succeeded(state, s_pNode->QueryService(guidService, IID_PPV_ARGS(&spService)), "QueryService"))
+                {
+                    return;
+                }
+            }
+        }
+    }
+    state.SetItemsProcessed(static_cast<int64_t>(state.iterations()) * c_cWorkerLookups);
+}
+BENCHMARK_TEMPLATE(BM_QueryServiceWorkers, false)->Arg(10)->Arg(20)->Arg(30)->Threads(4)->UseRealTime();
+BENCHMARK_TEMPLATE(BM_QueryServiceWorkers, true)->Arg(10)->Arg(20)->Arg(30)->Threads(4)->UseRealTime();
+
+// A service proffered by the root of a state.range(0) deep chain (1 being the object itself) used from
+// the leaf once per iteration, looked up with a QueryService every time or held in a ServiceRef
+
+template <bool fServiceRef>
+void BM_ServiceRefUse(benchmark::State &state)
+{
+    std::vector<ComPtr<CSitedProfferService>> rgNodes;
+    ComPtr<CAgileServiceProvider> spProvider = Make<CAgileServiceProvider>();
+    GUID const guidService = _NewServiceId();
+    DWORD dwCookie;
+    if (_Succeeded(state, _BuildChain(static_cast<UINT>(state.range(0)), &rgNodes), "SetSite") &&
+        _Succeeded(state, _ProfferServiceOf(rgNodes.front().Get())->ProfferService(guidService, spProvider.Get(), &dwCookie), "ProfferService"))
+    {
+        ServiceRef<IServiceProvider> serviceRef;
+        serviceRef.Bind(rgNodes.back().Get(), guidService);
+        for (auto _ : state)
+        {
+            if (fServiceRef)
+            {
+                IServiceProvider *pService;
+                if (!_Succeeded(state, serviceRef.Get(&pService), "ServiceRef::Get"))
+                {
+                    break;
+                }
+                benchmark::DoNotOptimize(pService);
+            }
+            else
+            {
+                ComPtr<IServiceProvider> spService;
+                if (!_Succeeded(state, rgNodes.back()->QueryService(guidService, IID_PPV_ARGS(&spService)), "QueryService"))
+                {
+                    break;
+                }
+            }
+        }
+    }
+    _TearDownChain(&rgNodes);
+}
+BENCHMARK_TEMPLATE(BM_ServiceRefUse, false)->Arg(1)->Arg(10);
+BENCHMARK_TEMPLATE(BM_ServiceRefUse, true)->Arg(1)->Arg(10);
+
+// Removes --<pszName>=<value> from the command line, returns whether it was there
+bool _TakeFlag(int *pargc, char **argv, const char *pszName, long long *pValue)
+{
+    size_t const cchName = strlen(pszName);
+    for (int idx = 1; idx < *pargc; idx++)
+    {
+        if ((strncmp(argv[idx], "--", 2) == 0) && (strncmp(argv[idx] + 2, pszName, cchName) == 0) && (argv[idx][2 + cchName] == '='))
+        {
+            *pValue = strtoll(argv[idx] + 3 + cchName, nullptr, 10);
+            for (int idxMove = idx; idxMove < *pargc - 1; idxMove++)
+            {
+                argv[idxMove] = argv[idxMove + 1];
+            }
+            (*pargc)--;
+            return true;
+        }
+    }
+    return false;
+}
+
+} // namespace
+
+int main(int argc, char **argv)
+{
+    auto &cost = PortableCom::CurrentMarshalingCost();
+    long long llMarshal = cost.llMarshalNanoseconds;
+    long long llUnmarshal = cost.llUnmarshalNanoseconds;
+    long long llCall = cost.llCallNanoseconds;
+    _TakeFlag(&argc, argv, "marshal_ns", &llMarshal);
+    _TakeFlag(&argc, argv, "unmarshal_ns", &llUnmarshal);
+    _TakeFlag(&argc, argv, "call_ns", &llCall);
+    PortableCom::SetMarshalingCost(std::chrono::nanoseconds(llMarshal), std::chrono::nanoseconds(llUnmarshal), std::chrono::nanoseconds(llCall));
+
+    benchmark::Initialize(&argc, argv);
+    if (benchmark::ReportUnrecognizedArguments(argc, argv))
+    {
+        return 1;
+    }
+    benchmark::RunSpecifiedBenchmarks();
+    benchmark::Shutdown();
+    return g_fFailed ? 1 : 0;
+}
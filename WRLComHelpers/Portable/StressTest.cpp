@@ -0,0 +1,496 @@
+// Contention and churn torture test of the agile ProfferService family and ObjectWithSite, built against
+// the COM stand-in in Portable/include. Configure with -DWRLCOMHELPERS_TSAN=ON to run it under
+// ThreadSanitizer.
+//
+// --threads=<n> threads hammer a single sited host object with a mix of operations, --ops=<n> each:
+//
+//  - QueryService for one of the churned services, or for a service only the host's site answers
+//  - ProfferService or RevokeService of one of the thread's own services, in turn
+//  - SetSite to a new site
+//
+// --read_percent=<n> of the operations are lookups, --site_percent=<n> of the rest are SetSite swaps.
+// Every host flavor is run unless --host=<name> picks one. Reports the throughput and the p50, p99 and
+// p999 latencies of each operation, and counts these violations:
+//
+//  - a lookup that started after RevokeService returned got the revoked provider, or one proffered
+//    for another service
+//  - a lookup that started after SetSite returned got a service from the site it replaced
+//  - providers or sites still alive once the host and everything the test held were released
+//
+// Exits with a failure on any violation or failed COM call.
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <mutex>
+#include <random>
+#include <thread>
+#include <vector>
+#include "ObjectWithSiteImpl.h"
+#include "ProfferServiceImpl.h"
+
+using namespace Microsoft::WRL;
+using namespace Windows::Internal::WRL;
+
+namespace
+{
+
+struct StressConfig
+{
+    UINT cThreads;
+    UINT cOpsPerThread;
+    UINT uReadPercent;
+    UINT uSitePercent;
+    const char *pszHost;
+};
+
+const UINT c_cServicesPerThread = 8;
+
+// Orders the events the violations are judged by: a lookup reads it before it starts, RevokeService and
+// SetSite bump it after they return
+std::atomic<LONGLONG> g_llClock(0);
+std::atomic<LONG> g_cLiveObjects(0);
+std::atomic<LONG> g_cViolations(0);
+std::atomic<LONG> g_cFailedCalls(0);
+
+const GUID c_guidSiteService = { 0x2b6f5c8e, 0x61d4, 0x4f0a, { 0x8e, 0x19, 0x73, 0xc2, 0x0b, 0x5d, 0x94, 0xa1 } };
+
+void _Violation(const char *pszWhat)
+{
+    if (g_cViolations.fetch_add(1) < 10)
+    {
+        fprintf(stderr, "violation: %s\n", pszWhat);
+    }
+}
+
+bool _Check(HRESULT hr, const char *pszCall)
+{
+    if (FAILED(hr))
+    {
+        if (g_cFailedCalls.fetch_add(1) < 10)
+        {
+            fprintf(stderr, "%s failed with 0x%08x\n", pszCall, static_cast<unsigned int>(hr));
+        }
+        return false;
+    }
+    return true;
+}
+
+// Counted, so that leaks show, and stamped when it stops being the current one
+class CStressObject
+{
+public:
+    CStressObject() : llRetiredAt(0)
+    {
+        g_cLiveObjects.fetch_add(1);
+    }
+
+    ~CStressObject()
+    {
+        g_cLiveObjects.fetch_sub(1);
+    }
+
+    void Retire()
+    {
+        llRetiredAt.store(g_llClock.fetch_add(1) + 1);
+    }
+
+    // Whether it was retired before a lookup that started at llStart
+    bool RetiredBefore(LONGLONG llStart) const
+    {
+        LONGLONG const llRetired = llRetiredAt.load();
+        return (llRetired != 0) && (llRetired <= llStart);
+    }
+
+private:
+    std::atomic<LONGLONG> llRetiredAt;
+};
+
+class CStressProvider : public RuntimeClass<RuntimeClassFlags<RuntimeClassType::ClassicCom>, FtmBase, IServiceProvider>,
+                        public CStressObject
+{
+public:
+    explicit CStressProvider(REFGUID guidService) : guidService(guidService)
+    {
+    }
+
+    IFACEMETHODIMP QueryService(_In_ REFGUID /*guidService*/, _In_ REFIID riid, _COM_Outptr_ void **ppv)
+    {
+        return QueryInterface(riid, ppv);
+    }
+
+    GUID const guidService;
+};
+
+class CStressSite : public RuntimeClass<
+    RuntimeClassFlags<RuntimeClassType::ClassicCom>,
+    FtmBase,
+    Implements<RuntimeClassFlags<RuntimeClassType::ClassicCom>,
+    Windows::Internal::WRL::ObjectWithSite,
+    AgileProfferService>>,
+                    public CStressObject
+{
+protected:
+    HRESULT v_QueryService(_In_ REFGUID guidService, _In_ REFIID riid, _COM_Outptr_ void **ppv) override
+    {
+        *ppv = nullptr;
+        return (guidService == c_guidSiteService) ? QueryInterface(riid, ppv) : E_NOTIMPL;
+    }
+
+    void v_SummarizeServices(_Inout_ Windows::Internal::WRL::Details::ServiceSummary *pSummary) override
+    {
+        pSummary->Add(c_guidSiteService);
+    }
+};
+
+template <typename TObjectWithSite, typename TProfferService>
+class CStressHost : public RuntimeClass<
+    RuntimeClassFlags<RuntimeClassType::ClassicCom>,
+    FtmBase,
+    Implements<RuntimeClassFlags<RuntimeClassType::ClassicCom>,
+    TObjectWithSite,
+    TProfferService>>
+{
+};
+
+class CCachingObjectWithSite : public Windows::Internal::WRL::ObjectWithSite
+{
+public:
+    CCachingObjectWithSite() : ObjectWithSite(OWSO_CACHE_RESOLVED_SITE)
+    {
+    }
+};
+
+class CCachingAgileProfferService : public AgileProfferService
+{
+public:
+    CCachingAgileProfferService() : AgileProfferService(AgileReferenceOptions::AGILEREFERENCE_DEFAULT, PSO_CACHE_RESOLVED_PROVIDERS | PSO_MEMOIZE_SITE_CHAIN)
+    {
+    }
+};
+
+class CSummarizingSnapshotProfferService : public SnapshotAgileProfferService
+{
+public:
+    CSummarizingSnapshotProfferService() : SnapshotAgileProfferService(AgileReferenceOptions::AGILEREFERENCE_DEFAULT, PSO_SUMMARIZE_SITE_CHAIN)
+    {
+    }
+};
+
+typedef CStressHost<Windows::Internal::WRL::ObjectWithSite, AgileProfferService> CAgileHost;
+typedef CStressHost<CCachingObjectWithSite, CCachingAgileProfferService> CCachingHost;
+typedef CStressHost<LockFreeObjectWithSite, CSummarizingSnapshotProfferService> CLockFreeHost;
+
+enum StressOp
+{
+    SO_QUERY_SERVICE,
+    SO_PROFFER_SERVICE,
+    SO_REVOKE_SERVICE,
+    SO_SET_SITE,
+    SO_COUNT
+};
+
+const char * const c_rgpszOps[SO_COUNT] = { "QueryService", "ProfferService", "RevokeService", "SetSite" };
+
+// Latencies in nanoseconds, per operation
+struct LatencySamples
+{
+    std::vector<ULONG> rgOps[SO_COUNT];
+};
+
+struct OwnedService
+{
+    GUID guidService;
+    DWORD dwCookie;
+    ComPtr<CStressProvider> spProvider;     // nullptr while revoked
+};
+
+template <typename THost>
+class CStressRun
+{
+public:
+    CStressRun(StressConfig const &config) : _config(config), _rgServices(config.cThreads * c_cServicesPerThread), _fStart(false)
+    {
+    }
+
+    bool Run(_Out_ double *pdblSeconds, _Inout_ LatencySamples *pSamples)
+    {
+        _spHost = Make<THost>();
+        _spSite = Make<CStressSite>();
+        bool fSucceeded = _spHost && _spSite && _Check(_spHost->SetSite(_spSite->CastToUnknown()), "SetSite");
+        for (UINT idx = 0; fSucceeded && (idx < _rgServices.size()); idx++)
+        {
+            OwnedService &service = _rgServices[idx];
+            fSucceeded = _Check(CoCreateGuid(&service.guidService), "CoCreateGuid");
+            if (fSucceeded && ((idx % 2) == 0))
+            {
+                service.spProvider = Make<CStressProvider>(service.guidService);
+                fSucceeded = _Check(_spHost->ProfferService(service.guidService, service.spProvider.Get(), &service.dwCookie), "ProfferService");
+            }
+        }
+
+        std::vector<LatencySamples> rgThreadSamples(_config.cThreads);
+        std::vector<std::thread> rgThreads;
+        for (UINT idx = 0; fSucceeded && (idx < _config.cThreads); idx++)
+        {
+            rgThreads.emplace_back([this, idx, &rgThreadSamples]()
+            {
+                _Worker(idx, &rgThreadSamples[idx]);
+            });
+        }
+
+        auto const start = std::chrono::steady_clock::now();
+        _fStart.store(true);
+        for (auto &thread : rgThreads)
+        {
+            thread.join();
+        }
+        *pdblSeconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+
+        for (auto const &samples : rgThreadSamples)
+        {
+            for (UINT op = 0; op < SO_COUNT; op++)
+            {
+                pSamples->rgOps[op].insert(pSamples->rgOps[op].end(), samples.rgOps[op].begin(), samples.rgOps[op].end());
+            }
+        }
+
+        // Tear everything down, after which nothing of the test may be alive
+        for (auto &service : _rgServices)
+        {
+            if (service.spProvider)
+            {
+                _Check(_spHost->RevokeService(service.dwCookie), "RevokeService");
+                service.spProvider.Reset();
+            }
+        }
+
+        if (_spHost)
+        {
+            _Check(_spHost->SetSite(nullptr), "SetSite");
+        }
+        _spHost.Reset();
+        _spSite.Reset();
+        return fSucceeded;
+    }
+
+private:
+    void _Worker(UINT idxThread, _Inout_ LatencySamples *pSamples)
+    {
+        CoInitializeEx(nullptr, COINIT_MULTITHREADED);
+        std::minstd_rand random(idxThread + 1);
+        for (auto &samples : pSamples->rgOps)
+        {
+            samples.reserve(_config.cOpsPerThread);
+        }
+
+        while (!_fStart.load())
+        {
+            std::this_thread::yield();
+        }
+
+        UINT idxNextOwned = 0;
+        for (UINT idxOp = 0; idxOp < _config.cOpsPerThread; idxOp++)
+        {
+            UINT const uRoll = static_cast<UINT>(random() % 100);
+            if (uRoll < _config.uReadPercent)
+            {
+                _QueryService(random, pSamples);
+            }
+            else if (((uRoll - _config.uReadPercent) * 100) < (_config.uSitePercent * (100 - _config.uReadPercent)))
+            {
+                _SetSite(pSamples);
+            }
+            else
+            {
+                _Churn(&_rgServices[idxThread * c_cServicesPerThread + (idxNextOwned++ % c_cServicesPerThread)], pSamples);
+            }
+        }
+        CoUninitialize();
+    }
+
+    void _QueryService(_Inout_ std::minstd_rand &random, _Inout_ LatencySamples *pSamples)
+    {
+        // One lookup in eight goes to the site
+        UINT const idxService = static_cast<UINT>(random() % (_rgServices.size() + _rgServices.size() / 8));
+        bool const fSiteService = (idxService >= _rgServices.size());
+        REFGUID guidService = fSiteService ? c_guidSiteService : _rgServices[idxService].guidService;
+
+        LONGLONG const llStart = g_llClock.load();
+        ComPtr<IServiceProvider> spService;
+        auto const start = std::chrono::steady_clock::now();
+        HRESULT const hr = _spHost->QueryService(guidService, IID_PPV_ARGS(&spService));
+        _Record(SO_QUERY_SERVICE, start, pSamples);
+
+        if (fSiteService)
+        {
+            // There always is a site
+            if (_Check(hr, "QueryService") && static_cast<CStressSite *>(static_cast<AgileProfferService *>(spService.Get()))->RetiredBefore(llStart))
+            {
+                _Violation("a lookup got a service from a replaced site");
+            }
+        }
+        else if (SUCCEEDED(hr))
+        {
+            CStressProvider *pProvider = static_cast<CStressProvider *>(spService.Get());
+            if (pProvider->guidService != guidService)
+            {
+                _Violation("a lookup got the provider of another service");
+            }
+            else if (pProvider->RetiredBefore(llStart))
+            {
+                _Violation("a lookup got a revoked provider");
+            }
+        }
+    }
+
+    void _Churn(_Inout_ OwnedService *pService, _Inout_ LatencySamples *pSamples)
+    {
+        if (pService->spProvider)
+        {
+            auto const start = std::chrono::steady_clock::now();
+            HRESULT const hr = _spHost->RevokeService(pService->dwCookie);
+            _Record(SO_REVOKE_SERVICE, start, pSamples);
+            if (_Check(hr, "RevokeService"))
+            {
+                pService->spProvider->Retire();
+                pService->spProvider.Reset();
+            }
+        }
+        else
+        {
+            ComPtr<CStressProvider> spProvider = Make<CStressProvider>(pService->guidService);
+            auto const start = std::chrono::steady_clock::now();
+            HRESULT const hr = _spHost->ProfferService(pService->guidService, spProvider.Get(), &pService->dwCookie);
+            _Record(SO_PROFFER_SERVICE, start, pSamples);
+            if (_Check(hr, "ProfferService"))
+            {
+                pService->spProvider = spProvider;
+            }
+        }
+    }
+
+    // Swaps are serialized so that it is known which site each one replaced
+    void _SetSite(_Inout_ LatencySamples *pSamples)
+    {
+        ComPtr<CStressSite> spSite = Make<CStressSite>();
+        std::lock_guard<std::mutex> lock(_siteLock);
+        auto const start = std::chrono::steady_clock::now();
+        HRESULT const hr = _spHost->SetSite(spSite->CastToUnknown());
+        _Record(SO_SET_SITE, start, pSamples);
+        if (_Check(hr, "SetSite"))
+        {
+            _spSite->Retire();
+            _spSite = spSite;
+        }
+    }
+
+    static void _Record(StressOp op, std::chrono::steady_clock::time_point start, _Inout_ LatencySamples *pSamples)
+    {
+        auto const ns = std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now() - start).count();
+        pSamples->rgOps[op].push_back(static_cast<ULONG>(std::min<long long>(ns, 0xFFFFFFFFLL)));
+    }
+
+    StressConfig const &_config;
+    ComPtr<THost> _spHost;
+    ComPtr<CStressSite> _spSite;            // guarded by _siteLock once the workers run
+    std::mutex _siteLock;
+    std::vector<OwnedService> _rgServices;  // c_cServicesPerThread per thread, each only churned by its own
+    std::atomic<bool> _fStart;
+};
+
+ULONG _Percentile(std::vector<ULONG> const &rgSorted, double dblPercentile)
+{
+    return rgSorted.empty() ? 0 : rgSorted[static_cast<size_t>(dblPercentile * (rgSorted.size() - 1))];
+}
+
+template <typename THost>
+void _RunHost(const char *pszHost, StressConfig const &config)
+{
+    if ((config.pszHost != nullptr) && (strcmp(config.pszHost, pszHost) != 0))
+    {
+        return;
+    }
+
+    LONG const cViolationsBefore = g_cViolations.load();
+    LatencySamples samples;
+    double dblSeconds = 0;
+    CStressRun<THost> run(config);
+    run.Run(&dblSeconds, &samples);
+
+    size_t cOps = 0;
+    printf("%s: %u threads, %u%% reads, %u%% of writes SetSite\n", pszHost, config.cThreads, config.uReadPercent, config.uSitePercent);
+    printf("  %-16s %10s %12s %10s %10s %10s\n", "operation", "count", "ops/s", "p50 ns", "p99 ns", "p999 ns");
+    for (UINT op = 0; op < SO_COUNT; op++)
+    {
+        std::vector<ULONG> &rgSorted = samples.rgOps[op];
+        std::sort(rgSorted.begin(), rgSorted.end());
+        cOps += rgSorted.size();
+        printf("  %-16s %10zu %12.0f %10lu %10lu %10lu\n", c_rgpszOps[op], rgSorted.size(), rgSorted.size() / dblSeconds,
+               static_cast<unsigned long>(_Percentile(rgSorted, 0.5)), static_cast<unsigned long>(_Percentile(rgSorted, 0.99)),
+               static_cast<unsigned long>(_Percentile(rgSorted, 0.999)));
+    }
+
+    LONG const cLive = g_cLiveObjects.load();
+    if (cLive != 0)
+    {
+        _Violation("providers or sites leaked");
+        g_cLiveObjects.store(0);
+    }
+    printf("  %-16s %10zu %12.0f\n", "all", cOps, cOps / dblSeconds);
+    printf("  violations: %ld, leaked objects: %ld\n\n", static_cast<long>(g_cViolations.load() - cViolationsBefore), static_cast<long>(cLive));
+}
+
+// Removes --<pszName>=<value> from the command line, returns whether it was there
+bool _TakeFlag(int *pargc, char **argv, const char *pszName, const char **ppszValue)
+{
+    size_t const cchName = strlen(pszName);
+    for (int idx = 1; idx < *pargc; idx++)
+    {
+        if ((strncmp(argv[idx], "--", 2) == 0) && (strncmp(argv[idx] + 2, pszName, cchName) == 0) && (argv[idx][2 + cchName] == '='))
+        {
+            *ppszValue = argv[idx] + 3 + cchName;
+            for (int idxMove = idx; idxMove < *pargc - 1; idxMove++)
+            {
+                argv[idxMove] = argv[idxMove + 1];
+            }
+            (*pargc)--;
+            return true;
+        }
+    }
+    return false;
+}
+
+void _TakeFlag(int *pargc, char **argv, const char *pszName, UINT uMax, _Inout_ UINT *puValue)
+{
+    const char *pszValue;
+    if (_TakeFlag(pargc, argv, pszName, &pszValue))
+    {
+        *puValue = std::min(static_cast<UINT>(strtoul(pszValue, nullptr, 10)), uMax);
+    }
+}
+
+} // namespace
+
+int main(int argc, char **argv)
+{
+    StressConfig config = { 4, 20000, 90, 20, nullptr };
+    _TakeFlag(&argc, argv, "threads", 256, &config.cThreads);
+    _TakeFlag(&argc, argv, "ops", 100000000, &config.cOpsPerThread);
+    _TakeFlag(&argc, argv, "read_percent", 100, &config.uReadPercent);
+    _TakeFlag(&argc, argv, "site_percent", 100, &config.uSitePercent);
+    _TakeFlag(&argc, argv, "host", &config.pszHost);
+    if ((argc > 1) || (config.cThreads == 0))
+    {
+        fprintf(stderr, "usage: %s [--threads=<n>] [--ops=<n>] [--read_percent=<n>] [--site_percent=<n>] [--host=agile|caching|lockfree]\n", argv[0]);
+        return 1;
+    }
+
+    _RunHost<CAgileHost>("agile", config);
+    _RunHost<CCachingHost>("caching", config);
+    _RunHost<CLockFreeHost>("lockfree", config);
+    return ((g_cViolations.load() == 0) && (g_cFailedCalls.load() == 0)) ? 0 : 1;
+}
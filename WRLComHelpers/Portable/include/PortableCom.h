@@ -0,0 +1,1936 @@
+#pragma once
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <cstdint>
+#include <cstring>
+#include <deque>
+#include <mutex>
+#include <new>
+#include <random>
+#include <shared_mutex>
+#include <thread>
+#include <type_traits>
+#include <vector>
+#include <typeinfo>
+#include <sched.h>
+
+// A minimal stand-in for the parts of Win32, COM and WRL that the helpers in this repository use, so
+// that they can be built, tested and profiled with a non Microsoft toolchain.
+//
+// This is not COM. There is no marshaling and no message pump; every call runs on the calling thread.
+// What it does model is the part that matters for the helpers' behavior and performance:
+//
+//  - Apartments. CoInitializeEx puts a thread in the MTA or in a new STA of its own, a thread that
+//    never called it is in the implicit MTA. CoGetContextToken identifies the current apartment.
+//  - Agile references. RoGetAgileReference remembers the apartment it was created in and whether the
+//    object is agile (implements IAgileObject, as FtmBase does). Resolving a non agile object from
+//    another apartment costs the simulated unmarshaling time and returns a proxy. The object is
+//    "marshaled" once, when the reference is created (AGILEREFERENCE_DEFAULT) or first resolved
+//    elsewhere (AGILEREFERENCE_DELAYEDMARSHAL). Releasing a marshaled reference outside of the object's
+//    apartment costs the simulated call time, for releasing the marshaled data there.
+//  - Proxies, for IServiceProvider, IObjectWithSite and IProfferService only. A call through one costs
+//    the simulated call time and runs as if in the object's apartment, interfaces passed in or out are
+//    marshaled the same way. Other interfaces have no proxy/stub, so QueryInterface fails for them.
+//    The last Release of a proxy costs the call time as well, for releasing the object behind it.
+//    All three costs are set with PortableCom::SetMarshalingCost.
+//  - Object contexts. CoGetObjectContext returns one for the current apartment, whose ContextCallback
+//    runs the callback as if in that apartment, at the call cost when called from another one.
+//  - WRL's ComPtr, Implements, RuntimeClass, FtmBase, Make and Wrappers::SRWLock, the latter mapped
+//    to std::shared_mutex.
+//  - TrySubmitThreadpoolCallback, on a process wide pool that adds a thread whenever work is queued
+//    and no thread is idle, which is about what the Windows pool does for callbacks that block.
+//
+// Only what the helpers and the benchmarks use is here. Interfaces not known to this file get an IID
+// derived from their type name, which is stable within a process and that's all __uuidof is used for.
+
+// SAL annotations
+#define _In_
+#define _In_opt_
+#define _In_reads_(x)
+#define _In_reads_opt_(x)
+#define _Inout_
+#define _Inout_opt_
+#define _Inout_updates_(x)
+#define _Out_
+#define _Out_opt_
+#define _Out_writes_(x)
+#define _Out_writes_opt_(x)
+#define _Outptr_
+#define _Outptr_opt_
+#define _Outptr_result_maybenull_
+#define _Outptr_opt_result_maybenull_
+#define _COM_Outptr_
+#define _COM_Outptr_opt_
+#define _COM_Outptr_result_maybenull_
+#define _Guarded_by_(x)
+#define _Requires_lock_held_(x)
+#define _Ret_maybenull_
+
+// Basic types, with the widths they have on Windows
+typedef int32_t LONG;
+typedef uint32_t ULONG;
+typedef uint32_t DWORD;
+typedef uint32_t UINT32;
+typedef unsigned int UINT;
+typedef uint16_t WORD;
+typedef uint8_t BYTE;
+typedef int BOOL;
+typedef int64_t LONGLONG;
+typedef int64_t LONG64;
+typedef uint64_t ULONGLONG;
+typedef uintptr_t ULONG_PTR;
+typedef void *PVOID;
+typedef int32_t HRESULT;
+
+#define TRUE 1
+#define FALSE 0
+#define MAXWORD 0xffff
+#define MAXUINT ((UINT)~((UINT)0))
+#define LOWORD(l) ((WORD)(((ULONG_PTR)(l)) & 0xffff))
+#define HIWORD(l) ((WORD)((((ULONG_PTR)(l)) >> 16) & 0xffff))
+#define ARRAYSIZE(a) (sizeof(a) / sizeof((a)[0]))
+#define ZeroMemory(p, cb) memset((p), 0, (cb))
+#define CopyMemory(pDest, pSource, cb) memcpy((pDest), (pSource), (cb))
+
+#define DECLSPEC_CACHEALIGN __attribute__((aligned(64)))
+#define STDMETHODCALLTYPE
+#define CALLBACK
+#define WINAPI
+#define IFACEMETHODIMP HRESULT STDMETHODCALLTYPE
+#define IFACEMETHODIMP_(type) type STDMETHODCALLTYPE
+#define MIDL_INTERFACE(x) struct
+
+#define DEFINE_ENUM_FLAG_OPERATORS(ENUMTYPE) \
+    inline ENUMTYPE operator|(ENUMTYPE a, ENUMTYPE b) { return ENUMTYPE(((std::underlying_type<ENUMTYPE>::type)a) | ((std::underlying_type<ENUMTYPE>::type)b)); } \
+    inline ENUMTYPE &operator|=(ENUMTYPE &a, ENUMTYPE b) { return a = a | b; } \
+    inline ENUMTYPE operator&(ENUMTYPE a, ENUMTYPE b) { return ENUMTYPE(((std::underlying_type<ENUMTYPE>::type)a) & ((std::underlying_type<ENUMTYPE>::type)b)); } \
+    inline ENUMTYPE &operator&=(ENUMTYPE &a, ENUMTYPE b) { return a = a & b; } \
+    inline ENUMTYPE operator~(ENUMTYPE a) { return ENUMTYPE(~((std::underlying_type<ENUMTYPE>::type)a)); } \
+    inline ENUMTYPE operator^(ENUMTYPE a, ENUMTYPE b) { return ENUMTYPE(((std::underlying_type<ENUMTYPE>::type)a) ^ ((std::underlying_type<ENUMTYPE>::type)b)); } \
+    inline ENUMTYPE &operator^=(ENUMTYPE &a, ENUMTYPE b) { return a = a ^ b; }
+
+// HRESULTs
+#define SUCCEEDED(hr) (((HRESULT)(hr)) >= 0)
+#define FAILED(hr) (((HRESULT)(hr)) < 0)
+#define S_OK ((HRESULT)0)
+#define S_FALSE ((HRESULT)1)
+#define E_NOTIMPL ((HRESULT)0x80004001)
+#define E_NOINTERFACE ((HRESULT)0x80004002)
+#define E_POINTER ((HRESULT)0x80004003)
+#define E_ABORT ((HRESULT)0x80004004)
+#define E_FAIL ((HRESULT)0x80004005)
+#define E_BOUNDS ((HRESULT)0x8000000B)
+#define E_UNEXPECTED ((HRESULT)0x8000FFFF)
+#define E_OUTOFMEMORY ((HRESULT)0x8007000E)
+#define E_INVALIDARG ((HRESULT)0x80070057)
+#define RPC_E_CHANGED_MODE ((HRESULT)0x80010106)
+#define CO_E_NOTINITIALIZED ((HRESULT)0x800401F0)
+
+#define ERROR_CIRCULAR_DEPENDENCY 1059L
+#define ERROR_NOT_FOUND 1168L
+#define ERROR_ALREADY_REGISTERED 1242L
+#define ERROR_NO_SYSTEM_RESOURCES 1450L
+#define ERROR_INVALID_STATE 5023L
+
+inline HRESULT HRESULT_FROM_WIN32(long x)
+{
+    return (x <= 0) ? (HRESULT)x : (HRESULT)((((ULONG)x) & 0x0000FFFF) | (7 << 16) | 0x80000000);
+}
+
+// GUIDs
+struct GUID
+{
+    ULONG Data1;
+    WORD Data2;
+    WORD Data3;
+    BYTE Data4[8];
+};
+typedef GUID IID;
+typedef const GUID &REFGUID;
+typedef const IID &REFIID;
+typedef const GUID &REFCLSID;
+
+inline bool IsEqualGUID(REFGUID left, REFGUID right)
+{
+    return memcmp(&left, &right, sizeof(GUID)) == 0;
+}
+
+inline bool operator==(REFGUID left, REFGUID right)
+{
+    return IsEqualGUID(left, right);
+}
+
+inline bool operator!=(REFGUID left, REFGUID right)
+{
+    return !IsEqualGUID(left, right);
+}
+
+// Interlocked operations, all full barriers like on Windows
+inline LONG InterlockedIncrement(LONG volatile *p)
+{
+    return __atomic_add_fetch(p, 1, __ATOMIC_SEQ_CST);
+}
+
+inline LONG InterlockedDecrement(LONG volatile *p)
+{
+    return __atomic_sub_fetch(p, 1, __ATOMIC_SEQ_CST);
+}
+
+inline LONG InterlockedExchange(LONG volatile *p, LONG value)
+{
+    return __atomic_exchange_n(p, value, __ATOMIC_SEQ_CST);
+}
+
+inline LONG InterlockedExchangeAdd(LONG volatile *p, LONG value)
+{
+    return __atomic_fetch_add(p, value, __ATOMIC_SEQ_CST);
+}
+
+inline LONG InterlockedCompareExchange(LONG volatile *p, LONG exchange, LONG comparand)
+{
+    __atomic_compare_exchange_n(p, &comparand, exchange, false, __ATOMIC_SEQ_CST, __ATOMIC_SEQ_CST);
+    return comparand;
+}
+
+inline LONGLONG InterlockedIncrement64(LONGLONG volatile *p)
+{
+    return __atomic_add_fetch(p, 1, __ATOMIC_SEQ_CST);
+}
+
+inline LONGLONG InterlockedExchangeAdd64(LONGLONG volatile *p, LONGLONG value)
+{
+    return __atomic_fetch_add(p, value, __ATOMIC_SEQ_CST);
+}
+
+inline LONGLONG InterlockedCompareExchange64(LONGLONG volatile *p, LONGLONG exchange, LONGLONG comparand)
+{
+    __atomic_compare_exchange_n(p, &comparand, exchange, false, __ATOMIC_SEQ_CST, __ATOMIC_SEQ_CST);
+    return comparand;
+}
+
+inline PVOID InterlockedExchangePointer(PVOID volatile *p, PVOID value)
+{
+    return __atomic_exchange_n(p, value, __ATOMIC_SEQ_CST);
+}
+
+inline PVOID InterlockedCompareExchangePointer(PVOID volatile *p, PVOID exchange, PVOID comparand)
+{
+    __atomic_compare_exchange_n(p, &comparand, exchange, false, __ATOMIC_SEQ_CST, __ATOMIC_SEQ_CST);
+    return comparand;
+}
+
+// Plain loads and stores that are still atomic, for data with a single writer
+inline LONG ReadAcquire(LONG const volatile *p)
+{
+    return __atomic_load_n(p, __ATOMIC_ACQUIRE);
+}
+
+inline void WriteRelease(LONG volatile *p, LONG value)
+{
+    __atomic_store_n(p, value, __ATOMIC_RELEASE);
+}
+
+inline ULONG ReadULongNoFence(ULONG const volatile *p)
+{
+    return __atomic_load_n(p, __ATOMIC_RELAXED);
+}
+
+inline void WriteULongNoFence(ULONG volatile *p, ULONG value)
+{
+    __atomic_store_n(p, value, __ATOMIC_RELAXED);
+}
+
+inline LONG64 ReadNoFence64(LONG64 const volatile *p)
+{
+    return __atomic_load_n(p, __ATOMIC_RELAXED);
+}
+
+inline void WriteNoFence64(LONG64 volatile *p, LONG64 value)
+{
+    __atomic_store_n(p, value, __ATOMIC_RELAXED);
+}
+
+inline PVOID ReadPointerAcquire(PVOID const volatile *p)
+{
+    return __atomic_load_n(p, __ATOMIC_ACQUIRE);
+}
+
+#define MemoryBarrier() __atomic_thread_fence(__ATOMIC_SEQ_CST)
+#if defined(__x86_64__) || defined(__i386__)
+#define YieldProcessor() __builtin_ia32_pause()
+#else
+#define YieldProcessor() ((void)0)
+#endif
+
+// Threads
+inline DWORD GetCurrentThreadId()
+{
+    // Like on Windows: nonzero, a multiple of four and unique among the live threads
+    static std::atomic<DWORD> s_dwNextThreadId(4);
+    thread_local DWORD const dwThreadId = s_dwNextThreadId.fetch_add(4);
+    return dwThreadId;
+}
+
+inline BOOL SwitchToThread()
+{
+    return (sched_yield() == 0) ? TRUE : FALSE;
+}
+
+inline void Sleep(DWORD dwMilliseconds)
+{
+    std::this_thread::sleep_for(std::chrono::milliseconds(dwMilliseconds));
+}
+
+// Fiber local storage, with one fiber per thread. Like on Windows the callback of an index is called
+// with the thread's value, if not null, when the thread exits, and with the value of every thread
+// when the index is freed.
+typedef void (WINAPI *PFLS_CALLBACK_FUNCTION)(PVOID pFlsData);
+#define FLS_OUT_OF_INDEXES ((DWORD)0xFFFFFFFF)
+
+namespace PortableCom
+{
+
+static const DWORD c_cFlsIndexes = 128;
+
+inline std::atomic<PFLS_CALLBACK_FUNCTION> *FlsCallbacks()
+{
+    static std::atomic<PFLS_CALLBACK_FUNCTION> s_rgpfnCallbacks[c_cFlsIndexes];
+    return s_rgpfnCallbacks;
+}
+
+struct FlsValues;
+
+// Every thread's values, for FlsFree
+struct FlsThreads
+{
+    std::mutex lock;
+    std::vector<FlsValues *> rgpValues;
+};
+
+inline FlsThreads &AllFlsThreads()
+{
+    static FlsThreads *s_pThreads = new FlsThreads();     // never destroyed, threads may outlive statics
+    return *s_pThreads;
+}
+
+struct FlsValues
+{
+    std::atomic<PVOID> rgpvValues[c_cFlsIndexes] = {};
+
+    FlsValues()
+    {
+        std::lock_guard<std::mutex> lock(AllFlsThreads().lock);
+        AllFlsThreads().rgpValues.push_back(this);
+    }
+
+    ~FlsValues()
+    {
+        {
+            FlsThreads &threads = AllFlsThreads();
+            std::lock_guard<std::mutex> lock(threads.lock);
+            for (size_t idx = 0; idx < threads.rgpValues.size(); idx++)
+            {
+                if (threads.rgpValues[idx] == this)
+                {
+                    threads.rgpValues.erase(threads.rgpValues.begin() + idx);
+                    break;
+                }
+            }
+        }
+
+        for (DWORD idx = 0; idx < c_cFlsIndexes; idx++)
+        {
+            PFLS_CALLBACK_FUNCTION const pfnCallback = FlsCallbacks()[idx].load();
+            PVOID const pvValue = rgpvValues[idx].exchange(nullptr);
+            if ((pvValue != nullptr) && (pfnCallback != nullptr))
+            {
+                pfnCallback(pvValue);
+            }
+        }
+    }
+};
+
+inline FlsValues &CurrentFlsValues()
+{
+    thread_local FlsValues s_values;
+    return s_values;
+}
+
+} // namespace PortableCom
+
+inline DWORD FlsAlloc(PFLS_CALLBACK_FUNCTION pfnCallback)
+{
+    static std::atomic<DWORD> s_dwNextIndex(0);
+    DWORD const dwIndex = s_dwNextIndex.fetch_add(1);
+    if (dwIndex >= PortableCom::c_cFlsIndexes)
+    {
+        return FLS_OUT_OF_INDEXES;
+    }
+    PortableCom::FlsCallbacks()[dwIndex].store(pfnCallback);
+    return dwIndex;
+}
+
+// Indexes aren't handed out again, there are enough of them for the helpers and the tests
+inline BOOL FlsFree(DWORD dwFlsIndex)
+{
+    PortableCom::FlsThreads &threads = PortableCom::AllFlsThreads();
+    PFLS_CALLBACK_FUNCTION const pfnCallback = PortableCom::FlsCallbacks()[dwFlsIndex].exchange(nullptr);
+    std::lock_guard<std::mutex> lock(threads.lock);
+    for (PortableCom::FlsValues *pValues : threads.rgpValues)
+    {
+        PVOID const pvValue = pValues->rgpvValues[dwFlsIndex].exchange(nullptr);
+        if ((pvValue != nullptr) && (pfnCallback != nullptr))
+        {
+            pfnCallback(pvValue);
+        }
+    }
+    return TRUE;
+}
+
+inline PVOID FlsGetValue(DWORD dwFlsIndex)
+{
+    return PortableCom::CurrentFlsValues().rgpvValues[dwFlsIndex].load(std::memory_order_relaxed);
+}
+
+inline BOOL FlsSetValue(DWORD dwFlsIndex, PVOID pvFlsData)
+{
+    PortableCom::CurrentFlsValues().rgpvValues[dwFlsIndex].store(pvFlsData, std::memory_order_relaxed);
+    return TRUE;
+}
+
+union LARGE_INTEGER
+{
+    LONGLONG QuadPart;
+};
+
+inline BOOL QueryPerformanceCounter(LARGE_INTEGER *pCount)
+{
+    pCount->QuadPart = std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now().time_since_epoch()).count();
+    return TRUE;
+}
+
+inline BOOL QueryPerformanceFrequency(LARGE_INTEGER *pFrequency)
+{
+    pFrequency->QuadPart = 1000000000;
+    return TRUE;
+}
+
+// Interlocked singly linked lists. Lock free on Windows, a spin lock is enough for the stand-in.
+struct SLIST_ENTRY
+{
+    SLIST_ENTRY *Next;
+};
+typedef SLIST_ENTRY *PSLIST_ENTRY;
+
+struct alignas(16) SLIST_HEADER
+{
+    SLIST_ENTRY *pFirst;
+    LONG volatile lLock;
+    WORD wDepth;
+};
+typedef SLIST_HEADER *PSLIST_HEADER;
+
+inline void InitializeSListHead(PSLIST_HEADER pHead)
+{
+    pHead->pFirst = nullptr;
+    pHead->lLock = 0;
+    pHead->wDepth = 0;
+}
+
+namespace PortableCom
+{
+struct SListLock
+{
+    explicit SListLock(PSLIST_HEADER pHead) : _pHead(pHead)
+    {
+        while (__atomic_exchange_n(&_pHead->lLock, 1, __ATOMIC_ACQUIRE) != 0)
+        {
+            YieldProcessor();
+        }
+    }
+
+    ~SListLock()
+    {
+        __atomic_store_n(&_pHead->lLock, 0, __ATOMIC_RELEASE);
+    }
+
+private:
+    PSLIST_HEADER _pHead;
+};
+} // namespace PortableCom
+
+inline PSLIST_ENTRY InterlockedPushEntrySList(PSLIST_HEADER pHead, PSLIST_ENTRY pEntry)
+{
+    PortableCom::SListLock lock(pHead);
+    PSLIST_ENTRY const pFirst = pHead->pFirst;
+    pEntry->Next = pFirst;
+    pHead->pFirst = pEntry;
+    pHead->wDepth++;
+    return pFirst;
+}
+
+inline PSLIST_ENTRY InterlockedPopEntrySList(PSLIST_HEADER pHead)
+{
+    PortableCom::SListLock lock(pHead);
+    PSLIST_ENTRY const pFirst = pHead->pFirst;
+    if (pFirst != nullptr)
+    {
+        pHead->pFirst = pFirst->Next;
+        pHead->wDepth--;
+    }
+    return pFirst;
+}
+
+inline PSLIST_ENTRY InterlockedFlushSList(PSLIST_HEADER pHead)
+{
+    PortableCom::SListLock lock(pHead);
+    PSLIST_ENTRY const pFirst = pHead->pFirst;
+    pHead->pFirst = nullptr;
+    pHead->wDepth = 0;
+    return pFirst;
+}
+
+inline WORD QueryDepthSList(PSLIST_HEADER pHead)
+{
+    PortableCom::SListLock lock(pHead);
+    return pHead->wDepth;
+}
+
+struct INIT_ONCE
+{
+    LONG volatile lState;                   // 0 not run, 1 running, 2 done
+};
+typedef INIT_ONCE *PINIT_ONCE;
+#define INIT_ONCE_STATIC_INIT { 0 }
+
+typedef BOOL (CALLBACK *PINIT_ONCE_FN)(PINIT_ONCE pInitOnce, PVOID pParameter, PVOID *ppContext);
+
+inline void InitOnceInitialize(PINIT_ONCE pInitOnce)
+{
+    pInitOnce->lState = 0;
+}
+
+inline BOOL InitOnceExecuteOnce(PINIT_ONCE pInitOnce, PINIT_ONCE_FN pfnInit, PVOID pParameter, PVOID *ppContext)
+{
+    for (;;)
+    {
+        LONG const lState = __atomic_load_n(&pInitOnce->lState, __ATOMIC_ACQUIRE);
+        if (lState == 2)
+        {
+            return TRUE;
+        }
+
+        if ((lState == 0) && (InterlockedCompareExchange(&pInitOnce->lState, 1, 0) == 0))
+        {
+            BOOL const fSucceeded = pfnInit(pInitOnce, pParameter, ppContext);
+            __atomic_store_n(&pInitOnce->lState, fSucceeded ? 2 : 0, __ATOMIC_RELEASE);
+            return fSucceeded;
+        }
+        SwitchToThread();
+    }
+}
+
+// Modules. The process is the only module there is and it never unloads.
+struct HINSTANCE__;
+typedef HINSTANCE__ *HMODULE;
+typedef const wchar_t *LPCWSTR;
+#define GET_MODULE_HANDLE_EX_FLAG_UNCHANGED_REFCOUNT 0x00000002
+#define GET_MODULE_HANDLE_EX_FLAG_FROM_ADDRESS 0x00000004
+
+inline BOOL GetModuleHandleExW(DWORD /*dwFlags*/, LPCWSTR /*pszModuleName*/, HMODULE *phModule)
+{
+    static char s_module;
+    *phModule = reinterpret_cast<HMODULE>(&s_module);
+    return TRUE;
+}
+
+// Thread pool
+struct TP_CALLBACK_INSTANCE;
+typedef TP_CALLBACK_INSTANCE *PTP_CALLBACK_INSTANCE;
+typedef void (CALLBACK *PTP_SIMPLE_CALLBACK)(PTP_CALLBACK_INSTANCE Instance, PVOID Context);
+
+// Only the library of the environment, which the stand-in has no use for since nothing unloads
+struct TP_CALLBACK_ENVIRON
+{
+    PVOID RaceDll;
+};
+typedef TP_CALLBACK_ENVIRON *PTP_CALLBACK_ENVIRON;
+
+inline void InitializeThreadpoolEnvironment(PTP_CALLBACK_ENVIRON pcbe)
+{
+    pcbe->RaceDll = nullptr;
+}
+
+inline void SetThreadpoolCallbackLibrary(PTP_CALLBACK_ENVIRON pcbe, PVOID mod)
+{
+    pcbe->RaceDll = mod;
+}
+
+namespace PortableCom
+{
+class ThreadPool
+{
+public:
+    static ThreadPool &Instance()
+    {
+        // Never destroyed, its threads may still be running when the process exits
+        static ThreadPool *s_pPool = new ThreadPool();
+        return *s_pPool;
+    }
+
+    bool Submit(PTP_SIMPLE_CALLBACK pfnCallback, PVOID pvContext)
+    {
+        std::lock_guard<std::mutex> lock(_mutex);
+        _queue.push_back(WorkItem{ pfnCallback, pvContext });
+        if ((_queue.size() > _cIdle) && (_cThreads < c_cMaxThreads))
+        {
+            std::thread thread([this]() { _Work(); });
+            thread.detach();
+            _cThreads++;
+        }
+        else
+        {
+            _condition.notify_one();
+        }
+        return true;
+    }
+
+private:
+    static const size_t c_cMaxThreads = 512;
+
+    struct WorkItem
+    {
+        PTP_SIMPLE_CALLBACK pfnCallback;
+        PVOID pvContext;
+    };
+
+    void _Work()
+    {
+        std::unique_lock<std::mutex> lock(_mutex);
+        for (;;)
+        {
+            _cIdle++;
+            _condition.wait(lock, [this]() { return !_queue.empty(); });
+            _cIdle--;
+            WorkItem const item = _queue.front();
+            _queue.pop_front();
+            lock.unlock();
+            item.pfnCallback(nullptr, item.pvContext);
+            lock.lock();
+        }
+    }
+
+    std::mutex _mutex;
+    std::condition_variable _condition;
+    std::deque<WorkItem> _queue;
+    size_t _cThreads = 0;
+    size_t _cIdle = 0;
+};
+} // namespace PortableCom
+
+inline BOOL TrySubmitThreadpoolCallback(PTP_SIMPLE_CALLBACK pfns, PVOID pv, PTP_CALLBACK_ENVIRON /*pcbe*/)
+{
+    return PortableCom::ThreadPool::Instance().Submit(pfns, pv) ? TRUE : FALSE;
+}
+
+// The pool adds threads as needed anyway
+inline BOOL CallbackMayRunLong(PTP_CALLBACK_INSTANCE /*pci*/)
+{
+    return TRUE;
+}
+
+// COM interfaces
+struct IUnknown;
+
+namespace PortableCom
+{
+
+inline GUID GuidFromName(const char *pszName)
+{
+    // Two FNV-1a hashes with different seeds fill the 128 bits
+    ULONGLONG rgHashes[2] = { 0xcbf29ce484222325ull, 0x84222325cbf29ce4ull };
+    for (const char *pch = pszName; *pch != '\0'; pch++)
+    {
+        for (auto &hash : rgHashes)
+        {
+            hash = (hash ^ static_cast<BYTE>(*pch)) * 0x100000001b3ull;
+        }
+    }
+    GUID guid;
+    memcpy(&guid, rgHashes, sizeof(guid));
+    return guid;
+}
+
+// Specialized below for the interfaces with a well known IID
+template <typename T>
+struct InterfaceId
+{
+    static REFIID Get()
+    {
+        static const IID iid = GuidFromName(typeid(T).name());
+        return iid;
+    }
+};
+
+template <typename T>
+inline REFIID UuidOf()
+{
+    return InterfaceId<typename std::remove_cv<typename std::remove_pointer<typename std::remove_reference<T>::type>::type>::type>::Get();
+}
+
+} // namespace PortableCom
+
+#define __uuidof(x) ::PortableCom::UuidOf<__typeof__(x)>()
+
+#define DEFINE_PORTABLE_INTERFACE_ID(itf, l, w1, w2, b1, b2, b3, b4, b5, b6, b7, b8) \
+    inline constexpr IID IID_##itf = { l, w1, w2, { b1, b2, b3, b4, b5, b6, b7, b8 } }; \
+    namespace PortableCom { template <> struct InterfaceId<itf> { static REFIID Get() { return IID_##itf; } }; }
+
+struct IUnknown
+{
+    virtual HRESULT STDMETHODCALLTYPE QueryInterface(REFIID riid, void **ppvObject) = 0;
+    virtual ULONG STDMETHODCALLTYPE AddRef() = 0;
+    virtual ULONG STDMETHODCALLTYPE Release() = 0;
+};
+DEFINE_PORTABLE_INTERFACE_ID(IUnknown, 0x00000000, 0x0000, 0x0000, 0xC0, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x46)
+
+struct IAgileObject : public IUnknown
+{
+};
+DEFINE_PORTABLE_INTERFACE_ID(IAgileObject, 0x94ea2b94, 0xe9cc, 0x49e0, 0xc0, 0xff, 0xee, 0x64, 0xca, 0x8f, 0x5b, 0x90)
+
+struct IAgileReference : public IUnknown
+{
+    virtual HRESULT STDMETHODCALLTYPE Resolve(REFIID riid, void **ppvObjectReference) = 0;
+};
+DEFINE_PORTABLE_INTERFACE_ID(IAgileReference, 0xC03F6A43, 0x65A4, 0x9818, 0x98, 0x7E, 0xE0, 0xB8, 0x10, 0xD2, 0xA6, 0xF2)
+
+struct IServiceProvider : public IUnknown
+{
+    virtual HRESULT STDMETHODCALLTYPE QueryService(REFGUID guidService, REFIID riid, void **ppvObject) = 0;
+};
+DEFINE_PORTABLE_INTERFACE_ID(IServiceProvider, 0x6d5140c1, 0x7436, 0x11ce, 0x80, 0x34, 0x00, 0xaa, 0x00, 0x60, 0x09, 0xfa)
+
+struct IProfferService : public IUnknown
+{
+    virtual HRESULT STDMETHODCALLTYPE ProfferService(REFGUID guidService, IServiceProvider *psp, DWORD *pdwCookie) = 0;
+    virtual HRESULT STDMETHODCALLTYPE RevokeService(DWORD dwCookie) = 0;
+};
+DEFINE_PORTABLE_INTERFACE_ID(IProfferService, 0xcb728b20, 0xf786, 0x11ce, 0x92, 0xad, 0x00, 0xaa, 0x00, 0xa7, 0x4c, 0xd0)
+
+struct IObjectWithSite : public IUnknown
+{
+    virtual HRESULT STDMETHODCALLTYPE SetSite(IUnknown *pUnkSite) = 0;
+    virtual HRESULT STDMETHODCALLTYPE GetSite(REFIID riid, void **ppvSite) = 0;
+};
+DEFINE_PORTABLE_INTERFACE_ID(IObjectWithSite, 0xFC4801A3, 0x2BA9, 0x11CF, 0xA2, 0x29, 0x00, 0xAA, 0x00, 0x3D, 0x73, 0x52)
+
+// Only asked for, to tell a proxy from an object, so none of its methods are here
+struct IClientSecurity : public IUnknown
+{
+};
+DEFINE_PORTABLE_INTERFACE_ID(IClientSecurity, 0x0000013D, 0x0000, 0x0000, 0xC0, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x46)
+
+struct ComCallData
+{
+    DWORD dwDispid;
+    DWORD dwReserved;
+    void *pUserDefined;
+};
+typedef HRESULT (STDMETHODCALLTYPE *PFNCONTEXTCALL)(ComCallData *pParam);
+
+struct IContextCallback : public IUnknown
+{
+    virtual HRESULT STDMETHODCALLTYPE ContextCallback(PFNCONTEXTCALL pfnCallback, ComCallData *pParam, REFIID riid, int iMethod, IUnknown *pUnk) = 0;
+};
+DEFINE_PORTABLE_INTERFACE_ID(IContextCallback, 0x000001da, 0x0000, 0x0000, 0xC0, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x46)
+
+template <typename T>
+void **IID_PPV_ARGS_Helper(T **pp)
+{
+    static_assert(std::is_base_of<IUnknown, T>::value, "T has to derive from IUnknown");
+    return reinterpret_cast<void **>(pp);
+}
+
+#define IID_PPV_ARGS(ppType) __uuidof(**(ppType)), IID_PPV_ARGS_Helper(ppType)
+
+// Apartments and agile references
+enum COINIT
+{
+    COINIT_MULTITHREADED = 0x0,
+    COINIT_APARTMENTTHREADED = 0x2,
+};
+
+enum AgileReferenceOptions
+{
+    AGILEREFERENCE_DEFAULT = 0,
+    AGILEREFERENCE_DELAYEDMARSHAL = 1,
+};
+
+namespace PortableCom
+{
+
+struct ApartmentState
+{
+    ULONG_PTR idApartment;                  // 0 until CoInitializeEx
+    ULONG cInitialize;
+    bool fSingleThreaded;
+};
+
+static const ULONG_PTR c_idMultithreadedApartment = 1;
+
+inline ApartmentState &CurrentApartmentState()
+{
+    thread_local ApartmentState state = { 0, 0, false };
+    return state;
+}
+
+// Threads that never initialized COM are in the implicit MTA
+inline ULONG_PTR CurrentApartmentId()
+{
+    ULONG_PTR const idApartment = CurrentApartmentState().idApartment;
+    return (idApartment != 0) ? idApartment : c_idMultithreadedApartment;
+}
+
+struct MarshalingCost
+{
+    std::atomic<LONGLONG> llMarshalNanoseconds;
+    std::atomic<LONGLONG> llUnmarshalNanoseconds;
+    std::atomic<LONGLONG> llCallNanoseconds;
+};
+
+inline MarshalingCost &CurrentMarshalingCost()
+{
+    // Roughly what marshaling an interface, unmarshaling a proxy and a call into an idle STA cost
+    static MarshalingCost s_cost = { { 5000 }, { 2000 }, { 2000 } };
+    return s_cost;
+}
+
+// Sets the time spent marshaling a non agile object for an agile reference, the time each resolve of
+// it from another apartment costs and the time of each call through a proxy. Zero turns that part of
+// the simulation off.
+inline void SetMarshalingCost(std::chrono::nanoseconds marshal, std::chrono::nanoseconds unmarshal, std::chrono::nanoseconds call)
+{
+    CurrentMarshalingCost().llMarshalNanoseconds = marshal.count();
+    CurrentMarshalingCost().llUnmarshalNanoseconds = unmarshal.count();
+    CurrentMarshalingCost().llCallNanoseconds = call.count();
+}
+
+inline void SimulateWork(LONGLONG llNanoseconds)
+{
+    if (llNanoseconds > 0)
+    {
+        auto const end = std::chrono::steady_clock::now() + std::chrono::nanoseconds(llNanoseconds);
+        while (std::chrono::steady_clock::now() < end)
+        {
+        }
+    }
+}
+
+// Makes the calling thread act as a member of another apartment for the duration of a call through
+// a proxy, which is where that call would run with real COM
+class ApartmentScope
+{
+public:
+    explicit ApartmentScope(ULONG_PTR idApartment) : _idPrevious(CurrentApartmentState().idApartment)
+    {
+        CurrentApartmentState().idApartment = idApartment;
+    }
+
+    ~ApartmentScope()
+    {
+        CurrentApartmentState().idApartment = _idPrevious;
+    }
+
+private:
+    ULONG_PTR const _idPrevious;
+
+    ApartmentScope(const ApartmentScope &);
+    ApartmentScope &operator=(const ApartmentScope &);
+};
+
+inline bool IsAgile(IUnknown *punk)
+{
+    IUnknown *punkAgile;
+    bool const fAgile = SUCCEEDED(punk->QueryInterface(IID_IAgileObject, reinterpret_cast<void **>(&punkAgile)));
+    if (fAgile)
+    {
+        punkAgile->Release();
+    }
+    return fAgile;
+}
+
+inline HRESULT MarshalInterface(ULONG_PTR idHome, REFIID riid, IUnknown *punk, void **ppv);
+
+// Stands in for a standard proxy. Only the interfaces below have a "proxy/stub", asking a proxy for
+// any other interface fails like it would with real COM, after a call into the object's apartment.
+// IClientSecurity is the proxy's own and answered without one. Every call pays the simulated call
+// cost and runs as if on a thread of the object's apartment, with interface parameters marshaled
+// both ways.
+class Proxy final : public IServiceProvider, public IObjectWithSite, public IProfferService, public IClientSecurity
+{
+public:
+    Proxy(IUnknown *punkTarget, ULONG_PTR idHome) : _cRef(1), _punkTarget(punkTarget), _idHome(idHome)
+    {
+        _punkTarget->AddRef();
+    }
+
+    // Unwraps a proxy, returns nullptr for anything else
+    static Proxy *FromUnknown(IUnknown *punk)
+    {
+        Proxy *pProxy;
+        return SUCCEEDED(punk->QueryInterface(UuidOf<Proxy>(), reinterpret_cast<void **>(&pProxy))) ? pProxy : nullptr;
+    }
+
+    IUnknown *Target() const
+    {
+        return _punkTarget;
+    }
+
+    ULONG_PTR Home() const
+    {
+        return _idHome;
+    }
+
+    HRESULT STDMETHODCALLTYPE QueryInterface(REFIID riid, void **ppvObject) override
+    {
+        *ppvObject = nullptr;
+        if (riid == UuidOf<Proxy>())
+        {
+            // Not AddRef'd, only used by FromUnknown
+            *ppvObject = this;
+            return S_OK;
+        }
+
+        if (riid == IID_IClientSecurity)
+        {
+            AddRef();
+            *ppvObject = static_cast<IClientSecurity *>(this);
+            return S_OK;
+        }
+
+        void *pv = nullptr;
+        if (riid == IID_IUnknown)
+        {
+            pv = static_cast<IServiceProvider *>(this);
+        }
+        else if (riid == IID_IServiceProvider)
+        {
+            pv = static_cast<IServiceProvider *>(this);
+        }
+        else if (riid == IID_IObjectWithSite)
+        {
+            pv = static_cast<IObjectWithSite *>(this);
+        }
+        else if (riid == IID_IProfferService)
+        {
+            pv = static_cast<IProfferService *>(this);
+        }
+        else
+        {
+            // Asked of the object first, only then is the missing proxy/stub found out
+            return _Call([]() { return E_NOINTERFACE; });
+        }
+
+        // The object itself has to implement the interface too
+        IUnknown *punkInterface;
+        HRESULT hr = _Call([&]() { return _punkTarget->QueryInterface(riid, reinterpret_cast<void **>(&punkInterface)); });
+        if (SUCCEEDED(hr))
+        {
+            punkInterface->Release();
+            AddRef();
+            *ppvObject = pv;
+        }
+        return hr;
+    }
+
+    ULONG STDMETHODCALLTYPE AddRef() override
+    {
+        return ++_cRef;
+    }
+
+    ULONG STDMETHODCALLTYPE Release() override
+    {
+        ULONG const cRef = --_cRef;
+        if (cRef == 0)
+        {
+            delete this;
+        }
+        return cRef;
+    }
+
+    HRESULT STDMETHODCALLTYPE QueryService(REFGUID guidService, REFIID riid, void **ppvObject) override
+    {
+        *ppvObject = nullptr;
+        ULONG_PTR const idCaller = CurrentApartmentId();
+        return _Call([&]()
+        {
+            IServiceProvider *pServiceProvider;
+            HRESULT hr = _punkTarget->QueryInterface(IID_IServiceProvider, reinterpret_cast<void **>(&pServiceProvider));
+            if (SUCCEEDED(hr))
+            {
+                IUnknown *punkService;
+                hr = pServiceProvider->QueryService(guidService, riid, reinterpret_cast<void **>(&punkService));
+                if (SUCCEEDED(hr))
+                {
+                    hr = _MarshalOut(idCaller, riid, punkService, ppvObject);
+                }
+                pServiceProvider->Release();
+            }
+            return hr;
+        });
+    }
+
+    HRESULT STDMETHODCALLTYPE SetSite(IUnknown *punkSite) override
+    {
+        ULONG_PTR const idCaller = CurrentApartmentId();
+        return _Call([&]()
+        {
+            IObjectWithSite *pObjectWithSite;
+            HRESULT hr = _punkTarget->QueryInterface(IID_IObjectWithSite, reinterpret_cast<void **>(&pObjectWithSite));
+            if (SUCCEEDED(hr))
+            {
+                IUnknown *punkSiteMarshaled = nullptr;
+                if (punkSite != nullptr)
+                {
+                    hr = MarshalInterface(idCaller, IID_IUnknown, punkSite, reinterpret_cast<void **>(&punkSiteMarshaled));
+                }
+
+                if (SUCCEEDED(hr))
+                {
+                    hr = pObjectWithSite->SetSite(punkSiteMarshaled);
+                    if (punkSiteMarshaled != nullptr)
+                    {
+                        punkSiteMarshaled->Release();
+                    }
+                }
+                pObjectWithSite->Release();
+            }
+            return hr;
+        });
+    }
+
+    HRESULT STDMETHODCALLTYPE GetSite(REFIID riid, void **ppvSite) override
+    {
+        *ppvSite = nullptr;
+        ULONG_PTR const idCaller = CurrentApartmentId();
+        return _Call([&]()
+        {
+            IObjectWithSite *pObjectWithSite;
+            HRESULT hr = _punkTarget->QueryInterface(IID_IObjectWithSite, reinterpret_cast<void **>(&pObjectWithSite));
+            if (SUCCEEDED(hr))
+            {
+                IUnknown *punkSite;
+                hr = pObjectWithSite->GetSite(riid, reinterpret_cast<void **>(&punkSite));
+                if (SUCCEEDED(hr))
+                {
+                    hr = _MarshalOut(idCaller, riid, punkSite, ppvSite);
+                }
+                pObjectWithSite->Release();
+            }
+            return hr;
+        });
+    }
+
+    HRESULT STDMETHODCALLTYPE ProfferService(REFGUID guidService, IServiceProvider *psp, DWORD *pdwCookie) override
+    {
+        ULONG_PTR const idCaller = CurrentApartmentId();
+        return _Call([&]()
+        {
+            IProfferService *pProfferService;
+            HRESULT hr = _punkTarget->QueryInterface(IID_IProfferService, reinterpret_cast<void **>(&pProfferService));
+            if (SUCCEEDED(hr))
+            {
+                IServiceProvider *pspMarshaled;
+                hr = MarshalInterface(idCaller, IID_IServiceProvider, psp, reinterpret_cast<void **>(&pspMarshaled));
+                if (SUCCEEDED(hr))
+                {
+                    hr = pProfferService->ProfferService(guidService, pspMarshaled, pdwCookie);
+                    pspMarshaled->Release();
+                }
+                pProfferService->Release();
+            }
+            return hr;
+        });
+    }
+
+    HRESULT STDMETHODCALLTYPE RevokeService(DWORD dwCookie) override
+    {
+        return _Call([&]()
+        {
+            IProfferService *pProfferService;
+            HRESULT hr = _punkTarget->QueryInterface(IID_IProfferService, reinterpret_cast<void **>(&pProfferService));
+            if (SUCCEEDED(hr))
+            {
+                hr = pProfferService->RevokeService(dwCookie);
+                pProfferService->Release();
+            }
+            return hr;
+        });
+    }
+
+private:
+    ~Proxy()
+    {
+        _Call([this]() { _punkTarget->Release(); return S_OK; });
+    }
+
+    template <typename TCall>
+    HRESULT _Call(const TCall &call)
+    {
+        SimulateWork(CurrentMarshalingCost().llCallNanoseconds);
+        ApartmentScope scope(_idHome);
+        return call();
+    }
+
+    // Hands an interface obtained in the object's apartment back to the caller, consumes punk
+    HRESULT _MarshalOut(ULONG_PTR idCaller, REFIID riid, IUnknown *punk, void **ppv)
+    {
+        HRESULT hr;
+        {
+            ApartmentScope scope(idCaller);
+            hr = MarshalInterface(_idHome, riid, punk, ppv);
+        }
+        punk->Release();
+        return hr;
+    }
+
+    std::atomic<ULONG> _cRef;
+    IUnknown *_punkTarget;
+    ULONG_PTR const _idHome;
+};
+
+// Returns a pointer to punk usable in the current apartment, where punk belongs to apartment idHome:
+// punk itself when it is agile or at home, otherwise a proxy
+inline HRESULT MarshalInterface(ULONG_PTR idHome, REFIID riid, IUnknown *punk, void **ppv)
+{
+    *ppv = nullptr;
+    Proxy *pProxy = Proxy::FromUnknown(punk);
+    if (pProxy != nullptr)
+    {
+        idHome = pProxy->Home();
+        punk = pProxy->Target();
+    }
+
+    if ((idHome == CurrentApartmentId()) || IsAgile(punk))
+    {
+        return punk->QueryInterface(riid, ppv);
+    }
+
+    Proxy *pNewProxy = new (std::nothrow) Proxy(punk, idHome);
+    if (pNewProxy == nullptr)
+    {
+        return E_OUTOFMEMORY;
+    }
+    HRESULT hr = pNewProxy->QueryInterface(riid, ppv);
+    pNewProxy->Release();
+    return hr;
+}
+
+class AgileReference final : public IAgileReference, public IAgileObject
+{
+public:
+    AgileReference(IUnknown *punk, ULONG_PTR idHome, bool fAgile, bool fMarshaled) :
+        _cRef(1), _punk(punk), _idHome(idHome), _fAgile(fAgile), _fMarshaled(fMarshaled)
+    {
+        _punk->AddRef();
+    }
+
+    HRESULT STDMETHODCALLTYPE QueryInterface(REFIID riid, void **ppvObject) override
+    {
+        if ((riid == IID_IUnknown) || (riid == IID_IAgileReference))
+        {
+            *ppvObject = static_cast<IAgileReference *>(this);
+        }
+        else if (riid == IID_IAgileObject)
+        {
+            *ppvObject = static_cast<IAgileObject *>(this);
+        }
+        else
+        {
+            *ppvObject = nullptr;
+            return E_NOINTERFACE;
+        }
+        AddRef();
+        return S_OK;
+    }
+
+    ULONG STDMETHODCALLTYPE AddRef() override
+    {
+        return ++_cRef;
+    }
+
+    ULONG STDMETHODCALLTYPE Release() override
+    {
+        ULONG const cRef = --_cRef;
+        if (cRef == 0)
+        {
+            delete this;
+        }
+        return cRef;
+    }
+
+    HRESULT STDMETHODCALLTYPE Resolve(REFIID riid, void **ppvObjectReference) override
+    {
+        if (_fAgile || (CurrentApartmentId() == _idHome))
+        {
+            return _punk->QueryInterface(riid, ppvObjectReference);
+        }
+
+        if (!_fMarshaled.exchange(true))
+        {
+            SimulateWork(CurrentMarshalingCost().llMarshalNanoseconds);
+        }
+        SimulateWork(CurrentMarshalingCost().llUnmarshalNanoseconds);
+        return MarshalInterface(_idHome, riid, _punk, ppvObjectReference);
+    }
+
+private:
+    ~AgileReference()
+    {
+        if (!_fAgile && _fMarshaled && (CurrentApartmentId() != _idHome))
+        {
+            SimulateWork(CurrentMarshalingCost().llCallNanoseconds);
+        }
+        _punk->Release();
+    }
+
+    std::atomic<ULONG> _cRef;
+    IUnknown *_punk;
+    ULONG_PTR const _idHome;
+    bool const _fAgile;
+    std::atomic<bool> _fMarshaled;
+};
+
+// Stands in for the object context of an apartment, which runs a callback there like a call through a
+// proxy would. Agile, like the real one.
+class ObjectContext final : public IContextCallback, public IAgileObject
+{
+public:
+    explicit ObjectContext(ULONG_PTR idHome) : _cRef(1), _idHome(idHome)
+    {
+    }
+
+    HRESULT STDMETHODCALLTYPE QueryInterface(REFIID riid, void **ppvObject) override
+    {
+        if ((riid == IID_IUnknown) || (riid == IID_IContextCallback))
+        {
+            *ppvObject = static_cast<IContextCallback *>(this);
+        }
+        else if (riid == IID_IAgileObject)
+        {
+            *ppvObject = static_cast<IAgileObject *>(this);
+        }
+        else
+        {
+            *ppvObject = nullptr;
+            return E_NOINTERFACE;
+        }
+        AddRef();
+        return S_OK;
+    }
+
+    ULONG STDMETHODCALLTYPE AddRef() override
+    {
+        return ++_cRef;
+    }
+
+    ULONG STDMETHODCALLTYPE Release() override
+    {
+        ULONG const cRef = --_cRef;
+        if (cRef == 0)
+        {
+            delete this;
+        }
+        return cRef;
+    }
+
+    HRESULT STDMETHODCALLTYPE ContextCallback(PFNCONTEXTCALL pfnCallback, ComCallData *pParam, REFIID /*riid*/, int /*iMethod*/, IUnknown * /*pUnk*/) override
+    {
+        if (CurrentApartmentId() == _idHome)
+        {
+            return pfnCallback(pParam);
+        }
+
+        SimulateWork(CurrentMarshalingCost().llCallNanoseconds);
+        ApartmentScope scope(_idHome);
+        return pfnCallback(pParam);
+    }
+
+private:
+    std::atomic<ULONG> _cRef;
+    ULONG_PTR const _idHome;
+};
+
+} // namespace PortableCom
+
+inline HRESULT CoInitializeEx(void * /*pvReserved*/, DWORD dwCoInit)
+{
+    auto &state = PortableCom::CurrentApartmentState();
+    bool const fSingleThreaded = (dwCoInit & COINIT_APARTMENTTHREADED) != 0;
+    if (state.cInitialize != 0)
+    {
+        if (state.fSingleThreaded != fSingleThreaded)
+        {
+            return RPC_E_CHANGED_MODE;
+        }
+        state.cInitialize++;
+        return S_FALSE;
+    }
+
+    static std::atomic<ULONG_PTR> s_idNextApartment(PortableCom::c_idMultithreadedApartment + 1);
+    state.idApartment = fSingleThreaded ? s_idNextApartment.fetch_add(1) : PortableCom::c_idMultithreadedApartment;
+    state.fSingleThreaded = fSingleThreaded;
+    state.cInitialize = 1;
+    return S_OK;
+}
+
+inline void CoUninitialize()
+{
+    auto &state = PortableCom::CurrentApartmentState();
+    if ((state.cInitialize != 0) && (--state.cInitialize == 0))
+    {
+        state.idApartment = 0;
+    }
+}
+
+inline HRESULT CoGetContextToken(ULONG_PTR *pToken)
+{
+    *pToken = PortableCom::CurrentApartmentId();
+    return S_OK;
+}
+
+inline HRESULT CoGetObjectContext(REFIID riid, void **ppv)
+{
+    *ppv = nullptr;
+    PortableCom::ObjectContext *pContext = new (std::nothrow) PortableCom::ObjectContext(PortableCom::CurrentApartmentId());
+    if (pContext == nullptr)
+    {
+        return E_OUTOFMEMORY;
+    }
+    HRESULT hr = pContext->QueryInterface(riid, ppv);
+    pContext->Release();
+    return hr;
+}
+
+inline HRESULT CoCreateGuid(GUID *pguid)
+{
+    thread_local std::mt19937_64 generator(std::random_device{}() ^ GetCurrentThreadId());
+    ULONGLONG const rgBits[2] = { generator(), generator() };
+    memcpy(pguid, rgBits, sizeof(*pguid));
+    return S_OK;
+}
+
+inline HRESULT RoGetAgileReference(AgileReferenceOptions options, REFIID riid, IUnknown *pUnk, IAgileReference **ppAgileReference)
+{
+    *ppAgileReference = nullptr;
+    if (pUnk == nullptr)
+    {
+        return E_INVALIDARG;
+    }
+
+    // A reference to a proxy refers to the object behind it
+    ULONG_PTR idHome = PortableCom::CurrentApartmentId();
+    PortableCom::Proxy *pProxy = PortableCom::Proxy::FromUnknown(pUnk);
+    if (pProxy != nullptr)
+    {
+        idHome = pProxy->Home();
+        pUnk = pProxy->Target();
+    }
+
+    IUnknown *punkRequested;
+    HRESULT hr = pUnk->QueryInterface(riid, reinterpret_cast<void **>(&punkRequested));
+    if (SUCCEEDED(hr))
+    {
+        bool const fAgile = PortableCom::IsAgile(pUnk);
+        bool const fMarshal = !fAgile && (options == AGILEREFERENCE_DEFAULT);
+        if (fMarshal)
+        {
+            PortableCom::SimulateWork(PortableCom::CurrentMarshalingCost().llMarshalNanoseconds);
+        }
+
+        *ppAgileReference = new (std::nothrow) PortableCom::AgileReference(punkRequested, idHome, fAgile, fMarshal);
+        hr = (*ppAgileReference != nullptr) ? S_OK : E_OUTOFMEMORY;
+        punkRequested->Release();
+    }
+    return hr;
+}
+
+// WRL
+namespace Microsoft { namespace WRL {
+
+enum RuntimeClassType
+{
+    WinRt = 0x0001,
+    ClassicCom = 0x0002,
+    WinRtClassicComMix = WinRt | ClassicCom,
+    InhibitWeakReference = 0x0004,
+    Delegate = ClassicCom,
+    InhibitFtmBase = 0x0008,
+};
+
+template <unsigned int flags>
+struct RuntimeClassFlags
+{
+    static const unsigned int value = flags;
+};
+
+template <typename T>
+class ComPtr;
+
+namespace Details
+{
+
+template <typename TComPtr>
+class ComPtrRef
+{
+public:
+    typedef typename TComPtr::InterfaceType InterfaceType;
+
+    explicit ComPtrRef(TComPtr *ptr) : _ptr(ptr)
+    {
+    }
+
+    operator void **() const
+    {
+        return reinterpret_cast<void **>(_ptr->ReleaseAndGetAddressOf());
+    }
+
+    operator InterfaceType **()
+    {
+        return _ptr->ReleaseAndGetAddressOf();
+    }
+
+    // Like WRL, taking the address of a ComPtr to get a ComPtr * empties it
+    operator TComPtr *()
+    {
+        *_ptr = nullptr;
+        return _ptr;
+    }
+
+    InterfaceType *operator*()
+    {
+        return _ptr->Get();
+    }
+
+    InterfaceType * const *GetAddressOf() const
+    {
+        return _ptr->GetAddressOf();
+    }
+
+    InterfaceType **ReleaseAndGetAddressOf()
+    {
+        return _ptr->ReleaseAndGetAddressOf();
+    }
+
+private:
+    TComPtr *_ptr;
+};
+
+} // namespace Details
+
+template <typename T>
+class ComPtr
+{
+public:
+    typedef T InterfaceType;
+
+    ComPtr() : _ptr(nullptr)
+    {
+    }
+
+    ComPtr(std::nullptr_t) : _ptr(nullptr)
+    {
+    }
+
+    template <typename U>
+    ComPtr(U *other) : _ptr(other)
+    {
+        _InternalAddRef();
+    }
+
+    ComPtr(const ComPtr &other) : _ptr(other._ptr)
+    {
+        _InternalAddRef();
+    }
+
+    template <typename U, typename = typename std::enable_if<std::is_convertible<U *, T *>::value>::type>
+    ComPtr(const ComPtr<U> &other) : _ptr(other.Get())
+    {
+        _InternalAddRef();
+    }
+
+    ComPtr(ComPtr &&other) : _ptr(other._ptr)
+    {
+        other._ptr = nullptr;
+    }
+
+    template <typename U, typename = typename std::enable_if<std::is_convertible<U *, T *>::value>::type>
+    ComPtr(ComPtr<U> &&other) : _ptr(other.Detach())
+    {
+    }
+
+    ~ComPtr()
+    {
+        _InternalRelease();
+    }
+
+    ComPtr &operator=(std::nullptr_t)
+    {
+        _InternalRelease();
+        return *this;
+    }
+
+    template <typename U>
+    ComPtr &operator=(U *other)
+    {
+        ComPtr(other).Swap(*this);
+        return *this;
+    }
+
+    ComPtr &operator=(const ComPtr &other)
+    {
+        ComPtr(other).Swap(*this);
+        return *this;
+    }
+
+    template <typename U>
+    ComPtr &operator=(const ComPtr<U> &other)
+    {
+        ComPtr(other).Swap(*this);
+        return *this;
+    }
+
+    ComPtr &operator=(ComPtr &&other)
+    {
+        ComPtr(static_cast<ComPtr &&>(other)).Swap(*this);
+        return *this;
+    }
+
+    template <typename U>
+    ComPtr &operator=(ComPtr<U> &&other)
+    {
+        ComPtr(static_cast<ComPtr<U> &&>(other)).Swap(*this);
+        return *this;
+    }
+
+    void Swap(ComPtr &other)
+    {
+        T *ptr = _ptr;
+        _ptr = other._ptr;
+        other._ptr = ptr;
+    }
+
+    void Swap(ComPtr &&other)
+    {
+        Swap(other);
+    }
+
+    explicit operator bool() const
+    {
+        return _ptr != nullptr;
+    }
+
+    T *Get() const
+    {
+        return _ptr;
+    }
+
+    T *operator->() const
+    {
+        return _ptr;
+    }
+
+    Details::ComPtrRef<ComPtr<T>> operator&()
+    {
+        return Details::ComPtrRef<ComPtr<T>>(this);
+    }
+
+    T * const *GetAddressOf() const
+    {
+        return &_ptr;
+    }
+
+    T **GetAddressOf()
+    {
+        return &_ptr;
+    }
+
+    T **ReleaseAndGetAddressOf()
+    {
+        _InternalRelease();
+        return &_ptr;
+    }
+
+    T *Detach()
+    {
+        T *ptr = _ptr;
+        _ptr = nullptr;
+        return ptr;
+    }
+
+    void Attach(T *other)
+    {
+        if (_ptr != nullptr)
+        {
+            _ptr->Release();
+        }
+        _ptr = other;
+    }
+
+    ULONG Reset()
+    {
+        return _InternalRelease();
+    }
+
+    HRESULT CopyTo(T **ptr) const
+    {
+        _InternalAddRef();
+        *ptr = _ptr;
+        return S_OK;
+    }
+
+    HRESULT CopyTo(REFIID riid, void **ptr) const
+    {
+        return _ptr->QueryInterface(riid, ptr);
+    }
+
+    template <typename U>
+    HRESULT CopyTo(U **ptr) const
+    {
+        return _ptr->QueryInterface(__uuidof(U), reinterpret_cast<void **>(ptr));
+    }
+
+    template <typename U>
+    HRESULT As(Details::ComPtrRef<ComPtr<U>> p) const
+    {
+        return _ptr->QueryInterface(__uuidof(U), p);
+    }
+
+    template <typename U>
+    HRESULT As(ComPtr<U> *p) const
+    {
+        return _ptr->QueryInterface(__uuidof(U), reinterpret_cast<void **>(p->ReleaseAndGetAddressOf()));
+    }
+
+    HRESULT AsIID(REFIID riid, ComPtr<IUnknown> *p) const
+    {
+        return _ptr->QueryInterface(riid, reinterpret_cast<void **>(p->ReleaseAndGetAddressOf()));
+    }
+
+private:
+    void _InternalAddRef() const
+    {
+        if (_ptr != nullptr)
+        {
+            _ptr->AddRef();
+        }
+    }
+
+    ULONG _InternalRelease()
+    {
+        ULONG cRef = 0;
+        T *ptr = _ptr;
+        if (ptr != nullptr)
+        {
+            _ptr = nullptr;
+            cRef = ptr->Release();
+        }
+        return cRef;
+    }
+
+    T *_ptr;
+};
+
+template <typename T, typename U>
+bool operator==(const ComPtr<T> &left, const ComPtr<U> &right)
+{
+    return static_cast<IUnknown *>(left.Get()) == static_cast<IUnknown *>(right.Get());
+}
+
+template <typename T>
+bool operator==(const ComPtr<T> &left, std::nullptr_t)
+{
+    return left.Get() == nullptr;
+}
+
+template <typename T>
+bool operator!=(const ComPtr<T> &left, std::nullptr_t)
+{
+    return left.Get() != nullptr;
+}
+
+namespace Details
+{
+
+template <typename T, typename = void>
+struct InterfaceTraits
+{
+    static bool CanCastTo(T *p, REFIID riid, void **ppv)
+    {
+        if (riid == __uuidof(T))
+        {
+            *ppv = p;
+            return true;
+        }
+        return false;
+    }
+
+    static IUnknown *CastToUnknown(T *p)
+    {
+        return p;
+    }
+};
+
+// Classes built by Implements are searched item by item
+template <typename T>
+struct InterfaceTraits<T, typename T::ImplementsTag>
+{
+    static bool CanCastTo(T *p, REFIID riid, void **ppv)
+    {
+        return p->CanCastTo(riid, ppv);
+    }
+
+    static IUnknown *CastToUnknown(T *p)
+    {
+        return p->CastToUnknown();
+    }
+};
+
+template <typename TFirst, typename... TRest>
+class InterfaceList : public TFirst, public InterfaceList<TRest...>
+{
+public:
+    bool CanCastTo(REFIID riid, void **ppv)
+    {
+        return InterfaceTraits<TFirst>::CanCastTo(static_cast<TFirst *>(this), riid, ppv) ||
+               InterfaceList<TRest...>::CanCastTo(riid, ppv);
+    }
+
+    IUnknown *CastToUnknown()
+    {
+        return InterfaceTraits<TFirst>::CastToUnknown(static_cast<TFirst *>(this));
+    }
+};
+
+template <typename TLast>
+class InterfaceList<TLast> : public TLast
+{
+public:
+    bool CanCastTo(REFIID riid, void **ppv)
+    {
+        return InterfaceTraits<TLast>::CanCastTo(static_cast<TLast *>(this), riid, ppv);
+    }
+
+    IUnknown *CastToUnknown()
+    {
+        return InterfaceTraits<TLast>::CastToUnknown(static_cast<TLast *>(this));
+    }
+};
+
+} // namespace Details
+
+template <typename TFlags, typename... TItems>
+class Implements;
+
+template <unsigned int flags, typename... TItems>
+class Implements<RuntimeClassFlags<flags>, TItems...> : public Details::InterfaceList<TItems...>
+{
+public:
+    typedef void ImplementsTag;
+
+    bool CanCastTo(REFIID riid, void **ppv)
+    {
+        return Details::InterfaceList<TItems...>::CanCastTo(riid, ppv);
+    }
+
+    IUnknown *CastToUnknown()
+    {
+        return Details::InterfaceList<TItems...>::CastToUnknown();
+    }
+};
+
+// Free threaded marshaling, which for the stand in just means being an IAgileObject
+class FtmBase : public Implements<RuntimeClassFlags<ClassicCom>, IAgileObject>
+{
+};
+
+template <typename TFlags, typename... TItems>
+class RuntimeClass : public Implements<TFlags, TItems...>
+{
+public:
+    RuntimeClass() : _cRef(1)
+    {
+    }
+
+    HRESULT STDMETHODCALLTYPE QueryInterface(REFIID riid, void **ppvObject) override
+    {
+        if (riid == IID_IUnknown)
+        {
+            *ppvObject = this->CastToUnknown();
+        }
+        else if (!this->CanCastTo(riid, ppvObject))
+        {
+            *ppvObject = nullptr;
+            return E_NOINTERFACE;
+        }
+        AddRef();
+        return S_OK;
+    }
+
+    ULONG STDMETHODCALLTYPE AddRef() override
+    {
+        return ++_cRef;
+    }
+
+    ULONG STDMETHODCALLTYPE Release() override
+    {
+        ULONG const cRef = --_cRef;
+        if (cRef == 0)
+        {
+            delete this;
+        }
+        return cRef;
+    }
+
+    HRESULT RuntimeClassInitialize()
+    {
+        return S_OK;
+    }
+
+protected:
+    virtual ~RuntimeClass()
+    {
+    }
+
+private:
+    std::atomic<ULONG> _cRef;
+};
+
+template <typename T, typename... TArgs>
+ComPtr<T> Make(TArgs &&... args)
+{
+    ComPtr<T> sp;
+    sp.Attach(new (std::nothrow) T(static_cast<TArgs &&>(args)...));
+    return sp;
+}
+
+template <typename T, typename I, typename... TArgs>
+HRESULT MakeAndInitialize(I **ppvObject, TArgs &&... args)
+{
+    *ppvObject = nullptr;
+    ComPtr<T> sp;
+    sp.Attach(new (std::nothrow) T());
+    HRESULT hr = sp ? sp->RuntimeClassInitialize(static_cast<TArgs &&>(args)...) : E_OUTOFMEMORY;
+    if (SUCCEEDED(hr))
+    {
+        *ppvObject = sp.Detach();
+    }
+    return hr;
+}
+
+template <typename T, typename I, typename... TArgs>
+HRESULT MakeAndInitialize(Details::ComPtrRef<ComPtr<I>> ppvObject, TArgs &&... args)
+{
+    return MakeAndInitialize<T>(static_cast<I **>(ppvObject), static_cast<TArgs &&>(args)...);
+}
+
+namespace Wrappers
+{
+
+class SRWLock
+{
+public:
+    class SyncLockExclusive
+    {
+    public:
+        explicit SyncLockExclusive(SRWLock *pLock) : _pLock(pLock)
+        {
+            _pLock->_lock.lock();
+        }
+
+        SyncLockExclusive(SyncLockExclusive &&other) : _pLock(other._pLock)
+        {
+            other._pLock = nullptr;
+        }
+
+        ~SyncLockExclusive()
+        {
+            Unlock();
+        }
+
+        void Unlock()
+        {
+            if (_pLock != nullptr)
+            {
+                _pLock->_lock.unlock();
+                _pLock = nullptr;
+            }
+        }
+
+    private:
+        SRWLock *_pLock;
+    };
+
+    class SyncLockShared
+    {
+    public:
+        explicit SyncLockShared(SRWLock *pLock) : _pLock(pLock)
+        {
+            _pLock->_lock.lock_shared();
+        }
+
+        SyncLockShared(SyncLockShared &&other) : _pLock(other._pLock)
+        {
+            other._pLock = nullptr;
+        }
+
+        ~SyncLockShared()
+        {
+            Unlock();
+        }
+
+        void Unlock()
+        {
+            if (_pLock != nullptr)
+            {
+                _pLock->_lock.unlock_shared();
+                _pLock = nullptr;
+            }
+        }
+
+    private:
+        SRWLock *_pLock;
+    };
+
+    SRWLock()
+    {
+    }
+
+    SyncLockExclusive LockExclusive()
+    {
+        return SyncLockExclusive(this);
+    }
+
+    SyncLockShared LockShared()
+    {
+        return SyncLockShared(this);
+    }
+
+private:
+    std::shared_mutex _lock;
+
+    SRWLock(const SRWLock &);
+    SRWLock &operator=(const SRWLock &);
+};
+
+} // namespace Wrappers
+} // namespace WRL
+} // namespace Microsoft
+
+template <typename T>
+void **IID_PPV_ARGS_Helper(Microsoft::WRL::Details::ComPtrRef<T> pp)
+{
+    return pp;
+}
@@ -0,0 +1,3 @@
+#pragma once
+// Stand-in for the Windows SDK header of the same name, see PortableCom.h
+#include "PortableCom.h"
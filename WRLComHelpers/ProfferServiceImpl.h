@@ -3,6 +3,10 @@
 #include <combaseapi.h>                     // For RoGetAgileReference
 #include <wrl.h>                            // For Microsoft::WRL::ComPtr and friends
 #include <wrl/wrappers/corewrappers.h>      // for SRWLock implementation
+#include "HazardPointerImpl.h"              // For the lock free reads of SnapshotAgileProfferService
+#include "SiteChainImpl.h"                  // For ISiteChainNode
+#include "DeferredReleaseImpl.h"            // For PSO_DEFER_RELEASE
+#include "AdaptiveAgileReferenceImpl.h"     // For PSO_ADAPTIVE_AGILE_REFERENCES
 
 // This header file aids in the implementation of the IProfferService and helper for the 
 // IQueryService and IServiceProvider interfaces.
@@ -13,10 +17,30 @@
 // occur from the same thread.
 //
 // If you choose to handle failures IServiceProvider::QueryService of C[Agile]ProfferService then override
-// v_QueryService.
+// v_QueryService. For more than a handful of services consider ServiceMap (ServiceMapImpl.h), which implements
+// v_QueryService for you with a constant time lookup.
 //
 // Chose CAgileProfferService if your class that derives from WRL/FTMBase (is Agile)
 //
+// Chose SnapshotAgileProfferService instead for agile objects that are queried from many threads at once.
+// QueryService doesn't take a lock there, it reads an immutable snapshot of the registered services that
+// ProfferService and RevokeService replace (copy on write), so prefer it only when proffering is rare.
+// (It only falls back to the lock if the process runs out of hazard slots, see HazardPointerImpl.h.)
+//
+// Objects created by the thousand that all proffer the same providers can share them instead: proffer them
+// once on a ProfferServiceTemplate and call UseServiceTemplate on each object, which then only copies them
+// if it proffers or revokes anything of its own.
+//
+// Services that are expensive to create and may never be asked for can be proffered with ProfferLazyService
+// instead, which takes a factory and only creates the provider on the first QueryService for it.
+//
+// Agile callers that shouldn't wait for providers living in STAs can hand the lookup off to the thread
+// pool with QueryServiceAsync (QueryServiceAsyncImpl.h), which blocks a pool thread instead.
+//
+// Code that asks for the same service over and over can keep a ServiceRef (ServiceRefImpl.h) to it
+// instead, which only looks the service up again after a ProfferService, RevokeService or SetSite on an
+// object of the chain it went through.
+//
 // Should you want to control the AgileReferenceOptions of this class from Default to Delayed Marshaling
 // then derive your own class from CProfferService or CAigleProfferService and specify the desired marshaling options.
 //
@@ -27,199 +51,2637 @@
 //     }
 // };
 //
+// PSO_ADAPTIVE_AGILE_REFERENCES picks between the two per provider instead, by how the provider is used.
+//
+// The same goes for the optional behaviors in ProfferServiceOptions, for example
+//
+// class CCachingAgileProfferService : public CAgileProfferService
+// {
+//     CCachingAgileProfferService() : CAgileProfferService(AgileReferenceOptions::AGILEREFERENCE_DEFAULT, PSO_CACHE_RESOLVED_PROVIDERS)
+//     {
+//     }
+// };
+//
+// Each class derives from a template taking an instrumentation policy, ProfferService from
+// ProfferServiceT<NoServiceInstrumentation> and so on. To see which services are looked up, how they are
+// found and what resolving their providers costs use ProfferServiceT<ServiceLookupInstrumentation>
+// instead, see ServiceInstrumentationImpl.h.
+//
+// The second template parameter is how many services are kept inside the object itself (4 by default),
+// proffering up to that many allocates nothing but their agile references. Past it the services move to
+// a hash table recycled through a process wide pool. Raise it for objects that always proffer a few more,
+// or use 0 to keep the object as small as possible when most instances never proffer anything.
+//
+//
+
+namespace Windows { namespace Internal { namespace WRL {
+
+// Optional behaviors of C[Agile]ProfferService, passed along with the AgileReferenceOptions.
+enum ProfferServiceOptions
+{
+    PSO_NONE                        = 0x0,
+    // Remember the IServiceProvider that QueryService resolved, per calling thread, so that repeated
+    // queries for the same service skip IAgileReference::Resolve (and the unmarshaling that comes with
+    // it for a provider living in another apartment). RevokeService invalidates the remembered providers
+    // and releases those of its apartment, see ResolvedProviderCache.
+    PSO_CACHE_RESOLVED_PROVIDERS    = 0x1,
+    // Remember which ancestor in the site chain answered a service, and which services nothing in the
+    // chain answers, so that repeated lookups go straight to the owner (or fail right away) instead of
+    // hopping through every ancestor. A route holds until a SetSite, ProfferService or RevokeService on
+    // the object itself or on an ancestor the route goes through, changes elsewhere leave it alone. Misses
+    // are remembered as well, unless the walk ended at an ancestor that isn't a ProfferServiceBase, so only
+    // use this when the v_QueryService overrides in the chain answer the same services for as long as a
+    // site is set.
+    PSO_MEMOIZE_SITE_CHAIN          = 0x2,
+    // Keep a summary (a Bloom filter) of the services the ancestors in the site chain may answer, and
+    // which of them may answer what, so that a service none of them has fails without walking the chain
+    // and one that some ancestor has skips the ancestors that don't. The summary is rebuilt after a
+    // SetSite, ProfferService or RevokeService on the object or any of its ancestors. Ancestors only
+    // count as answering the services proffered on them and those their v_SummarizeServices declares
+    // (ServiceMap declares its entries), so only use this when every v_QueryService override in the
+    // chain declares its services.
+    // Takes precedence over PSO_MEMOIZE_SITE_CHAIN.
+    PSO_SUMMARIZE_SITE_CHAIN        = 0x4,
+    // Hand the agile references of revoked providers to DeferredReleaseQueue (DeferredReleaseImpl.h)
+    // rather than releasing them in RevokeService, which for a provider in another apartment means a
+    // call into that apartment on the revoking thread.
+    PSO_DEFER_RELEASE               = 0x8,
+    // Ignore the AgileReferenceOptions and reach each provider through an AdaptiveAgileReference
+    // (AdaptiveAgileReferenceImpl.h): proffering marshals nothing, QueryService from the provider's own
+    // apartment (or for an agile provider) uses it directly, and the first QueryService from anywhere
+    // else marshals it once. See GetAdaptiveAgileReferenceStatistics for which providers went which way,
+    // and GetServiceReferenceUsage for a single service.
+    PSO_ADAPTIVE_AGILE_REFERENCES   = 0x10,
+    // Look services up in the site chain with SiteChainWalker (SiteChainImpl.h): each ancestor that is
+    // a ProfferServiceBase is asked for its own services in turn, from a loop, instead of the lookup
+    // going to the site's QueryService, which hands it to its own site and so on. Deep chains cost no
+    // stack and a site cycle fails with ERROR_CIRCULAR_DEPENDENCY rather than overflowing it, but an
+    // override of IServiceProvider::QueryService on an ancestor isn't called. QueryServices walks the
+    // chain once for all of its queries. PSO_MEMOIZE_SITE_CHAIN and PSO_SUMMARIZE_SITE_CHAIN always walk.
+    PSO_WALK_SITE_CHAIN             = 0x20,
+};
+DEFINE_ENUM_FLAG_OPERATORS(ProfferServiceOptions);
+
+namespace Details
+{
+
+class ProfferServiceNoLock
+{
+public:
+    // Need to define a destructor so when this pattern is used
+    // auto lock = srwLock.LockXXX
+    // the compiler does not generate the warning
+    // 
+    // profferserviceimpl.h(58) : error C4189: 'lock' : local variable is initialized but not referenced
+    // 
+    // which is why returning something like (int 0) doesn't work.
+    //
+    ~ProfferServiceNoLock()
+    {
+    }
+
+    ProfferServiceNoLock LockExclusive() { return (*this); }
+    ProfferServiceNoLock LockShared() { return (*this); }
+};
+
+inline UINT HashServiceId(_In_ REFGUID guid)
+{
+    // Fold the four DWORDs of the GUID and then mix (murmur3 finalizer) so that
+    // sequential or hand crafted service ids still spread across a table.
+    const UINT32 *pdw = reinterpret_cast<const UINT32 *>(&guid);
+    UINT32 hash = pdw[0] ^ pdw[1] ^ pdw[2] ^ pdw[3];
+    hash ^= hash >> 16;
+    hash *= 0x85ebca6b;
+    hash ^= hash >> 13;
+    hash *= 0xc2b2ae35;
+    hash ^= hash >> 16;
+    return hash;
+}
+
+// Bloom filter of service GUIDs, for PSO_SUMMARIZE_SITE_CHAIN. With 1024 bits and two of them per
+// service a summary of a few hundred services still rules out most of the others.
+class ServiceSummary
+{
+public:
+    ServiceSummary()
+    {
+        Clear();
+    }
+
+    void Clear()
+    {
+        ZeroMemory(_rgBits, sizeof(_rgBits));
+    }
+
+    // For an ancestor that can't be summarized, which may answer anything
+    void SetAll()
+    {
+        for (UINT idx = 0; idx < ARRAYSIZE(_rgBits); idx++)
+        {
+            _rgBits[idx] = ~0ull;
+        }
+    }
+
+    void Add(_In_ REFGUID guidService)
+    {
+        UINT const hash = HashServiceId(guidService);
+        _rgBits[_Word(hash)] |= _Bit(hash);
+        _rgBits[_Word(hash >> 16)] |= _Bit(hash >> 16);
+    }
+
+    void Add(_In_ ServiceSummary const &other)
+    {
+        for (UINT idx = 0; idx < ARRAYSIZE(_rgBits); idx++)
+        {
+            _rgBits[idx] |= other._rgBits[idx];
+        }
+    }
+
+    // False means guidService definitely isn't in the summary
+    bool MayContain(_In_ REFGUID guidService) const
+    {
+        UINT const hash = HashServiceId(guidService);
+        return ((_rgBits[_Word(hash)] & _Bit(hash)) != 0) && ((_rgBits[_Word(hash >> 16)] & _Bit(hash >> 16)) != 0);
+    }
+
+    bool IsEmpty() const
+    {
+        ULONGLONG bits = 0;
+        for (UINT idx = 0; idx < ARRAYSIZE(_rgBits); idx++)
+        {
+            bits |= _rgBits[idx];
+        }
+        return bits == 0;
+    }
+
+private:
+    static const UINT c_cBits = 1024;
+
+    static UINT _Word(_In_ UINT hash)
+    {
+        return (hash % c_cBits) / 64;
+    }
+
+    static ULONGLONG _Bit(_In_ UINT hash)
+    {
+        return 1ull << (hash % 64);
+    }
+
+    ULONGLONG _rgBits[c_cBits / 64];
+};
+
+// Recycles the blocks behind the service and cookie tables that outgrow their inline entries, so
+// that brokers coming and going by the thousand don't each go to the heap for them. Blocks come in
+// power of two sizes from 256 bytes to 64KB, carved out of 64KB chunks and kept on a lock free list
+// per size once freed. The chunks are never given back, the pool only ever holds as much as was in
+// use at the peak. Bigger blocks come straight from the heap.
+//
+// Templated only so that the lists can live in a header without a separate definition in some
+// translation unit.
+template <typename Unused = void>
+class ServiceBlockPoolT
+{
+public:
+    static void *Allocate(_In_ size_t cb)
+    {
+        UINT const idxClass = _SizeClass(cb);
+        void *pBlock = (idxClass == c_cClasses) ? ::operator new(cb, std::nothrow) : InterlockedPopEntrySList(&s_rgFreeLists[idxClass]);
+        if ((pBlock == nullptr) && (idxClass != c_cClasses))
+        {
+            pBlock = _Carve(idxClass);
+        }
+
+        if (pBlock != nullptr)
+        {
+            InterlockedExchangeAdd64(&s_cbInUse, static_cast<LONG64>(cb));
+        }
+        return pBlock;
+    }
+
+    // cb is the size the block was allocated with
+    static void Free(_In_opt_ void *pBlock, _In_ size_t cb)
+    {
+        if (pBlock != nullptr)
+        {
+            InterlockedExchangeAdd64(&s_cbInUse, -static_cast<LONG64>(cb));
+            UINT const idxClass = _SizeClass(cb);
+            if (idxClass == c_cClasses)
+            {
+                ::operator delete(pBlock);
+            }
+            else
+            {
+                InterlockedPushEntrySList(&s_rgFreeLists[idxClass], static_cast<PSLIST_ENTRY>(pBlock));
+            }
+        }
+    }
+
+    // Bytes taken from the heap for chunks so far
+    static ULONGLONG ReservedBytes()
+    {
+        return static_cast<ULONGLONG>(ReadNoFence64(&s_cbReserved));
+    }
+
+    // Bytes currently allocated, as asked for by the callers of Allocate
+    static ULONGLONG BytesInUse()
+    {
+        return static_cast<ULONGLONG>(ReadNoFence64(&s_cbInUse));
+    }
+
+private:
+    static const size_t c_cbMinBlock = 256;
+    static const UINT c_cClasses = 9;               // 256 bytes to 64KB
+    static const size_t c_cbChunk = 64 * 1024;
+
+    static UINT _SizeClass(_In_ size_t cb)
+    {
+        UINT idxClass = 0;
+        while ((idxClass < c_cClasses) && ((c_cbMinBlock << idxClass) < cb))
+        {
+            idxClass++;
+        }
+        return idxClass;
+    }
+
+    // Takes a chunk from the heap, keeps its first block and frees the others into the list
+    static void *_Carve(_In_ UINT idxClass)
+    {
+        size_t const cbBlock = c_cbMinBlock << idxClass;
+        BYTE *pChunk = new (std::nothrow) BYTE[c_cbChunk];
+        if (pChunk != nullptr)
+        {
+            InterlockedExchangeAdd64(&s_cbReserved, c_cbChunk);
+            for (size_t ibBlock = cbBlock; ibBlock + cbBlock <= c_cbChunk; ibBlock += cbBlock)
+            {
+                InterlockedPushEntrySList(&s_rgFreeLists[idxClass], reinterpret_cast<PSLIST_ENTRY>(pChunk + ibBlock));
+            }
+        }
+        return pChunk;
+    }
+
+    static SLIST_HEADER s_rgFreeLists[c_cClasses];  // all zero is an empty list
+    static LONG64 volatile s_cbReserved;
+    static LONG64 volatile s_cbInUse;
+};
+
+template <typename Unused>
+SLIST_HEADER ServiceBlockPoolT<Unused>::s_rgFreeLists[ServiceBlockPoolT<Unused>::c_cClasses];
+
+template <typename Unused>
+LONG64 volatile ServiceBlockPoolT<Unused>::s_cbReserved = 0;
+
+template <typename Unused>
+LONG64 volatile ServiceBlockPoolT<Unused>::s_cbInUse = 0;
+
+typedef ServiceBlockPoolT<> ServiceBlockPool;
+
+// Table of proffered services keyed by the service GUID. The first cInlineEntries services live in
+// the table itself and are found by a linear scan, which needs no allocation and for a handful of
+// services is as fast as hashing. Past that the table turns into an open addressed (linear probing)
+// hash table in a block from the ServiceBlockPool, and stays one.
+//
+// Either way the GUID is stored inline in each entry and the entries are contiguous so a lookup
+// usually touches a single cache line instead of chasing a pointer per registered service.
+// Removal from the hash table uses backward shift deletion so it never accumulates tombstones.
 //
+// The table does no locking of its own; the owner is responsible for serializing access.
+template <UINT cInlineEntries>
+class ServiceTableT
+{
+public:
+    struct Entry
+    {
+        Entry() : dwCookie(0)
+        {
+        }
+
+        GUID guidService;
+        DWORD dwCookie;     // 0 marks an empty slot, cookies handed out start at 1
+        Microsoft::WRL::ComPtr<IAgileReference> spServiceProviderAgileReference;
+    };
+
+    ServiceTableT() : _pEntries(nullptr), _cEntries(0), _cCapacity(0)
+    {
+    }
+
+    ~ServiceTableT()
+    {
+        _FreeEntries(_pEntries, _cCapacity);
+    }
+
+    const Entry *Find(_In_ REFGUID guidService) const
+    {
+        if (_cCapacity == 0)
+        {
+            for (UINT idx = 0; idx < _cEntries; idx++)
+            {
+                if (_rgInline[idx].guidService == guidService)
+                {
+                    return &_rgInline[idx];
+                }
+            }
+        }
+        else if (_cEntries != 0)
+        {
+            UINT const mask = _cCapacity - 1;
+            for (UINT idx = HashServiceId(guidService) & mask; _pEntries[idx].dwCookie != 0; idx = (idx + 1) & mask)
+            {
+                if (_pEntries[idx].guidService == guidService)
+                {
+                    return &_pEntries[idx];
+                }
+            }
+        }
+        return nullptr;
+    }
+
+    HRESULT Insert(_In_ REFGUID guidService, _In_ DWORD dwCookie, _In_opt_ IAgileReference *pReference)
+    {
+        if (Find(guidService) != nullptr)
+        {
+            return HRESULT_FROM_WIN32(ERROR_ALREADY_REGISTERED);
+        }
+
+        HRESULT hr = Reserve(_cEntries + 1);
+        if (SUCCEEDED(hr))
+        {
+            Entry &entry = (_cCapacity == 0) ? _rgInline[_cEntries] : _pEntries[_FindEmptySlot(guidService)];
+            entry.guidService = guidService;
+            entry.dwCookie = dwCookie;
+            entry.spServiceProviderAgileReference = pReference;
+            _cEntries++;
+        }
+        return hr;
+    }
+
+    // Makes room for cEntries entries in total so that inserting a batch grows the table at most once
+    HRESULT Reserve(_In_ UINT cEntries)
+    {
+        if ((_cCapacity == 0) && (cEntries <= cInlineEntries))
+        {
+            return S_OK;
+        }
+
+        // Keep the load factor at or below 1/2 so that misses, which are common when a lookup
+        // ends up walking the site chain, terminate after a couple of probes.
+        UINT cNewCapacity = (_cCapacity == 0) ? 8 : _cCapacity;
+        while (cEntries * 2 > cNewCapacity)
+        {
+            cNewCapacity *= 2;
+        }
+        return (cNewCapacity > _cCapacity) ? _Grow(cNewCapacity) : S_OK;
+    }
+
+    // Removes the entry for guidService and hands back its agile reference so that
+    // the caller can release it outside of any lock.
+    bool Remove(_In_ REFGUID guidService, _Out_ Microsoft::WRL::ComPtr<IAgileReference> *pspRemoved)
+    {
+        Entry const *pEntry = Find(guidService);
+        if (pEntry != nullptr)
+        {
+            if (_cCapacity == 0)
+            {
+                // Keep the inline entries packed, the last one takes the place of the removed one
+                UINT const idx = static_cast<UINT>(pEntry - _rgInline);
+                UINT const idxLast = _cEntries - 1;
+                pspRemoved->Attach(_rgInline[idx].spServiceProviderAgileReference.Detach());
+                _rgInline[idx].guidService = _rgInline[idxLast].guidService;
+                _rgInline[idx].dwCookie = _rgInline[idxLast].dwCookie;
+                _rgInline[idx].spServiceProviderAgileReference.Swap(_rgInline[idxLast].spServiceProviderAgileReference);
+                _rgInline[idxLast].dwCookie = 0;
+                _cEntries--;
+            }
+            else
+            {
+                UINT const idx = static_cast<UINT>(pEntry - _pEntries);
+                pspRemoved->Attach(_pEntries[idx].spServiceProviderAgileReference.Detach());
+                _RemoveAt(idx);
+            }
+        }
+        return pEntry != nullptr;
+    }
+
+    // Makes this (empty) table a copy of source, keeping its layout.
+    HRESULT CopyFrom(_In_ const ServiceTableT &source)
+    {
+        HRESULT hr = S_OK;
+        if (source._cCapacity == 0)
+        {
+            for (UINT idx = 0; idx < source._cEntries; idx++)
+            {
+                _rgInline[idx] = source._rgInline[idx];
+            }
+            _cEntries = source._cEntries;
+        }
+        else
+        {
+            _pEntries = _AllocateEntries(source._cCapacity);
+            hr = (_pEntries != nullptr) ? S_OK : E_OUTOFMEMORY;
+            if (SUCCEEDED(hr))
+            {
+                _cCapacity = source._cCapacity;
+                _cEntries = source._cEntries;
+                for (UINT idx = 0; idx < _cCapacity; idx++)
+                {
+                    _pEntries[idx] = source._pEntries[idx];
+                }
+            }
+        }
+        return hr;
+    }
+
+    // Makes this (empty) table a copy of a table with another number of inline entries, inserting the
+    // entries one by one. Either all of them are copied or, when there is no room for them, none.
+    template <UINT cSourceInlineEntries>
+    HRESULT CopyFrom(_In_ const ServiceTableT<cSourceInlineEntries> &source)
+    {
+        HRESULT hr = Reserve(source._cEntries);
+        bool const fSourceInline = (source._cCapacity == 0);
+        auto const *pSourceEntries = fSourceInline ? source._rgInline : source._pEntries;
+        UINT const cSourceEntries = fSourceInline ? source._cEntries : source._cCapacity;
+        for (UINT idx = 0; SUCCEEDED(hr) && (idx < cSourceEntries); idx++)
+        {
+            if (pSourceEntries[idx].dwCookie != 0)
+            {
+                hr = Insert(pSourceEntries[idx].guidService, pSourceEntries[idx].dwCookie, pSourceEntries[idx].spServiceProviderAgileReference.Get());
+            }
+        }
+        return hr;
+    }
+
+    UINT Count() const
+    {
+        return _cEntries;
+    }
+
+    void Summarize(_Inout_ ServiceSummary *pSummary) const
+    {
+        Entry const *pEntries = (_cCapacity == 0) ? _rgInline : _pEntries;
+        UINT const cEntries = (_cCapacity == 0) ? _cEntries : _cCapacity;
+        for (UINT idx = 0; idx < cEntries; idx++)
+        {
+            if (pEntries[idx].dwCookie != 0)
+            {
+                pSummary->Add(pEntries[idx].guidService);
+            }
+        }
+    }
+
+private:
+    UINT _FindEmptySlot(_In_ REFGUID guidService) const
+    {
+        UINT const mask = _cCapacity - 1;
+        UINT idx = HashServiceId(guidService) & mask;
+        while (_pEntries[idx].dwCookie != 0)
+        {
+            idx = (idx + 1) & mask;
+        }
+        return idx;
+    }
+
+    HRESULT _Grow(_In_ UINT cNewCapacity)
+    {
+        Entry *pNewEntries = _AllocateEntries(cNewCapacity);
+        HRESULT hr = (pNewEntries != nullptr) ? S_OK : E_OUTOFMEMORY;
+        if (SUCCEEDED(hr))
+        {
+            // Coming from the inline entries the old entries are the first _cEntries of those
+            bool const fFromInline = (_cCapacity == 0);
+            Entry *pOldEntries = fFromInline ? _rgInline : _pEntries;
+            UINT const cOldEntries = fFromInline ? _cEntries : _cCapacity;
+            UINT const cOldCapacity = _cCapacity;
+            _pEntries = pNewEntries;
+            _cCapacity = cNewCapacity;
+            for (UINT idx = 0; idx < cOldEntries; idx++)
+            {
+                if (pOldEntries[idx].dwCookie != 0)
+                {
+                    Entry &entry = _pEntries[_FindEmptySlot(pOldEntries[idx].guidService)];
+                    entry.guidService = pOldEntries[idx].guidService;
+                    entry.dwCookie = pOldEntries[idx].dwCookie;
+                    entry.spServiceProviderAgileReference.Swap(pOldEntries[idx].spServiceProviderAgileReference);
+                    pOldEntries[idx].dwCookie = 0;
+                }
+            }
+
+            if (!fFromInline)
+            {
+                _FreeEntries(pOldEntries, cOldCapacity);
+            }
+        }
+        return hr;
+    }
+
+    void _RemoveAt(_In_ UINT idxRemove)
+    {
+        // Backward shift deletion: pull every following entry of the probe run that is not
+        // already at its ideal position back into the hole.
+        UINT const mask = _cCapacity - 1;
+        UINT idxHole = idxRemove;
+        for (UINT idx = (idxHole + 1) & mask; _pEntries[idx].dwCookie != 0; idx = (idx + 1) & mask)
+        {
+            UINT const idxHome = HashServiceId(_pEntries[idx].guidService) & mask;
+            bool const fStays = (idxHole <= idx) ? ((idxHole < idxHome) && (idxHome <= idx)) :
+                                                   ((idxHole < idxHome) || (idxHome <= idx));
+            if (!fStays)
+            {
+                _pEntries[idxHole].guidService = _pEntries[idx].guidService;
+                _pEntries[idxHole].dwCookie = _pEntries[idx].dwCookie;
+                _pEntries[idxHole].spServiceProviderAgileReference.Swap(_pEntries[idx].spServiceProviderAgileReference);
+                idxHole = idx;
+            }
+        }
+        _pEntries[idxHole].dwCookie = 0;
+        _pEntries[idxHole].spServiceProviderAgileReference.Reset();
+        _cEntries--;
+    }
+
+    static Entry *_AllocateEntries(_In_ UINT cEntries)
+    {
+        Entry *pEntries = static_cast<Entry *>(ServiceBlockPool::Allocate(cEntries * sizeof(Entry)));
+        for (UINT idx = 0; (pEntries != nullptr) && (idx < cEntries); idx++)
+        {
+            new (&pEntries[idx]) Entry();
+        }
+        return pEntries;
+    }
+
+    static void _FreeEntries(_In_opt_ Entry *pEntries, _In_ UINT cEntries)
+    {
+        if (pEntries != nullptr)
+        {
+            for (UINT idx = 0; idx < cEntries; idx++)
+            {
+                pEntries[idx].~Entry();
+            }
+            ServiceBlockPool::Free(pEntries, cEntries * sizeof(Entry));
+        }
+    }
+
+    Entry  _rgInline[(cInlineEntries != 0) ? cInlineEntries : 1];
+    Entry *_pEntries;   // the hash table, once the inline entries are outgrown
+    UINT   _cEntries;
+    UINT   _cCapacity;  // of the hash table, zero while the entries are inline and a power of two after
+
+    template <UINT cOtherInlineEntries>
+    friend class ServiceTableT;
+
+    // Not copyable
+    ServiceTableT(const ServiceTableT &);
+    ServiceTableT & operator=(const ServiceTableT &);
+};
+
+typedef ServiceTableT<0> ServiceTable;
+
+// Hands out the cookies of proffered services. A cookie is a slot index in the low word and that
+// slot's generation in the high word, so revoking goes straight to the slot and a stale or already
+// revoked cookie is told apart by its generation. Freed slots are reused, so proffering and revoking
+// over and over doesn't grow anything. The first cInlineSlots slots live in the table itself, more
+// come from the ServiceBlockPool.
+//
+// The table does no locking of its own; the owner is responsible for serializing access.
+template <UINT cInlineSlots>
+class ServiceCookieTableT
+{
+public:
+    ServiceCookieTableT() : _pSlots(_rgInline), _cSlots(0), _cCapacity(cInlineSlots), _idxFirstFree(c_idxNone)
+    {
+    }
+
+    ~ServiceCookieTableT()
+    {
+        _FreeSlots();
+    }
+
+    HRESULT Allocate(_In_ REFGUID guidService, _Out_ DWORD *pdwCookie)
+    {
+        *pdwCookie = 0;
+        HRESULT hr = S_OK;
+        UINT idx = _idxFirstFree;
+        if (idx != c_idxNone)
+        {
+            _idxFirstFree = _pSlots[idx].idxNextFree;
+        }
+        else
+        {
+            hr = (_cSlots < _cCapacity) ? S_OK : _Grow();
+            if (SUCCEEDED(hr))
+            {
+                idx = _cSlots++;
+                _pSlots[idx].wGeneration = 1;
+            }
+        }
+
+        if (SUCCEEDED(hr))
+        {
+            _pSlots[idx].guidService = guidService;
+            _pSlots[idx].fInUse = true;
+            *pdwCookie = (static_cast<DWORD>(_pSlots[idx].wGeneration) << 16) | idx;
+        }
+        return hr;
+    }
+
+    // Returns the service the cookie was handed out for, as long as it hasn't been freed since
+    bool Lookup(_In_ DWORD dwCookie, _Out_ GUID *pguidService) const
+    {
+        UINT const idx = LOWORD(dwCookie);
+        bool const fValid = (idx < _cSlots) && _pSlots[idx].fInUse && (_pSlots[idx].wGeneration == HIWORD(dwCookie));
+        if (fValid)
+        {
+            *pguidService = _pSlots[idx].guidService;
+        }
+        return fValid;
+    }
+
+    // dwCookie must have passed Lookup
+    void Free(_In_ DWORD dwCookie)
+    {
+        UINT const idx = LOWORD(dwCookie);
+        _pSlots[idx].fInUse = false;
+        // Generation 0 is skipped so that no cookie is ever 0
+        _pSlots[idx].wGeneration = (_pSlots[idx].wGeneration == MAXWORD) ? 1 : _pSlots[idx].wGeneration + 1;
+        _pSlots[idx].idxNextFree = _idxFirstFree;
+        _idxFirstFree = idx;
+    }
+
+    // Whether no cookie was ever handed out
+    bool IsUnused() const
+    {
+        return _cSlots == 0;
+    }
+
+    // Makes this unused table a copy of source, so that the cookies source handed out are valid here
+    // as well. The table is still unused if that fails.
+    template <UINT cSourceInlineSlots>
+    HRESULT CopyFrom(_In_ const ServiceCookieTableT<cSourceInlineSlots> &source)
+    {
+        HRESULT hr = S_OK;
+        while (SUCCEEDED(hr) && (_cCapacity < source._cSlots))
+        {
+            hr = _Grow();
+        }
+
+        if (SUCCEEDED(hr) && (source._cSlots != 0))
+        {
+            CopyMemory(_pSlots, source._pSlots, source._cSlots * sizeof(Slot));
+            _cSlots = source._cSlots;
+            _idxFirstFree = source._idxFirstFree;
+        }
+        return hr;
+    }
+
+private:
+    static const UINT c_idxNone = MAXUINT;
+    static const UINT c_cMaxSlots = MAXWORD + 1;
+
+    struct Slot
+    {
+        GUID guidService;
+        UINT idxNextFree;
+        WORD wGeneration;
+        bool fInUse;
+    };
+
+    HRESULT _Grow()
+    {
+        UINT const cNewCapacity = (_cCapacity < 8) ? 8 : ((_cCapacity < c_cMaxSlots) ? _cCapacity * 2 : c_cMaxSlots);
+        HRESULT hr = (cNewCapacity > _cCapacity) ? S_OK : HRESULT_FROM_WIN32(ERROR_NO_SYSTEM_RESOURCES);
+        if (SUCCEEDED(hr))
+        {
+            Slot *pNewSlots = static_cast<Slot *>(ServiceBlockPool::Allocate(cNewCapacity * sizeof(Slot)));
+            hr = (pNewSlots != nullptr) ? S_OK : E_OUTOFMEMORY;
+            if (SUCCEEDED(hr))
+            {
+                if (_cSlots != 0)
+                {
+                    CopyMemory(pNewSlots, _pSlots, _cSlots * sizeof(Slot));
+                }
+                _FreeSlots();
+                _pSlots = pNewSlots;
+                _cCapacity = cNewCapacity;
+            }
+        }
+        return hr;
+    }
+
+    void _FreeSlots()
+    {
+        if (_pSlots != _rgInline)
+        {
+            ServiceBlockPool::Free(_pSlots, _cCapacity * sizeof(Slot));
+        }
+    }
+
+    Slot  _rgInline[(cInlineSlots != 0) ? cInlineSlots : 1];
+    Slot *_pSlots;          // _rgInline until it is outgrown
+    UINT  _cSlots;          // slots handed out at least once
+    UINT  _cCapacity;
+    UINT  _idxFirstFree;
+
+    template <UINT cOtherInlineSlots>
+    friend class ServiceCookieTableT;
+
+    // Not copyable
+    ServiceCookieTableT(const ServiceCookieTableT &);
+    ServiceCookieTableT & operator=(const ServiceCookieTableT &);
+};
+
+// Proffers every service in rgguidServices under the same agile reference, or none of them.
+// Shared by the registries, the caller holds whatever lock serializes the two tables.
+template <typename TServiceTable, typename TCookieTable>
+HRESULT AddServices(_Inout_ TServiceTable &serviceTable, _Inout_ TCookieTable &cookieTable,
+                           _In_reads_(cServices) const GUID *rgguidServices, _In_ UINT cServices,
+                           _In_ IAgileReference *pReference, _Out_writes_(cServices) DWORD *rgdwCookies)
+{
+    ZeroMemory(rgdwCookies, cServices * sizeof(*rgdwCookies));
+    HRESULT hr = serviceTable.Reserve(serviceTable.Count() + cServices);
+    UINT cAdded = 0;
+    while (SUCCEEDED(hr) && (cAdded < cServices))
+    {
+        hr = cookieTable.Allocate(rgguidServices[cAdded], &rgdwCookies[cAdded]);
+        if (SUCCEEDED(hr))
+        {
+            // Also catches a service listed twice in the same batch
+            hr = serviceTable.Insert(rgguidServices[cAdded], rgdwCookies[cAdded], pReference);
+            if (FAILED(hr))
+            {
+                cookieTable.Free(rgdwCookies[cAdded]);
+                rgdwCookies[cAdded] = 0;
+            }
+        }
+
+        if (SUCCEEDED(hr))
+        {
+            cAdded++;
+        }
+    }
+
+    if (FAILED(hr))
+    {
+        // Roll back. The caller still holds pReference so these are never the last release.
+        for (UINT idx = 0; idx < cAdded; idx++)
+        {
+            Microsoft::WRL::ComPtr<IAgileReference> spRemoved;
+            serviceTable.Remove(rgguidServices[idx], &spRemoved);
+            cookieTable.Free(rgdwCookies[idx]);
+            rgdwCookies[idx] = 0;
+        }
+    }
+    return hr;
+}
+
+// Revokes every valid cookie in rgdwCookies, returns E_INVALIDARG if any of them wasn't.
+// The removed references are moved to rgspRemoved so that the caller can release them outside of the lock.
+template <typename TServiceTable, typename TCookieTable>
+HRESULT RemoveServices(_Inout_ TServiceTable &serviceTable, _Inout_ TCookieTable &cookieTable,
+                              _In_reads_(cCookies) const DWORD *rgdwCookies, _In_ UINT cCookies,
+                              _Out_writes_(cCookies) Microsoft::WRL::ComPtr<IAgileReference> *rgspRemoved)
+{
+    HRESULT hr = S_OK;
+    for (UINT idx = 0; idx < cCookies; idx++)
+    {
+        GUID guidService;
+        if (cookieTable.Lookup(rgdwCookies[idx], &guidService) && serviceTable.Remove(guidService, &rgspRemoved[idx]))
+        {
+            cookieTable.Free(rgdwCookies[idx]);
+        }
+        else
+        {
+            hr = E_INVALIDARG;
+        }
+    }
+    return hr;
+}
+
+// The services ProfferServiceTemplate starts objects off with, see ProfferServiceBase::UseServiceTemplate.
+// Filled in first and then shared, read only, by every object using it. Reference counted, the objects
+// using it hold a reference until they copy its services or go away.
+class ServiceTemplate
+{
+public:
+    // agileReferenceOption and the PSO_ADAPTIVE_AGILE_REFERENCES of options pick the agile references
+    // of the services, the same way as for ProfferServiceBase
+    static HRESULT Create(_In_ AgileReferenceOptions agileReferenceOption, _In_ ProfferServiceOptions options, _Outptr_ ServiceTemplate **ppTemplate)
+    {
+        *ppTemplate = new (std::nothrow) ServiceTemplate(agileReferenceOption, options);
+        return (*ppTemplate != nullptr) ? S_OK : E_OUTOFMEMORY;
+    }
+
+    HRESULT ProfferService(_In_ REFGUID guidService, _In_ IServiceProvider *psp, _Out_ DWORD *pdwCookie)
+    {
+        return ProfferServices(&guidService, 1, psp, pdwCookie);
+    }
+
+    // Same as ProfferServiceBase::ProfferServices. The cookies are valid for RevokeService on every object
+    // using the template. Fails with HRESULT_FROM_WIN32(ERROR_INVALID_STATE) once an object uses it.
+    HRESULT ProfferServices(_In_reads_(cServices) const GUID *rgguidServices, _In_ UINT cServices, _In_ IServiceProvider *psp, _Out_writes_(cServices) DWORD *rgdwCookies)
+    {
+        ZeroMemory(rgdwCookies, cServices * sizeof(*rgdwCookies));
+        HRESULT hr = (ReadAcquire(&_fShared) == 0) ? S_OK : HRESULT_FROM_WIN32(ERROR_INVALID_STATE);
+        Microsoft::WRL::ComPtr<IAgileReference> spReference;
+        if (SUCCEEDED(hr))
+        {
+            hr = GetAgileReference((_options & PSO_ADAPTIVE_AGILE_REFERENCES) != 0, _agileReferenceOption, __uuidof(psp), psp, &spReference);
+        }
+
+        if (SUCCEEDED(hr))
+        {
+            hr = AddServices(_serviceTable, _cookieTable, rgguidServices, cServices, spReference.Get(), rgdwCookies);
+        }
+        return hr;
+    }
+
+    ULONG AddRef()
+    {
+        return InterlockedIncrement(&_cRef);
+    }
+
+    ULONG Release()
+    {
+        ULONG const cRef = InterlockedDecrement(&_cRef);
+        if (cRef == 0)
+        {
+            delete this;
+        }
+        return cRef;
+    }
+
+    // For the registries: a reference for an object that starts using the template, which is read only from then on
+    ServiceTemplate *Share()
+    {
+        InterlockedExchange(&_fShared, 1);
+        AddRef();
+        return this;
+    }
+
+    ServiceTable const &Services() const
+    {
+        return _serviceTable;
+    }
+
+    ServiceCookieTableT<0> const &Cookies() const
+    {
+        return _cookieTable;
+    }
+
+private:
+    ServiceTemplate(_In_ AgileReferenceOptions agileReferenceOption, _In_ ProfferServiceOptions options) :
+        _agileReferenceOption(agileReferenceOption), _options(options), _cRef(1), _fShared(0)
+    {
+    }
+
+    ServiceTable _serviceTable;
+    ServiceCookieTableT<0> _cookieTable;
+    AgileReferenceOptions const _agileReferenceOption;
+    ProfferServiceOptions const _options;
+    LONG volatile _cRef;
+    LONG volatile _fShared;
+
+    ServiceTemplate(const ServiceTemplate &);
+    ServiceTemplate & operator=(const ServiceTemplate &);
+};
+
+// How many queries ProfferServiceBase::QueryServices handles in one pass, longer arrays are split
+const UINT c_cMaxBatchedQueries = 16;
+
+// Resolves rgpReferences into rgspProviders, skipping the null ones. Queries for services proffered
+// together share a reference, which is resolved only once for all of them.
+template <typename TInstrumentation>
+void ResolveProviderReferences(_In_reads_(cReferences) IAgileReference * const *rgpReferences, _In_ UINT cReferences, _Out_writes_(cReferences) Microsoft::WRL::ComPtr<IServiceProvider> *rgspProviders)
+{
+    for (UINT idx = 0; idx < cReferences; idx++)
+    {
+        if (rgpReferences[idx] != nullptr)
+        {
+            UINT idxSame = 0;
+            while ((idxSame < idx) && (rgpReferences[idxSame] != rgpReferences[idx]))
+            {
+                idxSame++;
+            }
+
+            if (idxSame < idx)
+            {
+                rgspProviders[idx] = rgspProviders[idxSame];
+            }
+            else
+            {
+                auto const start = TInstrumentation::BeginResolve();
+                rgpReferences[idx]->Resolve(IID_PPV_ARGS(&rgspProviders[idx]));
+                TInstrumentation::EndResolve(ARK_SERVICE_PROVIDER, start);
+            }
+        }
+    }
+}
+
+// The registry of proffered services behind ProfferServiceBase, serialized with LockType. The first
+// cInlineServices services take no allocation besides their agile reference. A registry started off
+// with a ServiceTemplate reads the template's tables until the first Add or Remove copies them.
+template <typename LockType, UINT cInlineServices>
+class ServiceRegistry
+{
+public:
+    ServiceRegistry() : _pBase(nullptr)
+    {
+    }
+
+    ~ServiceRegistry()
+    {
+        if (_pBase != nullptr)
+        {
+            _pBase->Release();
+        }
+    }
+
+    // Only for a registry that never had anything added
+    HRESULT SetBase(_In_ ServiceTemplate *pTemplate)
+    {
+        auto lock = _srwLock.LockExclusive();
+        HRESULT hr = ((_pBase == nullptr) && _cookieTable.IsUnused()) ? S_OK : HRESULT_FROM_WIN32(ERROR_INVALID_STATE);
+        if (SUCCEEDED(hr))
+        {
+            _pBase = pTemplate->Share();
+        }
+        return hr;
+    }
+
+    HRESULT Add(_In_reads_(cServices) const GUID *rgguidServices, _In_ UINT cServices, _In_ IAgileReference *pReference, _Out_writes_(cServices) DWORD *rgdwCookies)
+    {
+        ServiceTemplate *pReleaseBase;
+        HRESULT hr;
+        {
+            auto lock = _srwLock.LockExclusive();
+            hr = _CopyBase(&pReleaseBase);
+            if (SUCCEEDED(hr))
+            {
+                hr = AddServices(_serviceTable, _cookieTable, rgguidServices, cServices, pReference, rgdwCookies);
+            }
+            else
+            {
+                ZeroMemory(rgdwCookies, cServices * sizeof(*rgdwCookies));
+            }
+        }
+
+        // The last reference to the template holds agile references too
+        if (pReleaseBase != nullptr)
+        {
+            pReleaseBase->Release();
+        }
+        return hr;
+    }
+
+    // The removed references are handed back so that the caller releases them outside of the lock
+    HRESULT Remove(_In_reads_(cCookies) const DWORD *rgdwCookies, _In_ UINT cCookies, _Out_writes_(cCookies) Microsoft::WRL::ComPtr<IAgileReference> *rgspRemoved)
+    {
+        ServiceTemplate *pReleaseBase;
+        HRESULT hr;
+        {
+            auto lock = _srwLock.LockExclusive();
+            hr = _CopyBase(&pReleaseBase);
+            if (SUCCEEDED(hr))
+            {
+                hr = RemoveServices(_serviceTable, _cookieTable, rgdwCookies, cCookies, rgspRemoved);
+            }
+        }
+
+        if (pReleaseBase != nullptr)
+        {
+            pReleaseBase->Release();
+        }
+        return hr;
+    }
+
+    // The agile reference registered for guidService, E_NOTIMPL when there is none
+    HRESULT GetReference(_In_ REFGUID guidService, _COM_Outptr_ IAgileReference **ppReference)
+    {
+        auto lock = _srwLock.LockShared();
+        *ppReference = _FindReference(guidService);
+        if (*ppReference == nullptr)
+        {
+            return E_NOTIMPL;
+        }
+        (*ppReference)->AddRef();
+        return S_OK;
+    }
+
+    // Returns E_NOTIMPL when nothing is registered for guidService
+    template <typename TInstrumentation>
+    HRESULT ResolveProvider(_In_ REFGUID guidService, _COM_Outptr_ IServiceProvider **ppProvider)
+    {
+        *ppProvider = nullptr;
+        // Make sure to resolve the reference outside of the lock
+        Microsoft::WRL::ComPtr<IAgileReference> spProviderReference;
+        if (FAILED(GetReference(guidService, &spProviderReference)))
+        {
+            return E_NOTIMPL;
+        }
+
+        auto const start = TInstrumentation::BeginResolve();
+        HRESULT hr = spProviderReference->Resolve(IID_PPV_ARGS(ppProvider));
+        TInstrumentation::EndResolve(ARK_SERVICE_PROVIDER, start);
+        return hr;
+    }
+
+    // ResolveProvider for every query of rgQueries that hasn't succeeded yet, at most
+    // c_cMaxBatchedQueries of them, with a single acquisition of the lock. The providers
+    // of the others, and of services nothing is registered for, are left null.
+    template <typename TInstrumentation>
+    void ResolveProviders(_In_reads_(cQueries) const ServiceQuery *rgQueries, _In_ UINT cQueries, _Out_writes_(cQueries) Microsoft::WRL::ComPtr<IServiceProvider> *rgspProviders)
+    {
+        Microsoft::WRL::ComPtr<IAgileReference> rgspReferences[c_cMaxBatchedQueries];
+        IAgileReference *rgpReferences[c_cMaxBatchedQueries] = {};
+        {
+            auto lock = _srwLock.LockShared();
+            for (UINT idx = 0; idx < cQueries; idx++)
+            {
+                if (FAILED(rgQueries[idx].hr))
+                {
+                    rgspReferences[idx] = _FindReference(*rgQueries[idx].pguidService);
+                    rgpReferences[idx] = rgspReferences[idx].Get();
+                }
+            }
+        }
+        ResolveProviderReferences<TInstrumentation>(rgpReferences, cQueries, rgspProviders);
+    }
+
+    // Adds every registered service to pSummary
+    void Summarize(_Inout_ ServiceSummary *pSummary)
+    {
+        auto lock = _srwLock.LockShared();
+        if (_pBase != nullptr)
+        {
+            _pBase->Services().Summarize(pSummary);
+        }
+        else
+        {
+            _serviceTable.Summarize(pSummary);
+        }
+    }
+
+private:
+    // Called with the lock held
+    IAgileReference *_FindReference(_In_ REFGUID guidService) const
+    {
+        if (_pBase != nullptr)
+        {
+            auto pEntry = _pBase->Services().Find(guidService);
+            return (pEntry != nullptr) ? pEntry->spServiceProviderAgileReference.Get() : nullptr;
+        }
+
+        auto pEntry = _serviceTable.Find(guidService);
+        return (pEntry != nullptr) ? pEntry->spServiceProviderAgileReference.Get() : nullptr;
+    }
+
+    // Gives the registry its own copy of the template's tables, if it still reads those. Called with
+    // the lock held, *ppReleaseBase receives the reference to the template for the caller to release
+    // once the lock is dropped. Copying the cookies again after a failure copies the same, so they are
+    // only copied while the cookie table is unused.
+    HRESULT _CopyBase(_Outptr_result_maybenull_ ServiceTemplate **ppReleaseBase)
+    {
+        *ppReleaseBase = nullptr;
+        HRESULT hr = S_OK;
+        if (_pBase != nullptr)
+        {
+            if (_cookieTable.IsUnused())
+            {
+                hr = _cookieTable.CopyFrom(_pBase->Cookies());
+            }
+
+            if (SUCCEEDED(hr))
+            {
+                hr = _serviceTable.CopyFrom(_pBase->Services());
+            }
+
+            if (SUCCEEDED(hr))
+            {
+                *ppReleaseBase = _pBase;
+                _pBase = nullptr;
+            }
+        }
+        return hr;
+    }
+
+    ServiceTableT<cInlineServices> _serviceTable;
+    ServiceCookieTableT<cInlineServices> _cookieTable;
+    ServiceTemplate *_pBase;    // shared until the first Add or Remove, guarded by _srwLock
+    LockType     _srwLock;
+
+    ServiceRegistry(const ServiceRegistry &);
+    ServiceRegistry & operator=(const ServiceRegistry &);
+};
+
+// Lock policy for SnapshotAgileProfferService. The lock itself serializes writers, readers go
+// through the copy on write snapshots of ServiceRegistry<ProfferServiceSnapshotLock, ...> and only
+// take it shared when no hazard slot is free.
+class ProfferServiceSnapshotLock : public Microsoft::WRL::Wrappers::SRWLock
+{
+};
+
+// An immutable, reference counted version of the registered services. Once published a
+// snapshot is never modified, writers build a new one and retire the old.
+class ServiceSnapshot
+{
+public:
+    static HRESULT Create(_In_opt_ const ServiceTable *pCopyFrom, _Outptr_ ServiceSnapshot **ppSnapshot)
+    {
+        *ppSnapshot = nullptr;
+        ServiceSnapshot *pSnapshot = new (std::nothrow) ServiceSnapshot();
+        HRESULT hr = (pSnapshot != nullptr) ? S_OK : E_OUTOFMEMORY;
+        if (SUCCEEDED(hr) && (pCopyFrom != nullptr))
+        {
+            hr = pSnapshot->serviceTable.CopyFrom(*pCopyFrom);
+            if (FAILED(hr))
+            {
+                pSnapshot->Release();
+                pSnapshot = nullptr;
+            }
+        }
+        *ppSnapshot = pSnapshot;
+        return hr;
+    }
+
+    ULONG AddRef()
+    {
+        return InterlockedIncrement(&_cRef);
+    }
+
+    ULONG Release()
+    {
+        ULONG const cRef = InterlockedDecrement(&_cRef);
+        if (cRef == 0)
+        {
+            delete this;
+        }
+        return cRef;
+    }
+
+    ServiceTable serviceTable;
+    ServiceSnapshot *pNextRetired;
+
+private:
+    ServiceSnapshot() : pNextRetired(nullptr), _cRef(1)
+    {
+    }
+
+    LONG volatile _cRef;
+};
+
+// The snapshots are allocations of their own, their service tables don't keep entries inline. Until
+// the first snapshot is published readers read the ServiceTemplate the registry was started off with,
+// if any, which is kept to the end since a reader may still be reading it.
+template <UINT cInlineServices>
+class ServiceRegistry<ProfferServiceSnapshotLock, cInlineServices>
+{
+public:
+    ServiceRegistry() : _pCurrent(nullptr), _pBase(nullptr)
+    {
+    }
+
+    ~ServiceRegistry()
+    {
+        if (_pCurrent != nullptr)
+        {
+            _pCurrent->Release();
+        }
+
+        if (_pBase != nullptr)
+        {
+            _pBase->Release();
+        }
+    }
+
+    HRESULT SetBase(_In_ ServiceTemplate *pTemplate)
+    {
+        auto lock = _srwLock.LockExclusive();
+        HRESULT hr = ((_pBase == nullptr) && (_pCurrent == nullptr) && _cookieTable.IsUnused()) ? S_OK : HRESULT_FROM_WIN32(ERROR_INVALID_STATE);
+        if (SUCCEEDED(hr))
+        {
+            InterlockedExchangePointer(reinterpret_cast<void * volatile *>(&_pBase), pTemplate->Share());
+        }
+        return hr;
+    }
+
+    // A batch costs a single copy of the registry, no matter how many services it holds
+    HRESULT Add(_In_reads_(cServices) const GUID *rgguidServices, _In_ UINT cServices, _In_ IAgileReference *pReference, _Out_writes_(cServices) DWORD *rgdwCookies)
+    {
+        ServiceSnapshot *pRelease = nullptr;
+        HRESULT hr;
+        {
+            auto lock = _srwLock.LockExclusive();
+            ServiceSnapshot *pNew;
+            hr = _CreateSnapshot(&pNew);
+            if (SUCCEEDED(hr))
+            {
+                hr = AddServices(pNew->serviceTable, _cookieTable, rgguidServices, cServices, pReference, rgdwCookies);
+                pRelease = SUCCEEDED(hr) ? _Publish(pNew) : pNew;
+            }
+        }
+        // Releasing snapshots releases agile references, keep that outside of the lock
+        HazardRetireList<ServiceSnapshot>::ReleaseChain(pRelease);
+        return hr;
+    }
+
+    HRESULT Remove(_In_reads_(cCookies) const DWORD *rgdwCookies, _In_ UINT cCookies, _Out_writes_(cCookies) Microsoft::WRL::ComPtr<IAgileReference> *rgspRemoved)
+    {
+        ServiceSnapshot *pRelease = nullptr;
+        HRESULT hr;
+        {
+            auto lock = _srwLock.LockExclusive();
+            ServiceSnapshot *pNew;
+            hr = _CreateSnapshot(&pNew);
+            if (SUCCEEDED(hr))
+            {
+                UINT const cServicesBefore = pNew->serviceTable.Count();
+                hr = RemoveServices(pNew->serviceTable, _cookieTable, rgdwCookies, cCookies, rgspRemoved);
+                pRelease = (pNew->serviceTable.Count() != cServicesBefore) ? _Publish(pNew) : pNew;
+            }
+        }
+        HazardRetireList<ServiceSnapshot>::ReleaseChain(pRelease);
+        return hr;
+    }
+
+    HRESULT GetReference(_In_ REFGUID guidService, _COM_Outptr_ IAgileReference **ppReference)
+    {
+        *ppReference = nullptr;
+        ServicesReader reader(this);
+        auto pEntry = (reader.Services() != nullptr) ? reader.Services()->Find(guidService) : nullptr;
+        if (pEntry == nullptr)
+        {
+            return E_NOTIMPL;
+        }
+        return pEntry->spServiceProviderAgileReference.CopyTo(ppReference);
+    }
+
+    template <typename TInstrumentation>
+    HRESULT ResolveProvider(_In_ REFGUID guidService, _COM_Outptr_ IServiceProvider **ppProvider)
+    {
+        *ppProvider = nullptr;
+
+        // Resolve may block on an unmarshal or re-enter, it is called once the reader is gone
+        Microsoft::WRL::ComPtr<IAgileReference> spProviderReference;
+        if (FAILED(GetReference(guidService, &spProviderReference)))
+        {
+            return E_NOTIMPL;
+        }
+
+        auto const start = TInstrumentation::BeginResolve();
+        HRESULT hr = spProviderReference->Resolve(IID_PPV_ARGS(ppProvider));
+        TInstrumentation::EndResolve(ARK_SERVICE_PROVIDER, start);
+        return hr;
+    }
+
+    template <typename TInstrumentation>
+    void ResolveProviders(_In_reads_(cQueries) const ServiceQuery *rgQueries, _In_ UINT cQueries, _Out_writes_(cQueries) Microsoft::WRL::ComPtr<IServiceProvider> *rgspProviders)
+    {
+        Microsoft::WRL::ComPtr<IAgileReference> rgspReferences[c_cMaxBatchedQueries];
+        IAgileReference *rgpReferences[c_cMaxBatchedQueries] = {};
+        {
+            ServicesReader reader(this);
+            for (UINT idx = 0; (reader.Services() != nullptr) && (idx < cQueries); idx++)
+            {
+                auto pEntry = FAILED(rgQueries[idx].hr) ? reader.Services()->Find(*rgQueries[idx].pguidService) : nullptr;
+                if (pEntry != nullptr)
+                {
+                    rgspReferences[idx] = pEntry->spServiceProviderAgileReference;
+                    rgpReferences[idx] = rgspReferences[idx].Get();
+                }
+            }
+        }
+        ResolveProviderReferences<TInstrumentation>(rgpReferences, cQueries, rgspProviders);
+    }
+
+    void Summarize(_Inout_ ServiceSummary *pSummary)
+    {
+        ServicesReader reader(this);
+        if (reader.Services() != nullptr)
+        {
+            reader.Services()->Summarize(pSummary);
+        }
+    }
+
+private:
+    // The services of the current snapshot, or those of the template before there is one, kept alive
+    // while the reader is. A hazard pointer protects the snapshot or, when every hazard slot is taken,
+    // a reference on it taken under the writer lock. Keep it short lived, and take a reference on what
+    // is needed past it rather than call out while holding it.
+    class ServicesReader
+    {
+    public:
+        explicit ServicesReader(_In_ ServiceRegistry *pRegistry) : _pHeld(nullptr), _pServices(nullptr)
+        {
+            ServiceSnapshot *pSnapshot;
+            if (_hazard.IsValid())
+            {
+                pSnapshot = _hazard.Protect(&pRegistry->_pCurrent);
+            }
+            else
+            {
+                auto lock = pRegistry->_srwLock.LockShared();
+                pSnapshot = pRegistry->_pCurrent;
+                if (pSnapshot != nullptr)
+                {
+                    pSnapshot->AddRef();
+                    _pHeld = pSnapshot;
+                }
+            }
+
+            if (pSnapshot != nullptr)
+            {
+                _pServices = &pSnapshot->serviceTable;
+            }
+            else
+            {
+                ServiceTemplate *pBase = reinterpret_cast<ServiceTemplate *>(ReadPointerAcquire(reinterpret_cast<void * const volatile *>(&pRegistry->_pBase)));
+                _pServices = (pBase != nullptr) ? &pBase->Services() : nullptr;
+            }
+        }
+
+        ~ServicesReader()
+        {
+            if (_pHeld != nullptr)
+            {
+                _pHeld->Release();
+            }
+        }
+
+        ServiceTable const *Services() const
+        {
+            return _pServices;
+        }
+
+    private:
+        HazardPointer _hazard;
+        ServiceSnapshot *_pHeld;
+        ServiceTable const *_pServices;
+
+        ServicesReader(const ServicesReader &);
+        ServicesReader & operator=(const ServicesReader &);
+    };
+
+    // A copy of the current services for a writer to change, called with the writer lock held. The
+    // first copy of the template's services takes its cookies along, see ServiceRegistry::_CopyBase.
+    HRESULT _CreateSnapshot(_Outptr_ ServiceSnapshot **ppNew)
+    {
+        *ppNew = nullptr;
+        HRESULT hr = S_OK;
+        ServiceTable const *pCopyFrom = (_pCurrent != nullptr) ? &_pCurrent->serviceTable : nullptr;
+        if ((pCopyFrom == nullptr) && (_pBase != nullptr))
+        {
+            pCopyFrom = &_pBase->Services();
+            if (_cookieTable.IsUnused())
+            {
+                hr = _cookieTable.CopyFrom(_pBase->Cookies());
+            }
+        }
+
+        if (SUCCEEDED(hr))
+        {
+            hr = ServiceSnapshot::Create(pCopyFrom, ppNew);
+        }
+        return hr;
+    }
+
+    // Publishes pNew and retires the previous snapshot. Called with the writer lock held,
+    // returns the snapshots that are now safe to release.
+    ServiceSnapshot *_Publish(_In_ ServiceSnapshot *pNew)
+    {
+        ServiceSnapshot *pOld = reinterpret_cast<ServiceSnapshot *>(InterlockedExchangePointer(reinterpret_cast<void * volatile *>(&_pCurrent), pNew));
+        if (pOld != nullptr)
+        {
+            _retired.Retire(pOld);
+        }
+        return _retired.DetachReclaimable();
+    }
+
+    ServiceSnapshot * volatile _pCurrent;
+    ServiceTemplate * volatile _pBase;
+    HazardRetireList<ServiceSnapshot> _retired;
+    ServiceCookieTableT<cInlineServices> _cookieTable;
+    ProfferServiceSnapshotLock _srwLock;
+};
+
+// Per thread cache of the IServiceProvider pointers that QueryService resolved, used for
+// PSO_CACHE_RESOLVED_PROVIDERS.
+//
+// A slot belongs to the thread (and COM context) that filled it and is only ever handed out to,
+// or replaced by, that same thread so a proxy never leaves the apartment it was unmarshaled in.
+// Each slot has its own cache line, threads looking up their own slots don't share any writes.
+// Entries carry the cache's generation at the time the provider was resolved, RevokeService calls
+// Invalidate which bumps the generation, making every older entry a miss, and releases the entries
+// of the calling apartment. Those of other apartments are released there, when their thread next
+// looks a provider up or stores one, or when the cache is destroyed.
+class ResolvedProviderCache
+{
+public:
+    ResolvedProviderCache() : _pSlots(nullptr), _lGeneration(0)
+    {
+    }
+
+    ~ResolvedProviderCache()
+    {
+        delete [] _pSlots;
+    }
+
+    // Read before resolving, and passed to Store along with what was resolved
+    LONG Generation() const
+    {
+        return ReadAcquire(&_lGeneration);
+    }
+
+    bool Lookup(_In_ REFGUID guidService, _COM_Outptr_ IServiceProvider **ppProvider)
+    {
+        *ppProvider = nullptr;
+        DWORD const dwThreadId = GetCurrentThreadId();
+        ULONG_PTR ulContextToken = 0;
+        CoGetContextToken(&ulContextToken);
+        LONG const lGeneration = Generation();
+        Slot *pFirstSlot = _GetSlots();
+        UINT const idxStart = _SlotIndex(guidService, dwThreadId);
+        for (UINT idxProbe = 0; (pFirstSlot != nullptr) && (idxProbe < c_cProbes); idxProbe++)
+        {
+            Slot &slot = pFirstSlot[(idxStart + idxProbe) & (c_cSlots - 1)];
+            Microsoft::WRL::ComPtr<IServiceProvider> spStale;
+            if ((ReadULongNoFence(&slot.dwThreadId) == dwThreadId) && _TryLockSlot(slot))
+            {
+                bool const fOurs = (slot.dwThreadId == dwThreadId) && (slot.ulContextToken == ulContextToken);
+                bool const fHit = fOurs && (slot.lGeneration == lGeneration) && (slot.guidService == guidService) && slot.spProvider;
+                if (fHit)
+                {
+                    slot.spProvider.CopyTo(ppProvider);
+                    _Count(&slot.cHits);
+                }
+                else if (fOurs && (slot.lGeneration != lGeneration))
+                {
+                    // Revoked since, release it here rather than leave it to another apartment
+                    spStale.Swap(slot.spProvider);
+                }
+                _UnlockSlot(slot);
+                if (fHit)
+                {
+                    return true;
+                }
+            }
+        }
+
+        // Charge the miss to the thread's home slot
+        if ((pFirstSlot != nullptr) && _TryLockSlot(pFirstSlot[idxStart]))
+        {
+            _Count(&pFirstSlot[idxStart].cMisses);
+            _UnlockSlot(pFirstSlot[idxStart]);
+        }
+        return false;
+    }
+
+    void Store(_In_ REFGUID guidService, _In_ LONG lGeneration, _In_ IServiceProvider *pProvider)
+    {
+        DWORD const dwThreadId = GetCurrentThreadId();
+        ULONG_PTR ulContextToken = 0;
+        CoGetContextToken(&ulContextToken);
+        Slot *pFirstSlot = _GetSlots();
+        UINT const idxStart = _SlotIndex(guidService, dwThreadId);
+
+        // Replace this thread's entry for the service, otherwise take a free slot. Slots of other
+        // threads are left alone since their providers have to be released in their apartment.
+        Slot *pTarget = nullptr;
+        for (UINT idxProbe = 0; (pFirstSlot != nullptr) && (idxProbe < c_cProbes); idxProbe++)
+        {
+            Slot &slot = pFirstSlot[(idxStart + idxProbe) & (c_cSlots - 1)];
+            DWORD const dwSlotThreadId = ReadULongNoFence(&slot.dwThreadId);
+            if ((dwSlotThreadId == dwThreadId) && (slot.guidService == guidService))
+            {
+                pTarget = &slot;
+                break;
+            }
+            if ((pTarget == nullptr) && (dwSlotThreadId == 0))
+            {
+                pTarget = &slot;
+            }
+        }
+
+        // Let the release of a replaced provider occur outside of the slot lock. A provider resolved
+        // before an Invalidate isn't stored, the generation is read under the slot lock so that either
+        // this sees the new one or Invalidate sees the entry.
+        Microsoft::WRL::ComPtr<IServiceProvider> spReplaced;
+        if ((pTarget != nullptr) && _TryLockSlot(*pTarget))
+        {
+            if (((pTarget->dwThreadId == 0) || (pTarget->dwThreadId == dwThreadId)) && (lGeneration == Generation()))
+            {
+                WriteULongNoFence(&pTarget->dwThreadId, dwThreadId);
+                pTarget->ulContextToken = ulContextToken;
+                pTarget->lGeneration = lGeneration;
+                pTarget->guidService = guidService;
+                spReplaced.Swap(pTarget->spProvider);
+                pTarget->spProvider = pProvider;
+            }
+            _UnlockSlot(*pTarget);
+        }
+    }
+
+    // Makes every entry stale and releases those of the calling apartment. Call it after the services
+    // have been removed from the registry, a lookup racing with it then can't store a revoked provider.
+    void Invalidate()
+    {
+        InterlockedIncrement(&_lGeneration);
+
+        ULONG_PTR ulContextToken = 0;
+        CoGetContextToken(&ulContextToken);
+        Slot *pFirstSlot = _ReadSlots();
+        for (UINT idx = 0; (pFirstSlot != nullptr) && (idx < c_cSlots); idx++)
+        {
+            Slot &slot = pFirstSlot[idx];
+            Microsoft::WRL::ComPtr<IServiceProvider> spReleased;
+            if (ReadULongNoFence(&slot.dwThreadId) != 0)
+            {
+                // Wait for the slot rather than skip it, a Store holding it may be about to fill it
+                while (!_TryLockSlot(slot))
+                {
+                    YieldProcessor();
+                }
+                if ((slot.dwThreadId != 0) && (slot.ulContextToken == ulContextToken))
+                {
+                    spReleased.Swap(slot.spProvider);
+                }
+                _UnlockSlot(slot);
+            }
+        }
+    }
+
+    // The counts are gathered per slot without further synchronization, treat them as approximate
+    void GetStatistics(_Out_ ULONGLONG *pcHits, _Out_ ULONGLONG *pcMisses) const
+    {
+        *pcHits = 0;
+        *pcMisses = 0;
+        Slot *pFirstSlot = _ReadSlots();
+        for (UINT idx = 0; (pFirstSlot != nullptr) && (idx < c_cSlots); idx++)
+        {
+            *pcHits += ReadULongNoFence(&pFirstSlot[idx].cHits);
+            *pcMisses += ReadULongNoFence(&pFirstSlot[idx].cMisses);
+        }
+    }
+
+private:
+    static const UINT c_cSlots = 64;
+    static const UINT c_cProbes = 4;
+
+    struct DECLSPEC_CACHEALIGN Slot
+    {
+        Slot() : lBusy(0), dwThreadId(0), ulContextToken(0), lGeneration(0), cHits(0), cMisses(0)
+        {
+            ZeroMemory(&guidService, sizeof(guidService));
+        }
+
+        LONG volatile lBusy;
+        DWORD volatile dwThreadId;  // 0 until the slot is first filled, probed without the lock
+        ULONG_PTR ulContextToken;
+        LONG lGeneration;
+        GUID guidService;
+        Microsoft::WRL::ComPtr<IServiceProvider> spProvider;
+        ULONG volatile cHits;       // written with the lock held, read by GetStatistics without it
+        ULONG volatile cMisses;
+    };
+
+    static void _Count(_Inout_ ULONG volatile *pcCount)
+    {
+        WriteULongNoFence(pcCount, ReadULongNoFence(pcCount) + 1);
+    }
+
+    static UINT _SlotIndex(_In_ REFGUID guidService, _In_ DWORD dwThreadId)
+    {
+        return (HashServiceId(guidService) ^ ((dwThreadId >> 2) * 2654435761u)) & (c_cSlots - 1);
+    }
+
+    // Slots are only ever contended when two threads hash to the same one, in which case the
+    // loser just treats it as a miss rather than waiting.
+    static bool _TryLockSlot(_In_ Slot &slot)
+    {
+        return InterlockedCompareExchange(&slot.lBusy, 1, 0) == 0;
+    }
+
+    static void _UnlockSlot(_In_ Slot &slot)
+    {
+        InterlockedExchange(&slot.lBusy, 0);
+    }
+
+    // The slots are allocated on first use so that objects that are never queried pay nothing
+    Slot *_ReadSlots() const
+    {
+        return reinterpret_cast<Slot *>(ReadPointerAcquire(reinterpret_cast<void * const volatile *>(&_pSlots)));
+    }
+
+    Slot *_GetSlots()
+    {
+        Slot *pSlots = _ReadSlots();
+        if (pSlots == nullptr)
+        {
+            Slot *pNewSlots = new (std::nothrow) Slot[c_cSlots];
+            if (pNewSlots != nullptr)
+            {
+                pSlots = reinterpret_cast<Slot *>(InterlockedCompareExchangePointer(reinterpret_cast<void * volatile *>(&_pSlots), pNewSlots, nullptr));
+                if (pSlots == nullptr)
+                {
+                    pSlots = pNewSlots;
+                }
+                else
+                {
+                    delete [] pNewSlots;
+                }
+            }
+        }
+        return pSlots;
+    }
+
+    Slot * volatile _pSlots;
+    LONG volatile _lGeneration;     // bumped by Invalidate
+
+    ResolvedProviderCache(const ResolvedProviderCache &);
+    ResolvedProviderCache & operator=(const ResolvedProviderCache &);
+};
+
+// Remembers, for PSO_MEMOIZE_SITE_CHAIN, which ancestor answered a service or that nothing in the
+// site chain did. Small and direct mapped on purpose, it only needs to hold the services a node
+// actually forwards up the chain. The owner serializes access.
+class SiteChainRouteCache
+{
+public:
+    struct Route
+    {
+        Route() : fValid(false), fOwnerIsNode(false)
+        {
+        }
+
+        GUID guidService;
+        bool fValid;
+        bool fOwnerIsNode;      // the owner implements ISiteChainNode, ask it for its local services only
+        SiteChainNodeGenerations generations;   // of the node and of the ancestors the route goes through
+        Microsoft::WRL::ComPtr<IAgileReference> spOwnerReference;   // nullptr for a chain wide miss
+    };
+
+    // Copies out the owner of a route for guidService none of whose nodes moved on since, a miss
+    // leaves *pspOwnerReference empty
+    bool Lookup(_In_ REFGUID guidService, _Out_ bool *pfOwnerIsNode, _Out_ Microsoft::WRL::ComPtr<IAgileReference> *pspOwnerReference) const
+    {
+        Route const &route = _rgRoutes[HashServiceId(guidService) % ARRAYSIZE(_rgRoutes)];
+        bool const fFound = route.fValid && (route.guidService == guidService) && route.generations.IsCurrent();
+        if (fFound)
+        {
+            *pfOwnerIsNode = route.fOwnerIsNode;
+            *pspOwnerReference = route.spOwnerReference;
+        }
+        return fFound;
+    }
+
+    // Swaps *pRoute into its slot, the displaced route is handed back so that it can be released
+    // outside the lock
+    void Store(_Inout_ Route *pRoute)
+    {
+        Route &slot = _rgRoutes[HashServiceId(pRoute->guidService) % ARRAYSIZE(_rgRoutes)];
+        std::swap(slot.guidService, pRoute->guidService);
+        std::swap(slot.fValid, pRoute->fValid);
+        std::swap(slot.fOwnerIsNode, pRoute->fOwnerIsNode);
+        slot.generations.Swap(&pRoute->generations);
+        slot.spOwnerReference.Swap(pRoute->spOwnerReference);
+    }
+
+    // Forgets every route, the owner references are moved to pspReleased for release outside the lock
+    void Clear(_Out_writes_(c_cRoutes) Microsoft::WRL::ComPtr<IAgileReference> *pspReleased)
+    {
+        for (UINT idx = 0; idx < c_cRoutes; idx++)
+        {
+            _rgRoutes[idx].fValid = false;
+            pspReleased[idx].Attach(_rgRoutes[idx].spOwnerReference.Detach());
+        }
+    }
+
+    static const UINT c_cRoutes = 16;
+
+private:
+    Route _rgRoutes[c_cRoutes];
+};
+
+// Stands in for the agile reference of a provider that ProfferLazyServices registered. The first
+// Resolve calls the factory and takes an agile reference on what it created, every later Resolve goes
+// through that reference. Concurrent first Resolves wait for a single call of the factory, and a
+// failed call leaves the next Resolve to try again.
+template <typename TFactory>
+class LazyServiceProviderReference : public Microsoft::WRL::RuntimeClass<
+    Microsoft::WRL::RuntimeClassFlags<Microsoft::WRL::RuntimeClassType::ClassicCom>,
+    Microsoft::WRL::FtmBase,
+    IAgileReference>
+{
+public:
+    LazyServiceProviderReference(_In_ AgileReferenceOptions agileReferenceOption, _In_ bool fAdaptive, const TFactory &factory) :
+        _agileReferenceOption(agileReferenceOption), _fAdaptive(fAdaptive), _factory(factory)
+    {
+        InitOnceInitialize(&_initOnce);
+    }
+
+    // IAgileReference
+    IFACEMETHODIMP Resolve(_In_ REFIID riid, _COM_Outptr_ void **ppv)
+    {
+        *ppv = nullptr;
+        CreateParameter parameter = { this, S_OK };
+        HRESULT hr = InitOnceExecuteOnce(&_initOnce, _Create, &parameter, nullptr) ? S_OK : parameter.hr;
+        if (SUCCEEDED(hr))
+        {
+            hr = _spReference->Resolve(riid, ppv);
+        }
+        return hr;
+    }
+
+private:
+    struct CreateParameter
+    {
+        LazyServiceProviderReference *pThis;
+        HRESULT hr;
+    };
+
+    static BOOL CALLBACK _Create(_Inout_ PINIT_ONCE /*pInitOnce*/, _Inout_opt_ PVOID pParameter, _Outptr_opt_result_maybenull_ PVOID * /*ppContext*/)
+    {
+        CreateParameter *pCreate = static_cast<CreateParameter *>(pParameter);
+        LazyServiceProviderReference *pThis = pCreate->pThis;
+        Microsoft::WRL::ComPtr<IServiceProvider> spProvider;
+        HRESULT hr = pThis->_factory(&spProvider);
+        if (SUCCEEDED(hr))
+        {
+            hr = GetAgileReference(pThis->_fAdaptive, pThis->_agileReferenceOption, __uuidof(IServiceProvider), spProvider.Get(), &pThis->_spReference);
+        }
+        pCreate->hr = hr;
+        return SUCCEEDED(hr);
+    }
+
+    AgileReferenceOptions const _agileReferenceOption;
+    bool const _fAdaptive;
+    TFactory _factory;
+    INIT_ONCE _initOnce;
+    Microsoft::WRL::ComPtr<IAgileReference> _spReference;     // set once _initOnce completed
+};
+
+// What PSO_SUMMARIZE_SITE_CHAIN knows about the ancestors of a node: the services any of them may
+// answer, and nearest first the ancestors that may answer any. It holds as long as none of the nodes
+// it went through moves on. Immutable once built and reference counted, so that lookups keep using
+// it while a newer one replaces it.
+class SiteChainSummary
+{
+public:
+    struct Owner
+    {
+        Owner() : fNode(false)
+        {
+        }
+
+        Microsoft::WRL::ComPtr<IAgileReference> spReference;
+        ServiceSummary services;
+        bool fNode;         // implements ISiteChainNode, ask it for its local services only
+    };
+
+    SiteChainSummary() : cOwners(0), rgOwners(nullptr), _cCapacity(0), _cRef(1)
+    {
+    }
+
+    HRESULT AddOwner(_In_ IServiceProvider *pOwner, _In_ bool fNode, _In_ ServiceSummary const &ownerServices)
+    {
+        HRESULT hr = (cOwners < _cCapacity) ? S_OK : _Grow();
+        if (SUCCEEDED(hr))
+        {
+            hr = RoGetAgileReference(AgileReferenceOptions::AGILEREFERENCE_DEFAULT, __uuidof(IServiceProvider), pOwner, &rgOwners[cOwners].spReference);
+        }
+
+        if (SUCCEEDED(hr))
+        {
+            rgOwners[cOwners].services = ownerServices;
+            rgOwners[cOwners].fNode = fNode;
+            services.Add(ownerServices);
+            cOwners++;
+        }
+        return hr;
+    }
+
+    ULONG AddRef()
+    {
+        return InterlockedIncrement(&_cRef);
+    }
+
+    ULONG Release()
+    {
+        ULONG const cRef = InterlockedDecrement(&_cRef);
+        if (cRef == 0)
+        {
+            delete this;
+        }
+        return cRef;
+    }
+
+    SiteChainNodeGenerations generations;   // of the node summarized and of every node above it
+    ServiceSummary services;
+    UINT cOwners;
+    Owner *rgOwners;
+
+private:
+    ~SiteChainSummary()
+    {
+        delete [] rgOwners;
+    }
+
+    HRESULT _Grow()
+    {
+        UINT const cNewCapacity = (_cCapacity == 0) ? 4 : _cCapacity * 2;
+        Owner *rgNewOwners = new (std::nothrow) Owner[cNewCapacity];
+        HRESULT hr = (rgNewOwners != nullptr) ? S_OK : E_OUTOFMEMORY;
+        if (SUCCEEDED(hr))
+        {
+            for (UINT idx = 0; idx < cOwners; idx++)
+            {
+                rgNewOwners[idx].spReference.Swap(rgOwners[idx].spReference);
+                rgNewOwners[idx].services = rgOwners[idx].services;
+                rgNewOwners[idx].fNode = rgOwners[idx].fNode;
+            }
+            delete [] rgOwners;
+            rgOwners = rgNewOwners;
+            _cCapacity = cNewCapacity;
+        }
+        return hr;
+    }
+
+    UINT _cCapacity;
+    LONG volatile _cRef;
+
+    SiteChainSummary(const SiteChainSummary &);
+    SiteChainSummary & operator=(const SiteChainSummary &);
+};
+
+template <typename LockType, typename TInstrumentation, UINT cInlineServices>
+class ProfferServiceBase : public Microsoft::WRL::Implements<Microsoft::WRL::RuntimeClassFlags<Microsoft::WRL::RuntimeClassType::ClassicCom>, 
+                                                               IProfferService,
+                                                               IServiceProvider,
+                                                               ISiteChainNode>
+{
+public:
+    // IProfferService
+    IFACEMETHODIMP ProfferService(_In_ REFGUID rguidService, _In_ IServiceProvider *psp, _Out_ DWORD *pdwCookie)
+    {
+        return ProfferServices(&rguidService, 1, psp, pdwCookie);
+    }
+
+    IFACEMETHODIMP RevokeService(_In_ DWORD dwCookie)
+    {
+        return RevokeServices(&dwCookie, 1);
+    }
+
+    // Proffers all of rgguidServices, served by the same psp, in one go: a single agile reference is
+    // shared by all of them and they are added under a single lock acquisition. Either every service
+    // is proffered, and rgdwCookies receives their cookies, or none is (say one is already registered).
+    HRESULT ProfferServices(_In_reads_(cServices) const GUID *rgguidServices, _In_ UINT cServices, _In_ IServiceProvider *psp, _Out_writes_(cServices) DWORD *rgdwCookies)
+    {
+        ZeroMemory(rgdwCookies, cServices * sizeof(*rgdwCookies));
+        Microsoft::WRL::ComPtr<IAgileReference> spReference;
+        HRESULT hr = GetAgileReference((_options & PSO_ADAPTIVE_AGILE_REFERENCES) != 0, _agileReferenceOption, __uuidof(psp), psp, &spReference);
+        if (SUCCEEDED(hr))
+        {
+            hr = _registry.Add(rgguidServices, cServices, spReference.Get(), rgdwCookies);
+            if (SUCCEEDED(hr))
+            {
+                _AdvanceNodeGeneration();
+            }
+        }
+        return hr;
+    }
+
+    // Proffers guidService without creating its provider yet. factory is a callable taking an
+    // IServiceProvider ** and returning an HRESULT, called on the first QueryService for the service
+    // (or for any of rgguidServices) on the thread of that QueryService. The provider is created at
+    // most once, even when AgileProfferService gets several first QueryServices at once, unless the
+    // factory fails, then the next QueryService calls it again. The factory is kept, and the provider
+    // once created, until the service is revoked.
+    template <typename TFactory>
+    HRESULT ProfferLazyService(_In_ REFGUID guidService, const TFactory &factory, _Out_ DWORD *pdwCookie)
+    {
+        return ProfferLazyServices(&guidService, 1, factory, pdwCookie);
+    }
+
+    template <typename TFactory>
+    HRESULT ProfferLazyServices(_In_reads_(cServices) const GUID *rgguidServices, _In_ UINT cServices, const TFactory &factory, _Out_writes_(cServices) DWORD *rgdwCookies)
+    {
+        ZeroMemory(rgdwCookies, cServices * sizeof(*rgdwCookies));
+        Microsoft::WRL::ComPtr<LazyServiceProviderReference<TFactory>> spReference = Microsoft::WRL::Make<LazyServiceProviderReference<TFactory>>(_agileReferenceOption,
+            (_options & PSO_ADAPTIVE_AGILE_REFERENCES) != 0, factory);
+        HRESULT hr = spReference ? S_OK : E_OUTOFMEMORY;
+        if (SUCCEEDED(hr))
+        {
+            hr = _registry.Add(rgguidServices, cServices, spReference.Get(), rgdwCookies);
+            if (SUCCEEDED(hr))
+            {
+                _AdvanceNodeGeneration();
+            }
+        }
+        return hr;
+    }
+
+    // Starts the object off with the services of pTemplate, which it shares with every other object
+    // using the template instead of proffering them itself: no allocation and no agile reference per
+    // service. The object copies them on its first ProfferService or RevokeService, the cookies the
+    // template handed out can be revoked here as well. Fails with HRESULT_FROM_WIN32(ERROR_INVALID_STATE)
+    // once the object has proffered anything.
+    HRESULT UseServiceTemplate(_In_ ServiceTemplate *pTemplate)
+    {
+        HRESULT hr = _registry.SetBase(pTemplate);
+        if (SUCCEEDED(hr))
+        {
+            _AdvanceNodeGeneration();
+        }
+        return hr;
+    }
+
+    // Revokes every valid cookie of rgdwCookies under a single lock acquisition. Returns E_INVALIDARG
+    // if any cookie wasn't valid, the valid ones are revoked regardless.
+    HRESULT RevokeServices(_In_reads_(cCookies) const DWORD *rgdwCookies, _In_ UINT cCookies)
+    {
+        // The references are released after the registry's lock has been dropped
+        Microsoft::WRL::ComPtr<IAgileReference> spReferenceRelease;
+        Microsoft::WRL::ComPtr<IAgileReference> *rgspReferenceRelease = &spReferenceRelease;
+        if (cCookies > 1)
+        {
+            rgspReferenceRelease = new (std::nothrow) Microsoft::WRL::ComPtr<IAgileReference>[cCookies];
+            if (rgspReferenceRelease == nullptr)
+            {
+                return E_OUTOFMEMORY;
+            }
+        }
+
+        HRESULT hr = _registry.Remove(rgdwCookies, cCookies, rgspReferenceRelease);
+
+        // Only after the removal, a lookup racing with us must not remember a revoked
+        // provider under the new generation. Stale cookies remove nothing and change nothing,
+        // the generations are left alone so that what was remembered everywhere stays valid.
+        bool fRemoved = false;
+        for (UINT idx = 0; !fRemoved && (idx < cCookies); idx++)
+        {
+            fRemoved = (rgspReferenceRelease[idx] != nullptr);
+        }
+        if (fRemoved)
+        {
+            _providerCache.Invalidate();
+            _AdvanceNodeGeneration();
+        }
+
+        for (UINT idx = 0; ((_options & PSO_DEFER_RELEASE) != 0) && (idx < cCookies); idx++)
+        {
+            DeferredReleaseQueue::Defer(rgspReferenceRelease[idx].GetAddressOf());
+        }
+
+        if (rgspReferenceRelease != &spReferenceRelease)
+        {
+            delete [] rgspReferenceRelease;
+        }
+        return hr;
+    }
+
+    IFACEMETHODIMP QueryService(_In_ REFGUID guidService, _In_ REFIID riid, _COM_Outptr_ void **ppv)
+    {
+        ServiceResolutionPath path;
+        UINT cHops = 0;
+        HRESULT hr = _QueryLocalService(guidService, riid, ppv, &path);
+
+        // Now, if all that fails and the object supports IObjectWithSite then
+        // proceed up the site chain.
+        if (FAILED(hr))
+        {
+            hr = _QuerySiteChain(guidService, riid, ppv, &path, &cHops);
+        }
+
+        TInstrumentation::OnQueryService(guidService, path, cHops);
+        return hr;
+    }
+
+    // Looks up every service of rgQueries, with the same outcome as a QueryService for each of them.
+    // The registry is read under a single lock acquisition for the whole batch and a provider shared
+    // by several of the services is resolved once. With PSO_WALK_SITE_CHAIN alone the services not
+    // found locally go up the site chain together, each ancestor is asked once for all that are still
+    // missing. Returns S_OK when every service was found, S_FALSE when only some and E_NOTIMPL when
+    // none were, the outcome of each is in its ServiceQuery.
+    HRESULT QueryServices(_Inout_updates_(cQueries) ServiceQuery *rgQueries, _In_ UINT cQueries)
+    {
+        UINT cFound = 0;
+        for (UINT idxFirst = 0; idxFirst < cQueries; idxFirst += c_cMaxBatchedQueries)
+        {
+            UINT const cBatch = ((cQueries - idxFirst) < c_cMaxBatchedQueries) ? (cQueries - idxFirst) : c_cMaxBatchedQueries;
+            cFound += _QueryServicesBatch(rgQueries + idxFirst, cBatch);
+        }
+        return (cFound == cQueries) ? S_OK : ((cFound != 0) ? S_FALSE : E_NOTIMPL);
+    }
+
+    // ISiteChainNode
+    IFACEMETHODIMP QueryLocalService(_In_ REFGUID guidService, _In_ REFIID riid, _COM_Outptr_ void **ppv)
+    {
+        ServiceResolutionPath path;
+        return _QueryLocalService(guidService, riid, ppv, &path);
+    }
+
+    IFACEMETHODIMP_(void) QueryLocalServices(_Inout_updates_(cQueries) ServiceQuery *rgQueries, _In_ UINT cQueries)
+    {
+        ServiceResolutionPath rgPaths[c_cMaxBatchedQueries];
+        for (UINT idxFirst = 0; idxFirst < cQueries; idxFirst += c_cMaxBatchedQueries)
+        {
+            UINT const cBatch = ((cQueries - idxFirst) < c_cMaxBatchedQueries) ? (cQueries - idxFirst) : c_cMaxBatchedQueries;
+            _QueryLocalServices(rgQueries + idxFirst, cBatch, rgPaths);
+        }
+    }
+
+    IFACEMETHODIMP_(void) GetLocalServiceSummary(_Out_ ServiceSummary *pSummary)
+    {
+        pSummary->Clear();
+        _registry.Summarize(pSummary);
+        v_SummarizeServices(pSummary);
+    }
+
+    IFACEMETHODIMP_(void) SiteChanged()
+    {
+        _AdvanceNodeGeneration();
+
+        // The routes and the summary hold references on our former ancestors, drop them now
+        // rather than whenever the next lookup notices they are stale.
+        Microsoft::WRL::ComPtr<IAgileReference> rgspReleased[SiteChainRouteCache::c_cRoutes];
+        SiteChainSummary *pReleased;
+        {
+            auto lock = _routeLock.LockExclusive();
+            _routeCache.Clear(rgspReleased);
+            pReleased = _pChainSummary;
+            _pChainSummary = nullptr;
+        }
+
+        if (pReleased != nullptr)
+        {
+            pReleased->Release();
+        }
+    }
+
+    // Created on the first call, objects nobody watches don't pay for it
+    IFACEMETHODIMP GetNodeGeneration(_Outptr_ SiteChainNodeGeneration **ppGeneration)
+    {
+        SiteChainNodeGeneration *pGeneration = _ReadNodeGeneration();
+        if (pGeneration == nullptr)
+        {
+            SiteChainNodeGeneration *pNewGeneration = new (std::nothrow) SiteChainNodeGeneration();
+            if (pNewGeneration == nullptr)
+            {
+                *ppGeneration = nullptr;
+                return E_OUTOFMEMORY;
+            }
+
+            pGeneration = reinterpret_cast<SiteChainNodeGeneration *>(InterlockedCompareExchangePointer(reinterpret_cast<void * volatile *>(&_pNodeGeneration), pNewGeneration, nullptr));
+            if (pGeneration == nullptr)
+            {
+                pGeneration = pNewGeneration;
+            }
+            else
+            {
+                pNewGeneration->Release();
+            }
+        }
+
+        pGeneration->AddRef();
+        *ppGeneration = pGeneration;
+        return S_OK;
+    }
+
+protected:
+    virtual HRESULT v_QueryService(_In_ REFGUID /*guidService*/, _In_ REFIID /*riid*/, _COM_Outptr_ void ** /*ppv*/)
+    {
+        return E_NOTIMPL;
+    }
+
+    // Adds the services v_QueryService answers to pSummary, for the descendants that use
+    // PSO_SUMMARIZE_SITE_CHAIN. Overrides of v_QueryService should override this as well.
+    virtual void v_SummarizeServices(_Inout_ ServiceSummary * /*pSummary*/)
+    {
+    }
+
+    ProfferServiceBase(AgileReferenceOptions agileReferenceOption, ProfferServiceOptions options) : _agileReferenceOption(agileReferenceOption),
+                                                                                                     _options(options),
+                                                                                                     _pChainSummary(nullptr),
+                                                                                                     _pNodeGeneration(nullptr)
+    {
+    }
 
-namespace Windows { namespace Internal { namespace WRL {
+    ~ProfferServiceBase()
+    {
+        if (_pChainSummary != nullptr)
+        {
+            _pChainSummary->Release();
+        }
 
-namespace Details
-{
+        // Whatever was found through us is gone with us
+        if (_pNodeGeneration != nullptr)
+        {
+            _pNodeGeneration->Advance();
+            _pNodeGeneration->Release();
+        }
+    }
 
-class ProfferServiceNoLock
-{
 public:
-    // Need to define a destructor so when this pattern is used
-    // auto lock = srwLock.LockXXX
-    // the compiler does not generate the warning
-    // 
-    // profferserviceimpl.h(58) : error C4189: 'lock' : local variable is initialized but not referenced
-    // 
-    // which is why returning something like (int 0) doesn't work.
-    //
-    ~ProfferServiceNoLock()
+    // Hits and misses of the PSO_CACHE_RESOLVED_PROVIDERS cache, both zero when it isn't enabled.
+    // The counts are gathered without synchronization so treat them as approximate.
+    void GetResolvedProviderCacheStatistics(_Out_ ULONGLONG *pcHits, _Out_ ULONGLONG *pcMisses) const
     {
+        _providerCache.GetStatistics(pcHits, pcMisses);
     }
 
-    ProfferServiceNoLock LockExclusive() { return (*this); }
-    ProfferServiceNoLock LockShared() { return (*this); }
-};
-
-template <typename LockType>
-class ProfferServiceBase : public Microsoft::WRL::Implements<Microsoft::WRL::RuntimeClassFlags<Microsoft::WRL::RuntimeClassType::ClassicCom>, 
-                                                               IProfferService,
-                                                               IServiceProvider>
-{
-public:
-    // IProfferService
-    IFACEMETHODIMP ProfferService(_In_ REFGUID rguidService, _In_ IServiceProvider *psp, _Out_ DWORD *pdwCookie)
+    // How the provider of guidService was reached through its AdaptiveAgileReference, for
+    // PSO_ADAPTIVE_AGILE_REFERENCES. Fails with E_NOTIMPL when nothing is registered for the service
+    // and with E_NOINTERFACE when its provider isn't held through an AdaptiveAgileReference (including
+    // lazy services).
+    HRESULT GetServiceReferenceUsage(_In_ REFGUID guidService, _Out_ AdaptiveAgileReferenceUsage *pUsage)
     {
-        *pdwCookie = 0;
+        ZeroMemory(pUsage, sizeof(*pUsage));
         Microsoft::WRL::ComPtr<IAgileReference> spReference;
-        HRESULT hr = RoGetAgileReference(_agileReferenceOption, __uuidof(psp), psp, &spReference);
+        HRESULT hr = _registry.GetReference(guidService, &spReference);
         if (SUCCEEDED(hr))
         {
-            auto lock = _srwLock.LockExclusive();
-            auto pWalk = _pServiceItems;
-            while (pWalk != nullptr)
+            hr = GetAdaptiveAgileReferenceUsage(spReference.Get(), pUsage);
+        }
+        return hr;
+    }
+
+private:
+    // Our services or our site changed, after the change itself so that a lookup racing with it either
+    // sees the change or is invalidated by it. The barrier orders the change before the read of
+    // _pNodeGeneration, against a GetNodeGeneration creating it and a lookup reading it.
+    void _AdvanceNodeGeneration()
+    {
+        MemoryBarrier();
+        SiteChainNodeGeneration *pGeneration = _ReadNodeGeneration();
+        if (pGeneration != nullptr)
+        {
+            pGeneration->Advance();
+        }
+    }
+
+    SiteChainNodeGeneration *_ReadNodeGeneration() const
+    {
+        return reinterpret_cast<SiteChainNodeGeneration *>(ReadPointerAcquire(reinterpret_cast<void * const volatile *>(&_pNodeGeneration)));
+    }
+
+    HRESULT _QueryLocalService(_In_ REFGUID guidService, _In_ REFIID riid, _COM_Outptr_ void **ppv, _Out_ ServiceResolutionPath *pPath)
+    {
+        *ppv = nullptr;
+        *pPath = SRP_REGISTRY;
+        Microsoft::WRL::ComPtr<IServiceProvider> spProvider;
+        HRESULT hr = _ResolveProvider(guidService, &spProvider);
+        if (SUCCEEDED(hr))
+        {
+            hr = spProvider->QueryService(guidService, riid, ppv);
+        }
+
+        // In theory, this should be checking explicitly for E_NOTIMPL per guidelines
+        // for implementing QueryService. However, this isn't always the case.
+        // We can get here one of two ways. Either the service wasn't found in our table
+        // or the spProvider->QueryService call above failed.
+        if (FAILED(hr))
+        {
+            hr = v_QueryService(guidService, riid, ppv);
+            *pPath = SUCCEEDED(hr) ? SRP_VIRTUAL : SRP_NOT_FOUND;
+        }
+        return hr;
+    }
+
+    // _QueryLocalService for every query of rgQueries that hasn't succeeded yet, at most
+    // c_cMaxBatchedQueries of them. rgPaths receives how those were answered.
+    void _QueryLocalServices(_Inout_updates_(cQueries) ServiceQuery *rgQueries, _In_ UINT cQueries, _Out_writes_(cQueries) ServiceResolutionPath *rgPaths)
+    {
+        Microsoft::WRL::ComPtr<IServiceProvider> rgspProviders[c_cMaxBatchedQueries];
+        if ((_options & PSO_CACHE_RESOLVED_PROVIDERS) == 0)
+        {
+            _registry.template ResolveProviders<TInstrumentation>(rgQueries, cQueries, rgspProviders);
+        }
+        else
+        {
+            // The cache is per service already, nothing to gain from batching
+            for (UINT idx = 0; idx < cQueries; idx++)
             {
-                if (pWalk->guidService == rguidService)
+                if (FAILED(rgQueries[idx].hr))
                 {
-                    hr = HRESULT_FROM_WIN32(ERROR_ALREADY_REGISTERED);
-                    break;
+                    _ResolveProvider(*rgQueries[idx].pguidService, &rgspProviders[idx]);
                 }
-                pWalk = pWalk->pNext;
             }
+        }
 
-            if (SUCCEEDED(hr))
+        for (UINT idx = 0; idx < cQueries; idx++)
+        {
+            ServiceQuery &query = rgQueries[idx];
+            if (FAILED(query.hr))
             {
-                ServiceItem *pItem = new (std::nothrow) ServiceItem(rguidService, _dwNextCookie, spReference.Get(), _pServiceItems);
-                hr = (pItem != nullptr) ? S_OK : E_OUTOFMEMORY;
-                if (SUCCEEDED(hr))
+                query.hr = E_NOTIMPL;
+                rgPaths[idx] = SRP_REGISTRY;
+                if (rgspProviders[idx])
                 {
-                    _pServiceItems = pItem;
-                    *pdwCookie = _dwNextCookie++;
+                    query.hr = rgspProviders[idx]->QueryService(*query.pguidService, *query.piid, reinterpret_cast<void **>(&query.punkService));
+                }
+
+                // Same as _QueryLocalService, v_QueryService gets its chance whatever the reason
+                if (FAILED(query.hr))
+                {
+                    query.hr = v_QueryService(*query.pguidService, *query.piid, reinterpret_cast<void **>(&query.punkService));
+                    rgPaths[idx] = SUCCEEDED(query.hr) ? SRP_VIRTUAL : SRP_NOT_FOUND;
                 }
             }
         }
-        return hr;
     }
 
-    IFACEMETHODIMP RevokeService(_In_ DWORD dwCookie)
+    // QueryServices for at most c_cMaxBatchedQueries queries, returns how many were found
+    UINT _QueryServicesBatch(_Inout_updates_(cQueries) ServiceQuery *rgQueries, _In_ UINT cQueries)
     {
-        HRESULT hr = E_INVALIDARG;
-        // This is not declared in minimum scope so that the release occurs
-        // outside of holding the lock
-        Microsoft::WRL::ComPtr<IAgileReference> spReferenceRelease;
+        ServiceResolutionPath rgPaths[c_cMaxBatchedQueries];
+        UINT rgcHops[c_cMaxBatchedQueries] = {};
+        for (UINT idx = 0; idx < cQueries; idx++)
+        {
+            rgQueries[idx].punkService = nullptr;
+            rgQueries[idx].hr = E_NOTIMPL;
+        }
+        _QueryLocalServices(rgQueries, cQueries, rgPaths);
+
+        if ((_options & (PSO_MEMOIZE_SITE_CHAIN | PSO_SUMMARIZE_SITE_CHAIN | PSO_WALK_SITE_CHAIN)) != PSO_WALK_SITE_CHAIN)
         {
-            auto lock =_srwLock.LockExclusive();
-            auto pWalk = _pServiceItems;
-            auto pPrev = _pServiceItems;
-            while (pWalk != nullptr)
+            // The remembered routes, the owners the summary points to and our site's QueryService
+            // are per service; follow them one by one
+            for (UINT idx = 0; idx < cQueries; idx++)
             {
-                if (pWalk->dwCookie == dwCookie)
+                ServiceQuery &query = rgQueries[idx];
+                if (FAILED(query.hr))
                 {
-                    spReferenceRelease.Attach(pWalk->spServiceProviderAgileReference.Detach());
-                    pPrev->pNext = pWalk->pNext;
-                    _pServiceItems = (pWalk == _pServiceItems) ? _pServiceItems->pNext : _pServiceItems;
-
-                    delete pWalk;
-                    hr = S_OK;    
-                    break;
+                    query.hr = _QuerySiteChain(*query.pguidService, *query.piid, reinterpret_cast<void **>(&query.punkService), &rgPaths[idx], &rgcHops[idx]);
                 }
-                pPrev = pWalk;
-                pWalk = pWalk->pNext;
             }
         }
-        return hr;
+        else
+        {
+            _QuerySiteChainBatch(rgQueries, cQueries, rgPaths, rgcHops);
+        }
+
+        UINT cFound = 0;
+        for (UINT idx = 0; idx < cQueries; idx++)
+        {
+            TInstrumentation::OnQueryService(*rgQueries[idx].pguidService, rgPaths[idx], rgcHops[idx]);
+            cFound += SUCCEEDED(rgQueries[idx].hr) ? 1 : 0;
+        }
+        return cFound;
     }
 
-    IFACEMETHODIMP QueryService(_In_ REFGUID guidService, _In_ REFIID riid, _COM_Outptr_ void **ppv)
+    // Walks the ancestors once for all the queries not answered yet, asking each ancestor for the
+    // ones that are still missing by then
+    void _QuerySiteChainBatch(_Inout_updates_(cQueries) ServiceQuery *rgQueries, _In_ UINT cQueries, _Inout_updates_(cQueries) ServiceResolutionPath *rgPaths, _Inout_updates_(cQueries) UINT *rgcHops)
     {
-        *ppv = nullptr;
-        HRESULT hr = E_NOTIMPL;
-        // Make sure to resolve the reference outside of the lock
-        Microsoft::WRL::ComPtr<IAgileReference> spProfiderReference;
+        bool rgfMissing[c_cMaxBatchedQueries];
+        UINT cMissing = 0;
+        for (UINT idx = 0; idx < cQueries; idx++)
         {
-            auto lock =_srwLock.LockShared();
-            auto pWalk = _pServiceItems;
-            while (pWalk != nullptr)
+            rgfMissing[idx] = FAILED(rgQueries[idx].hr);
+            cMissing += rgfMissing[idx] ? 1 : 0;
+        }
+
+        SiteChainWalker walker(CastToUnknown());
+        while ((cMissing != 0) && walker.Next())
+        {
+            if (walker.Node() != nullptr)
+            {
+                walker.Node()->QueryLocalServices(rgQueries, cQueries);
+            }
+            else
+            {
+                // An ancestor we can't see past, its QueryService asks the rest of the chain
+                for (UINT idx = 0; idx < cQueries; idx++)
+                {
+                    if (rgfMissing[idx])
+                    {
+                        rgQueries[idx].hr = walker.Ancestor()->QueryService(*rgQueries[idx].pguidService, *rgQueries[idx].piid, reinterpret_cast<void **>(&rgQueries[idx].punkService));
+                    }
+                }
+            }
+
+            for (UINT idx = 0; idx < cQueries; idx++)
             {
-                if (pWalk->guidService == guidService)
+                if (rgfMissing[idx])
                 {
-                    spProfiderReference = pWalk->spServiceProviderAgileReference;
-                    hr = S_OK;
-                    break;
+                    rgcHops[idx] = walker.Hops();
+                    if (SUCCEEDED(rgQueries[idx].hr))
+                    {
+                        rgfMissing[idx] = false;
+                        rgPaths[idx] = SRP_SITE_CHAIN;
+                        cMissing--;
+                    }
                 }
-                pWalk = pWalk->pNext;
             }
         }
 
-        if (SUCCEEDED(hr))
+        for (UINT idx = 0; FAILED(walker.Status()) && (idx < cQueries); idx++)
         {
-            Microsoft::WRL::ComPtr<IServiceProvider> spProvider;
-            hr = spProfiderReference->Resolve(IID_PPV_ARGS(&spProvider));
-            if (SUCCEEDED(hr))
+            if (rgfMissing[idx])
             {
-                hr = spProvider->QueryService(guidService, riid, ppv);
+                rgQueries[idx].hr = walker.Status();
             }
         }
+    }
 
-        // In theory, this should be checking explicitly for E_NOTIMPL per guidelines
-        // for implementing QueryService. However, this isn't always the case.
-        // We can get here one of two ways. Either the service wasn't found in our list
-        // or the spProvider->QueryService call above failed.
-        if (FAILED(hr))
+    // Looks guidService up above us, the way the options ask for
+    HRESULT _QuerySiteChain(_In_ REFGUID guidService, _In_ REFIID riid, _COM_Outptr_ void **ppv, _Out_ ServiceResolutionPath *pPath, _Out_ UINT *pcHops)
+    {
+        if ((_options & PSO_SUMMARIZE_SITE_CHAIN) != 0)
         {
-            hr = v_QueryService(guidService, riid, ppv);
+            return _QuerySummarizedSiteChain(guidService, riid, ppv, pPath, pcHops);
+        }
+        if ((_options & PSO_MEMOIZE_SITE_CHAIN) != 0)
+        {
+            return _QueryMemoizedSiteChain(guidService, riid, ppv, pPath, pcHops);
         }
+        return ((_options & PSO_WALK_SITE_CHAIN) != 0) ? _WalkSiteChain(guidService, riid, ppv, pPath, pcHops) :
+                                                         _QuerySite(guidService, riid, ppv, pPath, pcHops);
+    }
 
-        // Now, if all that fails and the object supports IObjectWithSite then
-        // proceed up the site chain.
+    // Asks only the ancestors the summary says may have guidService, nearest first
+    HRESULT _QuerySummarizedSiteChain(_In_ REFGUID guidService, _In_ REFIID riid, _COM_Outptr_ void **ppv, _Out_ ServiceResolutionPath *pPath, _Out_ UINT *pcHops)
+    {
+        *ppv = nullptr;
+        *pPath = SRP_NOT_FOUND;
+        *pcHops = 0;
+        SiteChainSummary *pSummary;
+        HRESULT hr = _GetChainSummary(&pSummary);
         if (FAILED(hr))
         {
-            Microsoft::WRL::ComPtr<IObjectWithSite> spSite;
-            if (SUCCEEDED(CastToUnknown()->QueryInterface(IID_PPV_ARGS(&spSite))))
+            // Couldn't summarize, do without
+            return _WalkSiteChain(guidService, riid, ppv, pPath, pcHops);
+        }
+
+        hr = E_NOTIMPL;
+        if (pSummary->services.MayContain(guidService))
+        {
+            for (UINT idx = 0; FAILED(hr) && (idx < pSummary->cOwners); idx++)
             {
-                Microsoft::WRL::ComPtr<IServiceProvider> spProvider;
-                if (SUCCEEDED(spSite->GetSite(IID_IServiceProvider, &spProvider)))
+                SiteChainSummary::Owner const &owner = pSummary->rgOwners[idx];
+                if (owner.services.MayContain(guidService))
                 {
-                    hr = spProvider->QueryService(guidService, riid, ppv);
+                    Microsoft::WRL::ComPtr<IServiceProvider> spOwner;
+                    auto const start = TInstrumentation::BeginResolve();
+                    hr = owner.spReference->Resolve(IID_PPV_ARGS(&spOwner));
+                    TInstrumentation::EndResolve(ARK_ROUTE_OWNER, start);
+                    if (SUCCEEDED(hr))
+                    {
+                        (*pcHops)++;
+                        hr = _QueryAncestor(spOwner.Get(), owner.fNode, guidService, riid, ppv);
+                    }
                 }
             }
         }
+        pSummary->Release();
+
+        if (SUCCEEDED(hr))
+        {
+            *pPath = SRP_SITE_CHAIN;
+        }
         return hr;
     }
 
-protected:
-    virtual HRESULT v_QueryService(_In_ REFGUID /*guidService*/, _In_ REFIID /*riid*/, _COM_Outptr_ void ** /*ppv*/)
+    // The summary of our ancestors, built again if there is none yet or a node it went through moved on
+    HRESULT _GetChainSummary(_Outptr_ SiteChainSummary **ppSummary)
     {
-        return E_NOTIMPL;
+        *ppSummary = nullptr;
+        {
+            auto lock = _routeLock.LockShared();
+            if ((_pChainSummary != nullptr) && _pChainSummary->generations.IsCurrent())
+            {
+                _pChainSummary->AddRef();
+                *ppSummary = _pChainSummary;
+                return S_OK;
+            }
+        }
+
+        // Each generation is read before the node is summarized or its site followed
+        SiteChainSummary *pSummary = new (std::nothrow) SiteChainSummary();
+        HRESULT hr = (pSummary != nullptr) ? pSummary->generations.Track(this) : E_OUTOFMEMORY;
+        SiteChainWalker walker(CastToUnknown());
+        while (SUCCEEDED(hr) && walker.Next())
+        {
+            // An ancestor that isn't a node may answer anything, and asks the rest of the chain itself
+            ServiceSummary services;
+            if (walker.Node() != nullptr)
+            {
+                hr = pSummary->generations.Track(walker.Node());
+                walker.Node()->GetLocalServiceSummary(&services);
+            }
+            else
+            {
+                services.SetAll();
+            }
+
+            if (SUCCEEDED(hr) && !services.IsEmpty())
+            {
+                hr = pSummary->AddOwner(walker.Ancestor(), walker.Node() != nullptr, services);
+            }
+        }
+
+        if (SUCCEEDED(hr))
+        {
+            hr = walker.Status();
+        }
+
+        if (SUCCEEDED(hr))
+        {
+            SiteChainSummary *pReplaced;
+            {
+                auto lock = _routeLock.LockExclusive();
+                pReplaced = _pChainSummary;
+                pSummary->AddRef();
+                _pChainSummary = pSummary;
+            }
+
+            if (pReplaced != nullptr)
+            {
+                pReplaced->Release();
+            }
+            *ppSummary = pSummary;
+        }
+        else if (pSummary != nullptr)
+        {
+            pSummary->Release();
+        }
+        return hr;
+    }
+
+    // Asks our own site, which recursively walks the rest of the chain
+    HRESULT _QuerySite(_In_ REFGUID guidService, _In_ REFIID riid, _COM_Outptr_ void **ppv, _Out_ ServiceResolutionPath *pPath, _Out_ UINT *pcHops)
+    {
+        *ppv = nullptr;
+        *pcHops = 0;
+        HRESULT hr = E_NOTIMPL;
+        Microsoft::WRL::ComPtr<IObjectWithSite> spSite;
+        if (SUCCEEDED(CastToUnknown()->QueryInterface(IID_PPV_ARGS(&spSite))))
+        {
+            Microsoft::WRL::ComPtr<IServiceProvider> spProvider;
+            if (SUCCEEDED(spSite->GetSite(IID_PPV_ARGS(&spProvider))))
+            {
+                *pcHops = 1;
+                hr = spProvider->QueryService(guidService, riid, ppv);
+            }
+        }
+        *pPath = SUCCEEDED(hr) ? SRP_SITE_CHAIN : SRP_NOT_FOUND;
+        return hr;
     }
 
-    ProfferServiceBase(AgileReferenceOptions agileReferenceOption) : _dwNextCookie(1) , 
-                                                                     _agileReferenceOption(agileReferenceOption),
-                                                                     _pServiceItems(nullptr)
+    // Asks each ancestor in turn, nearest first, for its own services
+    HRESULT _WalkSiteChain(_In_ REFGUID guidService, _In_ REFIID riid, _COM_Outptr_ void **ppv, _Out_ ServiceResolutionPath *pPath, _Out_ UINT *pcHops)
     {
+        *ppv = nullptr;
+        HRESULT hr = E_NOTIMPL;
+        SiteChainWalker walker(CastToUnknown());
+        while (FAILED(hr) && walker.Next())
+        {
+            hr = (walker.Node() != nullptr) ? walker.Node()->QueryLocalService(guidService, riid, ppv) :
+                                              walker.Ancestor()->QueryService(guidService, riid, ppv);
+        }
+
+        if (FAILED(walker.Status()))
+        {
+            hr = walker.Status();
+        }
+        *pcHops = walker.Hops();
+        *pPath = SUCCEEDED(hr) ? SRP_SITE_CHAIN : SRP_NOT_FOUND;
+        return hr;
     }
 
-private:
-    struct ServiceItem
+    // Same result as _WalkSiteChain, but learns which ancestor answered
+    HRESULT _QueryMemoizedSiteChain(_In_ REFGUID guidService, _In_ REFIID riid, _COM_Outptr_ void **ppv, _Out_ ServiceResolutionPath *pPath, _Out_ UINT *pcHops)
     {
-        ServiceItem(REFGUID serviceId, DWORD cookie, IAgileReference *pReference, ServiceItem *pNextItem) : pNext(pNextItem),
-                                                                                                            dwCookie(cookie),
-                                                                                                            spServiceProviderAgileReference(pReference),
-                                                                                                            guidService(serviceId) 
+        *ppv = nullptr;
+        *pPath = SRP_NOT_FOUND;
+        *pcHops = 0;
+        bool fOwnerIsNode = false;
+        Microsoft::WRL::ComPtr<IAgileReference> spOwnerReference;
+        bool fRemembered;
         {
+            auto lock = _routeLock.LockShared();
+            fRemembered = _routeCache.Lookup(guidService, &fOwnerIsNode, &spOwnerReference);
         }
 
-        REFGUID guidService;
-        Microsoft::WRL::ComPtr<IAgileReference> spServiceProviderAgileReference;
-        DWORD const dwCookie;
-        ServiceItem *pNext;
+        if (fRemembered)
+        {
+            if (!spOwnerReference)
+            {
+                return E_NOTIMPL;
+            }
 
-    private:
-        // Create a private assignment operator to avoid error C4512
-        // This occurs due to the "const"-ness of dwCookie and REFGUID guidService
-        ServiceItem & operator=( const ServiceItem & );
-    };
+            Microsoft::WRL::ComPtr<IServiceProvider> spOwner;
+            auto const start = TInstrumentation::BeginResolve();
+            HRESULT hr = spOwnerReference->Resolve(IID_PPV_ARGS(&spOwner));
+            TInstrumentation::EndResolve(ARK_ROUTE_OWNER, start);
+            if (SUCCEEDED(hr))
+            {
+                *pcHops = 1;
+                hr = _QueryAncestor(spOwner.Get(), fOwnerIsNode, guidService, riid, ppv);
+            }
+            if (SUCCEEDED(hr))
+            {
+                *pPath = SRP_MEMOIZED_ROUTE;
+                return hr;
+            }
+            // The owner changed its mind without its generation moving (v_QueryService), walk again
+        }
 
-    ServiceItem *_pServiceItems;
-    DWORD        _dwNextCookie;    // unique cookie index for next proffered service
-    LockType     _srwLock;
+        // The route holds as long as neither our site nor any node up to the owner moves on, each
+        // generation is read before the node is asked anything. Whatever an ancestor that isn't a node
+        // answers is out of sight: a route may lead to it, since it is asked again every time, but a
+        // miss through it isn't remembered.
+        SiteChainRouteCache::Route route;
+        route.guidService = guidService;
+        route.fValid = SUCCEEDED(route.generations.Track(this));
+        HRESULT hr = E_NOTIMPL;
+        SiteChainWalker walker(CastToUnknown());
+        while (FAILED(hr) && walker.Next())
+        {
+            // An ancestor we can't see past asks the rest of the chain, the walk ends with it
+            if (walker.Node() != nullptr)
+            {
+                route.fValid = route.fValid && SUCCEEDED(route.generations.Track(walker.Node()));
+                hr = walker.Node()->QueryLocalService(guidService, riid, ppv);
+            }
+            else
+            {
+                hr = walker.Ancestor()->QueryService(guidService, riid, ppv);
+                route.fValid = route.fValid && SUCCEEDED(hr);
+            }
+        }
+        *pcHops = walker.Hops();
+
+        route.fOwnerIsNode = (walker.Node() != nullptr);
+        if (FAILED(walker.Status()))
+        {
+            // Gave up, which is not a miss to remember
+            hr = walker.Status();
+            route.fValid = false;
+        }
+        else if (route.fValid && SUCCEEDED(hr) &&
+                 FAILED(RoGetAgileReference(AgileReferenceOptions::AGILEREFERENCE_DEFAULT, __uuidof(IServiceProvider), walker.Ancestor(), &route.spOwnerReference)))
+        {
+            // Couldn't keep a route to the owner, remember nothing rather than a miss
+            route.fValid = false;
+        }
+
+        if (route.fValid)
+        {
+            auto lock = _routeLock.LockExclusive();
+            _routeCache.Store(&route);
+            // The displaced route is destroyed after the lock is released
+        }
+
+        if (SUCCEEDED(hr))
+        {
+            *pPath = SRP_SITE_CHAIN;
+        }
+        return hr;
+    }
+
+    static HRESULT _QueryAncestor(_In_ IServiceProvider *pAncestor, _In_ bool fAncestorIsNode, _In_ REFGUID guidService, _In_ REFIID riid, _COM_Outptr_ void **ppv)
+    {
+        Microsoft::WRL::ComPtr<ISiteChainNode> spNode;
+        if (fAncestorIsNode && SUCCEEDED(pAncestor->QueryInterface(IID_PPV_ARGS(&spNode))))
+        {
+            return spNode->QueryLocalService(guidService, riid, ppv);
+        }
+        return pAncestor->QueryService(guidService, riid, ppv);
+    }
+
+    HRESULT _ResolveProvider(_In_ REFGUID guidService, _COM_Outptr_ IServiceProvider **ppProvider)
+    {
+        if ((_options & PSO_CACHE_RESOLVED_PROVIDERS) == 0)
+        {
+            return _registry.template ResolveProvider<TInstrumentation>(guidService, ppProvider);
+        }
+
+        // Read the generation before looking in the registry, if the service is revoked while
+        // we resolve it the entry stored below is already stale.
+        LONG const lGeneration = _providerCache.Generation();
+        HRESULT hr = S_OK;
+        if (!_providerCache.Lookup(guidService, ppProvider))
+        {
+            hr = _registry.template ResolveProvider<TInstrumentation>(guidService, ppProvider);
+            if (SUCCEEDED(hr))
+            {
+                _providerCache.Store(guidService, lGeneration, *ppProvider);
+            }
+        }
+        return hr;
+    }
+
+    ServiceRegistry<LockType, cInlineServices> _registry;
+    ResolvedProviderCache _providerCache;
+    SiteChainRouteCache _routeCache;
+    LockType _routeLock;
     AgileReferenceOptions _agileReferenceOption;
+    ProfferServiceOptions const _options;
+    SiteChainSummary *_pChainSummary;   // for PSO_SUMMARIZE_SITE_CHAIN, guarded by _routeLock
+    SiteChainNodeGeneration *_pNodeGeneration;     // nullptr until the first GetNodeGeneration
 };
 } 
 //Details namespace
 
+// Services shared by many objects, see ProfferServiceBase::UseServiceTemplate
+typedef Details::ServiceTemplate ProfferServiceTemplate;
+
 // Here is an example of CProfferService usage:
 // class CNonAgileObject : public RuntimeClass<
 //                                   RuntimeClassFlags<RuntimeClassType::ClassicCom>,
@@ -250,10 +2712,21 @@ private:
 // };
 //
 
-class ProfferService : public Windows::Internal::WRL::Details::ProfferServiceBase<Windows::Internal::WRL::Details::ProfferServiceNoLock>
+template <typename TInstrumentation = NoServiceInstrumentation, UINT cInlineServices = 4>
+class ProfferServiceT : public Windows::Internal::WRL::Details::ProfferServiceBase<Windows::Internal::WRL::Details::ProfferServiceNoLock, TInstrumentation, cInlineServices>
 {
 public:
-    ProfferService(AgileReferenceOptions agileReferenceOptions = AgileReferenceOptions::AGILEREFERENCE_DEFAULT) : ProfferServiceBase<Windows::Internal::WRL::Details::ProfferServiceNoLock>(agileReferenceOptions)
+    ProfferServiceT(AgileReferenceOptions agileReferenceOptions = AgileReferenceOptions::AGILEREFERENCE_DEFAULT, ProfferServiceOptions options = PSO_NONE) : Details::ProfferServiceBase<Windows::Internal::WRL::Details::ProfferServiceNoLock, TInstrumentation, cInlineServices>(agileReferenceOptions, options)
+    {
+    }
+};
+
+// ProfferServiceT with the defaults. A class rather than a typedef: deriving classes name it in their
+// constructors, where a typedef would find the inherited IProfferService::ProfferService method instead
+class ProfferService : public ProfferServiceT<>
+{
+public:
+    ProfferService(AgileReferenceOptions agileReferenceOptions = AgileReferenceOptions::AGILEREFERENCE_DEFAULT, ProfferServiceOptions options = PSO_NONE) : ProfferServiceT<>(agileReferenceOptions, options)
     {
     }
 };
@@ -287,10 +2760,39 @@ public:
 //      }
 // };
 
-class AgileProfferService : public Windows::Internal::WRL::Details::ProfferServiceBase<Microsoft::WRL::Wrappers::SRWLock>
+template <typename TInstrumentation = NoServiceInstrumentation, UINT cInlineServices = 4>
+class AgileProfferServiceT : public Windows::Internal::WRL::Details::ProfferServiceBase<Microsoft::WRL::Wrappers::SRWLock, TInstrumentation, cInlineServices>
+{
+public:
+    AgileProfferServiceT(AgileReferenceOptions agileReferenceOptions = AgileReferenceOptions::AGILEREFERENCE_DEFAULT, ProfferServiceOptions options = PSO_NONE) : Details::ProfferServiceBase<Microsoft::WRL::Wrappers::SRWLock, TInstrumentation, cInlineServices>(agileReferenceOptions, options)
+    {
+    }
+};
+
+class AgileProfferService : public AgileProfferServiceT<>
+{
+public:
+    AgileProfferService(AgileReferenceOptions agileReferenceOptions = AgileReferenceOptions::AGILEREFERENCE_DEFAULT, ProfferServiceOptions options = PSO_NONE) : AgileProfferServiceT<>(agileReferenceOptions, options)
+    {
+    }
+};
+
+// Same as AgileProfferService but QueryService reads the registered services without taking any lock,
+// see ProfferServiceSnapshotLock. ProfferService and RevokeService copy the registry, so use it when
+// queries vastly outnumber proffers.
+template <typename TInstrumentation = NoServiceInstrumentation, UINT cInlineServices = 4>
+class SnapshotAgileProfferServiceT : public Windows::Internal::WRL::Details::ProfferServiceBase<Windows::Internal::WRL::Details::ProfferServiceSnapshotLock, TInstrumentation, cInlineServices>
+{
+public:
+    SnapshotAgileProfferServiceT(AgileReferenceOptions agileReferenceOptions = AgileReferenceOptions::AGILEREFERENCE_DEFAULT, ProfferServiceOptions options = PSO_NONE) : Details::ProfferServiceBase<Details::ProfferServiceSnapshotLock, TInstrumentation, cInlineServices>(agileReferenceOptions, options)
+    {
+    }
+};
+
+class SnapshotAgileProfferService : public SnapshotAgileProfferServiceT<>
 {
 public:
-    AgileProfferService(AgileReferenceOptions agileReferenceOptions = AgileReferenceOptions::AGILEREFERENCE_DEFAULT) : Details::ProfferServiceBase<Microsoft::WRL::Wrappers::SRWLock>(agileReferenceOptions)
+    SnapshotAgileProfferService(AgileReferenceOptions agileReferenceOptions = AgileReferenceOptions::AGILEREFERENCE_DEFAULT, ProfferServiceOptions options = PSO_NONE) : SnapshotAgileProfferServiceT<>(agileReferenceOptions, options)
     {
     }
 };
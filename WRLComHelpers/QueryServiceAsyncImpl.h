@@ -0,0 +1,125 @@
+#pragma once
+#include <new>                              // For std::nothrow
+#include <combaseapi.h>                     // For RoGetAgileReference and CoInitializeEx
+#include <wrl.h>                            // For Microsoft::WRL::ComPtr
+#include "ModuleThreadpoolImpl.h"           // For the thread pool callback that runs the lookup
+
+// QueryServiceAsync runs IServiceProvider::QueryService on a thread pool thread and hands the outcome
+// to a completion callback there, so that the calling thread never waits for it.
+//
+// This only moves the lookup to another thread, it doesn't make it asynchronous: the QueryService is
+// the same synchronous call, and a slow lookup blocks the pool thread running it instead of the caller.
+// Nor is it faster, every lookup pays a hop to the pool on top of the QueryService and the lookups in
+// flight take a pool thread each. Use it to keep a thread that must stay responsive (say one that
+// services a queue) from waiting on an STA, not to speed lookups up.
+//
+// It is meant for agile code (MTA threads, thread pool callbacks, FtmBase objects) looking services up
+// through an AgileProfferService whose providers, or whose site chain, live in STAs. A synchronous
+// QueryService blocks such a caller until the STA gets around to pumping. With QueryServiceAsync the
+// caller carries on.
+//
+//  ComPtr<IServiceProvider> spBroker = ...;
+//  HRESULT hr = QueryServiceAsync(spBroker.Get(), SID_SSomeService, __uuidof(ISomeService),
+//      [](HRESULT hr, _In_opt_ IUnknown *punkService)
+//      {
+//          if (SUCCEEDED(hr))
+//          {
+//              ISomeService *pService = static_cast<ISomeService *>(punkService);
+//              ...
+//          }
+//      });
+//
+// When QueryServiceAsync succeeds the completion is called exactly once, on a pool thread in the MTA,
+// and when it fails never. punkService is the riid interface of the service and only valid during
+// the call, AddRef it to keep it. The completion is copied and destroyed right after it was called.
+//
+// A provider that isn't agile is held through an agile reference, marshaled by QueryServiceAsync and
+// resolved on the pool thread. The pool thread still blocks on the calls into the STA, so it tells the
+// pool (CallbackMayRunLong) that it may take long, and the pool adds threads instead of queueing other
+// work behind it.
+//
+// The pool thread runs the completion, which is code of the caller's module, so a lookup in flight
+// keeps the module loaded (see ModuleThreadpoolImpl.h): a FreeLibrary doesn't unload it before every
+// completion returned.
+
+namespace Windows { namespace Internal { namespace WRL {
+
+namespace Details
+{
+
+template <typename TCompletion>
+class QueryServiceOperation
+{
+public:
+    QueryServiceOperation(_In_ REFGUID guidService, _In_ REFIID riid, const TCompletion &completion) :
+        _guidService(guidService), _iid(riid), _completion(completion)
+    {
+    }
+
+    HRESULT Start(_In_ IServiceProvider *pServiceProvider)
+    {
+        HRESULT hr = RoGetAgileReference(AgileReferenceOptions::AGILEREFERENCE_DEFAULT, __uuidof(IServiceProvider), pServiceProvider, &_spProviderReference);
+        if (SUCCEEDED(hr))
+        {
+            hr = ModuleThreadpool::TrySubmitCallback(_Run, this) ? S_OK : E_OUTOFMEMORY;
+        }
+        return hr;
+    }
+
+private:
+    static void CALLBACK _Run(_Inout_ PTP_CALLBACK_INSTANCE pInstance, _Inout_opt_ PVOID pvContext)
+    {
+        QueryServiceOperation *pOperation = static_cast<QueryServiceOperation *>(pvContext);
+        CallbackMayRunLong(pInstance);
+
+        HRESULT const hrInitialize = CoInitializeEx(nullptr, COINIT_MULTITHREADED);
+        HRESULT hr = hrInitialize;
+        Microsoft::WRL::ComPtr<IUnknown> spService;
+        if (SUCCEEDED(hr))
+        {
+            Microsoft::WRL::ComPtr<IServiceProvider> spProvider;
+            hr = pOperation->_spProviderReference->Resolve(__uuidof(IServiceProvider), &spProvider);
+            if (SUCCEEDED(hr))
+            {
+                hr = spProvider->QueryService(pOperation->_guidService, pOperation->_iid, reinterpret_cast<void **>(spService.GetAddressOf()));
+            }
+        }
+
+        pOperation->_completion(hr, spService.Get());
+
+        // Whatever the operation holds may be a proxy, let go of it while still in the MTA
+        spService.Reset();
+        delete pOperation;
+        if (SUCCEEDED(hrInitialize))
+        {
+            CoUninitialize();
+        }
+    }
+
+    GUID const _guidService;
+    IID const _iid;
+    TCompletion _completion;
+    Microsoft::WRL::ComPtr<IAgileReference> _spProviderReference;
+};
+
+} // namespace Details
+
+template <typename TCompletion>
+HRESULT QueryServiceAsync(_In_ IServiceProvider *pServiceProvider, _In_ REFGUID guidService, _In_ REFIID riid, const TCompletion &completion)
+{
+    Details::QueryServiceOperation<TCompletion> *pOperation = new (std::nothrow) Details::QueryServiceOperation<TCompletion>(guidService, riid, completion);
+    HRESULT hr = (pOperation != nullptr) ? S_OK : E_OUTOFMEMORY;
+    if (SUCCEEDED(hr))
+    {
+        hr = pOperation->Start(pServiceProvider);
+        if (FAILED(hr))
+        {
+            delete pOperation;
+        }
+    }
+    return hr;
+}
+
+} // namespace WRL
+} // namespace Internal
+} // namespace Windows
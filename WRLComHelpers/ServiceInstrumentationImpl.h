@@ -0,0 +1,398 @@
+#pragma once
+#include <new>                              // For std::nothrow
+#include "ProfferServiceImpl.h"             // For the ProfferServiceT family and HashServiceId
+#include "ObjectWithSiteImpl.h"             // For ObjectWithSiteT
+
+// ServiceLookupInstrumentation is an instrumentation policy (see NoServiceInstrumentation in
+// SiteChainImpl.h) that records, for every object built with it:
+//
+//  - per service GUID, how many QueryService calls were answered by each ServiceResolutionPath
+//    (SRP_NOT_FOUND being the misses) and how many ancestors those calls asked in total
+//  - a histogram of the number of ancestors a QueryService asked
+//  - per AgileResolveKind, a latency histogram and the total time of IAgileReference::Resolve
+//
+// class CInstrumentedObject : public RuntimeClass<
+//                                   RuntimeClassFlags<RuntimeClassType::ClassicCom>,
+//                                   Implements<RuntimeClassFlags<RuntimeClassType::ClassicCom>,
+//                                              ObjectWithSiteT<ServiceLookupInstrumentation>,
+//                                              AgileProfferServiceT<ServiceLookupInstrumentation>>>
+// {
+// };
+//
+// ServiceLookupSnapshot snapshot;
+// ServiceLookupInstrumentation::Snapshot(&snapshot);
+//
+// Each thread records into a buffer of its own, so recording takes no lock and no interlocked operation;
+// Snapshot adds the buffers of every thread up while they keep recording. A thread finds its buffer
+// through fiber local storage and hands it back when it exits, the next new thread carries on counting
+// in it, so thread pool churn doesn't use the buffers up. The counts are process wide per policy type,
+// give ServiceLookupInstrumentationT a tag type of your own to keep a set of objects apart from the rest.
+// The fiber local storage index and the buffers are freed with the module's static objects, so that a
+// DLL using this can be unloaded; like any static, the instrumentation can't be used past that point.
+
+namespace Windows { namespace Internal { namespace WRL {
+
+struct ServiceLookupSnapshot
+{
+    static const UINT c_cMaxServices = 256;
+    static const UINT c_cHopBuckets = 16;           // 0 to 14 ancestors, then 15 or more
+    static const UINT c_cLatencyBuckets = 24;       // bucket n counts [2^n, 2^(n+1)) ns, the last one everything above
+
+    struct ServiceCounts
+    {
+        GUID guidService;
+        ULONGLONG rgcQueries[SRP_COUNT];            // indexed by ServiceResolutionPath
+        ULONGLONG cHops;
+    };
+
+    UINT cThreads;                                  // thread buffers recorded into, at most as many as threads recorded at once
+    UINT cServices;
+    ServiceCounts rgServices[c_cMaxServices];
+    ULONGLONG cUntrackedQueries;                    // for services beyond what a thread (or this snapshot) keeps apart
+    ULONGLONG cDroppedEvents;                       // recorded by threads that got no buffer, while c_cThreadBuffers others were live
+    ULONGLONG rgcQueriesByHops[c_cHopBuckets];
+    ULONGLONG rgcResolves[ARK_COUNT][c_cLatencyBuckets];
+    ULONGLONG rgResolveNanoseconds[ARK_COUNT];
+
+    // Upper bound of a latency bucket, the latency below which a given share of the resolves of a kind
+    // completed is LatencyBucketLimit of the first bucket where the running count reaches that share.
+    static ULONGLONG LatencyBucketLimit(_In_ UINT idxBucket)
+    {
+        return (idxBucket + 1 < c_cLatencyBuckets) ? (2ull << idxBucket) : ~0ull;
+    }
+};
+
+template <typename Tag = void>
+class ServiceLookupInstrumentationT
+{
+public:
+    typedef LONGLONG Timestamp;
+
+    static Timestamp BeginResolve()
+    {
+        LARGE_INTEGER counter;
+        QueryPerformanceCounter(&counter);
+        return counter.QuadPart;
+    }
+
+    static void EndResolve(_In_ AgileResolveKind kind, _In_ Timestamp const &start)
+    {
+        LARGE_INTEGER counter;
+        QueryPerformanceCounter(&counter);
+        ThreadBuffer *pBuffer = _CurrentThreadBuffer();
+        if (pBuffer != nullptr)
+        {
+            ULONGLONG const nanoseconds = _Nanoseconds(counter.QuadPart - start);
+            _Add(&pBuffer->rgcResolves[kind][_LatencyBucket(nanoseconds)], 1);
+            _Add(&pBuffer->rgResolveNanoseconds[kind], static_cast<LONG64>(nanoseconds));
+        }
+    }
+
+    static void OnQueryService(_In_ REFGUID guidService, _In_ ServiceResolutionPath path, _In_ UINT cHops)
+    {
+        ThreadBuffer *pBuffer = _CurrentThreadBuffer();
+        if (pBuffer != nullptr)
+        {
+            _Add(&pBuffer->rgcQueriesByHops[(cHops < ServiceLookupSnapshot::c_cHopBuckets) ? cHops : ServiceLookupSnapshot::c_cHopBuckets - 1], 1);
+            ServiceCounters *pCounters = _FindOrAddService(pBuffer, guidService);
+            if (pCounters != nullptr)
+            {
+                _Add(&pCounters->rgcQueries[path], 1);
+                _Add(&pCounters->cHops, cHops);
+            }
+            else
+            {
+                _Add(&pBuffer->cUntrackedQueries, 1);
+            }
+        }
+    }
+
+    // Adds up what every thread recorded so far. Safe to call while other threads record, in which case
+    // their latest events may or may not be included.
+    static void Snapshot(_Out_ ServiceLookupSnapshot *pSnapshot)
+    {
+        ZeroMemory(pSnapshot, sizeof(*pSnapshot));
+        pSnapshot->cDroppedEvents = static_cast<ULONGLONG>(ReadNoFence64(&s_cDroppedEvents));
+        for (UINT idxThread = 0; idxThread < c_cThreadBuffers; idxThread++)
+        {
+            ThreadBuffer const *pBuffer = static_cast<ThreadBuffer const *>(ReadPointerAcquire(reinterpret_cast<PVOID const volatile *>(&s_rgpThreadBuffers[idxThread])));
+            if (pBuffer != nullptr)
+            {
+                pSnapshot->cThreads++;
+                _Merge(pSnapshot, *pBuffer);
+            }
+        }
+    }
+
+private:
+    static const UINT c_cThreadBuffers = 64;
+    static const UINT c_cServicesPerThread = 64;    // a power of two
+    static const UINT c_cMaxServiceProbes = 8;      // so that a full table doesn't make every untracked query slow
+
+    struct ServiceCounters
+    {
+        LONG volatile fUsed;                        // set, with release semantics, once guidService is written
+        GUID guidService;
+        LONG64 volatile rgcQueries[SRP_COUNT];
+        LONG64 volatile cHops;
+    };
+
+    // Only the owning thread writes to its buffer, Snapshot reads it from any thread
+    struct DECLSPEC_CACHEALIGN ThreadBuffer
+    {
+        LONG volatile fOwned;                       // cleared, with release semantics, when the owner exits
+        ServiceCounters rgServices[c_cServicesPerThread];
+        LONG64 volatile cUntrackedQueries;
+        LONG64 volatile rgcQueriesByHops[ServiceLookupSnapshot::c_cHopBuckets];
+        LONG64 volatile rgcResolves[ARK_COUNT][ServiceLookupSnapshot::c_cLatencyBuckets];
+        LONG64 volatile rgResolveNanoseconds[ARK_COUNT];
+    };
+
+    // Single writer, so a plain read and write is enough; both are atomic for Snapshot's sake
+    static void _Add(_Inout_ LONG64 volatile *pCounter, _In_ LONG64 value)
+    {
+        WriteNoFence64(pCounter, ReadNoFence64(pCounter) + value);
+    }
+
+    // The buffer of the calling thread, from its fiber local storage. Returns nullptr, and counts the
+    // event as dropped, for a thread that found every buffer owned by a live thread.
+    static ThreadBuffer *_CurrentThreadBuffer()
+    {
+        InitOnceExecuteOnce(&s_initOnce, _AllocFlsIndex, nullptr, nullptr);
+        PVOID pvBuffer = nullptr;
+        if (s_dwFlsIndex != FLS_OUT_OF_INDEXES)
+        {
+            pvBuffer = FlsGetValue(s_dwFlsIndex);
+            if (pvBuffer == nullptr)
+            {
+                // Only done once per thread, a thread that gets no buffer keeps s_noBuffer and drops
+                // its events without looking again
+                pvBuffer = _ClaimBuffer();
+                FlsSetValue(s_dwFlsIndex, (pvBuffer != nullptr) ? pvBuffer : &s_noBuffer);
+            }
+        }
+
+        if ((pvBuffer == nullptr) || (pvBuffer == &s_noBuffer))
+        {
+            InterlockedIncrement64(&s_cDroppedEvents);
+            return nullptr;
+        }
+        return static_cast<ThreadBuffer *>(pvBuffer);
+    }
+
+    // Takes over a buffer whose thread exited, otherwise adds one. Starts at a slot picked by hashing the
+    // thread id, the same way a HazardPointer finds its slot, so new threads don't all contend on the
+    // first buffers.
+    static ThreadBuffer *_ClaimBuffer()
+    {
+        UINT const idxStart = ((GetCurrentThreadId() >> 2) * 2654435761u) % c_cThreadBuffers;
+        for (UINT idxPass = 0; idxPass < 2; idxPass++)
+        {
+            for (UINT cProbes = 0; cProbes < c_cThreadBuffers; cProbes++)
+            {
+                ThreadBuffer * volatile *ppBuffer = &s_rgpThreadBuffers[(idxStart + cProbes) % c_cThreadBuffers];
+                ThreadBuffer *pBuffer = static_cast<ThreadBuffer *>(ReadPointerAcquire(reinterpret_cast<PVOID const volatile *>(ppBuffer)));
+                if ((pBuffer == nullptr) && (idxPass == 1))
+                {
+                    // Value initialized, so every counter starts at zero
+                    ThreadBuffer *pNewBuffer = new (std::nothrow) ThreadBuffer();
+                    if (pNewBuffer == nullptr)
+                    {
+                        return nullptr;
+                    }
+
+                    pNewBuffer->fOwned = TRUE;
+                    pBuffer = static_cast<ThreadBuffer *>(InterlockedCompareExchangePointer(reinterpret_cast<PVOID volatile *>(ppBuffer), pNewBuffer, nullptr));
+                    if (pBuffer == nullptr)
+                    {
+                        return pNewBuffer;
+                    }
+                    delete pNewBuffer;
+                }
+
+                // The previous owner's counts stay, and are visible to us, once it let go of the buffer
+                if ((pBuffer != nullptr) && (ReadAcquire(&pBuffer->fOwned) == FALSE) && (InterlockedCompareExchange(&pBuffer->fOwned, TRUE, FALSE) == FALSE))
+                {
+                    return pBuffer;
+                }
+            }
+        }
+        return nullptr;
+    }
+
+    static BOOL CALLBACK _AllocFlsIndex(_Inout_ PINIT_ONCE /*pInitOnce*/, _Inout_opt_ PVOID /*pParameter*/, _Outptr_opt_result_maybenull_ PVOID * /*ppContext*/)
+    {
+        s_dwFlsIndex = FlsAlloc(_OnThreadExit);
+        s_teardown.Arm();
+        return TRUE;
+    }
+
+    // Frees the index when the module's static objects are destroyed, Windows would otherwise call
+    // _OnThreadExit on every later thread exit, in a DLL that may be gone by then. FlsFree calls it for
+    // every thread that still has a buffer, which leaves all of them free to delete.
+    class ModuleTeardown
+    {
+    public:
+        // Makes sure the compiler keeps s_teardown, a static member of a template only exists if used
+        void Arm()
+        {
+        }
+
+        ~ModuleTeardown()
+        {
+            DWORD const dwFlsIndex = s_dwFlsIndex;
+            s_dwFlsIndex = FLS_OUT_OF_INDEXES;
+            if (dwFlsIndex != FLS_OUT_OF_INDEXES)
+            {
+                FlsFree(dwFlsIndex);
+            }
+
+            for (UINT idxThread = 0; idxThread < c_cThreadBuffers; idxThread++)
+            {
+                delete static_cast<ThreadBuffer *>(InterlockedExchangePointer(reinterpret_cast<PVOID volatile *>(&s_rgpThreadBuffers[idxThread]), nullptr));
+            }
+        }
+    };
+
+    // Called with the thread's buffer when it exits
+    static void WINAPI _OnThreadExit(_In_ PVOID pvBuffer)
+    {
+        if (pvBuffer != &s_noBuffer)
+        {
+            WriteRelease(&static_cast<ThreadBuffer *>(pvBuffer)->fOwned, FALSE);
+        }
+    }
+
+    static ServiceCounters *_FindOrAddService(_In_ ThreadBuffer *pBuffer, _In_ REFGUID guidService)
+    {
+        UINT const mask = c_cServicesPerThread - 1;
+        UINT const idxStart = Details::HashServiceId(guidService) & mask;
+        for (UINT cProbes = 0; cProbes < c_cMaxServiceProbes; cProbes++)
+        {
+            ServiceCounters *pCounters = &pBuffer->rgServices[(idxStart + cProbes) & mask];
+            if (pCounters->fUsed == 0)
+            {
+                pCounters->guidService = guidService;
+                WriteRelease(&pCounters->fUsed, 1);
+                return pCounters;
+            }
+
+            if (pCounters->guidService == guidService)
+            {
+                return pCounters;
+            }
+        }
+        return nullptr;
+    }
+
+    static void _Merge(_Inout_ ServiceLookupSnapshot *pSnapshot, _In_ ThreadBuffer const &buffer)
+    {
+        pSnapshot->cUntrackedQueries += ReadNoFence64(&buffer.cUntrackedQueries);
+        for (UINT idx = 0; idx < ServiceLookupSnapshot::c_cHopBuckets; idx++)
+        {
+            pSnapshot->rgcQueriesByHops[idx] += ReadNoFence64(&buffer.rgcQueriesByHops[idx]);
+        }
+
+        for (UINT kind = 0; kind < ARK_COUNT; kind++)
+        {
+            pSnapshot->rgResolveNanoseconds[kind] += ReadNoFence64(&buffer.rgResolveNanoseconds[kind]);
+            for (UINT idx = 0; idx < ServiceLookupSnapshot::c_cLatencyBuckets; idx++)
+            {
+                pSnapshot->rgcResolves[kind][idx] += ReadNoFence64(&buffer.rgcResolves[kind][idx]);
+            }
+        }
+
+        for (UINT idxService = 0; idxService < c_cServicesPerThread; idxService++)
+        {
+            ServiceCounters const &counters = buffer.rgServices[idxService];
+            if (ReadAcquire(&counters.fUsed) == 0)
+            {
+                continue;
+            }
+
+            ServiceLookupSnapshot::ServiceCounts *pCounts = nullptr;
+            for (UINT idx = 0; (pCounts == nullptr) && (idx < pSnapshot->cServices); idx++)
+            {
+                if (pSnapshot->rgServices[idx].guidService == counters.guidService)
+                {
+                    pCounts = &pSnapshot->rgServices[idx];
+                }
+            }
+
+            if ((pCounts == nullptr) && (pSnapshot->cServices < ServiceLookupSnapshot::c_cMaxServices))
+            {
+                pCounts = &pSnapshot->rgServices[pSnapshot->cServices++];
+                pCounts->guidService = counters.guidService;
+            }
+
+            ULONGLONG cQueries = 0;
+            for (UINT path = 0; path < SRP_COUNT; path++)
+            {
+                ULONGLONG const c = ReadNoFence64(&counters.rgcQueries[path]);
+                cQueries += c;
+                if (pCounts != nullptr)
+                {
+                    pCounts->rgcQueries[path] += c;
+                }
+            }
+
+            if (pCounts != nullptr)
+            {
+                pCounts->cHops += ReadNoFence64(&counters.cHops);
+            }
+            else
+            {
+                pSnapshot->cUntrackedQueries += cQueries;
+            }
+        }
+    }
+
+    static ULONGLONG _Nanoseconds(_In_ LONGLONG ticks)
+    {
+        LARGE_INTEGER frequency;
+        QueryPerformanceFrequency(&frequency);
+        return (ticks > 0) ? static_cast<ULONGLONG>(ticks) * 1000000000ull / static_cast<ULONGLONG>(frequency.QuadPart) : 0;
+    }
+
+    static UINT _LatencyBucket(_In_ ULONGLONG nanoseconds)
+    {
+        UINT idxBucket = 0;
+        while ((nanoseconds >= 2) && (idxBucket + 1 < ServiceLookupSnapshot::c_cLatencyBuckets))
+        {
+            nanoseconds >>= 1;
+            idxBucket++;
+        }
+        return idxBucket;
+    }
+
+    static ThreadBuffer * volatile s_rgpThreadBuffers[c_cThreadBuffers];
+    static BYTE s_noBuffer;                         // its address is the fiber local value of threads that got no buffer
+    static LONG64 volatile s_cDroppedEvents;
+    static DWORD s_dwFlsIndex;
+    static INIT_ONCE s_initOnce;
+    static ModuleTeardown s_teardown;
+};
+
+template <typename Tag>
+typename ServiceLookupInstrumentationT<Tag>::ThreadBuffer * volatile ServiceLookupInstrumentationT<Tag>::s_rgpThreadBuffers[ServiceLookupInstrumentationT<Tag>::c_cThreadBuffers];
+
+template <typename Tag>
+BYTE ServiceLookupInstrumentationT<Tag>::s_noBuffer = 0;
+
+template <typename Tag>
+LONG64 volatile ServiceLookupInstrumentationT<Tag>::s_cDroppedEvents = 0;
+
+template <typename Tag>
+DWORD ServiceLookupInstrumentationT<Tag>::s_dwFlsIndex = FLS_OUT_OF_INDEXES;
+
+template <typename Tag>
+INIT_ONCE ServiceLookupInstrumentationT<Tag>::s_initOnce = INIT_ONCE_STATIC_INIT;
+
+template <typename Tag>
+typename ServiceLookupInstrumentationT<Tag>::ModuleTeardown ServiceLookupInstrumentationT<Tag>::s_teardown;
+
+typedef ServiceLookupInstrumentationT<> ServiceLookupInstrumentation;
+
+} // namespace WRL
+} // namespace Internal
+} // namespace Windows
@@ -0,0 +1,258 @@
+#pragma once
+#include "ProfferServiceImpl.h"             // For ProfferService, AgileProfferService and HashServiceId
+
+// ServiceMap implements v_QueryService of C[Agile]ProfferService from a list of services given as
+// template arguments, instead of a hand written chain of "if (serviceId == SID_X)" comparisons.
+//
+// The services are dispatched through a perfect hash table (hash and displace), so a lookup costs
+// one hash, two array reads and a single GUID compare no matter how many services the map holds.
+// The table lives in static storage, one per ServiceMap instantiation, and is built the first time
+// any object of that type is queried; nothing is allocated at runtime.
+//
+// Here is the CNonAgileObject example of ProfferServiceImpl.h written with a ServiceMap:
+//
+// class CNonAgileObject : public RuntimeClass<
+//                                   RuntimeClassFlags<RuntimeClassType::ClassicCom>,
+//                                   ServiceMap<CNonAgileObject, ProfferService,
+//                                              ServiceEntry<SID_CNonAgileObjectService1>,
+//                                              ServiceEntry<SID_CNonAgileObjectService2, CService2Handler>>>
+// {
+// };
+//
+// The service ids must be GUIDs with linkage (for example "extern const GUID SID_X" or a static data
+// member), since they are passed by reference. A handler is a type with a static member template
+//
+//      template <typename T>
+//      static HRESULT QueryService(_In_ T *pThis, _In_ REFGUID serviceId, _In_ REFIID riid, _COM_Outptr_ void **ppv);
+//
+// where T is the class deriving from ServiceMap. QueryInterfaceServiceHandler, the default, exposes
+// the object itself as the service.
+
+namespace Windows { namespace Internal { namespace WRL {
+
+struct QueryInterfaceServiceHandler
+{
+    template <typename T>
+    static HRESULT QueryService(_In_ T *pThis, _In_ REFGUID /*guidService*/, _In_ REFIID riid, _COM_Outptr_ void **ppv)
+    {
+        return pThis->QueryInterface(riid, ppv);
+    }
+};
+
+template <const GUID &guidService, typename THandler = QueryInterfaceServiceHandler>
+struct ServiceEntry
+{
+    static const GUID &Service()
+    {
+        return guidService;
+    }
+
+    typedef THandler Handler;
+};
+
+namespace Details
+{
+
+template <UINT cMinimum, UINT cValue = 1, bool fDone = (cValue >= cMinimum)>
+struct NextPowerOfTwo
+{
+    static const UINT value = NextPowerOfTwo<cMinimum, cValue * 2>::value;
+};
+
+template <UINT cMinimum, UINT cValue>
+struct NextPowerOfTwo<cMinimum, cValue, true>
+{
+    static const UINT value = cValue;
+};
+
+template <typename TDerived, typename... TEntries>
+class ServiceDispatchTable
+{
+public:
+    typedef HRESULT (*PFNSERVICEHANDLER)(_In_ TDerived *pThis, _In_ REFGUID guidService, _In_ REFIID riid, _COM_Outptr_ void **ppv);
+
+    // Returns nullptr when the service is not in the map
+    static PFNSERVICEHANDLER Find(_In_ REFGUID guidService)
+    {
+        // Acquire, so that the table _Build wrote before setting the flag is seen whole (on ARM too)
+        if (ReadAcquire(&s_fBuilt) == FALSE)
+        {
+            InitOnceExecuteOnce(&s_initOnce, _Build, nullptr, nullptr);
+        }
+
+        UINT const hash = HashServiceId(guidService);
+        if (s_fPerfect)
+        {
+            Slot const &slot = s_rgSlots[_SlotIndex(hash, s_rgDisplacements[hash & (c_cBuckets - 1)])];
+            return ((slot.pguidService != nullptr) && (*slot.pguidService == guidService)) ? slot.pfnHandler : nullptr;
+        }
+
+        for (UINT idx = 0; idx < c_cEntries; idx++)
+        {
+            if (*s_rgEntries[idx].pguidService == guidService)
+            {
+                return s_rgEntries[idx].pfnHandler;
+            }
+        }
+        return nullptr;
+    }
+
+private:
+    static_assert(sizeof...(TEntries) > 0, "A ServiceMap needs at least one ServiceEntry");
+
+    static const UINT c_cEntries = sizeof...(TEntries);
+    // About two services per bucket and a table at most half full keeps the displacement search short
+    static const UINT c_cBuckets = NextPowerOfTwo<(c_cEntries + 1) / 2>::value;
+    static const UINT c_cSlots = NextPowerOfTwo<c_cEntries * 2>::value;
+
+    struct Slot
+    {
+        GUID const *pguidService;
+        PFNSERVICEHANDLER pfnHandler;
+    };
+
+    static UINT _SlotIndex(_In_ UINT hash, _In_ UINT displacement)
+    {
+        UINT32 value = hash + displacement * 0x9e3779b9;
+        value ^= value >> 16;
+        value *= 0x85ebca6b;
+        value ^= value >> 13;
+        value *= 0xc2b2ae35;
+        value ^= value >> 16;
+        return value & (c_cSlots - 1);
+    }
+
+    // Tries to place every entry of bucket idxBucket with the given displacement, all or nothing
+    static bool _TryPlaceBucket(_In_ UINT idxBucket, _In_ UINT displacement, _In_reads_(c_cEntries) UINT const *rgHashes, _In_reads_(c_cEntries) bool const *rgfUsed)
+    {
+        UINT rgPlaced[c_cEntries];
+        UINT cPlaced = 0;
+        for (UINT idx = 0; idx < c_cEntries; idx++)
+        {
+            if (rgfUsed[idx] && ((rgHashes[idx] & (c_cBuckets - 1)) == idxBucket))
+            {
+                UINT const idxSlot = _SlotIndex(rgHashes[idx], displacement);
+                if (s_rgSlots[idxSlot].pguidService != nullptr)
+                {
+                    while (cPlaced != 0)
+                    {
+                        s_rgSlots[rgPlaced[--cPlaced]].pguidService = nullptr;
+                    }
+                    return false;
+                }
+                s_rgSlots[idxSlot] = s_rgEntries[idx];
+                rgPlaced[cPlaced++] = idxSlot;
+            }
+        }
+        return true;
+    }
+
+    static BOOL CALLBACK _Build(_Inout_ PINIT_ONCE /*pInitOnce*/, _Inout_opt_ PVOID /*pParameter*/, _Outptr_opt_result_maybenull_ PVOID * /*ppContext*/)
+    {
+        Slot const rgEntries[c_cEntries] = { { &TEntries::Service(), &TEntries::Handler::template QueryService<TDerived> }... };
+        UINT rgHashes[c_cEntries];
+        bool rgfUsed[c_cEntries];
+        UINT rgBucketSizes[c_cBuckets] = {};
+        for (UINT idx = 0; idx < c_cEntries; idx++)
+        {
+            s_rgEntries[idx] = rgEntries[idx];
+            rgHashes[idx] = HashServiceId(*rgEntries[idx].pguidService);
+
+            // Like an if chain the first entry for a service wins, the others are ignored
+            rgfUsed[idx] = true;
+            for (UINT idxPrevious = 0; rgfUsed[idx] && (idxPrevious < idx); idxPrevious++)
+            {
+                rgfUsed[idx] = (*rgEntries[idxPrevious].pguidService != *rgEntries[idx].pguidService);
+            }
+
+            if (rgfUsed[idx])
+            {
+                rgBucketSizes[rgHashes[idx] & (c_cBuckets - 1)]++;
+            }
+        }
+
+        // Place the fullest buckets first, while the table is still mostly empty
+        bool fPerfect = true;
+        for (UINT cBucketSize = c_cEntries; fPerfect && (cBucketSize > 0); cBucketSize--)
+        {
+            for (UINT idxBucket = 0; fPerfect && (idxBucket < c_cBuckets); idxBucket++)
+            {
+                if (rgBucketSizes[idxBucket] == cBucketSize)
+                {
+                    UINT displacement = 0;
+                    while ((displacement <= MAXWORD) && !_TryPlaceBucket(idxBucket, displacement, rgHashes, rgfUsed))
+                    {
+                        displacement++;
+                    }
+                    fPerfect = (displacement <= MAXWORD);
+                    s_rgDisplacements[idxBucket] = static_cast<WORD>(displacement);
+                }
+            }
+        }
+
+        // Practically unreachable, but should no displacement work Find falls back to a linear scan
+        s_fPerfect = fPerfect;
+        InterlockedExchange(&s_fBuilt, TRUE);
+        return TRUE;
+    }
+
+    static Slot s_rgEntries[c_cEntries];
+    static Slot s_rgSlots[c_cSlots];
+    static WORD s_rgDisplacements[c_cBuckets];
+    static bool s_fPerfect;
+    static LONG volatile s_fBuilt;
+    static INIT_ONCE s_initOnce;
+};
+
+template <typename TDerived, typename... TEntries>
+typename ServiceDispatchTable<TDerived, TEntries...>::Slot ServiceDispatchTable<TDerived, TEntries...>::s_rgEntries[ServiceDispatchTable<TDerived, TEntries...>::c_cEntries];
+
+template <typename TDerived, typename... TEntries>
+typename ServiceDispatchTable<TDerived, TEntries...>::Slot ServiceDispatchTable<TDerived, TEntries...>::s_rgSlots[ServiceDispatchTable<TDerived, TEntries...>::c_cSlots];
+
+template <typename TDerived, typename... TEntries>
+WORD ServiceDispatchTable<TDerived, TEntries...>::s_rgDisplacements[ServiceDispatchTable<TDerived, TEntries...>::c_cBuckets];
+
+template <typename TDerived, typename... TEntries>
+bool ServiceDispatchTable<TDerived, TEntries...>::s_fPerfect = false;
+
+template <typename TDerived, typename... TEntries>
+LONG volatile ServiceDispatchTable<TDerived, TEntries...>::s_fBuilt = FALSE;
+
+template <typename TDerived, typename... TEntries>
+INIT_ONCE ServiceDispatchTable<TDerived, TEntries...>::s_initOnce = INIT_ONCE_STATIC_INIT;
+
+} // namespace Details
+
+// TProfferService is ProfferService, AgileProfferService or SnapshotAgileProfferService (or a class
+// derived from one of them with the same constructor).
+template <typename TDerived, typename TProfferService, typename... TEntries>
+class ServiceMap : public TProfferService
+{
+public:
+    ServiceMap(AgileReferenceOptions agileReferenceOptions = AgileReferenceOptions::AGILEREFERENCE_DEFAULT, ProfferServiceOptions options = PSO_NONE) : TProfferService(agileReferenceOptions, options)
+    {
+    }
+
+protected:
+    HRESULT v_QueryService(_In_ REFGUID guidService, _In_ REFIID riid, _COM_Outptr_ void **ppv) override
+    {
+        *ppv = nullptr;
+        auto pfnHandler = Details::ServiceDispatchTable<TDerived, TEntries...>::Find(guidService);
+        return (pfnHandler != nullptr) ? pfnHandler(static_cast<TDerived *>(this), guidService, riid, ppv) : E_NOTIMPL;
+    }
+
+    void v_SummarizeServices(_Inout_ Details::ServiceSummary *pSummary) override
+    {
+        GUID const *rgpguidServices[] = { &TEntries::Service()... };
+        for (auto pguidService : rgpguidServices)
+        {
+            pSummary->Add(*pguidService);
+        }
+        TProfferService::v_SummarizeServices(pSummary);
+    }
+};
+
+} // namespace WRL
+} // namespace Internal
+} // namespace Windows
@@ -0,0 +1,198 @@
+#pragma once
+#include <wrl.h>                            // For Microsoft::WRL::ComPtr
+#include <ShObjIdl.h>                       // For IObjectWithSite and IServiceProvider
+#include "SiteChainImpl.h"                  // For SiteChainWalker and the generations
+
+// ServiceRef<T> looks a service up once and hands out the same T until something happens that may
+// change the answer, for code that would otherwise call QueryService for the same service on every
+// operation:
+//
+//  ServiceRef<ISomeService> someService;
+//  someService.Bind(spServiceProvider.Get(), SID_SSomeService);
+//  ...
+//  ISomeService *pService;
+//  if (SUCCEEDED(someService.Get(&pService)))
+//  {
+//      pService->DoSomething();
+//  }
+//
+// The handle walks the site chain itself and remembers the SiteChainNodeGeneration (SiteChainImpl.h)
+// of every node it went through, up to the one that answered. Get adds them up again, an atomic read
+// per node, and only looks the service up again once one of them has moved on: a ProfferService,
+// RevokeService or SetSite on one of those objects, so that a handle never hands out a service revoked,
+// or a site replaced, before Get was called, while changes to any other object leave it alone. A failed
+// lookup is remembered the same way. When the chain can't be followed node by node, because the object
+// bound to or an ancestor isn't a ProfferServiceBase (or lives in another apartment), nothing tells the
+// handle when the answer changes and it looks the service up on every Get, as QueryService would.
+// Changes the generations can't see, a v_QueryService starting to answer differently, are up to the
+// caller to follow with Invalidate.
+//
+// A handle isn't synchronized and, like the interface pointers it holds, belongs to the apartment it
+// is used from: give each thread its own. It doesn't hold what it is bound to either, which has to
+// outlive it (an object typically keeps the handles bound to itself, or to its own site, as members).
+// The ancestors it went through aren't held either, only their generations.
+
+namespace Windows { namespace Internal { namespace WRL {
+
+template <typename T>
+class ServiceRef
+{
+public:
+    ServiceRef() : _pServiceProvider(nullptr), _pObjectWithSite(nullptr), _fChainTracked(false), _hrLookup(E_UNEXPECTED), _fLookedUp(false)
+    {
+        ZeroMemory(&_guidService, sizeof(_guidService));
+    }
+
+    // Looks guidService up with pServiceProvider's QueryService, for instance that of a ProfferService
+    void Bind(_In_ IServiceProvider *pServiceProvider, _In_ REFGUID guidService)
+    {
+        Reset();
+        _pServiceProvider = pServiceProvider;
+        _guidService = guidService;
+    }
+
+    // Looks guidService up from whatever pObjectWithSite is sited to at the time
+    void BindToSite(_In_ IObjectWithSite *pObjectWithSite, _In_ REFGUID guidService)
+    {
+        Reset();
+        _pObjectWithSite = pObjectWithSite;
+        _guidService = guidService;
+    }
+
+    // The service, looked up again first if anything may have changed since the last lookup. *ppService
+    // is not AddRef'd, it stays valid until the next Get, Bind, BindToSite, Invalidate or Reset of the
+    // handle and is nullptr whenever the lookup failed. E_UNEXPECTED for a handle that isn't bound.
+    HRESULT Get(_Outptr_result_maybenull_ T **ppService)
+    {
+        if (!_IsCurrent())
+        {
+            _LookUp();
+        }
+        *ppService = _spService.Get();
+        return _hrLookup;
+    }
+
+    // Makes the next Get look the service up again
+    void Invalidate()
+    {
+        _fLookedUp = false;
+        _spService.Reset();
+        _nodeGenerations.Reset();
+    }
+
+    // Unbinds the handle and releases the service
+    void Reset()
+    {
+        Invalidate();
+        _pServiceProvider = nullptr;
+        _pObjectWithSite = nullptr;
+        _hrLookup = E_UNEXPECTED;
+    }
+
+private:
+    bool _IsCurrent() const
+    {
+        return _fLookedUp && _fChainTracked && _nodeGenerations.IsCurrent();
+    }
+
+    void _LookUp()
+    {
+        // Read the generations first, if anything changes during the lookup the next Get looks again.
+        // That of a node is read before its site is, or it is asked anything.
+        _nodeGenerations.Reset();
+        _fChainTracked = true;
+        Microsoft::WRL::ComPtr<T> spService;
+        HRESULT hr = E_UNEXPECTED;
+        IUnknown *punkWalkFrom = nullptr;
+        if (_pServiceProvider != nullptr)
+        {
+            // Same answer as its QueryService: its own services, then those of its site chain
+            Microsoft::WRL::ComPtr<Details::ISiteChainNode> spNode;
+            if (SUCCEEDED(_pServiceProvider->QueryInterface(IID_PPV_ARGS(&spNode))) && _TrackNode(spNode.Get()))
+            {
+                hr = spNode->QueryLocalService(_guidService, IID_PPV_ARGS(&spService));
+                punkWalkFrom = FAILED(hr) ? _pServiceProvider : nullptr;
+            }
+            else
+            {
+                _fChainTracked = false;
+                hr = _pServiceProvider->QueryService(_guidService, IID_PPV_ARGS(&spService));
+            }
+        }
+        else if (_pObjectWithSite != nullptr)
+        {
+            // Only asks the site chain, the object counts for its SetSite
+            Microsoft::WRL::ComPtr<Details::ISiteChainNode> spNode;
+            if (FAILED(_pObjectWithSite->QueryInterface(IID_PPV_ARGS(&spNode))) || !_TrackNode(spNode.Get()))
+            {
+                _fChainTracked = false;
+            }
+            punkWalkFrom = _pObjectWithSite;
+        }
+
+        if (punkWalkFrom != nullptr)
+        {
+            hr = _QuerySiteChain(punkWalkFrom, &spService);
+        }
+
+        // The service this replaces is released on the way out
+        _spService.Swap(spService);
+        if (FAILED(hr))
+        {
+            _spService.Reset();
+        }
+        _hrLookup = hr;
+        _fLookedUp = (_pServiceProvider != nullptr) || (_pObjectWithSite != nullptr);
+    }
+
+    // Asks each ancestor of punkObject in turn for its own services, the way ProfferServiceBase does
+    HRESULT _QuerySiteChain(_In_ IUnknown *punkObject, _Inout_ Microsoft::WRL::ComPtr<T> *pspService)
+    {
+        HRESULT hr = E_NOTIMPL;
+        SiteChainWalker walker(punkObject);
+        while (FAILED(hr) && walker.Next())
+        {
+            if (walker.Node() != nullptr)
+            {
+                if (!_TrackNode(walker.Node()))
+                {
+                    _fChainTracked = false;
+                }
+                hr = walker.Node()->QueryLocalService(_guidService, IID_PPV_ARGS(pspService->ReleaseAndGetAddressOf()));
+            }
+            else
+            {
+                // Asks the rest of the chain itself, out of our sight
+                _fChainTracked = false;
+                hr = walker.Ancestor()->QueryService(_guidService, IID_PPV_ARGS(pspService->ReleaseAndGetAddressOf()));
+            }
+        }
+
+        if (FAILED(walker.Status()))
+        {
+            hr = walker.Status();
+        }
+        return hr;
+    }
+
+    bool _TrackNode(_In_ Details::ISiteChainNode *pNode)
+    {
+        return SUCCEEDED(_nodeGenerations.Track(pNode));
+    }
+
+    IServiceProvider *_pServiceProvider;        // not AddRef'd, see above
+    IObjectWithSite *_pObjectWithSite;          // not AddRef'd either
+    GUID _guidService;
+    Microsoft::WRL::ComPtr<T> _spService;
+    Details::SiteChainNodeGenerations _nodeGenerations;     // of the nodes the last lookup went through
+    bool _fChainTracked;                        // every node the last lookup depended on is in _nodeGenerations
+    HRESULT _hrLookup;
+    bool _fLookedUp;
+
+    ServiceRef(const ServiceRef &);
+    ServiceRef & operator=(const ServiceRef &);
+};
+
+} // namespace WRL
+} // namespace Internal
+} // namespace Windows
@@ -0,0 +1,390 @@
+#pragma once
+#include <new>                              // For std::nothrow
+#include <utility>                          // For std::swap
+#include <wrl.h>                            // For Interlocked* and friends
+#include <Unknwn.h>                         // For IUnknown
+#include <ShObjIdl.h>                       // For IObjectWithSite, IServiceProvider and IClientSecurity
+
+// Pieces shared between ObjectWithSite and ProfferServiceBase for walking a site chain.
+//
+// ProfferServiceBase looks services up in its ancestors with SiteChainWalker when PSO_WALK_SITE_CHAIN,
+// PSO_MEMOIZE_SITE_CHAIN or PSO_SUMMARIZE_SITE_CHAIN asks it to, anything else that needs to go up a
+// chain of ObjectWithSite objects can use it as well.
+
+namespace Windows { namespace Internal { namespace WRL {
+
+// How ProfferServiceBase::QueryService found (or didn't find) a service
+enum ServiceResolutionPath
+{
+    SRP_REGISTRY,               // a provider proffered on the object itself
+    SRP_VIRTUAL,                // the object's v_QueryService
+    SRP_SITE_CHAIN,             // an ancestor, found by walking the site chain
+    SRP_MEMOIZED_ROUTE,         // an ancestor, found through the route PSO_MEMOIZE_SITE_CHAIN remembered
+    SRP_NOT_FOUND,
+    SRP_COUNT
+};
+
+// One lookup of ProfferServiceBase::QueryServices, laid out after MULTI_QI. The caller fills in the
+// service and interface ids, QueryServices the rest. punkService is the *piid interface of the service
+// and holds a reference the caller has to release, it is nullptr whenever hr is a failure.
+struct ServiceQuery
+{
+    const GUID *pguidService;
+    const IID *piid;
+    IUnknown *punkService;
+    HRESULT hr;
+};
+
+// What a timed IAgileReference::Resolve was resolving
+enum AgileResolveKind
+{
+    ARK_SERVICE_PROVIDER,       // a proffered IServiceProvider
+    ARK_SITE,                   // the site of an ObjectWithSite
+    ARK_ROUTE_OWNER,            // the ancestor a PSO_MEMOIZE_SITE_CHAIN route or a PSO_SUMMARIZE_SITE_CHAIN summary leads to
+    ARK_COUNT
+};
+
+// The instrumentation policy of ObjectWithSiteT and the ProfferServiceT family, used unless another one
+// is given. An instrumentation policy is a type with these static members:
+//
+//  Timestamp                   Copyable type returned by BeginResolve
+//  BeginResolve()              Called just before an IAgileReference::Resolve
+//  EndResolve(kind, start)     Called right after it, with what BeginResolve returned
+//  OnQueryService(guidService, path, cHops)
+//                              Called once per IServiceProvider::QueryService of a ProfferServiceBase,
+//                              with the number of ancestors it asked
+//
+// Every member here is empty, so that with this policy the hooks compile down to nothing.
+// ServiceLookupInstrumentation (ServiceInstrumentationImpl.h) is a policy that records them.
+struct NoServiceInstrumentation
+{
+    struct Timestamp
+    {
+    };
+
+    static Timestamp BeginResolve()
+    {
+        return Timestamp();
+    }
+
+    static void EndResolve(_In_ AgileResolveKind /*kind*/, _In_ Timestamp const & /*start*/)
+    {
+    }
+
+    static void OnQueryService(_In_ REFGUID /*guidService*/, _In_ ServiceResolutionPath /*path*/, _In_ UINT /*cHops*/)
+    {
+    }
+};
+
+namespace Details
+{
+
+class ServiceSummary;
+class SiteChainNodeGeneration;
+
+// Implemented by ProfferServiceBase so that a descendant walking the site chain can ask an ancestor
+// for just its own services instead of having that ancestor recursively walk the rest of the chain.
+// There is no proxy/stub for this interface on purpose; across apartments the QueryInterface fails
+// and the walker falls back to the ancestor's IServiceProvider::QueryService.
+MIDL_INTERFACE("af083702-b8e4-4d00-b3d0-0d86991b35ce")
+ISiteChainNode : public IUnknown
+{
+public:
+    // Answers from the node's registry and v_QueryService only, never from the node's site
+    virtual HRESULT STDMETHODCALLTYPE QueryLocalService(_In_ REFGUID guidService, _In_ REFIID riid, _COM_Outptr_ void **ppv) = 0;
+
+    // Same as QueryLocalService for every query of rgQueries that hasn't succeeded yet, the others
+    // are left alone
+    virtual void STDMETHODCALLTYPE QueryLocalServices(_Inout_updates_(cQueries) ServiceQuery *rgQueries, _In_ UINT cQueries) = 0;
+
+    // The services QueryLocalService may answer: those in the node's registry and those its
+    // v_QueryService declares through v_SummarizeServices
+    virtual void STDMETHODCALLTYPE GetLocalServiceSummary(_Out_ ServiceSummary *pSummary) = 0;
+
+    // Called by ObjectWithSite::SetSite on the same object once the site has changed
+    virtual void STDMETHODCALLTYPE SiteChanged() = 0;
+
+    // The generation of the node alone, AddRef'd, for those that remember what they found through it
+    virtual HRESULT STDMETHODCALLTYPE GetNodeGeneration(_Outptr_ SiteChainNodeGeneration **ppGeneration) = 0;
+};
+
+// Counter of a single node, bumped whenever the node's own services, or its site, change and once
+// more when the node goes away. Whatever was found by walking a chain is still valid as long as none
+// of the nodes it went through moved on, whatever happens elsewhere in the process. Reference counted
+// and apart from the node so that it can be watched without keeping the node alive. A node only
+// creates it when first asked, see ProfferServiceBase::GetNodeGeneration.
+class SiteChainNodeGeneration
+{
+public:
+    SiteChainNodeGeneration() : _lGeneration(0), _cRef(1)
+    {
+    }
+
+    LONG Current() const
+    {
+        return ReadAcquire(&_lGeneration);
+    }
+
+    void Advance()
+    {
+        InterlockedIncrement(&_lGeneration);
+    }
+
+    ULONG AddRef()
+    {
+        return InterlockedIncrement(&_cRef);
+    }
+
+    ULONG Release()
+    {
+        ULONG const cRef = InterlockedDecrement(&_cRef);
+        if (cRef == 0)
+        {
+            delete this;
+        }
+        return cRef;
+    }
+
+private:
+    LONG volatile _lGeneration;
+    LONG volatile _cRef;
+
+    SiteChainNodeGeneration(const SiteChainNodeGeneration &);
+    SiteChainNodeGeneration &operator=(const SiteChainNodeGeneration &);
+};
+
+// The SiteChainNodeGenerations of the nodes a walk went through, so that whatever it found can be
+// checked later with one read per node. Track a node before asking it anything or reading its site.
+// Generations only ever go up, so the sum of them is the same only if none of them moved.
+class SiteChainNodeGenerations
+{
+public:
+    SiteChainNodeGenerations() : _rgpGenerations(nullptr), _cGenerations(0), _cCapacity(0), _ulSum(0)
+    {
+    }
+
+    ~SiteChainNodeGenerations()
+    {
+        Reset();
+        delete [] _rgpGenerations;
+    }
+
+    HRESULT Track(_In_ ISiteChainNode *pNode)
+    {
+        HRESULT hr = (_cGenerations < _cCapacity) ? S_OK : _Grow();
+        SiteChainNodeGeneration *pGeneration = nullptr;
+        if (SUCCEEDED(hr))
+        {
+            hr = pNode->GetNodeGeneration(&pGeneration);
+        }
+
+        if (SUCCEEDED(hr))
+        {
+            _rgpGenerations[_cGenerations++] = pGeneration;
+            _ulSum += static_cast<ULONG>(pGeneration->Current());
+        }
+        return hr;
+    }
+
+    // None of the tracked nodes moved on since it was tracked
+    bool IsCurrent() const
+    {
+        ULONG ulSum = 0;
+        for (UINT idx = 0; idx < _cGenerations; idx++)
+        {
+            ulSum += static_cast<ULONG>(_rgpGenerations[idx]->Current());
+        }
+        return ulSum == _ulSum;
+    }
+
+    // Forgets every node, and keeps the room for as many
+    void Reset()
+    {
+        for (UINT idx = 0; idx < _cGenerations; idx++)
+        {
+            _rgpGenerations[idx]->Release();
+        }
+        _cGenerations = 0;
+        _ulSum = 0;
+    }
+
+    void Swap(_Inout_ SiteChainNodeGenerations *pOther)
+    {
+        std::swap(_rgpGenerations, pOther->_rgpGenerations);
+        std::swap(_cGenerations, pOther->_cGenerations);
+        std::swap(_cCapacity, pOther->_cCapacity);
+        std::swap(_ulSum, pOther->_ulSum);
+    }
+
+private:
+    HRESULT _Grow()
+    {
+        UINT const cNewCapacity = (_cCapacity == 0) ? 4 : _cCapacity * 2;
+        SiteChainNodeGeneration **rgpNewGenerations = new (std::nothrow) SiteChainNodeGeneration *[cNewCapacity];
+        HRESULT hr = (rgpNewGenerations != nullptr) ? S_OK : E_OUTOFMEMORY;
+        if (SUCCEEDED(hr))
+        {
+            for (UINT idx = 0; idx < _cGenerations; idx++)
+            {
+                rgpNewGenerations[idx] = _rgpGenerations[idx];
+            }
+            delete [] _rgpGenerations;
+            _rgpGenerations = rgpNewGenerations;
+            _cCapacity = cNewCapacity;
+        }
+        return hr;
+    }
+
+    SiteChainNodeGeneration **_rgpGenerations;
+    UINT _cGenerations;
+    UINT _cCapacity;
+    ULONG _ulSum;
+
+    SiteChainNodeGenerations(const SiteChainNodeGenerations &);
+    SiteChainNodeGenerations &operator=(const SiteChainNodeGenerations &);
+};
+
+// Walks a site chain up from the site of an object, one ancestor at a time:
+//
+//  SiteChainWalker walker(punkObject);        // or walker(punkObject, cMaxHops)
+//  while (walker.Next())
+//  {
+//      // walker.Ancestor(), and walker.Node() unless that ancestor isn't an ISiteChainNode
+//  }
+//  hr = walker.Status();
+//
+// The walk goes on to the site of every ancestor that is a node, those are asked for their own
+// services only, so a chain of any depth costs no stack. An ancestor that isn't a node (or lives in
+// another apartment) asks the rest of the chain itself, the walk ends with it. Asking a node for its
+// own services skips any override of its IServiceProvider::QueryService, only walk chains whose nodes
+// answer through their registry and v_QueryService.
+//
+// A walk given a hop limit gives up with E_BOUNDS past that many ancestors, and any walk gives up with
+// HRESULT_FROM_WIN32(ERROR_CIRCULAR_DEPENDENCY) when it comes back to a node it went past. Cycles
+// are found the way Brent's algorithm does, by comparing each node with a checkpoint moved ahead
+// every power of two hops, so within about twice the length of the chain and its cycle. A cycle
+// through an ancestor that isn't a node is out of its sight.
+class SiteChainWalker
+{
+public:
+    explicit SiteChainWalker(_In_ IUnknown *punkObject, _In_ UINT cMaxHops = MAXUINT) : _punkObject(punkObject), _cMaxHops(cMaxHops), _cHops(0),
+                                                                                       _cSinceCheckpoint(0), _cCheckpointSpan(1), _hrStatus(S_OK)
+    {
+    }
+
+    // Moves to the next ancestor, returns false once there is none or the walk gave up
+    bool Next()
+    {
+        Microsoft::WRL::ComPtr<IObjectWithSite> spSite;
+        if (_cHops == 0)
+        {
+            // The object itself is the first checkpoint, a site chain leading back to it is a cycle
+            if (_punkObject != nullptr)
+            {
+                _punkObject->QueryInterface(IID_PPV_ARGS(&spSite));
+                _spCheckpoint = spSite;
+                _punkObject = nullptr;
+            }
+        }
+        else if (_spNode && SUCCEEDED(_spAncestor.As(&spSite)))
+        {
+            // Checked on the way out of a node, the only ancestors a walk goes past
+            if (spSite.Get() == _spCheckpoint.Get())
+            {
+                return _GiveUp(HRESULT_FROM_WIN32(ERROR_CIRCULAR_DEPENDENCY));
+            }
+
+            if (++_cSinceCheckpoint == _cCheckpointSpan)
+            {
+                _spCheckpoint = spSite;
+                _cCheckpointSpan *= 2;
+                _cSinceCheckpoint = 0;
+            }
+        }
+
+        Microsoft::WRL::ComPtr<IServiceProvider> spNext;
+        if (spSite)
+        {
+            spSite->GetSite(IID_PPV_ARGS(&spNext));
+        }
+        _spAncestor = spNext;
+        _spNode.Reset();
+        if (!_spAncestor)
+        {
+            return false;
+        }
+
+        if (_cHops == _cMaxHops)
+        {
+            return _GiveUp(E_BOUNDS);
+        }
+        _cHops++;
+
+        if (!_IsProxy(_spAncestor.Get()))
+        {
+            _spAncestor.As(&_spNode);
+        }
+        return true;
+    }
+
+    IServiceProvider *Ancestor() const
+    {
+        return _spAncestor.Get();
+    }
+
+    // nullptr when the current ancestor isn't a node, it is the last one then
+    ISiteChainNode *Node() const
+    {
+        return _spNode.Get();
+    }
+
+    // How many ancestors the walk went through so far
+    UINT Hops() const
+    {
+        return _cHops;
+    }
+
+    // S_OK unless the walk gave up
+    HRESULT Status() const
+    {
+        return _hrStatus;
+    }
+
+private:
+    // ISiteChainNode has no proxy/stub, asking a proxy for it would only be a call into the ancestor's
+    // apartment to fail there. A standard proxy answers IClientSecurity itself, without that call.
+    static bool _IsProxy(_In_ IServiceProvider *pAncestor)
+    {
+        Microsoft::WRL::ComPtr<IClientSecurity> spClientSecurity;
+        return SUCCEEDED(pAncestor->QueryInterface(IID_PPV_ARGS(&spClientSecurity)));
+    }
+
+    bool _GiveUp(_In_ HRESULT hrStatus)
+    {
+        _hrStatus = hrStatus;
+        _spAncestor.Reset();
+        _spNode.Reset();
+        return false;
+    }
+
+    IUnknown *_punkObject;          // until the first Next
+    UINT const _cMaxHops;
+    Microsoft::WRL::ComPtr<IServiceProvider> _spAncestor;
+    Microsoft::WRL::ComPtr<ISiteChainNode> _spNode;
+    Microsoft::WRL::ComPtr<IObjectWithSite> _spCheckpoint;
+    UINT _cHops;
+    UINT _cSinceCheckpoint;
+    UINT _cCheckpointSpan;
+    HRESULT _hrStatus;
+
+    SiteChainWalker(const SiteChainWalker &);
+    SiteChainWalker &operator=(const SiteChainWalker &);
+};
+
+} // namespace Details
+
+typedef Details::SiteChainWalker SiteChainWalker;
+
+} // namespace WRL
+} // namespace Internal
+} // namespace Windows